@@ -0,0 +1,161 @@
+// ***************************************************************************
+// Key index distributions for the benchmark.
+//
+// A distribution draws the index of the key to operate on from [0, n), where
+// n is the number of keys inserted so far. Which keys are adjacent in the
+// tree depends on the key shape (see KeyShapes.h), not on the index.
+//
+//   uniform     every key equally likely
+//   zipfian     key i drawn with probability proportional to 1/(i+1)^theta,
+//               so the lowest indexes are the hottest (Gray et al., "Quickly
+//               generating billion-record synthetic databases", as in YCSB)
+//   hotspot     a fraction of the operations go to a hot set made up of the
+//               lowest indexes, the rest to the other keys, uniformly within
+//               each set
+//   latest      zipfian over recency: the most recently inserted keys are the
+//               hottest
+//   sequential  each thread walks through the keys in index order, starting
+//               at a different position per thread
+//
+// A distribution is used by a single thread. Each worker gets its own copy.
+// ***************************************************************************
+#pragma once
+
+#include <math.h>
+#include "Platform.h"
+#include "RandomLong.h"
+
+enum DistributionType { DIST_UNIFORM, DIST_ZIPFIAN, DIST_HOTSPOT, DIST_LATEST, DIST_SEQUENTIAL, DIST_COUNT };
+
+static const char* DistributionName[DIST_COUNT] = { "uniform", "zipfian", "hotspot", "latest", "sequential" };
+
+// Zipfian distribution over [0, n). The normalization constant zeta(n) is
+// extended incrementally when n grows, so growing the key set is cheap.
+class ZipfianGenerator
+{
+  double	  m_Theta;
+  double	  m_Alpha;
+  double	  m_Zeta2;
+  double	  m_ZetaN;			// zeta(m_ZetaCount, theta)
+  ULONGLONG	  m_ZetaCount;
+  double	  m_Eta;
+
+  void ExtendZeta(ULONGLONG count)
+  {
+	for (ULONGLONG i = m_ZetaCount; i < count; i++)
+	{
+	  m_ZetaN += 1.0 / pow(double(i + 1), m_Theta);
+	}
+	m_ZetaCount = count;
+	m_Eta = (1.0 - pow(2.0 / double(count), 1.0 - m_Theta)) / (1.0 - m_Zeta2 / m_ZetaN);
+  }
+
+public:
+  static constexpr double DefaultTheta = 0.99;
+
+  ZipfianGenerator(double theta = DefaultTheta)
+  {
+	m_Theta = theta;
+	m_Alpha = 1.0 / (1.0 - theta);
+	m_Zeta2 = 1.0 + 1.0 / pow(2.0, theta);
+	m_ZetaN = 0.0;
+	m_ZetaCount = 0;
+	m_Eta = 0.0;
+  }
+
+  double Theta() { return m_Theta; }
+
+  // Draw a value in [0, count) given a uniform value u in [0, 1)
+  ULONGLONG Next(double u, ULONGLONG count)
+  {
+	if (count <= 1)
+	{
+	  return 0;
+	}
+	if (count > m_ZetaCount)
+	{
+	  ExtendZeta(count);
+	}
+	double uz = u * m_ZetaN;
+	if (uz < 1.0) return 0;
+	if (uz < m_Zeta2) return 1;
+	ULONGLONG value = ULONGLONG(double(count) * pow(m_Eta * u - m_Eta + 1.0, m_Alpha));
+	return min(value, count - 1);
+  }
+};
+
+class KeyDistribution
+{
+  DistributionType	m_Type;
+  ZipfianGenerator	m_Zipfian;
+  double			m_HotSetFraction;	// Fraction of the keys in the hot set
+  double			m_HotOpFraction;	// Fraction of the operations on the hot set
+  ULONGLONG			m_Cursor;			// Next index for sequential
+
+  static double Uniform(CRandomULongs& rng)
+  {
+	return rng.GetRandomULong() / 4294967296.0;
+  }
+
+  static ULONGLONG UniformIndex(CRandomULongs& rng, ULONGLONG count)
+  {
+	ULONGLONG value = (ULONGLONG(rng.GetRandomULong()) << 32) | rng.GetRandomULong();
+	return value % count;
+  }
+
+public:
+  KeyDistribution(DistributionType type = DIST_UNIFORM, double theta = ZipfianGenerator::DefaultTheta,
+				  double hotSetFraction = 0.2, double hotOpFraction = 0.8)
+	: m_Zipfian(theta)
+  {
+	m_Type = type;
+	m_HotSetFraction = hotSetFraction;
+	m_HotOpFraction = hotOpFraction;
+	m_Cursor = 0;
+  }
+
+  DistributionType Type() { return m_Type; }
+
+  // Prepare for keys [0, count). Computes the zipfian constants up front so that
+  // the first draws of a timed run are not slowed down, and spreads the starting
+  // positions of sequential walks over the key set.
+  void Prepare(ULONGLONG count, UINT threadNr, UINT nThreads)
+  {
+	if (m_Type == DIST_ZIPFIAN || m_Type == DIST_LATEST)
+	{
+	  m_Zipfian.Next(0.0, count);
+	}
+	m_Cursor = (count / max(nThreads, 1U)) * threadNr;
+  }
+
+  // Index of the next key to operate on, with count keys present
+  ULONGLONG Next(CRandomULongs& rng, ULONGLONG count)
+  {
+	_ASSERTE(count > 0);
+	switch (m_Type)
+	{
+	case DIST_ZIPFIAN:
+	  return m_Zipfian.Next(Uniform(rng), count);
+
+	case DIST_LATEST:
+	  return count - 1 - m_Zipfian.Next(Uniform(rng), count);
+
+	case DIST_HOTSPOT:
+	{
+	  ULONGLONG hotCount = max(ULONGLONG(count * m_HotSetFraction), 1ULL);
+	  if (hotCount >= count || Uniform(rng) < m_HotOpFraction)
+	  {
+		return UniformIndex(rng, hotCount);
+	  }
+	  return hotCount + UniformIndex(rng, count - hotCount);
+	}
+
+	case DIST_SEQUENTIAL:
+	  if (m_Cursor >= count) m_Cursor = 0;
+	  return m_Cursor++;
+
+	default:
+	  return UniformIndex(rng, count);
+	}
+  }
+};
@@ -0,0 +1,275 @@
+// ***************************************************************************
+// Key shapes for the benchmark. A key shape maps a key index to a key, so a
+// key can be rebuilt from its index without storing it. Different indexes
+// always give different keys.
+//
+//   words  a word from the word list followed by a three character suffix:
+//          key i is word[i % nWords] followed by suffix i / nWords, as in the
+//          old test driver. With a fixed key length words are truncated or
+//          padded with '.'. Consecutive indexes are spread over the tree.
+//   int    the index as an 8-byte big-endian integer (see KeyEncoder.h).
+//          Consecutive indexes are adjacent in the tree, so inserting in index
+//          order is a monotonic (append) pattern.
+//   desc   the index as a 4-byte integer in descending order (see KeyEncoder.h).
+//          Inserting in index order prepends keys, and the keys of the first
+//          16M indexes start with 0xFF.
+//   uuid   a 36 character random (version 4 style) UUID derived from the
+//          index. Keys are spread uniformly over the tree.
+//   url    https://www.<host>.com/<path>/<index>, with host and path taken
+//          from the word list. Keys share long prefixes and many keys fall
+//          under a few hosts.
+// ***************************************************************************
+#pragma once
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "Platform.h"
+#include "KeyEncoder.h"
+
+class KeyShape
+{
+public:
+  virtual ~KeyShape() {}
+  virtual const char* Name() = 0;
+
+  // Build key nr index in buffer (at least MaxKeyLen() bytes) and return its length
+  virtual UINT MakeKey(ULONGLONG index, char* buffer) = 0;
+  virtual UINT MaxKeyLen() = 0;
+
+  // Nr of distinct keys the shape can generate
+  virtual ULONGLONG Capacity() = 0;
+
+protected:
+  // Bijective mix of a 64-bit value (the splitmix64 finalizer), so different
+  // indexes give different hash values
+  static ULONGLONG Mix64(ULONGLONG value)
+  {
+	value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+	return value ^ (value >> 31);
+  }
+};
+
+// Word list shared by the word and URL key shapes
+class WordList
+{
+  std::vector<std::string>  m_Words;
+
+public:
+  static const UINT MaxWordLen = 64;
+
+  // Load the words, truncated to maxWordLen characters. Words containing '.'
+  // are skipped so that keys padded with '.' stay unique.
+  bool Load(const char* fname, UINT maxWordLen)
+  {
+	FILE* fp = nullptr;
+	errno_t err = fopen_s(&fp, fname, "r");
+	if (err != 0 || !fp)
+	{
+	  fprintf(stderr, "Can't open word file %s\n", fname);
+	  return false;
+	}
+	maxWordLen = min(maxWordLen, UINT(MaxWordLen));
+	char word[MaxWordLen + 1];
+	while (fscanf(fp, "%64s", word) == 1)
+	{
+	  if (strchr(word, '.') != nullptr) continue;
+	  word[maxWordLen] = '\0';
+	  m_Words.push_back(word);
+	}
+	fclose(fp);
+
+	std::sort(m_Words.begin(), m_Words.end());
+	m_Words.erase(std::unique(m_Words.begin(), m_Words.end()), m_Words.end());
+	if (m_Words.empty())
+	{
+	  fprintf(stderr, "No words in %s\n", fname);
+	  return false;
+	}
+	return true;
+  }
+
+  size_t Count() { return m_Words.size(); }
+  const std::string& Word(size_t i) { return m_Words[i]; }
+
+  UINT MaxLen()
+  {
+	UINT maxLen = 0;
+	for (size_t i = 0; i < m_Words.size(); i++) maxLen = max(maxLen, UINT(m_Words[i].size()));
+	return maxLen;
+  }
+};
+
+class WordKeys : public KeyShape
+{
+  static const UINT SuffixLen = 3;
+  static const UINT SuffixBase = 25;
+  static const UINT SuffixRounds = SuffixBase * SuffixBase * SuffixBase;
+
+  WordList*	  m_Words;
+  UINT		  m_KeyLen;
+  UINT		  m_MaxKeyLen;
+
+public:
+  static const UINT MinKeyLen = SuffixLen + 1;
+
+  // keyLen = 0 gives keys of the word length plus the suffix
+  WordKeys(WordList* words, UINT keyLen)
+  {
+	m_Words = words;
+	m_KeyLen = keyLen;
+	m_MaxKeyLen = (keyLen > 0) ? keyLen : words->MaxLen() + SuffixLen;
+  }
+
+  // Longest word that fits in a key of length keyLen
+  static UINT MaxWordLen(UINT keyLen)
+  {
+	return (keyLen > 0) ? keyLen - SuffixLen : UINT(WordList::MaxWordLen);
+  }
+
+  const char* Name() { return "words"; }
+  UINT MaxKeyLen() { return m_MaxKeyLen; }
+  ULONGLONG Capacity() { return ULONGLONG(m_Words->Count()) * SuffixRounds; }
+
+  UINT MakeKey(ULONGLONG index, char* buffer)
+  {
+	const std::string& word = m_Words->Word(size_t(index % m_Words->Count()));
+	ULONGLONG round = index / m_Words->Count();
+
+	UINT len = UINT(word.size());
+	memcpy(buffer, word.data(), len);
+	if (m_KeyLen > 0)
+	{
+	  while (len < m_KeyLen - SuffixLen) buffer[len++] = '.';
+	}
+	for (int i = SuffixLen - 1; i >= 0; i--)
+	{
+	  buffer[len + i] = char('0' + round % SuffixBase);
+	  round /= SuffixBase;
+	}
+	return len + SuffixLen;
+  }
+};
+
+class IntKeys : public KeyShape
+{
+public:
+  const char* Name() { return "int"; }
+  UINT MaxKeyLen() { return sizeof(ULONGLONG); }
+  ULONGLONG Capacity() { return ~0ULL; }
+
+  UINT MakeKey(ULONGLONG index, char* buffer)
+  {
+	KeyEncoder enc(buffer, sizeof(ULONGLONG));
+	enc.AppendUInt(index);
+	return enc.GetLength();
+  }
+};
+
+class DescKeys : public KeyShape
+{
+public:
+  const char* Name() { return "desc"; }
+  UINT MaxKeyLen() { return sizeof(UINT32); }
+  ULONGLONG Capacity() { return 0x100000000ULL; }
+
+  UINT MakeKey(ULONGLONG index, char* buffer)
+  {
+	KeyEncoder enc(buffer, sizeof(UINT32));
+	enc.AppendUInt(index, sizeof(UINT32), true);
+	return enc.GetLength();
+  }
+};
+
+class UuidKeys : public KeyShape
+{
+  static const UINT UuidLen = 36;
+
+public:
+  const char* Name() { return "uuid"; }
+  UINT MaxKeyLen() { return UuidLen; }
+  ULONGLONG Capacity() { return ~0ULL; }
+
+  // The 32 hex digits are filled from two hash values of the index. The first
+  // hash is unique per index and fills the first 16 free digits. Digit 12 is
+  // the version (4) and digit 16 the variant (8, 9, a or b).
+  UINT MakeKey(ULONGLONG index, char* buffer)
+  {
+	static const char HexDigits[] = "0123456789abcdef";
+	ULONGLONG hash1 = Mix64(index);
+	ULONGLONG hash2 = Mix64(index ^ 0x5851f42d4c957f2dULL);
+
+	char digits[32];
+	UINT used = 0;
+	for (UINT d = 0; d < 32; d++)
+	{
+	  if (d == 12)
+	  {
+		digits[d] = '4';
+		continue;
+	  }
+	  if (d == 16)
+	  {
+		digits[d] = HexDigits[8 + (hash2 & 3)];
+		hash2 >>= 2;
+		continue;
+	  }
+	  if (used < 16)
+	  {
+		digits[d] = HexDigits[hash1 & 0xF];
+		hash1 >>= 4;
+	  }
+	  else
+	  {
+		digits[d] = HexDigits[hash2 & 0xF];
+		hash2 >>= 4;
+	  }
+	  used++;
+	}
+
+	// Format as 8-4-4-4-12
+	UINT len = 0;
+	for (UINT d = 0; d < 32; d++)
+	{
+	  if (d == 8 || d == 12 || d == 16 || d == 20) buffer[len++] = '-';
+	  buffer[len++] = digits[d];
+	}
+	return len;
+  }
+};
+
+class UrlKeys : public KeyShape
+{
+  static const UINT MaxHosts = 1000;
+  static const UINT MaxIndexLen = 20;
+
+  WordList*	  m_Words;
+  UINT		  m_nHosts;
+  UINT		  m_MaxKeyLen;
+
+public:
+  UrlKeys(WordList* words)
+  {
+	m_Words = words;
+	m_nHosts = UINT(min(words->Count(), size_t(MaxHosts)));
+	m_MaxKeyLen = UINT(strlen("https://www.") + strlen(".com/") + 2 * words->MaxLen() + 1 + MaxIndexLen);
+  }
+
+  const char* Name() { return "url"; }
+  UINT MaxKeyLen() { return m_MaxKeyLen; }
+  ULONGLONG Capacity() { return ~0ULL; }
+
+  UINT MakeKey(ULONGLONG index, char* buffer)
+  {
+	ULONGLONG hash = Mix64(index);
+
+	// Hosts are the first words in the list, so host names share prefixes too
+	const std::string& host = m_Words->Word(size_t(hash % m_nHosts));
+	const std::string& path = m_Words->Word(size_t((hash >> 20) % m_Words->Count()));
+	char url[2 * WordList::MaxWordLen + 64];
+	int len = snprintf(url, sizeof(url), "https://www.%s.com/%s/%llu", host.c_str(), path.c_str(), index);
+	memcpy(buffer, url, len);
+	return UINT(len);
+  }
+};
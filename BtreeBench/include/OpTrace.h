@@ -0,0 +1,203 @@
+// ***************************************************************************
+// Operation traces for the benchmark.
+//
+// A trace holds the operations of a benchmark run as one stream per thread:
+// the load streams (the inserts that loaded the tree) and the run streams
+// (the operations of the timed run). Each record holds the operation, the key
+// bytes and the record value, so a replay does not depend on the key shape,
+// distribution or random generator that produced the run. Replaying a trace
+// runs every stream on its own thread, in order, which makes each thread's
+// operation sequence identical across replays. Only the interleaving of the
+// threads differs; a single-stream trace replays deterministically.
+//
+// File layout:
+//   TraceFileHeader
+//   for each load stream, then each run stream:
+//     TraceStreamHeader, followed by m_Bytes bytes of records
+//   a record is a TraceRecord followed by m_KeyLen key bytes
+// ***************************************************************************
+#pragma once
+
+#include <vector>
+#include "Platform.h"
+
+#pragma pack(push)
+#pragma pack(1)
+
+struct TraceFileHeader
+{
+  char		  m_Magic[8];
+  UINT		  m_Version;
+  UINT		  m_LoadStreams;
+  UINT		  m_RunStreams;
+  UINT		  m_Reserved;
+};
+
+struct TraceStreamHeader
+{
+  ULONGLONG	  m_Records;
+  ULONGLONG	  m_Bytes;
+};
+
+struct TraceRecord
+{
+  UINT8		  m_Op;
+  UINT8		  m_Reserved;
+  UINT16	  m_KeyLen;
+  ULONGLONG	  m_Value;
+};
+
+#pragma pack(pop)
+
+// The records of one thread
+class TraceStream
+{
+  std::vector<char>	m_Data;
+  ULONGLONG			m_Records;
+  ULONGLONG			m_MaxRecords;	// Appending stops at this many records
+  size_t			m_ReadPos;
+
+  friend class OpTrace;
+
+public:
+  TraceStream(ULONGLONG maxRecords = ~0ULL)
+  {
+	m_Records = 0;
+	m_MaxRecords = maxRecords;
+	m_ReadPos = 0;
+  }
+
+  ULONGLONG RecordCount() { return m_Records; }
+  bool IsFull() { return m_Records >= m_MaxRecords; }
+
+  // Append a record. Returns false if the stream is full.
+  bool Append(UINT op, const char* key, UINT keyLen, ULONGLONG value)
+  {
+	if (IsFull() || keyLen > MAXUINT16)
+	{
+	  return false;
+	}
+	TraceRecord rec;
+	rec.m_Op = UINT8(op);
+	rec.m_Reserved = 0;
+	rec.m_KeyLen = UINT16(keyLen);
+	rec.m_Value = value;
+	const char* recBytes = (const char*)(&rec);
+	m_Data.insert(m_Data.end(), recBytes, recBytes + sizeof(rec));
+	m_Data.insert(m_Data.end(), key, key + keyLen);
+	m_Records++;
+	return true;
+  }
+
+  void Rewind() { m_ReadPos = 0; }
+
+  // Get the next record. The key points into the stream. Returns false at the end.
+  bool Next(UINT& op, const char*& key, UINT& keyLen, ULONGLONG& value)
+  {
+	if (m_ReadPos + sizeof(TraceRecord) > m_Data.size())
+	{
+	  return false;
+	}
+	TraceRecord rec;
+	memcpy(&rec, &m_Data[m_ReadPos], sizeof(rec));
+	if (m_ReadPos + sizeof(rec) + rec.m_KeyLen > m_Data.size())
+	{
+	  return false;
+	}
+	op = rec.m_Op;
+	keyLen = rec.m_KeyLen;
+	value = rec.m_Value;
+	key = &m_Data[m_ReadPos + sizeof(rec)];
+	m_ReadPos += sizeof(rec) + rec.m_KeyLen;
+	return true;
+  }
+};
+
+class OpTrace
+{
+  static const UINT Version = 1;
+
+  static bool WriteStream(FILE* file, TraceStream& stream)
+  {
+	TraceStreamHeader hdr;
+	hdr.m_Records = stream.m_Records;
+	hdr.m_Bytes = stream.m_Data.size();
+	if (fwrite(&hdr, sizeof(hdr), 1, file) != 1) return false;
+	return hdr.m_Bytes == 0 || fwrite(stream.m_Data.data(), size_t(hdr.m_Bytes), 1, file) == 1;
+  }
+
+  static bool ReadStream(FILE* file, TraceStream& stream)
+  {
+	TraceStreamHeader hdr;
+	if (fread(&hdr, sizeof(hdr), 1, file) != 1) return false;
+	stream.m_Data.resize(size_t(hdr.m_Bytes));
+	stream.m_Records = hdr.m_Records;
+	stream.m_ReadPos = 0;
+	return hdr.m_Bytes == 0 || fread(stream.m_Data.data(), size_t(hdr.m_Bytes), 1, file) == 1;
+  }
+
+public:
+  std::vector<TraceStream>  m_LoadStreams;
+  std::vector<TraceStream>  m_RunStreams;
+
+  bool Write(const char* fname)
+  {
+	FILE* file = nullptr;
+	errno_t err = fopen_s(&file, fname, "wb");
+	if (err != 0 || !file)
+	{
+	  fprintf(stderr, "Can't open trace file %s\n", fname);
+	  return false;
+	}
+	TraceFileHeader hdr;
+	memcpy(hdr.m_Magic, "BTTRACE", sizeof(hdr.m_Magic));
+	hdr.m_Version = Version;
+	hdr.m_LoadStreams = UINT(m_LoadStreams.size());
+	hdr.m_RunStreams = UINT(m_RunStreams.size());
+	hdr.m_Reserved = 0;
+
+	bool ok = fwrite(&hdr, sizeof(hdr), 1, file) == 1;
+	for (size_t i = 0; ok && i < m_LoadStreams.size(); i++) ok = WriteStream(file, m_LoadStreams[i]);
+	for (size_t i = 0; ok && i < m_RunStreams.size(); i++) ok = WriteStream(file, m_RunStreams[i]);
+	fclose(file);
+	if (!ok)
+	{
+	  fprintf(stderr, "Error writing trace file %s\n", fname);
+	}
+	return ok;
+  }
+
+  bool Read(const char* fname)
+  {
+	FILE* file = nullptr;
+	errno_t err = fopen_s(&file, fname, "rb");
+	if (err != 0 || !file)
+	{
+	  fprintf(stderr, "Can't open trace file %s\n", fname);
+	  return false;
+	}
+	TraceFileHeader hdr;
+	bool ok = fread(&hdr, sizeof(hdr), 1, file) == 1
+			  && memcmp(hdr.m_Magic, "BTTRACE", sizeof(hdr.m_Magic)) == 0 && hdr.m_Version == Version;
+	if (ok)
+	{
+	  m_LoadStreams.resize(hdr.m_LoadStreams);
+	  m_RunStreams.resize(hdr.m_RunStreams);
+	}
+	for (size_t i = 0; ok && i < m_LoadStreams.size(); i++) ok = ReadStream(file, m_LoadStreams[i]);
+	for (size_t i = 0; ok && i < m_RunStreams.size(); i++) ok = ReadStream(file, m_RunStreams[i]);
+	fclose(file);
+	if (!ok)
+	{
+	  fprintf(stderr, "%s is not a valid trace file\n", fname);
+	}
+	return ok;
+  }
+
+  static ULONGLONG RecordCount(std::vector<TraceStream>& streams)
+  {
+	ULONGLONG count = 0;
+	for (size_t i = 0; i < streams.size(); i++) count += streams[i].RecordCount();
+	return count;
+  }
+};
@@ -0,0 +1,156 @@
+// ***************************************************************************
+// Hardware performance counters of a thread, for the benchmark.
+//
+// On Linux the counters are opened with perf_event_open for the calling
+// thread, user mode only, so they work with the default perf_event_paranoid
+// setting. Each counter is opened on its own: a counter the processor or the
+// kernel does not provide (for example in a virtual machine) is skipped and
+// the others are still reported. If the kernel multiplexes counters, the
+// counts are scaled by the time each was enabled over the time it ran.
+// Elsewhere, or if no counter can be opened, Open() returns 0 and no counts
+// are valid.
+// ***************************************************************************
+#pragma once
+
+#include "Platform.h"
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+enum PerfCounterType
+{
+  PC_CYCLES, PC_INSTRUCTIONS, PC_CACHE_MISSES, PC_BRANCH_MISSES, PC_L1D_MISSES, PC_DTLB_MISSES,
+  PC_COUNT
+};
+
+static const char* PerfCounterName[PC_COUNT] =
+{
+  "cycles", "instructions", "cache_misses", "branch_misses", "l1d_load_misses", "dtlb_load_misses"
+};
+
+struct PerfCounts
+{
+  ULONGLONG	  m_Values[PC_COUNT];
+  bool		  m_Valid[PC_COUNT];	  // Counter was opened and ran
+
+  void Clear()
+  {
+	memset(m_Values, 0, sizeof(m_Values));
+	memset(m_Valid, 0, sizeof(m_Valid));
+  }
+
+  // Add the counts of another thread. A counter is valid only if it is valid in all threads.
+  void Add(const PerfCounts& other, bool first)
+  {
+	for (UINT i = 0; i < PC_COUNT; i++)
+	{
+	  m_Values[i] += other.m_Values[i];
+	  m_Valid[i] = (first || m_Valid[i]) && other.m_Valid[i];
+	}
+  }
+
+  bool AnyValid() const
+  {
+	for (UINT i = 0; i < PC_COUNT; i++)
+	{
+	  if (m_Valid[i]) return true;
+	}
+	return false;
+  }
+};
+
+class PerfCounters
+{
+  int		  m_Fds[PC_COUNT];		  // -1 if the counter is not open
+
+public:
+  PerfCounters()
+  {
+	for (UINT i = 0; i < PC_COUNT; i++) m_Fds[i] = -1;
+  }
+
+  ~PerfCounters() { Close(); }
+
+  // Open the counters of the calling thread, stopped. Returns the number of counters opened.
+  UINT Open()
+  {
+	UINT opened = 0;
+#if defined(__linux__)
+	static const ULONGLONG l1dReadMiss = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+										 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	static const ULONGLONG dtlbReadMiss = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+										  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	static const struct { UINT32 m_Type; ULONGLONG m_Config; } events[PC_COUNT] =
+	{
+	  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+	  { PERF_TYPE_HW_CACHE, l1dReadMiss },
+	  { PERF_TYPE_HW_CACHE, dtlbReadMiss },
+	};
+
+	for (UINT i = 0; i < PC_COUNT; i++)
+	{
+	  struct perf_event_attr attr;
+	  memset(&attr, 0, sizeof(attr));
+	  attr.size = sizeof(attr);
+	  attr.type = events[i].m_Type;
+	  attr.config = events[i].m_Config;
+	  attr.disabled = 1;
+	  attr.exclude_kernel = 1;
+	  attr.exclude_hv = 1;
+	  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	  m_Fds[i] = int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+	  if (m_Fds[i] >= 0) opened++;
+	}
+#endif
+	return opened;
+  }
+
+  void Start()
+  {
+#if defined(__linux__)
+	for (UINT i = 0; i < PC_COUNT; i++)
+	{
+	  if (m_Fds[i] < 0) continue;
+	  ioctl(m_Fds[i], PERF_EVENT_IOC_RESET, 0);
+	  ioctl(m_Fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+  }
+
+  // Stop the counters and read them into counts
+  void Stop(PerfCounts* counts)
+  {
+	counts->Clear();
+#if defined(__linux__)
+	for (UINT i = 0; i < PC_COUNT; i++)
+	{
+	  if (m_Fds[i] < 0) continue;
+	  ioctl(m_Fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+	  // Value, time enabled, time running
+	  ULONGLONG data[3];
+	  if (read(m_Fds[i], data, sizeof(data)) != ssize_t(sizeof(data)) || data[2] == 0) continue;
+	  counts->m_Values[i] = (data[2] < data[1]) ? ULONGLONG(double(data[0]) * double(data[1]) / double(data[2])) : data[0];
+	  counts->m_Valid[i] = true;
+	}
+#endif
+  }
+
+  void Close()
+  {
+#if defined(__linux__)
+	for (UINT i = 0; i < PC_COUNT; i++)
+	{
+	  if (m_Fds[i] >= 0) close(m_Fds[i]);
+	  m_Fds[i] = -1;
+	}
+#endif
+  }
+};
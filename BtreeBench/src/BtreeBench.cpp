@@ -0,0 +1,1097 @@
+// ***************************************************************************
+// YCSB-style benchmark for the lock-free B-tree.
+//
+// The benchmark loads a tree with keys built from a word list (words.txt),
+// then runs a workload mix for a fixed duration once for each thread count
+// in a list. For each run it reports throughput, the speedup over the first
+// run and latency percentiles for each operation type as JSON. If the library
+// is built with latency histograms (LatencyRecorder.h), the latencies measured
+// inside the tree, including page maintenance, are reported as well. The
+// retries and conflicts counted by the tree (ContentionStats.h) are reported
+// for every run, and with --profile a sampled breakdown of the operations
+// into phases (PhaseProfiler.h). Where hardware counters are available
+// (PerfCounters.h), cycles, instructions, cache, branch and TLB misses per
+// operation are reported too. They are counted in the worker threads over
+// the whole run, so they include generating the keys and timing the
+// operations.
+//
+// Workloads (percent of operations):
+//   A  50 read, 50 update
+//   B  95 read,  5 update
+//   C 100 read
+//   D  95 read,  5 insert
+//   F  50 read, 50 read-modify-write
+// Workload E (range scans) is not supported because the tree has no scan
+// operation.
+//
+// Keys are numbered. Inserts take the next unused number and the other
+// operations draw the number of an existing key from a distribution
+// (KeyDistribution.h). As in YCSB, workload D uses the latest distribution
+// and the others zipfian. A key shape (KeyShapes.h) turns the number into
+// the key.
+//
+// The operations of a run can be recorded to a trace file and replayed
+// later against the tree, for example to compare two builds (OpTrace.h).
+// Separately, the page maintenance and updates done inside the tree during
+// the runs can be traced (EventTrace.h) and printed with EventDecode.
+// ***************************************************************************
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "Platform.h"
+#include "RandomLong.h"
+#include "BtreeInternal.h"
+#include "BtreeSession.h"
+#include "LatencyHistogram.h"
+#include "PerfCounters.h"
+#include "KeyShapes.h"
+#include "KeyDistribution.h"
+#include "OpTrace.h"
+
+enum BenchOp { OP_READ, OP_UPDATE, OP_INSERT, OP_RMW, OP_COUNT };
+
+static const char* OpName[OP_COUNT] = { "read", "update", "insert", "rmw" };
+
+struct WorkloadMix
+{
+  char				  m_Name;
+  UINT				  m_Percent[OP_COUNT];
+  DistributionType	  m_Distribution;	// Default distribution
+};
+
+static const WorkloadMix Workloads[] =
+{
+  { 'A', {  50, 50, 0,  0 }, DIST_ZIPFIAN },
+  { 'B', {  95,  5, 0,  0 }, DIST_ZIPFIAN },
+  { 'C', { 100,  0, 0,  0 }, DIST_ZIPFIAN },
+  { 'D', {  95,  0, 5,  0 }, DIST_LATEST },
+  { 'F', {  50,  0, 0, 50 }, DIST_ZIPFIAN },
+};
+
+static const char* KeyShapeNames[] = { "words", "int", "desc", "uuid", "url" };
+
+struct BenchOptions
+{
+  const WorkloadMix*  m_Workload;
+  std::vector<UINT>   m_Threads;		// Thread counts, one run per count
+  ULONGLONG			  m_Keys;			// Nr of keys loaded before the runs
+  const char*		  m_KeyShape;
+  UINT				  m_KeyLen;			// Word key length, 0 = length of the word plus suffix
+  DistributionType	  m_Distribution;
+  double			  m_Theta;			// Zipfian constant for zipfian and latest
+  double			  m_HotSetFraction;	// Hot set size and operation share for hotspot
+  double			  m_HotOpFraction;
+  UINT				  m_Duration;		// Seconds per run
+  UINT				  m_Seed;
+  const char*		  m_WordsFile;
+  const char*		  m_JsonFile;		// nullptr = stdout
+  const char*		  m_RecordFile;		// Record the load and the run to this trace file
+  ULONGLONG			  m_RecordLimit;	// Max operations recorded per thread in the run
+  const char*		  m_ReplayFile;		// Replay this trace instead of running a workload
+  bool				  m_UseSession;		// Use a BtreeSession per thread
+  bool				  m_Verify;			// Look up all keys and check the tree after the runs
+  const char*		  m_EventFile;		// Trace tree events in the runs and dump them to this file
+  UINT32			  m_EventMask;		// Event types traced (EventTrace.h)
+  UINT32			  m_EventSample;	// Trace one of every N events per thread
+  UINT32			  m_ProfileRate;	// Profile the phases of one of every N operations per thread, 0 = off
+  bool				  m_UsePerf;		// Read hardware counters in the worker threads
+};
+
+// ---------------------------------------------------------------------------
+// Shared state
+// ---------------------------------------------------------------------------
+static WordList			  g_Words;
+static KeyShape*			  g_Keys = nullptr;
+static BtreeRoot*			  g_Btree = nullptr;
+static OpTrace				  g_Trace;
+static double				  g_NsPerTick = 1.0;
+
+static std::atomic<ULONGLONG> g_NextInsert;		// Index of the next key to insert
+static std::atomic<ULONGLONG> g_InsertedKeys;	// Nr of keys loaded or inserted so far
+static std::atomic<bool>	  g_StartFlag;
+static std::atomic<bool>	  g_StopFlag;
+
+static ULONGLONG Now()
+{
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  return ULONGLONG(counter.QuadPart);
+}
+
+static ULONGLONG RandomULongLong(CRandomULongs& rng)
+{
+  return (ULONGLONG(rng.GetRandomULong()) << 32) | rng.GetRandomULong();
+}
+
+// Record values are never dereferenced by the tree, so any non-null value will do
+static void* RecordValue(ULONGLONG value)
+{
+  return (void*)(UINT_PTR(value) | 1);
+}
+
+// Per-thread state, padded to avoid false sharing between threads
+struct alignas(64) WorkerState
+{
+  UINT				  m_ThreadNr;
+  const WorkloadMix*  m_Workload;
+  KeyDistribution	  m_Distribution;
+  TraceStream*		  m_Trace;			// Operations are recorded here if not null
+  bool				  m_UseSession;
+  bool				  m_UsePerf;
+  ULONGLONG			  m_Ops[OP_COUNT];
+  ULONGLONG			  m_Failed[OP_COUNT];
+  LatencyHistogram	  m_Latency[OP_COUNT];
+  PerfCounts		  m_Perf;			// Hardware counts of the run
+
+  void Reset()
+  {
+	m_Perf.Clear();
+	for (UINT i = 0; i < OP_COUNT; i++)
+	{
+	  m_Ops[i] = 0;
+	  m_Failed[i] = 0;
+	  m_Latency[i].Reset();
+	}
+  }
+};
+
+// The operations go through a BtreeSession if one is given, otherwise through the BtreeRoot API
+static BTRESULT DoLookup(BtreeSession* session, KeyType* key, void*& rec)
+{
+  return (session) ? session->LookupRecord(key, rec) : g_Btree->LookupRecord(key, rec);
+}
+
+static BTRESULT DoInsert(BtreeSession* session, KeyType* key, void* rec)
+{
+  return (session) ? session->InsertRecord(key, rec) : g_Btree->InsertRecord(key, rec);
+}
+
+static BTRESULT DoUpdate(BtreeSession* session, KeyType* key, void* rec)
+{
+  void* oldRec = nullptr;
+  return (session) ? session->UpdateRecord(key, rec, oldRec) : g_Btree->UpdateRecord(key, rec, oldRec);
+}
+
+static BTRESULT DoCompareAndSwap(BtreeSession* session, KeyType* key, void* expectedRec, void* newRec)
+{
+  return (session) ? session->CompareAndSwapRecord(key, expectedRec, newRec)
+				   : g_Btree->CompareAndSwapRecord(key, expectedRec, newRec);
+}
+
+// Execute one operation. value is the new record value for inserts and updates.
+static BTRESULT ExecuteOp(BtreeSession* session, UINT op, KeyType* key, ULONGLONG value)
+{
+  BTRESULT btr = BT_SUCCESS;
+  void* rec = nullptr;
+  switch (op)
+  {
+  case OP_READ:
+	btr = DoLookup(session, key, rec);
+	break;
+  case OP_UPDATE:
+	btr = DoUpdate(session, key, RecordValue(value));
+	break;
+  case OP_INSERT:
+	btr = DoInsert(session, key, RecordValue(value));
+	break;
+  case OP_RMW:
+	btr = DoLookup(session, key, rec);
+	if (btr == BT_SUCCESS)
+	{
+	  btr = DoCompareAndSwap(session, key, rec, RecordValue(UINT_PTR(rec) + 2));
+	}
+	break;
+  default:
+	btr = BT_INVALID_ARG;
+	break;
+  }
+  return btr;
+}
+
+static void WorkerThread(WorkerState* state, UINT seed)
+{
+  CRandomULongs rng(seed);
+  std::vector<char> keyBuffer(g_Keys->MaxKeyLen());
+  KeyType key(keyBuffer.data(), 0);
+  BtreeSession* session = (state->m_UseSession) ? new BtreeSession(g_Btree) : nullptr;
+  PerfCounters perf;
+  if (state->m_UsePerf) perf.Open();
+
+  UINT cumulative[OP_COUNT];
+  UINT total = 0;
+  for (UINT i = 0; i < OP_COUNT; i++)
+  {
+	total += state->m_Workload->m_Percent[i];
+	cumulative[i] = total;
+  }
+
+  while (!g_StartFlag.load(std::memory_order_acquire))
+  {
+	YieldProcessor();
+  }
+
+  perf.Start();
+  while (!g_StopFlag.load(std::memory_order_relaxed))
+  {
+	UINT draw = rng.GetRandomULong() % 100;
+	UINT op = 0;
+	while (draw >= cumulative[op]) op++;
+
+	ULONGLONG index = 0;
+	ULONGLONG value = 0;
+	if (op == OP_INSERT)
+	{
+	  index = g_NextInsert.fetch_add(1);
+	  value = index;
+	}
+	else
+	{
+	  index = state->m_Distribution.Next(rng, g_InsertedKeys.load(std::memory_order_relaxed));
+	  value = (ULONGLONG(state->m_ThreadNr) << 40) + state->m_Ops[op];
+	}
+	key.m_KeyLen = g_Keys->MakeKey(index, keyBuffer.data());
+
+	ULONGLONG start = Now();
+	BTRESULT btr = ExecuteOp(session, op, &key, value);
+	ULONGLONG elapsed = Now() - start;
+
+	if (op == OP_INSERT && btr == BT_SUCCESS)
+	{
+	  g_InsertedKeys.fetch_add(1, std::memory_order_relaxed);
+	}
+	state->m_Ops[op]++;
+	if (btr != BT_SUCCESS) state->m_Failed[op]++;
+	state->m_Latency[op].Record(ULONGLONG(elapsed * g_NsPerTick));
+
+	if (state->m_Trace && !state->m_Trace->Append(op, key.m_pKeyValue, key.m_KeyLen, value))
+	{
+	  state->m_Trace = nullptr;
+	}
+  }
+  perf.Stop(&state->m_Perf);
+
+  delete session;
+}
+
+// Execute the operations of a trace stream in order, as fast as possible
+static void ReplayThread(WorkerState* state, TraceStream* stream)
+{
+  BtreeSession* session = (state->m_UseSession) ? new BtreeSession(g_Btree) : nullptr;
+  KeyType key(nullptr, 0);
+  UINT op = 0;
+  const char* keyValue = nullptr;
+  UINT keyLen = 0;
+  ULONGLONG value = 0;
+  PerfCounters perf;
+  if (state->m_UsePerf) perf.Open();
+
+  while (!g_StartFlag.load(std::memory_order_acquire))
+  {
+	YieldProcessor();
+  }
+
+  perf.Start();
+  stream->Rewind();
+  while (stream->Next(op, keyValue, keyLen, value))
+  {
+	if (op >= OP_COUNT) continue;
+	key.m_pKeyValue = (char*)(keyValue);
+	key.m_KeyLen = keyLen;
+
+	ULONGLONG start = Now();
+	BTRESULT btr = ExecuteOp(session, op, &key, value);
+	ULONGLONG elapsed = Now() - start;
+
+	state->m_Ops[op]++;
+	if (btr != BT_SUCCESS) state->m_Failed[op]++;
+	state->m_Latency[op].Record(ULONGLONG(elapsed * g_NsPerTick));
+  }
+  perf.Stop(&state->m_Perf);
+
+  delete session;
+}
+
+// Load keys [0, keyCount) in a shuffled order using nThreads threads.
+// The inserts are recorded in the load streams of the trace if record is set.
+static double LoadKeys(ULONGLONG keyCount, UINT nThreads, UINT seed, bool record)
+{
+  std::vector<UINT> order((size_t)keyCount);
+  for (size_t i = 0; i < order.size(); i++) order[i] = UINT(i);
+
+  CRandomULongs rng(seed);
+  for (size_t i = order.size() - 1; i > 0; i--)
+  {
+	size_t indx = size_t(RandomULongLong(rng) % (i + 1));
+	std::swap(order[i], order[indx]);
+  }
+
+  if (record)
+  {
+	g_Trace.m_LoadStreams.resize(nThreads);
+  }
+
+  std::atomic<ULONGLONG> failed(0);
+  ULONGLONG start = Now();
+  std::vector<std::thread> threads;
+  for (UINT t = 0; t < nThreads; t++)
+  {
+	threads.push_back(std::thread([&, t]()
+	{
+	  std::vector<char> keyBuffer(g_Keys->MaxKeyLen());
+	  KeyType key(keyBuffer.data(), 0);
+	  BtreeSession session(g_Btree);
+	  TraceStream* trace = (record) ? &g_Trace.m_LoadStreams[t] : nullptr;
+	  for (size_t i = t; i < order.size(); i += nThreads)
+	  {
+		key.m_KeyLen = g_Keys->MakeKey(order[i], keyBuffer.data());
+		if (session.InsertRecord(&key, RecordValue(order[i])) != BT_SUCCESS) failed++;
+		if (trace) trace->Append(OP_INSERT, key.m_pKeyValue, key.m_KeyLen, order[i]);
+	  }
+	}));
+  }
+  for (size_t t = 0; t < threads.size(); t++) threads[t].join();
+  double seconds = (Now() - start) * g_NsPerTick / 1e9;
+
+  if (failed > 0)
+  {
+	fprintf(stderr, "Load: %llu inserts failed\n", ULONGLONG(failed));
+  }
+  return seconds;
+}
+
+// Replay the load streams of the trace, one thread per stream
+static double ReplayLoad()
+{
+  std::atomic<ULONGLONG> failed(0);
+  ULONGLONG start = Now();
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < g_Trace.m_LoadStreams.size(); t++)
+  {
+	threads.push_back(std::thread([&, t]()
+	{
+	  TraceStream& stream = g_Trace.m_LoadStreams[t];
+	  BtreeSession session(g_Btree);
+	  KeyType key(nullptr, 0);
+	  UINT op = 0;
+	  const char* keyValue = nullptr;
+	  UINT keyLen = 0;
+	  ULONGLONG value = 0;
+	  stream.Rewind();
+	  while (stream.Next(op, keyValue, keyLen, value))
+	  {
+		key.m_pKeyValue = (char*)(keyValue);
+		key.m_KeyLen = keyLen;
+		if (session.InsertRecord(&key, RecordValue(value)) != BT_SUCCESS) failed++;
+	  }
+	}));
+  }
+  for (size_t t = 0; t < threads.size(); t++) threads[t].join();
+  double seconds = (Now() - start) * g_NsPerTick / 1e9;
+
+  if (failed > 0)
+  {
+	fprintf(stderr, "Load: %llu inserts failed\n", ULONGLONG(failed));
+  }
+  return seconds;
+}
+
+// Look up every key loaded or inserted. Returns the number of keys not found.
+static ULONGLONG VerifyKeys(ULONGLONG keyCount)
+{
+  std::vector<char> keyBuffer(g_Keys->MaxKeyLen());
+  KeyType key(keyBuffer.data(), 0);
+  BtreeSession session(g_Btree);
+  ULONGLONG missing = 0;
+  for (ULONGLONG i = 0; i < keyCount; i++)
+  {
+	void* rec = nullptr;
+	key.m_KeyLen = g_Keys->MakeKey(i, keyBuffer.data());
+	if (session.LookupRecord(&key, rec) != BT_SUCCESS)
+	{
+	  if (missing < 10) fprintf(stderr, "Key %llu (%.*s) not found\n", i, key.m_KeyLen, key.m_pKeyValue);
+	  missing++;
+	}
+  }
+  return missing;
+}
+
+// ---------------------------------------------------------------------------
+// Runs and reporting
+// ---------------------------------------------------------------------------
+struct RunResult
+{
+  UINT				  m_Threads;
+  double			  m_Seconds;
+  ULONGLONG			  m_Ops[OP_COUNT];
+  ULONGLONG			  m_Failed[OP_COUNT];
+  LatencyHistogram	  m_Latency[OP_COUNT];
+  LatencySummary	  m_TreeLatency[LAT_OP_COUNT];	// From the library, if built with latency histograms
+  ContentionStats	  m_Contention;
+  PhaseProfile		  m_Phases[PROF_OP_COUNT];	// From the library, if profiling is on
+  PerfCounts		  m_Perf;					// All worker threads
+
+  ULONGLONG TotalOps()
+  {
+	ULONGLONG total = 0;
+	for (UINT i = 0; i < OP_COUNT; i++) total += m_Ops[i];
+	return total;
+  }
+};
+
+static void CollectResults(std::vector<WorkerState>& states, double seconds, RunResult* result)
+{
+  result->m_Threads = UINT(states.size());
+  result->m_Seconds = seconds;
+  result->m_Perf.Clear();
+  for (size_t t = 0; t < states.size(); t++)
+  {
+	result->m_Perf.Add(states[t].m_Perf, t == 0);
+  }
+  for (UINT i = 0; i < OP_COUNT; i++)
+  {
+	result->m_Ops[i] = 0;
+	result->m_Failed[i] = 0;
+	result->m_Latency[i].Reset();
+	for (size_t t = 0; t < states.size(); t++)
+	{
+	  result->m_Ops[i] += states[t].m_Ops[i];
+	  result->m_Failed[i] += states[t].m_Failed[i];
+	  result->m_Latency[i].Merge(states[t].m_Latency[i]);
+	}
+  }
+  for (UINT i = 0; i < LAT_OP_COUNT; i++)
+  {
+	g_Btree->GetLatencyStats(LatencyOp(i), &result->m_TreeLatency[i]);
+  }
+  g_Btree->GetContentionStats(&result->m_Contention);
+  for (UINT i = 0; i < PROF_OP_COUNT; i++)
+  {
+	g_Btree->GetPhaseProfile(ProfileOp(i), &result->m_Phases[i]);
+  }
+}
+
+// Run the workload for the given duration. If record is set, the operations
+// are recorded in the run streams of the trace.
+static void RunWorkload(BenchOptions& options, UINT nThreads, bool record, RunResult* result)
+{
+  std::vector<WorkerState> states(nThreads);
+  std::vector<std::thread> threads;
+
+  // Compute the zipfian constants once, the workers get copies
+  ULONGLONG keyCount = g_InsertedKeys;
+  KeyDistribution distribution(options.m_Distribution, options.m_Theta, options.m_HotSetFraction, options.m_HotOpFraction);
+  distribution.Prepare(keyCount, 0, 1);
+
+  if (record)
+  {
+	g_Trace.m_RunStreams.assign(nThreads, TraceStream(options.m_RecordLimit));
+  }
+
+  g_StartFlag = false;
+  g_StopFlag = false;
+  for (UINT t = 0; t < nThreads; t++)
+  {
+	states[t].m_ThreadNr = t;
+	states[t].m_Workload = options.m_Workload;
+	states[t].m_Distribution = distribution;
+	states[t].m_Distribution.Prepare(keyCount, t, nThreads);
+	states[t].m_Trace = (record) ? &g_Trace.m_RunStreams[t] : nullptr;
+	states[t].m_UseSession = options.m_UseSession;
+	states[t].m_UsePerf = options.m_UsePerf;
+	states[t].Reset();
+	threads.push_back(std::thread(WorkerThread, &states[t], options.m_Seed * 7919 + nThreads * 131 + t + 1));
+  }
+
+  g_Btree->ClearLatencyStats();
+  g_Btree->ClearContentionStats();
+  g_Btree->ClearPhaseProfile();
+  ULONGLONG start = Now();
+  g_StartFlag.store(true, std::memory_order_release);
+  std::this_thread::sleep_for(std::chrono::seconds(options.m_Duration));
+  g_StopFlag = true;
+  for (UINT t = 0; t < nThreads; t++) threads[t].join();
+  ULONGLONG end = Now();
+
+  CollectResults(states, (end - start) * g_NsPerTick / 1e9, result);
+}
+
+// Replay the run streams of the trace, one thread per stream
+static void RunReplay(BenchOptions& options, RunResult* result)
+{
+  size_t nThreads = g_Trace.m_RunStreams.size();
+  std::vector<WorkerState> states(nThreads);
+  std::vector<std::thread> threads;
+
+  g_StartFlag = false;
+  for (size_t t = 0; t < nThreads; t++)
+  {
+	states[t].m_ThreadNr = UINT(t);
+	states[t].m_Workload = nullptr;
+	states[t].m_Trace = nullptr;
+	states[t].m_UseSession = options.m_UseSession;
+	states[t].m_UsePerf = options.m_UsePerf;
+	states[t].Reset();
+	threads.push_back(std::thread(ReplayThread, &states[t], &g_Trace.m_RunStreams[t]));
+  }
+
+  g_Btree->ClearLatencyStats();
+  g_Btree->ClearContentionStats();
+  g_Btree->ClearPhaseProfile();
+  ULONGLONG start = Now();
+  g_StartFlag.store(true, std::memory_order_release);
+  for (size_t t = 0; t < nThreads; t++) threads[t].join();
+  ULONGLONG end = Now();
+
+  CollectResults(states, (end - start) * g_NsPerTick / 1e9, result);
+}
+
+static void WriteJson(FILE* file, BenchOptions& options, double loadSeconds, std::vector<RunResult>& results,
+					  bool verified, ULONGLONG missing, UINT checkErrors)
+{
+  fprintf(file, "{\n");
+  fprintf(file, "  \"benchmark\": \"BtreeBench\",\n");
+  if (options.m_ReplayFile)
+  {
+	fprintf(file, "  \"workload\": \"replay\",\n");
+	fprintf(file, "  \"trace\": \"%s\",\n", options.m_ReplayFile);
+	fprintf(file, "  \"keys\": %llu,\n", options.m_Keys);
+  }
+  else
+  {
+	fprintf(file, "  \"workload\": \"%c\",\n", options.m_Workload->m_Name);
+	fprintf(file, "  \"mix\": {");
+	for (UINT i = 0; i < OP_COUNT; i++)
+	{
+	  fprintf(file, "%s\"%s\": %d", (i > 0) ? ", " : "", OpName[i], options.m_Workload->m_Percent[i]);
+	}
+	fprintf(file, "},\n");
+	fprintf(file, "  \"distribution\": {\"type\": \"%s\"", DistributionName[options.m_Distribution]);
+	if (options.m_Distribution == DIST_ZIPFIAN || options.m_Distribution == DIST_LATEST)
+	{
+	  fprintf(file, ", \"theta\": %.3f", options.m_Theta);
+	}
+	if (options.m_Distribution == DIST_HOTSPOT)
+	{
+	  fprintf(file, ", \"hot_set\": %.3f, \"hot_ops\": %.3f", options.m_HotSetFraction, options.m_HotOpFraction);
+	}
+	fprintf(file, "},\n");
+	fprintf(file, "  \"key_shape\": \"%s\",\n", g_Keys->Name());
+	fprintf(file, "  \"keys\": %llu,\n", options.m_Keys);
+	fprintf(file, "  \"key_length\": %d,\n", options.m_KeyLen);
+	fprintf(file, "  \"duration_s\": %d,\n", options.m_Duration);
+	fprintf(file, "  \"seed\": %d,\n", options.m_Seed);
+	if (options.m_RecordFile)
+	{
+	  fprintf(file, "  \"trace\": \"%s\",\n", options.m_RecordFile);
+	}
+  }
+  fprintf(file, "  \"session\": %s,\n", (options.m_UseSession) ? "true" : "false");
+  fprintf(file, "  \"load\": {\"seconds\": %.3f, \"ops_per_sec\": %.0f},\n",
+		  loadSeconds, (loadSeconds > 0) ? options.m_Keys / loadSeconds : 0.0);
+  fprintf(file, "  \"runs\": [\n");
+
+  double baseRate = 0.0;
+  UINT baseThreads = 1;
+  for (size_t r = 0; r < results.size(); r++)
+  {
+	RunResult& res = results[r];
+	double rate = res.TotalOps() / res.m_Seconds;
+	if (r == 0)
+	{
+	  baseRate = rate;
+	  baseThreads = res.m_Threads;
+	}
+	double speedup = (baseRate > 0) ? rate / baseRate : 0.0;
+	fprintf(file, "    {\"threads\": %d, \"seconds\": %.3f, \"ops\": %llu, \"ops_per_sec\": %.0f, "
+				  "\"speedup\": %.3f, \"efficiency\": %.3f,\n",
+			res.m_Threads, res.m_Seconds, res.TotalOps(), rate, speedup, speedup * baseThreads / res.m_Threads);
+	fprintf(file, "     \"ops_by_type\": {\n");
+	bool first = true;
+	for (UINT i = 0; i < OP_COUNT; i++)
+	{
+	  if (res.m_Ops[i] == 0) continue;
+	  LatencyHistogram& lat = res.m_Latency[i];
+	  fprintf(file, "%s       \"%s\": {\"count\": %llu, \"failed\": %llu, \"ops_per_sec\": %.0f, \"mean_ns\": %.0f, "
+					"\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}",
+			  (first) ? "" : ",\n", OpName[i], res.m_Ops[i], res.m_Failed[i], res.m_Ops[i] / res.m_Seconds,
+			  lat.Mean(), lat.Percentile(50.0), lat.Percentile(99.0), lat.Percentile(99.9), lat.Max());
+	  first = false;
+	}
+	fprintf(file, "\n     }");
+
+	// Latency measured inside the tree, including page maintenance
+	if (LatencyRecorder::IsEnabled())
+	{
+	  fprintf(file, ",\n     \"tree_latency\": {\n");
+	  first = true;
+	  for (UINT i = 0; i < LAT_OP_COUNT; i++)
+	  {
+		LatencySummary& lat = res.m_TreeLatency[i];
+		if (lat.m_Count == 0) continue;
+		fprintf(file, "%s       \"%s\": {\"count\": %llu, \"mean_ns\": %.0f, "
+					  "\"p50_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu}",
+				(first) ? "" : ",\n", LatencyOpName[i], lat.m_Count, lat.m_Mean, lat.m_P50, lat.m_P99, lat.m_P999, lat.m_Max);
+		first = false;
+	  }
+	  fprintf(file, "\n     }");
+	}
+
+	// Retries and conflicts, nonzero counters only
+	ContentionStats& cs = res.m_Contention;
+	fprintf(file, ",\n     \"contention\": {\"mwcas_ops\": %llu, \"mwcas_failed\": %llu, \"mwcas_helped\": %llu, "
+				  "\"mwcas_helped_done\": %llu",
+			cs.m_MwCasOps, cs.m_MwCasFailed, cs.m_MwCasHelps, cs.m_MwCasHelpsBailed);
+	for (UINT i = 0; i < CC_COUNT; i++)
+	{
+	  if (cs.m_Counts[i] == 0) continue;
+	  fprintf(file, ",\n       \"%s\": %llu", ContentionCounterName[i], cs.m_Counts[i]);
+	}
+	fprintf(file, "}");
+
+	// Hardware counts per operation
+	if (options.m_UsePerf)
+	{
+	  PerfCounts& perf = res.m_Perf;
+	  ULONGLONG ops = res.TotalOps();
+	  fprintf(file, ",\n     \"perf\": {\"available\": %s", (perf.AnyValid() && ops > 0) ? "true" : "false");
+	  for (UINT i = 0; i < PC_COUNT && ops > 0; i++)
+	  {
+		if (!perf.m_Valid[i]) continue;
+		fprintf(file, ", \"%s_per_op\": %.2f", PerfCounterName[i], double(perf.m_Values[i]) / double(ops));
+	  }
+	  if (perf.m_Valid[PC_CYCLES] && perf.m_Valid[PC_INSTRUCTIONS] && perf.m_Values[PC_CYCLES] > 0)
+	  {
+		fprintf(file, ", \"ipc\": %.3f", double(perf.m_Values[PC_INSTRUCTIONS]) / double(perf.m_Values[PC_CYCLES]));
+	  }
+	  fprintf(file, "}");
+	}
+
+	// Mean time per phase of the sampled operations
+	if (options.m_ProfileRate > 0)
+	{
+	  fprintf(file, ",\n     \"phases\": {\"sample_rate\": %u", options.m_ProfileRate);
+	  for (UINT i = 0; i < PROF_OP_COUNT; i++)
+	  {
+		PhaseProfile& prof = res.m_Phases[i];
+		if (prof.m_Samples == 0) continue;
+		fprintf(file, ",\n       \"%s\": {\"samples\": %llu, \"total_ns\": %.0f", ProfileOpName[i], prof.m_Samples, prof.m_Total);
+		for (UINT p = 0; p < PH_COUNT; p++)
+		{
+		  fprintf(file, ", \"%s_ns\": %.0f", ProfilePhaseName[p], prof.m_Phases[p]);
+		}
+		fprintf(file, "}");
+	  }
+	  fprintf(file, "}");
+	}
+	fprintf(file, "}%s\n", (r + 1 < results.size()) ? "," : "");
+  }
+  fprintf(file, "  ]");
+  if (verified)
+  {
+	fprintf(file, ",\n  \"verify\": {\"keys\": %llu, \"missing\": %llu, \"check_errors\": %d}",
+			ULONGLONG(g_NextInsert), missing, checkErrors);
+  }
+  fprintf(file, "\n}\n");
+}
+
+static void Usage()
+{
+  fprintf(stderr,
+	"Usage: BtreeBench [options]\n"
+	"  --workload A|B|C|D|F   workload mix (default A)\n"
+	"  --threads N[,N...]     thread counts, one run per count (default 1,2,4)\n"
+	"  --keys N               keys loaded before the runs (default 1000000)\n"
+	"  --keyshape SHAPE       words, int, desc, uuid or url (default words)\n"
+	"  --keylen N             word key length, 0 = word length plus 3 (default 0)\n"
+	"  --distribution DIST    uniform, zipfian, hotspot, latest or sequential\n"
+	"                         (default latest for workload D, zipfian otherwise)\n"
+	"  --theta T              zipfian constant, 0 < T < 1 (default 0.99)\n"
+	"  --hotspot SET,OPS      fraction of keys in the hot set and of operations\n"
+	"                         on it (default 0.2,0.8)\n"
+	"  --duration S           seconds per run (default 10)\n"
+	"  --seed N               random seed (default 23456)\n"
+	"  --words FILE           word list (default words.txt)\n"
+	"  --json FILE            write results to FILE instead of stdout\n"
+	"  --record FILE          record the load and the run to a trace file (one thread count only)\n"
+	"  --record-limit N       max operations recorded per thread in the run (default 1000000)\n"
+	"  --replay FILE          replay a trace instead of running a workload\n"
+	"  --events FILE          trace tree events in the runs and dump them to FILE for EventDecode\n"
+	"  --event-types T[,T...] event types traced: insert, delete, consolidate, split, merge,\n"
+	"                         page_delete (default all)\n"
+	"  --event-sample N       trace one of every N events of each thread (default 1)\n"
+	"  --profile N            time the phases of one of every N operations of each thread\n"
+	"  --no-session           call the BtreeRoot API instead of using a BtreeSession per thread\n"
+	"  --no-perf              do not read hardware performance counters\n"
+	"  --verify               look up all keys and check the tree after the runs\n");
+}
+
+static bool ParseThreads(const char* arg, std::vector<UINT>& threads)
+{
+  threads.clear();
+  const char* p = arg;
+  while (*p)
+  {
+	char* end = nullptr;
+	long count = strtol(p, &end, 10);
+	if (end == p || count <= 0) return false;
+	threads.push_back(UINT(count));
+	p = (*end == ',') ? end + 1 : end;
+	if (*end != ',' && *end != '\0') return false;
+  }
+  return !threads.empty();
+}
+
+static bool ParseFraction(const char* arg, double& value)
+{
+  char* end = nullptr;
+  value = strtod(arg, &end);
+  return end != arg && value >= 0.0 && value <= 1.0;
+}
+
+static bool ParseEventTypes(const char* arg, UINT32& mask)
+{
+  mask = 0;
+  const char* p = arg;
+  while (*p)
+  {
+	const char* end = strchr(p, ',');
+	size_t len = (end) ? size_t(end - p) : strlen(p);
+	UINT type = TE_COUNT;
+	for (UINT t = TE_NONE + 1; t < TE_COUNT; t++)
+	{
+	  if (strlen(TraceEventName[t]) == len && strncmp(p, TraceEventName[t], len) == 0) type = t;
+	}
+	if (type == TE_COUNT) return false;
+	mask |= TRACE_MASK(type);
+	p = (end) ? end + 1 : p + len;
+  }
+  return mask != 0;
+}
+
+static bool ParseOptions(int argc, char** argv, BenchOptions& options)
+{
+  options.m_Workload = &Workloads[0];
+  options.m_Threads.clear();
+  options.m_Threads.push_back(1);
+  options.m_Threads.push_back(2);
+  options.m_Threads.push_back(4);
+  options.m_Keys = 1000000;
+  options.m_KeyShape = KeyShapeNames[0];
+  options.m_KeyLen = 0;
+  options.m_Distribution = DIST_COUNT;		// Workload default
+  options.m_Theta = ZipfianGenerator::DefaultTheta;
+  options.m_HotSetFraction = 0.2;
+  options.m_HotOpFraction = 0.8;
+  options.m_Duration = 10;
+  options.m_Seed = 23456;
+  options.m_WordsFile = "words.txt";
+  options.m_JsonFile = nullptr;
+  options.m_RecordFile = nullptr;
+  options.m_RecordLimit = 1000000;
+  options.m_ReplayFile = nullptr;
+  options.m_UseSession = true;
+  options.m_Verify = false;
+  options.m_EventFile = nullptr;
+  options.m_EventMask = TraceAllEvents;
+  options.m_EventSample = 1;
+  options.m_ProfileRate = 0;
+  options.m_UsePerf = true;
+
+  for (int i = 1; i < argc; i++)
+  {
+	const char* arg = argv[i];
+	const char* value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+	if (strcmp(arg, "--no-session") == 0)
+	{
+	  options.m_UseSession = false;
+	  continue;
+	}
+	if (strcmp(arg, "--verify") == 0)
+	{
+	  options.m_Verify = true;
+	  continue;
+	}
+	if (strcmp(arg, "--no-perf") == 0)
+	{
+	  options.m_UsePerf = false;
+	  continue;
+	}
+	if (value == nullptr)
+	{
+	  return false;
+	}
+	i++;
+
+	if (strcmp(arg, "--workload") == 0)
+	{
+	  char name = char(toupper(value[0]));
+	  if (name == 'E')
+	  {
+		fprintf(stderr, "Workload E needs range scans, which the tree does not support\n");
+		return false;
+	  }
+	  options.m_Workload = nullptr;
+	  for (size_t w = 0; w < sizeof(Workloads) / sizeof(Workloads[0]); w++)
+	  {
+		if (Workloads[w].m_Name == name && value[1] == '\0') options.m_Workload = &Workloads[w];
+	  }
+	  if (options.m_Workload == nullptr) return false;
+	}
+	else if (strcmp(arg, "--threads") == 0)
+	{
+	  if (!ParseThreads(value, options.m_Threads)) return false;
+	}
+	else if (strcmp(arg, "--keys") == 0)
+	{
+	  options.m_Keys = strtoull(value, nullptr, 10);
+	  if (options.m_Keys == 0) return false;
+	}
+	else if (strcmp(arg, "--keyshape") == 0)
+	{
+	  options.m_KeyShape = nullptr;
+	  for (size_t k = 0; k < sizeof(KeyShapeNames) / sizeof(KeyShapeNames[0]); k++)
+	  {
+		if (strcmp(value, KeyShapeNames[k]) == 0) options.m_KeyShape = KeyShapeNames[k];
+	  }
+	  if (options.m_KeyShape == nullptr) return false;
+	}
+	else if (strcmp(arg, "--distribution") == 0)
+	{
+	  options.m_Distribution = DIST_COUNT;
+	  for (UINT d = 0; d < DIST_COUNT; d++)
+	  {
+		if (strcmp(value, DistributionName[d]) == 0) options.m_Distribution = DistributionType(d);
+	  }
+	  if (options.m_Distribution == DIST_COUNT) return false;
+	}
+	else if (strcmp(arg, "--theta") == 0)
+	{
+	  if (!ParseFraction(value, options.m_Theta) || options.m_Theta == 0.0 || options.m_Theta == 1.0) return false;
+	}
+	else if (strcmp(arg, "--hotspot") == 0)
+	{
+	  const char* comma = strchr(value, ',');
+	  if (comma == nullptr || !ParseFraction(value, options.m_HotSetFraction) || !ParseFraction(comma + 1, options.m_HotOpFraction)) return false;
+	}
+	else if (strcmp(arg, "--event-types") == 0)
+	{
+	  if (!ParseEventTypes(value, options.m_EventMask)) return false;
+	}
+	else if (strcmp(arg, "--event-sample") == 0)
+	{
+	  options.m_EventSample = UINT32(strtoul(value, nullptr, 10));
+	  if (options.m_EventSample == 0) return false;
+	}
+	else if (strcmp(arg, "--profile") == 0)
+	{
+	  options.m_ProfileRate = UINT32(strtoul(value, nullptr, 10));
+	  if (options.m_ProfileRate == 0) return false;
+	}
+	else if (strcmp(arg, "--record-limit") == 0)
+	{
+	  options.m_RecordLimit = strtoull(value, nullptr, 10);
+	  if (options.m_RecordLimit == 0) return false;
+	}
+	else if (strcmp(arg, "--keylen") == 0)   options.m_KeyLen = UINT(atoi(value));
+	else if (strcmp(arg, "--duration") == 0) options.m_Duration = UINT(atoi(value));
+	else if (strcmp(arg, "--seed") == 0)	 options.m_Seed = UINT(strtoul(value, nullptr, 10));
+	else if (strcmp(arg, "--words") == 0)	 options.m_WordsFile = value;
+	else if (strcmp(arg, "--json") == 0)	 options.m_JsonFile = value;
+	else if (strcmp(arg, "--record") == 0)	 options.m_RecordFile = value;
+	else if (strcmp(arg, "--replay") == 0)	 options.m_ReplayFile = value;
+	else if (strcmp(arg, "--events") == 0)	 options.m_EventFile = value;
+	else return false;
+  }
+
+  if (options.m_Distribution == DIST_COUNT)
+  {
+	options.m_Distribution = options.m_Workload->m_Distribution;
+  }
+  if (options.m_RecordFile && (options.m_ReplayFile || options.m_Threads.size() != 1))
+  {
+	fprintf(stderr, "--record needs a single thread count and cannot be combined with --replay\n");
+	return false;
+  }
+  return true;
+}
+
+// Create the key shape selected by the options
+static bool CreateKeyShape(BenchOptions& options)
+{
+  if (strcmp(options.m_KeyShape, "int") == 0)
+  {
+	g_Keys = new IntKeys();
+	return true;
+  }
+  if (strcmp(options.m_KeyShape, "desc") == 0)
+  {
+	g_Keys = new DescKeys();
+	return true;
+  }
+  if (strcmp(options.m_KeyShape, "uuid") == 0)
+  {
+	g_Keys = new UuidKeys();
+	return true;
+  }
+
+  // The other shapes need the word list
+  bool words = strcmp(options.m_KeyShape, "words") == 0;
+  UINT keyLen = (words) ? options.m_KeyLen : 0;
+  if (keyLen > 0 && keyLen < WordKeys::MinKeyLen)
+  {
+	fprintf(stderr, "Key length must be at least %d\n", WordKeys::MinKeyLen);
+	return false;
+  }
+  if (!g_Words.Load(options.m_WordsFile, WordKeys::MaxWordLen(keyLen)))
+  {
+	return false;
+  }
+  if (words)
+  {
+	g_Keys = new WordKeys(&g_Words, keyLen);
+  }
+  else
+  {
+	g_Keys = new UrlKeys(&g_Words);
+  }
+  return true;
+}
+
+// Stop tracing and write the events of the runs
+static bool DumpEvents(const char* fileName)
+{
+  g_Btree->SetEventTrace(0);
+  FILE* file = nullptr;
+  errno_t err = fopen_s(&file, fileName, "wb");
+  if (err != 0 || !file)
+  {
+	fprintf(stderr, "Can't open event file %s\n", fileName);
+	return false;
+  }
+  BTRESULT btr = g_Btree->DumpEventTrace(file);
+  fclose(file);
+  if (btr != BT_SUCCESS)
+  {
+	fprintf(stderr, "Can't write event file %s\n", fileName);
+	return false;
+  }
+  fprintf(stderr, "Dumped tree events to %s\n", fileName);
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  BenchOptions options;
+  if (!ParseOptions(argc, argv, options))
+  {
+	Usage();
+	return 1;
+  }
+
+  LARGE_INTEGER freq;
+  QueryPerformanceFrequency(&freq);
+  g_NsPerTick = 1e9 / double(freq.QuadPart);
+
+  g_Btree = new BtreeRootInternal();
+  g_Btree->SetPhaseProfiling(options.m_ProfileRate);
+  double loadSeconds = 0.0;
+  std::vector<RunResult> results;
+  ULONGLONG missing = 0;
+  UINT checkErrors = 0;
+
+  if (options.m_ReplayFile)
+  {
+	if (!g_Trace.Read(options.m_ReplayFile))
+	{
+	  return 1;
+	}
+	options.m_Keys = OpTrace::RecordCount(g_Trace.m_LoadStreams);
+	fprintf(stderr, "Loading %llu keys with %zu threads\n", options.m_Keys, g_Trace.m_LoadStreams.size());
+	loadSeconds = ReplayLoad();
+
+	if (options.m_EventFile) g_Btree->SetEventTrace(options.m_EventMask, options.m_EventSample);
+	results.resize(1);
+	RunReplay(options, &results[0]);
+	fprintf(stderr, "Replay, %2d threads: %.0f ops/sec\n", results[0].m_Threads, results[0].TotalOps() / results[0].m_Seconds);
+
+	// The keys of the trace are not numbered, so only the tree structure is checked
+	if (options.m_Verify)
+	{
+	  checkErrors = g_Btree->CheckTree(stderr);
+	  options.m_Verify = false;
+	}
+  }
+  else
+  {
+	if (!CreateKeyShape(options))
+	{
+	  return 1;
+	}
+	if (options.m_Keys > 0xFFFFFFFF || options.m_Keys > g_Keys->Capacity() / 2)
+	{
+	  fprintf(stderr, "Too many keys: at most %llu with %s keys\n",
+			  min(g_Keys->Capacity() / 2, 0xFFFFFFFFULL), g_Keys->Name());
+	  return 1;
+	}
+
+	bool record = (options.m_RecordFile != nullptr);
+	UINT loadThreads = *std::max_element(options.m_Threads.begin(), options.m_Threads.end());
+	fprintf(stderr, "Loading %llu keys with %d threads\n", options.m_Keys, loadThreads);
+	loadSeconds = LoadKeys(options.m_Keys, loadThreads, options.m_Seed, record);
+	g_NextInsert = options.m_Keys;
+	g_InsertedKeys = options.m_Keys;
+
+	if (options.m_EventFile) g_Btree->SetEventTrace(options.m_EventMask, options.m_EventSample);
+	results.resize(options.m_Threads.size());
+	for (size_t r = 0; r < options.m_Threads.size(); r++)
+	{
+	  RunWorkload(options, options.m_Threads[r], record, &results[r]);
+	  fprintf(stderr, "Workload %c, %2d threads: %.0f ops/sec\n", options.m_Workload->m_Name,
+			  results[r].m_Threads, results[r].TotalOps() / results[r].m_Seconds);
+	}
+
+	if (record)
+	{
+	  if (!g_Trace.Write(options.m_RecordFile))
+	  {
+		return 1;
+	  }
+	  fprintf(stderr, "Recorded %llu load and %llu run operations to %s\n", OpTrace::RecordCount(g_Trace.m_LoadStreams),
+			  OpTrace::RecordCount(g_Trace.m_RunStreams), options.m_RecordFile);
+	}
+
+	if (options.m_Verify)
+	{
+	  missing = VerifyKeys(g_NextInsert);
+	  fprintf(stderr, "Verify: %llu of %llu keys missing\n", missing, ULONGLONG(g_NextInsert));
+	  checkErrors = g_Btree->CheckTree(stderr);
+	}
+  }
+
+  if (options.m_EventFile && !DumpEvents(options.m_EventFile))
+  {
+	return 1;
+  }
+
+  if (options.m_UsePerf && !results.empty() && !results[0].m_Perf.AnyValid())
+  {
+	fprintf(stderr, "Hardware performance counters are not available\n");
+  }
+
+  FILE* jsonFile = stdout;
+  if (options.m_JsonFile)
+  {
+	errno_t err = fopen_s(&jsonFile, options.m_JsonFile, "w");
+	if (err != 0 || !jsonFile)
+	{
+	  fprintf(stderr, "Can't open output file %s\n", options.m_JsonFile);
+	  return 1;
+	}
+  }
+  WriteJson(jsonFile, options, loadSeconds, results, options.m_Verify, missing, checkErrors);
+  if (jsonFile != stdout) fclose(jsonFile);
+
+  return (missing > 0 || checkErrors > 0) ? 2 : 0;
+}
@@ -1,25 +1,28 @@
 #pragma once
 
-#include <windows.h>
+#include "Platform.h"
 #include <atomic>
 #include "mwCAS.h"
 #include "Utilities.h"
 #include "MemoryBroker.h"
 #include "EpochManager.h"
 #include "MemoryBroker.h"
+#include "LatencyRecorder.h"
+#include "ContentionStats.h"
+#include "EventTrace.h"
+#include "PhaseProfiler.h"
 
 using namespace std; 
 
-//#define DO_LOG 1
-
 // Forward references
 class BtreeRootInternal;
 class BtreePage;
 class BtIterator;
+class ShadowIndex;
 
 enum BTRESULT {
   BT_SUCCESS, BT_INVALID_ARG, BT_DUPLICATE_KEY, BT_KEY_NOT_FOUND, BT_OUT_OF_MEMORY, BT_INTERNAL_ERROR,
-  BT_PAGE_INACTIVE, BT_PAGE_FULL, BT_NOT_INSERTED, BT_INSTALL_FAILED, BT_NO_ACTION_TAKEN
+  BT_PAGE_INACTIVE, BT_PAGE_FULL, BT_NOT_INSERTED, BT_INSTALL_FAILED, BT_NO_ACTION_TAKEN, BT_RECORD_CHANGED
 };
 
 // Defaul functions used unless user specifies otherwise
@@ -128,6 +131,60 @@ struct KeyType
 };
 
 
+// Key comparison policies. The search, sort and merge routines on pages are templates
+// on a comparer so that key comparisons can be inlined in the search and sort loops.
+// DefaultKeyComparer implements DefaultCompareKeys, any other comparison function
+// is called through CompareFnComparer.
+struct DefaultKeyComparer
+{
+  // Compares keys as unsigned byte strings (as memcmp does), eight bytes at a time.
+  // If one key is a prefix of the other, the shorter one is earlier in sort order,
+  // except for the one-byte high bound (KeyType::GetMaxValue), which is later than
+  // all keys, also keys that start with 0xFF.
+  int Compare(const void* key1, const int keylen1, const void* key2, const int keylen2) const
+  {
+	const BYTE* p1 = (const BYTE*)(key1);
+	const BYTE* p2 = (const BYTE*)(key2);
+	int minlen = min(keylen1, keylen2);
+	int pos = 0;
+	for (; pos + int(sizeof(ULONGLONG)) <= minlen; pos += sizeof(ULONGLONG))
+	{
+	  ULONGLONG word1, word2;
+	  memcpy(&word1, p1 + pos, sizeof(ULONGLONG));
+	  memcpy(&word2, p2 + pos, sizeof(ULONGLONG));
+	  if (word1 != word2)
+	  {
+		// Byte swap so that integer order is byte string order
+		word1 = _byteswap_uint64(word1);
+		word2 = _byteswap_uint64(word2);
+		return (word1 < word2) ? -1 : 1;
+	  }
+	}
+	for (; pos < minlen; pos++)
+	{
+	  if (p1[pos] != p2[pos]) return (p1[pos] < p2[pos]) ? -1 : 1;
+	}
+	if (minlen == 1 && keylen1 != keylen2 && p1[0] == BYTE(KeyType::MaxChar))
+	{
+	  return (keylen1 == 1) ? 1 : -1;
+	}
+	return (keylen1 > keylen2) - (keylen1 < keylen2);
+  }
+};
+
+struct CompareFnComparer
+{
+  CompareFn*		  m_CompareFn;
+
+  CompareFnComparer(CompareFn* compareFn) : m_CompareFn(compareFn) {}
+
+  int Compare(const void* key1, const int keylen1, const void* key2, const int keylen2) const
+  {
+	return m_CompareFn(key1, keylen1, key2, keylen2);
+  }
+};
+
+
 // A key-pointer entry on an index page or a leaf page.
 // On an index page, the pointer points to an index page or a leaf page.
 // On a leaf page, it points to a B-tree record.
@@ -163,10 +220,19 @@ struct KeyPtrPair
 	m_Pointer = (char*)(recptr);
   }
  
+  // A slot whose insert had not set the record pointer when the page was copied
+  // is closed by setting its pointer to the address of ClosedSlot.
+  static char ClosedSlot;
+
+  static bool IsNullPointer(LONGLONG val)
+  {
+	return (val == 0 || val == LONGLONG(&ClosedSlot));
+  }
+
   bool IsDeleted()
   {
 	LONGLONG val = m_Pointer.ReadLL();
-	return( val == 0 );	
+	return IsNullPointer(val);
   }
 };
 
@@ -248,8 +314,8 @@ struct PageStatus
   static void PrintPageStatus(FILE* file, LONGLONG psw, bool isIndexPage)
   {
 	PageStatus* pst = (PageStatus*)(&psw);
-	char* state = nullptr;
-	char* action = nullptr;
+	const char* state = nullptr;
+	const char* action = nullptr;
 	switch (pst->m_PageState)
 	{
 	case PAGE_NORMAL:   state = "NORMAL"; break;
@@ -299,8 +365,6 @@ struct PermutationArray
 	  m_PermArray[i] = i;
   }
 
-  BTRESULT SortPermArray();
-
 };
 
 extern void OnLeafPageDelete(void* btreePtr, void* objToDelete, MemObjectType objType);
@@ -318,6 +382,7 @@ struct BtreeStatistics
   UINT	  m_KeySpaceLP;
   UINT	  m_RecArrSpaceLP;
   UINT	  m_DeletedSpaceLP;
+  UINT	  m_UnsortedLP;			// Slots in the unsorted areas
 
   UINT	  m_SpaceIP;
   UINT	  m_AllocedSpaceIP;
@@ -329,6 +394,7 @@ struct BtreeStatistics
   {
 	m_LeafPages = m_IndexPages = m_Records = 0;
 	m_SpaceLP = m_AllocedSpaceLP = m_FreeSpaceLP = m_HeaderSpaceLP = m_KeySpaceLP = m_RecArrSpaceLP = m_DeletedSpaceLP = 0;
+	m_UnsortedLP = 0;
 	m_SpaceIP = m_AllocedSpaceIP = m_HeaderSpaceIP = m_KeySpaceIP = m_RecArrSpaceIP = 0;
   }
 
@@ -337,15 +403,34 @@ struct BtreeStatistics
 class BtreePage
 {
   friend class BtreeRootInternal;
+  friend class ShadowIndex;
 
   using UpdateCounter = MwcTargetField<volatile ULONGLONG, DescriptorFlagPos>;
 
 public:
   enum CompType       { LT, LTE, EQ, GTE, GT};
 
+  // Page sizes, including the header, are stored in 16 bits
+  static const UINT PageSizeLimit = 0xFFFF;
+
 protected:
   enum PageType:UINT8 { NO_PAGE, LEAF_PAGE, INDEX_PAGE };
 
+  // Append-pattern splits: if at least AppendSplitMinInserts records were appended
+  // in key order above the sorted set, the left page gets AppendSplitPercent of the records.
+  static const UINT AppendSplitMinInserts = 4;
+  static const UINT AppendSplitPercent = 90;
+
+  // Read-driven consolidation: a page with at least ReadScanMinUnsorted unsorted entries is
+  // consolidated by the next operation that reaches it once lookups have scanned 
+  // ReadScanCostFactor times its number of slots.
+  static const UINT ReadScanMinUnsorted = 8;
+  static const UINT ReadScanCostFactor = 4;
+
+  // A unique insert waits at most this many times for another insert into the page to
+  // complete. Then the page is consolidated, which closes the unfilled slot.
+  static const UINT MaxInsertWaits = 1000;
+
 
   PStatusWord		  m_PageStatus; // Status of this leaf page
 
@@ -358,9 +443,12 @@ protected:
   BtreePage*		  m_SrcPage2;		// Right source page
 #endif
   PageType			  m_PageType;		// Leaf page or index page
-  UINT16			  m_PageSize;		// Page size in bytes (max 64K)
+  UINT16			  m_PageSize;		// Page size in bytes (max PageSizeLimit)
   UINT16			  m_nSortedSet;		// Nr of records in the sorted set
   atomic_uint	      m_WastedSpace;    // Space wasted (in bytes) by records that have been deleted
+  UINT32			  m_CreateTime;		// Tick count (in ms) when the page was created
+  atomic_uint		  m_ReadScanCost;	// Nr of unsorted entries scanned by lookups on this page
+  volatile bool		  m_ReadScanHot;	// Lookups ask for the page to be consolidated (see ChargeReadScan)
   volatile PermutationArray* m_PermArr;      // Array giving the sorted order of all elements
 
   KeyPtrPair	      m_RecordArr[1];
@@ -382,17 +470,32 @@ protected:
   KeyPtrPair* GetUnsortedEntry(UINT indx) { return GetKeyPtrPair(indx + m_nSortedSet); }
 
   UINT AppendToSortedSet(char* separator, UINT sepLen, void* ptr);
-  BTRESULT SortUnsortedSet(KeyPtrPair* pSortedArr, UINT count);
-
-  BTRESULT ExtractLiveRecords(KeyPtrPair*& liveRecArray, UINT& count, UINT& keySpace);
-  BTRESULT AddRecordToPage(KeyType* key, void* recptr);
+  UINT SortUnsortedSlots(UINT nrUnsorted, UINT16* slots);
+  UINT MergeLiveSlots(UINT nrUnsorted, UINT16* order, UINT& keySpace);
+  template <class Comparer> UINT SortUnsortedSlots(const Comparer& comparer, UINT nrUnsorted, UINT16* slots);
+  template <class Comparer> UINT MergeLiveSlots(const Comparer& comparer, UINT nrUnsorted, UINT16* order, UINT& keySpace);
+
+  BTRESULT OrderLiveSlots(UINT nrUnsorted, UINT buffer, UINT16*& order, UINT& count, UINT& keySpace);
+  BTRESULT AddRecordToPage(KeyType* key, void* recptr, bool unique = false);
+  BTRESULT FindLiveRecord(KeyType* key, LONGLONG psw);
+  bool InsertInProgress(LONGLONG psw);
+  void CloseUnfilledSlots(LONGLONG psw);
+  template <class Comparer> BTRESULT FindLiveRecord(const Comparer& comparer, KeyType* key, LONGLONG psw);
+  int FindLiveSlot(KeyType* key, LONGLONG psw, bool& ambiguous);
+  template <class Comparer> int FindLiveSlot(const Comparer& comparer, KeyType* key, LONGLONG psw, bool& ambiguous);
   BTRESULT DeleteRecordFromPage(KeyType* key);
+  BTRESULT LocateRecordForUpdate(KeyType* key, void* expectedRec, LONGLONG& psw, KeyPtrPair*& kpp, LONGLONG& recPtr);
+  BTRESULT UpdateRecordOnPage(KeyType* key, void* expectedRec, void* newRec, void*& oldRec);
   BTRESULT CopyToNewPage(BtreePage* newPage);
 
   BTRESULT TryToMergePage(BtIterator* iter);
   BTRESULT MergeLeafPages(BtreePage* otherPage, bool mergeOnRight, BtreePage** newPage);
   BTRESULT ConsolidateLeafPage(BtIterator* iter, UINT minFree);
+  void ChargeReadScan(LONGLONG psw);
+  bool MarkReadScanHot(LONGLONG psw, LONGLONG& newpsw);
   BTRESULT SplitLeafPage(BtIterator* iter);
+  bool IsAppendPattern(LONGLONG psw);
+  template <class Comparer> bool IsAppendPattern(const Comparer& comparer, LONGLONG psw);
 
   BTRESULT MergeIndexPages(BtreePage* otherPage, bool mergeOnRight, BtreePage** newPage);
   BTRESULT ExpandIndexPage(char* separator, UINT sepLen, BtreePage* leftPage, BtreePage* rightPage, UINT oldPos, BtreePage*& newPage);
@@ -400,6 +503,9 @@ protected:
   BTRESULT SplitIndexPage(BtIterator* iter);
 
   BTRESULT CreatePermutationArray(PermutationArray*& permArr);
+  void SortPermutationArray(PermutationArray* permArr);
+  template <class Comparer> void SortPermutationArray(const Comparer& comparer, PermutationArray* permArr);
+  template <class Comparer> int KeySearch(const Comparer& comparer, KeyType* searchKey, BtreePage::CompType ctype);
 
  
 public:
@@ -472,12 +578,65 @@ struct KeyComparisonMap
   }
 };
 
+// One record of a multi-record update. The record with key m_Key must exist.
+// Its record pointer is replaced by m_NewRec or, if m_NewRec is null, the record is deleted.
+// If m_ExpectedRec is not null, the current record pointer must equal m_ExpectedRec.
+// The record pointer found is returned in m_OldRec.
+struct MultiUpdateEntry
+{
+  KeyType*	m_Key;
+  void*		m_ExpectedRec;
+  void*		m_NewRec;
+  void*		m_OldRec;
+};
+
+// Policy deciding how much free space to leave on a new leaf page.
+//   READ_OPTIMIZED  - pack pages densely, leaving only a small fraction of free space
+//   WRITE_OPTIMIZED - always leave a large fraction of free space
+//   AUTO            - scale the free space by the insert heat of the page, that is, 
+//                     the insert rate into its key range relative to the tree average.
+class PageSizePolicy
+{
+public:
+  enum PolicyType { READ_OPTIMIZED, WRITE_OPTIMIZED, AUTO };
+
+  PolicyType		  m_Type;
+  UINT32			  m_MinPageSize;		// Smaller leaf pages are merged
+  UINT32			  m_MaxPageSize;		// Larger leaf pages are split
+  double			  m_FreeSpaceFraction;	// Free space fraction for a page of average heat
+  double			  m_MinFreeFraction;	// Free space fraction for a cold page
+  double			  m_MaxFreeFraction;	// Upper bound on free space fraction for a hot page
+
+  PageSizePolicy(PolicyType type = AUTO)
+  {
+	m_Type = type;
+	m_MinPageSize = 128;
+	m_MaxPageSize = 512;
+	m_MinFreeFraction = 0.10;
+	m_MaxFreeFraction = 1.00;
+	m_FreeSpaceFraction = (type == READ_OPTIMIZED) ? m_MinFreeFraction : 0.50;
+  }
+
+  // Returns the fraction of free space to leave on a new leaf page.
+  // A negative heat means that the insert rate into the page is not known.
+  double FreeSpaceFraction(double heat)
+  {
+	switch (m_Type)
+	{
+	case READ_OPTIMIZED:  return m_MinFreeFraction;
+	case WRITE_OPTIMIZED: return m_FreeSpaceFraction;
+	default: break;
+	}
+	if (heat < 0.0) return m_FreeSpaceFraction;
+	double fraction = heat*m_FreeSpaceFraction;
+	return min(m_MaxFreeFraction, max(m_MinFreeFraction, fraction));
+  }
+};
+
 class BtreeRoot
 {
 protected:
-  UINT32			  m_MinPageSize;
-  UINT32			  m_MaxPageSize;
-  double			  m_FreeSpaceFraction;
+  PageSizePolicy	  m_PageSizePolicy;
 
 public:
   IMemoryAllocator*	  m_MemoryAllocator;
@@ -486,29 +645,66 @@ public:
 
   BtreeRoot()
   {
-	m_MinPageSize = 128;
-	m_MaxPageSize = 512;
-	m_FreeSpaceFraction = 0.50;
 	m_MemoryAllocator = GetDefaultMemoryAllocator();
 	m_CompareFn = DefaultCompareKeys;
 
   }
 
   BTRESULT InsertRecord(KeyType* key, void* recptr);
+  BTRESULT InsertIfAbsent(KeyType* key, void* recptr);
   BTRESULT LookupRecord(KeyType* key, void*& recFound);
   BTRESULT DeleteRecord(KeyType* key);
+  BTRESULT UpdateRecord(KeyType* key, void* newRec, void*& oldRec);
+  BTRESULT UpsertRecord(KeyType* key, void* recptr);
+  BTRESULT CompareAndSwapRecord(KeyType* key, void* expectedRec, void* newRec);
+  BTRESULT MultiUpdate(MultiUpdateEntry* entries, UINT count);
 
   BTRESULT TraceRecord(KeyType* key);
 
   void Print(FILE* file);
-  void CheckTree(FILE* file);
+  UINT CheckTree(FILE* file);		// Returns the number of errors found
   void PrintStats(FILE* file);
 
+  // Limbo memory (pages freed but not yet deallocated by the epoch manager)
+  void SetLimboLimits(__int64 softLimitBytes, __int64 hardLimitBytes);
+  void GetLimboStats(EpochLimboStats* stats);
+
+  // Latency of operations and page maintenance (see LatencyRecorder.h). Returns
+  // BT_NO_ACTION_TAKEN if the library was built without latency histograms.
+  BTRESULT GetLatencyStats(LatencyOp op, LatencySummary* summary);
+  void ClearLatencyStats();
+
+  // Retries and conflicts by reason (see ContentionStats.h)
+  void GetContentionStats(ContentionStats* stats);
+  void ClearContentionStats();
+
+  // Event tracing (see EventTrace.h). A zero mask turns tracing off.
+  void SetEventTrace(UINT32 eventMask, UINT32 sampleRate = 1);
+  BTRESULT DumpEventTrace(FILE* file);
+
+  // Sampled phase profile of record operations (see PhaseProfiler.h). A zero
+  // sample rate turns profiling off.
+  void SetPhaseProfiling(UINT32 sampleRate);
+  BTRESULT GetPhaseProfile(ProfileOp op, PhaseProfile* profile);
+  void ClearPhaseProfile();
+
+  // Page sizing policy. Should be set before the tree is populated.
+  BTRESULT SetPageSizePolicy(PageSizePolicy& policy);
+  void GetPageSizePolicy(PageSizePolicy& policy) { policy = m_PageSizePolicy; }
+
 };
 
 class BtreeRootInternal : public BtreeRoot
 {
   friend class BtreePage;
+  friend class ShadowIndex;
+  friend class BtreeSession;
+
+	// Nr of times a descent may resume from an ancestor on its path before starting over from the root
+	static const int		MaxResumeAttempts = 4;
+
+	// Nr of update-then-insert rounds an upsert makes before giving up (see DoUpsertRecord)
+	static const int		MaxUpsertAttempts = 100;
 
     MemoryBroker*			m_MemoryBroker;
     EpochManager*           m_EpochMgr;
@@ -528,16 +724,41 @@ class BtreeRootInternal : public BtreeRoot
     atomic_uint             m_nPageMerges;        // Nr of page merges
     atomic_uint             m_nPageDeletes;       // Nr of empty pages deleted
 
+	// Insert history used for sizing leaf pages (not cleared by ClearTreeStats)
+	ULONGLONG				m_CreateTime;		  // Tick count (in ms) when the tree was created
+	atomic_ullong			m_nTotalInserts;	  // Nr of records inserted since the tree was created
+	atomic_ullong			m_nTotalKeyBytes;	  // Total length of the keys inserted
+
+	// Shadow index of the top index levels
+	ShadowIndex* volatile	m_Shadow;			  // Current shadow index (may be stale or null)
+	volatile LONGLONG		m_IndexVersion;		  // Incremented before an index page is retired
+	ExclusiveLock			m_ShadowLock;		  // Held by the thread rebuilding the shadow index
+	atomic_uint				m_nShadowRebuilds;	  // Nr of times the shadow index was rebuilt
+	volatile ULONGLONG		m_ShadowBuildTime;	  // Tick count (in ms) of the last rebuild attempt
+
+	// Per-thread latency histograms (empty unless BTREE_LATENCY_HISTOGRAMS is defined)
+	LatencyRecorder			m_Latency;
+
+	// Per-thread counters of restarts, retries and failed installs
+	ContentionCounters		m_Contention;
+
+	// Per-thread rings of trace events, off unless enabled
+	EventTracer				m_Tracer;
+
+	// Per-thread phase times of sampled operations, off unless enabled
+	PhaseProfiler			m_Profiler;
+
 	// List of pages that were not installed
 	volatile BtreePage*		m_FailList;
 
 
 	// Compute the page size to allocate. 
-	UINT ComputeLeafPageSize(UINT nrRecords, UINT keySpace, UINT minFree);
+	UINT ComputeLeafPageSize(UINT nrRecords, UINT keySpace, UINT minFree, double heat = -1.0);
 	UINT ComputeIndexPageSize(UINT fanout, UINT keySpace);
 
 	BTRESULT FindTargetPage(KeyType* searchKey, BtIterator* iter);
-	BTRESULT AllocateLeafPage(UINT recCount, UINT keySpace, BtreePage*& newPage);
+	BTRESULT AllocateLeafPage(UINT recCount, UINT keySpace, BtreePage*& newPage, double heat = -1.0);
+	double LeafPageHeat(BtreePage* page, UINT recCount);
 	BTRESULT AllocateIndexPage(UINT recCount, UINT keySpace, BtreePage*& newPage);
 
 	BtreePage* CreateIndexPage(BtreePage* leftPage, BtreePage* rightPage, char* separator, UINT sepLen);
@@ -546,18 +767,43 @@ class BtreeRootInternal : public BtreeRoot
     BTRESULT InstallMergedPage(BtIterator* iter, ULONG pageIndx, BtreePage* otherSrcPage, LONGLONG otherPsw, BtreePage* newPage, BtreePage* newParentPage);
 	void ComputeTreeStats(BtreeStatistics* statsp);
     BTRESULT DoMaintenance(BtreePage* leafPage, BtIterator* iter);
+    void CheckPageAfterDelete(BtreePage* leafPage, BtIterator* iter);
+
+	UINT DescendShadowIndex(KeyType* searchKey, BtIterator* iter, BtreePage*& curPage);
+	void RebuildShadowIndex();
+	void RetireIndexPage(BtreePage* page);
+	void RetirePage(BtreePage* page);
+
+	// Record operations without entering an epoch (used directly by BtreeSession)
+	BTRESULT DoInsertRecord(KeyType* key, void* recptr, bool unique, BtIterator* iter);
+	BTRESULT DoLookupRecord(KeyType* key, void*& recFound, BtIterator* iter);
+	BTRESULT DoDeleteRecord(KeyType* key, BtIterator* iter);
+	BTRESULT DoUpdateRecord(KeyType* key, void* expectedRec, void* newRec, void*& oldRec, BtIterator* iter);
+	BTRESULT DoUpsertRecord(KeyType* key, void* recptr, BtIterator* iter);
+
+	void FreePages(BtreePage* page);
 
 public:
 	BtreeRootInternal();
+	~BtreeRootInternal();
 
-	BTRESULT InsertRecordInternal(KeyType* key, void* recptr);
+	BTRESULT InsertRecordInternal(KeyType* key, void* recptr, bool unique = false);
 	BTRESULT LookupRecordInternal(KeyType* key, void*& recFound);
 	BTRESULT DeleteRecordInternal(KeyType* key);
+	BTRESULT UpdateRecordInternal(KeyType* key, void* expectedRec, void* newRec, void*& oldRec);
+	BTRESULT UpsertRecordInternal(KeyType* key, void* recptr);
+	BTRESULT MultiUpdateInternal(MultiUpdateEntry* entries, UINT count);
 
 	void ClearTreeStats();
+	void GetTreeStats(BtreeStatistics* stats);
 	void PrintTreeStats(FILE* file);
+	EpochManager* GetEpochManager() { return m_EpochMgr; }
+	LatencyRecorder* GetLatencyRecorder() { return &m_Latency; }
+	ContentionCounters* GetContentionCounters() { return &m_Contention; }
+	EventTracer* GetEventTracer() { return &m_Tracer; }
+	PhaseProfiler* GetPhaseProfiler() { return &m_Profiler; }
 
-	void CheckTree(FILE* file);
+	UINT CheckTree(FILE* file);
 	void Print(FILE* file);
 
 #ifdef _DEBUG
@@ -581,9 +827,9 @@ struct PathEntry
 
   void PrintPathEntry(FILE* file, UINT level)
   {
-	fprintf(file, "Level %d: page 0X%I64X with status ", level, LONGLONG(m_Page));
+	fprintf(file, "Level %d: page 0X%llX with status ", level, LONGLONG(m_Page));
 	PageStatus::PrintPageStatus(file, LONGLONG(m_PageStatus), m_Page->IsIndexPage());
-	fprintf(file, "\n         chose slot %d, separator %.*s, pointer 0X%I64X\n",
+	fprintf(file, "\n         chose slot %d, separator %.*s, pointer 0X%llX\n",
 	           m_Slot, m_BoundLen, m_Bound, LONGLONG(m_NextPage));
 	m_Page->PrintPage(file, level, false);
   }
@@ -593,11 +839,13 @@ class BtIterator
 {
    friend class BtreeRootInternal;
   friend class BtreePage;
+  friend class BtreeSession;
 
   static const UINT MaxLevels = 10;
 
   BtreeRootInternal*	m_Btree;
   TraceInfo*            m_TrInfo;
+  PhaseSample*			m_Profile;			// Phase times of the operation, null unless it is sampled
 
   UINT					m_Count;			// No of entries added to m_Path
   PathEntry			    m_Path[MaxLevels];	// Pages on the path from the root to the current page
@@ -607,6 +855,7 @@ public:
   {
 	m_Btree = root;
 	m_Count = 0;
+	m_Profile = nullptr;
     for (UINT i = 0; i < MaxLevels; i++)
     {
         m_Path[i].m_Page = nullptr;
@@ -640,6 +889,18 @@ public:
 	m_Count++;
   }
 
+  // Extend the path with separator and child pointer supplied by the caller (the shadow index)
+  void ExtendPath(BtreePage* page, int slot, LONGLONG pageStatus64, char* bound, UINT boundLen, BtreePage* nextPage)
+  {
+	m_Path[m_Count].m_Page = page;
+	m_Path[m_Count].m_Slot = slot;
+	m_Path[m_Count].m_PageStatus = (void*)(pageStatus64);
+	m_Path[m_Count].m_Bound = bound;
+	m_Path[m_Count].m_BoundLen = boundLen;
+	m_Path[m_Count].m_NextPage = nextPage;
+	m_Count++;
+  }
+
   void PrintPath(FILE* file)
   {
 	fprintf(file, "******* Path from root down ********\n");
@@ -649,212 +910,17 @@ public:
 	}
 	fprintf(file, "******* End of path ********\n");
   }
-};
-
-#ifdef DO_LOG
-struct LogRec;
-
-struct InsertInfo
-{
-  char*		  m_Key;
-  UINT		  m_KeyLen;
-  BtreePage*  m_Page;
-  LONGLONG	  m_Status;
-  PathEntry   m_Prior;
-
-  static void RecInsert(char BorE, char* key, UINT keylen, BtreePage* page, LONGLONG pstatus, PathEntry* prior);
- 
-  void Print(FILE* file)
-  {
-	fprintf(file, "%.*s, page 0X%I64X ", m_KeyLen, m_Key, ULONGLONG(m_Page));
-	PageStatus::PrintPageStatus(file, m_Status, m_Page->IsIndexPage());
-	fprintf(file, "\n                            ");
-	fprintf(file, "Index term: %.*s ", m_Prior.m_BoundLen, m_Prior.m_Bound);
-	fprintf(file, "page 0X%I64X slot %d", ULONGLONG(m_Prior.m_Page), m_Prior.m_Slot);
-	PageStatus::PrintPageStatus(file, LONGLONG(m_Prior.m_PageStatus), m_Page->IsIndexPage());
-	fprintf(file, "\n");
-  }
-};
 
-struct ConsInfo
-{
-  BtreePage*  m_TrgPage;
-  LONGLONG	  m_TrgtStatus;
-  BtreePage*  m_NewPage;
-  LONGLONG	  m_NewStatus;
-  UINT		  m_RecCount;
-  BtreePage*  m_IndexPage;
-  LONGLONG    m_IndexPageStatus;
-
-  static void RecCons(char BorE, BtreePage* trgt, LONGLONG status, BtreePage* newpage, LONGLONG newstatus, UINT reccount,
-                                 BtreePage* indexPage, LONGLONG ipStatus);
- 
-  void Print(FILE* file)
+  // Record the page at the end of the path and its parent in a trace event
+  void TraceLeafPath(TraceEvent* ev)
   {
-	fprintf(file, "page 0X%I64X, ", ULONGLONG(m_TrgPage));
-	PageStatus::PrintPageStatus(file, m_TrgtStatus, m_TrgPage->IsIndexPage());
-	fprintf(file, " records %d\n", m_RecCount);
-    fprintf(file, "\t\t\t");
-	fprintf(file, "index page X%I64X, ", ULONGLONG(m_IndexPage));
-	PageStatus::PrintPageStatus(file, m_IndexPageStatus, true);
-    fprintf(file, "\n");
-   if (m_NewStatus == 0)
-    {
-        fprintf(file, "consolidation failed");
-    }
-    else
-    {
-        fprintf(file, "\t\t\t");
-	    fprintf(file, " new page 0X%I64X ", ULONGLONG(m_NewPage));
-        PageStatus::PrintPageStatus(file, m_NewStatus, m_NewPage->IsIndexPage());
-    }
-  }
-};
-
-struct SplitInfo
-{
-  BtreePage*	m_SrcPage;
-  LONGLONG		m_SrcStatus;
-  BtreePage*	m_LeftPage;
-  BtreePage*	m_RightPage;
-
-  static void RecSplit(char BorE, BtreePage* srcpage, LONGLONG srcstate, BtreePage* left, BtreePage* right);
- 
-  void Print(FILE* file)
-  {
-	fprintf(file, "page 0X%I64X ", ULONGLONG(m_SrcPage));
-	PageStatus::PrintPageStatus(file, m_SrcStatus, m_SrcPage->IsIndexPage());
-	fprintf(file, "left 0X%I64X, right 0X%I64X ", ULONGLONG(m_LeftPage), ULONGLONG(m_RightPage));
-  }
-};
-
-struct DeleteInfo
-{
-    char*		  m_Key;
-    UINT		  m_KeyLen;
-    BtreePage*    m_Page;
-    LONGLONG	  m_Status;
-    PathEntry     m_Prior;
-    BTRESULT      m_btResult;
-
-    static void RecDelete(char BorE, char* key, UINT keylen, BtreePage* page, LONGLONG pstatus, PathEntry* prior, BTRESULT btr);
-
-    void Print(FILE* file)
-    {
-        fprintf(file, "%.*s, page 0X%I64X ", m_KeyLen, m_Key, ULONGLONG(m_Page));
-        PageStatus::PrintPageStatus(file, m_Status, m_Page->IsIndexPage());
-        fprintf(file, "result code %d", INT(m_btResult));
-        fprintf(file, "\n                            ");
-        fprintf(file, "Index term: %.*s ", m_Prior.m_BoundLen, m_Prior.m_Bound);
-        fprintf(file, "page 0X%I64X slot %d", ULONGLONG(m_Prior.m_Page), m_Prior.m_Slot);
-        PageStatus::PrintPageStatus(file, LONGLONG(m_Prior.m_PageStatus), m_Prior.m_Page->IsIndexPage());
-        fprintf(file, "\n");
-    }
-};
-
-struct MergeInfo
-{
-    BtreePage*	m_SrcPage1;
-    LONGLONG	m_SrcStatus1;
-    BtreePage*	m_SrcPage2;
-    LONGLONG	m_SrcStatus2;
-    BtreePage*	m_NewPage;
-    BtreePage*  m_ParentPage;
-    LONGLONG    m_ParentStatus;
-    BtreePage*  m_GrandParentPage;
-    LONGLONG    m_GrandParentStatus;
-
-    static void RecMerge(char BorE, BtreePage* srcpage1, LONGLONG srcstate1, BtreePage* srcpage2, LONGLONG srcstatus2,
-                                    BtreePage* parentpage, LONGLONG parentstate, BtreePage* grandparentpage, LONGLONG grandparentstatus);
-
-    void Print(FILE* file)
-    {
-        fprintf(file, "page1 0X%I64X ", ULONGLONG(m_SrcPage1));
-        PageStatus::PrintPageStatus(file, m_SrcStatus1, m_SrcPage1->IsIndexPage());
-        fprintf(file, "page2 0X%I64X ", ULONGLONG(m_SrcPage2));
-        PageStatus::PrintPageStatus(file, m_SrcStatus2, m_SrcPage2->IsIndexPage());
-        fprintf(file, "new page 0X%I64X ", ULONGLONG(m_NewPage)); 
-        
-        fprintf(file, "\n\t\t\t");
-        fprintf(file, "parent page 0X%I64X ", ULONGLONG(m_ParentPage));
-        PageStatus::PrintPageStatus(file, m_ParentStatus, true);
-        fprintf(file, "grandparent page 0X%I64X ", ULONGLONG(m_GrandParentPage));
-        PageStatus::PrintPageStatus(file, m_GrandParentStatus, true);
-    }
-
-};
-
-struct DeletePageInfo
-{
-    BtreePage*  m_Page;
-    LONGLONG    m_PageStatus;
-    BtreePage*  m_ParentPage;
-    LONGLONG    m_ParentStatus;
-
-    static void RecDeletePage(char BorE, BtreePage* page, LONGLONG status, BtreePage* parent, LONGLONG parentstatus);
-
-    void Print(FILE* file)
-    {
-        fprintf(file, "page 0X%I64X ", ULONGLONG(m_Page));
-        PageStatus::PrintPageStatus(file, m_PageStatus, m_Page->IsIndexPage());
-        fprintf(file, "parent page 0X%I64X ", ULONGLONG(m_ParentPage));
-        PageStatus::PrintPageStatus(file, m_ParentStatus, true);
-    }
-};
-
-
-
-#define MaxLogEntries 900000
-extern volatile LONGLONG EventCounter;
-extern LogRec EventLog[];
-extern void PrintLog(FILE* file, int eventCount);
-extern FILE* logFile;
-extern bool  logPrintOn;
-
-
-struct LogRec
-{
-  UINT64	  m_Time;
-  UINT		  m_ThreadId;
-  char		  m_Action;
-  char		  m_BeginEnd;
-  union
-  {
-	InsertInfo      m_Insert;
-	ConsInfo        m_Cons;
-	SplitInfo       m_Split;
-    DeleteInfo      m_Delete;
-    MergeInfo       m_Merge;
-    DeletePageInfo  m_DeletePage;
-  };
-
-  LogRec()
-  {
-	m_Time = 0;
-	m_ThreadId = 0;
-	m_Action = ' ';
-	m_BeginEnd = ' ';
-  }
-
-  void Print(FILE* file)
-  {
-	fprintf(file, "Event %I64d by %d: %c,%c ", m_Time, m_ThreadId, m_Action, m_BeginEnd);
-	switch (m_Action)
+	PathEntry* pe = &m_Path[m_Count - 1];
+	ev->m_Page = ULONGLONG(pe->m_Page);
+	ev->m_Status = pe->m_PageStatus;
+	if (m_Count > 1)
 	{
-	case 'I': m_Insert.Print(file); break;
-	case 'C': m_Cons.Print(file); break;
-	case 'S': m_Split.Print(file); break;
-    case 'D': m_Delete.Print(file); break;
-    case 'M': m_Merge.Print(file); break;
-    case 'P': m_DeletePage.Print(file); break;
-	default:
-	  fprintf(file, "Unkwown event type %c", m_Action);
+	  ev->m_Parent = ULONGLONG(pe[-1].m_Page);
+	  ev->m_ParentStatus = pe[-1].m_PageStatus;
 	}
-	fprintf(file, "\n");
   }
- 
- };
-#endif DO_LOG
-
-
-
+};
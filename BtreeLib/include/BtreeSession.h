@@ -0,0 +1,60 @@
+// ***************************************************************************
+// A BtreeSession lets a thread run a batch of operations on a B-tree under a
+// single epoch instead of entering and exiting an epoch for every operation.
+//
+// The session enters an epoch when it is created and exits it when it is
+// destroyed. Pages and other objects freed while a thread is in an epoch
+// cannot be deallocated until the thread leaves it, so the session refreshes
+// its epoch (exits and re-enters) every RefreshInterval operations. Refresh()
+// can also be called directly, for example before the thread goes idle.
+// The session also reuses the same iterator for all its operations.
+//
+// Sampled operations (see PhaseProfiler.h) are charged for a refresh they
+// trigger.
+//
+// A session belongs to one thread and must not be shared between threads.
+// Records returned by a lookup remain protected by the epoch only until
+// the next refresh.
+// ***************************************************************************
+#pragma once
+
+#include "Platform.h"
+#include "BtreeInternal.h"
+
+class BtreeSession
+{
+public:
+  static const UINT DefaultRefreshInterval = 64;
+
+private:
+  BtreeRootInternal*  m_Btree;
+  BtIterator		  m_Iter;				// Iterator reused by all operations
+  LONGLONG			  m_EpochId;			// Epoch the session is in
+  UINT				  m_RefreshInterval;	// Nr of operations between epoch refreshes
+  UINT				  m_nOps;				// Nr of operations since the epoch was entered
+
+  void OperationDone()
+  {
+	if (++m_nOps >= m_RefreshInterval)
+	{
+	  Refresh();
+	}
+	m_Btree->m_Profiler.End(m_Iter.m_Profile);
+	m_Iter.m_Profile = nullptr;
+  }
+
+public:
+  BtreeSession(BtreeRoot* btree, UINT refreshInterval = DefaultRefreshInterval);
+  ~BtreeSession();
+
+  // Exit the current epoch and enter a new one
+  void Refresh();
+
+  BTRESULT InsertRecord(KeyType* key, void* recptr);
+  BTRESULT InsertIfAbsent(KeyType* key, void* recptr);
+  BTRESULT LookupRecord(KeyType* key, void*& recFound);
+  BTRESULT DeleteRecord(KeyType* key);
+  BTRESULT UpdateRecord(KeyType* key, void* newRec, void*& oldRec);
+  BTRESULT UpsertRecord(KeyType* key, void* recptr);
+  BTRESULT CompareAndSwapRecord(KeyType* key, void* expectedRec, void* newRec);
+};
@@ -0,0 +1,99 @@
+// ***************************************************************************
+// Counters of retries and conflicts in a B-tree, by reason.
+//
+// Restarts are counted when a descent (FindTargetPage) has to be resumed
+// from an ancestor or started over from the root. Retries are counted when
+// an operation goes back to find its target page again. The AddRecordToPage
+// counters show why inserts into a page fail, and the failed install counters
+// count page maintenance whose MwCAS (or validation before it) failed, by
+// type. Helping counts come from the MwCAS descriptor pool, which is shared
+// by all trees.
+//
+// The counters are per thread (see ThreadSlots.h) and are added up when read.
+// They are always on: all of them are on slow paths.
+// ***************************************************************************
+#pragma once
+
+#include "Platform.h"
+#include "ThreadSlots.h"
+#include "mwCAS.h"
+
+enum ContentionCounter
+{
+  // Descent restarts (FindTargetPage)
+  CC_RESTART_INDEX_INACTIVE,	  // Index page on the path was inactive
+  CC_RESTART_INDEX_CHANGED,		  // Index page became inactive while the child pointer was read
+  CC_RESTART_INDEX_SPLIT,		  // Index page on the path was split
+  CC_RESTART_INDEX_MERGE,		  // Index page on the path was merged
+  CC_RESTART_LEAF_INACTIVE,		  // Leaf page was inactive
+  CC_RESTART_LEAF_MAINTENANCE,	  // Leaf page was consolidated, split, merged or deleted
+  CC_RESTART_LEAF_CHANGED,		  // Leaf page became inactive while maintenance was considered
+  CC_RESTART_LEAF_READ_HOT,		  // Leaf page consolidated first for lookups (see ChargeReadScan)
+  CC_RESTART_FROM_ROOT,			  // No active ancestor to resume from, or too many resumes
+
+  // Operation retries
+  CC_RETRY_INSERT_NOT_INSERTED,	  // Page busy or slot closed (see the AddRecordToPage counters)
+  CC_RETRY_INSERT_PAGE_FULL,	  // Page full, consolidated or split first
+  CC_RETRY_LOOKUP,				  // Page inactive
+  CC_RETRY_DELETE,
+  CC_RETRY_UPDATE,
+
+  // AddRecordToPage
+  CC_ADD_PAGE_BUSY,				  // Page inactive or with pending maintenance
+  CC_ADD_WAIT_FOR_INSERT,		  // Unique insert waited for an insert in progress
+  CC_ADD_RESERVE_FAILED,		  // Page status CAS to reserve a slot failed
+  CC_ADD_SLOT_CLOSED,			  // Slot closed by maintenance before it was filled
+
+  // Failed installs
+  CC_INSTALL_FAILED_CONSOLIDATE,
+  CC_INSTALL_FAILED_SPLIT,		  // Leaf and index pages
+  CC_INSTALL_FAILED_MERGE,		  // Leaf and index pages
+  CC_INSTALL_FAILED_PAGE_DELETE,
+  CC_INSTALL_FAILED_PERM_ARRAY,	  // Permutation array of a leaf page
+
+  // Shadow index (see DescendShadowIndex)
+  CC_SHADOW_STALE,				  // Shadow index was stale or missing, or fell back to a normal descent
+
+  CC_COUNT
+};
+
+extern const char* ContentionCounterName[CC_COUNT];
+
+struct ContentionStats
+{
+  ULONGLONG	  m_Counts[CC_COUNT];
+
+  // MwCAS operations on the descriptor pool, all trees
+  ULONGLONG	  m_MwCasOps;			  // Operations started by their owner
+  ULONGLONG	  m_MwCasFailed;		  // Of those, failed
+  ULONGLONG	  m_MwCasHelps;			  // Operations helped by another thread
+  ULONGLONG	  m_MwCasHelpsBailed;	  // Of those, completed before the helper got to them
+
+  void Clear() { memset(this, 0, sizeof(*this)); }
+};
+
+class ContentionCounters
+{
+  struct ThreadCounts
+  {
+	ULONGLONG	m_Counts[CC_COUNT];
+
+	ThreadCounts() { memset(m_Counts, 0, sizeof(m_Counts)); }
+  };
+
+  ThreadSlots<ThreadCounts>	  m_Threads;
+  MwCasStats				  m_MwCasBase;	  // Pool counts when cleared
+
+public:
+  ContentionCounters() { Clear(); }
+
+  // Returns the new count of the calling thread, 0 if the thread has no slot
+  ULONGLONG Count(ContentionCounter counter)
+  {
+	ThreadCounts* counts = m_Threads.Get();
+	return (counts) ? ++counts->m_Counts[counter] : 0;
+  }
+
+  void Clear();
+  void GetStats(ContentionStats* stats);
+};
@@ -31,7 +31,7 @@
 
 #pragma once
 
-#define ASSERT_WITH_TRACE(condition, msg, ...) _ASSERTE(( L ## #condition ## msg, condition));
+#define ASSERT_WITH_TRACE(condition, msg, ...) _ASSERTE(((void)(#condition " " msg), (condition)));
 
 // Signature of the finalize callback function. 
 // The epoch manger calls this function on an item when  it is safe to garbage collect.
@@ -83,12 +83,30 @@ public:
   // Data object to physically delete
   void*			m_pDataObject;
 
+  // Bytes (data object plus this item) charged to limbo memory
+  ULONG			m_nSize;
+
 
   GCItem(MemObjectType type=MemObjectType::Invalid)
-	: m_NextItem(nullptr), m_ItemType(type), m_pDataObject(nullptr)
+	: m_NextItem(nullptr), m_ItemType(type), m_pDataObject(nullptr), m_nSize(0)
   {}
 };
 
+// Snapshot of the epoch manager's limbo memory, that is, objects that have been freed by the
+// application but not yet physically deallocated. A steadily growing limbo or oldest epoch age
+// indicates a thread that stays in an epoch for a long time and blocks epoch advancement.
+//
+struct EpochLimboStats
+{
+  __int64	m_nLimboBytes;			// Bytes held by objects waiting for deallocation
+  __int64	m_nLimboItems;			// Nr of objects waiting for deallocation
+  __int64	m_nCentralQueueItems;	// Nr of objects that are safe to deallocate but not yet deallocated
+  __int64	m_nCurrentEpoch;		// Current (external) epoch
+  __int64	m_OldestEpochAgeMs;		// Age in milliseconds of the oldest epoch that still has members
+  __int64	m_nAggressiveDrains;	// Nr of escalated deallocation batches (soft limit exceeded) that freed objects
+  __int64	m_nThrottledWriters;	// Nr of times a thread entering an epoch was throttled (hard limit exceeded)
+};
+
 // An epoch manager protects objects from premature deallocation by an epoch mechanism.
 // An object freed by the application is not immediately deallocated but
 // kept in a limbo list until it is guaranteed that no thread has a reference
@@ -111,8 +129,9 @@ private:
         Epoch()
            :m_DeallocationList(nullptr), 
 			m_LastItemHint(nullptr),
+            m_nItemCount(0),
             m_nMemberCount(0),
-            m_nItemCount(0)
+			m_StartTime(0)
         {}
 
         // Garbage list for this epoch. Once this epoch has drained and no
@@ -130,6 +149,9 @@ private:
 
         // Number of threads that are currently members of this epoch.
 		volatile LONG64 m_nMemberCount;
+
+		// Tick count (in milliseconds) when this epoch became the current epoch.
+		volatile ULONGLONG m_StartTime;
     };
 
 public:
@@ -155,6 +177,13 @@ public:
 	// Threads call this function when they participate in deallocating objects found on the central GC list.
     __checkReturn HRESULT DeallocateOnFinalize(__in void* pvMemoryToFree, __in MemObjectType type);
 
+	// Limbo memory above the soft limit makes threads do more deallocation work. Above the
+	// hard limit, threads are also throttled before entering an epoch until limbo memory drops.
+	void SetLimboLimits(__in __int64 nSoftLimitBytes, __in __int64 nHardLimitBytes);
+
+	// Returns a snapshot of limbo memory metrics.
+	void GetLimboStats(__out EpochLimboStats* pStats);
+
 
 private:
 
@@ -201,6 +230,8 @@ private:
 
     __checkReturn HRESULT TryAdvanceEpoch();
 
+	__checkReturn int	  DeallocationBatchSize(__in int nNormalCount);
+	__checkReturn HRESULT ThrottleOnLimboSize();
     __checkReturn HRESULT DoDeallocationWork(__in int itemDeallocationCount);
      __checkReturn HRESULT DeallocateItem(__in GCItem* pItem);
 	 __checkReturn HRESULT MigrateDeallocationQueue(__in EpochManager::Epoch* pEpochEntry);
@@ -218,6 +249,13 @@ private:
     static const __int64 DrainQueueDeallocCount = -1;
     static const __int64 DeallocCountLarge = 50;
     static const __int64 DeallocCountSmall = 20;
+    static const __int64 DeallocCountAggressive = 500;
+
+	// Default limbo memory limits and throttling parameters
+	static const __int64 LimboSoftLimitDefault = 64 * 1024 * 1024;
+	static const __int64 LimboHardLimitDefault = 512 * 1024 * 1024;
+	static const ULONG	 ThrottleRetryLimit = 10;
+	static const ULONG	 ThrottleSleepMs = 1;
 
 	
 	bool			  m_IsReadyForUse;						// Flag indicating whether the manager is ready for use or not.
@@ -233,6 +271,10 @@ private:
     void*				  m_pFinalizeContext;				// Context passed to the finalize callback function.
  
 	volatile __int64   m_nMemoryAllocatedCountInGC;			// Currently allocated memory in bytes of objects on the garbage list.
+	__int64			   m_nLimboSoftLimit;					// Escalate deallocation work when limbo memory exceeds this many bytes
+	__int64			   m_nLimboHardLimit;					// Throttle threads entering an epoch when limbo memory exceeds this many bytes
+	volatile __int64   m_nAggressiveDrains;					// Nr of escalated deallocation batches
+	volatile __int64   m_nThrottledWriters;					// Nr of times a thread entering an epoch was throttled
 
 	// All dynamically objects are acquired and freed through this memory broker.
 	// It tracks memory usage by object type (but doesn't know about objects in GC)
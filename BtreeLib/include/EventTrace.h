@@ -0,0 +1,142 @@
+// ***************************************************************************
+// Event tracing for debugging page maintenance and concurrency problems.
+//
+// Every thread writes compact binary events into its own ring buffer (see
+// ThreadSlots.h), so recording takes no locks and no shared counters. When a
+// ring is full the oldest events are overwritten. Tracing is compiled in but
+// off until enabled with a mask of the event types to record; a sample rate
+// of N records every Nth event of each thread. When tracing is off, a call
+// site costs a load and a branch.
+//
+// One event is recorded per action when it completes, successfully or not,
+// with the pages involved and their status words. DumpEventTrace writes the
+// rings to a binary file that EventDecode merges by time stamp and prints.
+// Rings are not synchronized with the threads writing them, so events being
+// written during a dump may be torn.
+// ***************************************************************************
+#pragma once
+
+#include "Platform.h"
+#include "ThreadSlots.h"
+
+#if defined(_WIN32)
+#include <intrin.h>
+#endif
+
+enum TraceEventType
+{
+  TE_NONE, TE_INSERT, TE_DELETE, TE_CONSOLIDATE, TE_SPLIT, TE_MERGE, TE_PAGE_DELETE,
+  TE_COUNT
+};
+
+#define TRACE_MASK(type)	(1u << (type))
+static const UINT32 TraceAllEvents = (1u << TE_COUNT) - 2;
+
+// Set in TraceEvent::m_Type if the target page is an index page
+static const UINT8 TraceIndexPage = 0x80;
+
+extern const char* TraceEventName[TE_COUNT];
+
+// Page addresses are recorded as ids; they are not dereferenced when decoding
+struct TraceEvent
+{
+  ULONGLONG	  m_Time;			  // Time stamp counter
+  UINT32	  m_ThreadId;
+  UINT8		  m_Type;			  // TraceEventType, plus TraceIndexPage
+  INT8		  m_Result;			  // BTRESULT of the action
+  UINT16	  m_KeyLen;			  // Insert, delete: key length
+  ULONGLONG	  m_Arg;			  // Insert, delete: first 8 key bytes. Split: right page. Merge: other source page
+  ULONGLONG	  m_Page;			  // Target page
+  LONGLONG	  m_Status;			  // Status of the target page the action was based on
+  ULONGLONG	  m_Parent;			  // Parent index page, zero for the root
+  LONGLONG	  m_ParentStatus;
+  ULONGLONG	  m_NewPage;		  // Consolidate, merge: new page. Split: left page. Page delete: new parent page
+
+  void SetKey(const char* key, UINT keyLen)
+  {
+	m_KeyLen = UINT16(keyLen);
+	memcpy(&m_Arg, key, (keyLen < sizeof(m_Arg)) ? keyLen : sizeof(m_Arg));
+  }
+};
+
+// Layout of a dump: the header followed by m_EventCount events, ring by ring,
+// each ring from its oldest to its newest event
+struct EventTraceHeader
+{
+  char		  m_Magic[8];		  // EventTraceMagic
+  UINT32	  m_EventSize;		  // sizeof(TraceEvent)
+  UINT32	  m_ThreadCount;	  // Nr of rings dumped
+  double	  m_NsPerTick;		  // Time stamp counter rate, measured since tracing was enabled
+  ULONGLONG	  m_StartTicks;		  // Time stamp counter when tracing was enabled
+  ULONGLONG	  m_EventCount;
+  ULONGLONG	  m_Overwritten;	  // Events lost because a ring was full
+};
+
+static const char EventTraceMagic[8] = { 'B', 'T', 'E', 'V', 'E', 'N', 'T', '1' };
+
+class EventTracer
+{
+public:
+  static const UINT RingSize = 8192;	  // Events per thread, a power of 2
+
+private:
+  struct Ring
+  {
+	ULONGLONG	m_Next;				  // Nr of events written, the next goes to m_Next % RingSize
+	UINT32		m_Skip;				  // Events to skip before the next sample
+	TraceEvent	m_Events[RingSize];
+
+	Ring() : m_Next(0), m_Skip(0) {}
+  };
+
+  // The ring of an exited thread goes to a later thread, so the thread id is kept per thread
+  static thread_local UINT32  t_ThreadId;
+
+  ThreadSlots<Ring>	  m_Rings;
+  volatile UINT32	  m_Mask;			  // Event types recorded, zero when tracing is off
+  volatile UINT32	  m_SampleRate;
+  ULONGLONG			  m_StartTicks;
+  LONGLONG			  m_StartTime;		  // Performance counter at m_StartTicks
+
+public:
+  EventTracer() : m_Mask(0), m_SampleRate(1), m_StartTicks(0), m_StartTime(0) {}
+
+  // Start recording the event types in mask (TRACE_MASK bits), one of every
+  // sampleRate events per thread. A zero mask stops tracing. The rings are
+  // kept, so events recorded earlier can still be dumped.
+  void Enable(UINT32 mask, UINT32 sampleRate);
+
+  // New event of the given type for the caller to fill in, or null if the type
+  // is not traced or the event is skipped by sampling
+  TraceEvent* NewEvent(TraceEventType type, int result)
+  {
+	if ((m_Mask & TRACE_MASK(type)) == 0) return nullptr;
+	return AddEvent(type, result);
+  }
+
+  // Write the rings to file. Returns the number of events written, or -1 on a write error.
+  LONGLONG Dump(FILE* file);
+
+private:
+  TraceEvent* AddEvent(TraceEventType type, int result)
+  {
+	Ring* ring = m_Rings.Get();
+	if (!ring) return nullptr;
+	if (ring->m_Skip > 0)
+	{
+	  ring->m_Skip--;
+	  return nullptr;
+	}
+	ring->m_Skip = m_SampleRate - 1;
+
+	TraceEvent* ev = &ring->m_Events[ring->m_Next & (RingSize - 1)];
+	ring->m_Next++;
+	memset(ev, 0, sizeof(*ev));
+	ev->m_Time = __rdtsc();
+	if (t_ThreadId == 0) t_ThreadId = GetCurrentThreadId();
+	ev->m_ThreadId = t_ThreadId;
+	ev->m_Type = UINT8(type);
+	ev->m_Result = INT8(result);
+	return ev;
+  }
+};
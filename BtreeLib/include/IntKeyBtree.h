@@ -0,0 +1,114 @@
+// ***************************************************************************
+// IntKeyBtree is a typed front end for B-trees with integer keys.
+//
+// Keys are encoded with KeyEncoder in sizeof(T) bytes, big-endian with the
+// sign bit of signed types flipped, so the tree's default comparison (byte
+// string order) is the numeric order of the values. Nothing else is
+// specific to integer keys: they are stored, searched and compared like any
+// other keys, so the tree shares all page layouts, MwCAS, epoch and SMO
+// logic with other B-trees.
+// ***************************************************************************
+#pragma once
+
+#include <type_traits>
+#include "BtreeInternal.h"
+#include "KeyEncoder.h"
+
+template <typename T>
+class IntKeyBtree
+{
+  static_assert(std::is_integral<T>::value && sizeof(T) <= sizeof(ULONGLONG), "IntKeyBtree requires an integer key type of at most 8 bytes");
+
+public:
+  static const UINT KeyLength = sizeof(T);
+
+private:
+  BtreeRootInternal*  m_Btree;			// Owned, deleted with this object
+
+  // A key value encoded in a local buffer
+  struct EncodedKey
+  {
+	char			  m_Buffer[KeyLength];
+	KeyType			  m_Key;
+
+	EncodedKey(T value)
+	{
+	  Encode(value, m_Buffer);
+	  m_Key.m_pKeyValue = m_Buffer;
+	  m_Key.m_KeyLen = KeyLength;
+	}
+  };
+
+public:
+  IntKeyBtree()
+  {
+	m_Btree = new BtreeRootInternal();
+  }
+
+  // Frees the tree. No other thread may still be using it.
+  ~IntKeyBtree()
+  {
+	delete m_Btree;
+  }
+
+  // The tree is owned by this object so it can't be copied
+  IntKeyBtree(const IntKeyBtree&) = delete;
+  IntKeyBtree& operator=(const IntKeyBtree&) = delete;
+
+  // Encode a key value into buffer (KeyLength bytes)
+  static void Encode(T value, char* buffer)
+  {
+	KeyEncoder enc(buffer, KeyLength);
+	BTRESULT btr = (std::is_unsigned<T>::value) ? enc.AppendUInt(ULONGLONG(value), KeyLength)
+	                                            : enc.AppendInt(LONGLONG(value), KeyLength);
+	_ASSERTE(btr == BT_SUCCESS && enc.GetLength() == KeyLength);
+	(void)(btr);
+  }
+
+  BtreeRoot* GetBtree() { return m_Btree; }
+
+  BTRESULT InsertRecord(T key, void* recptr)
+  {
+	EncodedKey ekey(key);
+	return m_Btree->InsertRecord(&ekey.m_Key, recptr);
+  }
+
+  BTRESULT InsertIfAbsent(T key, void* recptr)
+  {
+	EncodedKey ekey(key);
+	return m_Btree->InsertIfAbsent(&ekey.m_Key, recptr);
+  }
+
+  BTRESULT LookupRecord(T key, void*& recFound)
+  {
+	EncodedKey ekey(key);
+	return m_Btree->LookupRecord(&ekey.m_Key, recFound);
+  }
+
+  BTRESULT DeleteRecord(T key)
+  {
+	EncodedKey ekey(key);
+	return m_Btree->DeleteRecord(&ekey.m_Key);
+  }
+
+  BTRESULT UpdateRecord(T key, void* newRec, void*& oldRec)
+  {
+	EncodedKey ekey(key);
+	return m_Btree->UpdateRecord(&ekey.m_Key, newRec, oldRec);
+  }
+
+  BTRESULT UpsertRecord(T key, void* recptr)
+  {
+	EncodedKey ekey(key);
+	return m_Btree->UpsertRecord(&ekey.m_Key, recptr);
+  }
+
+  BTRESULT CompareAndSwapRecord(T key, void* expectedRec, void* newRec)
+  {
+	EncodedKey ekey(key);
+	return m_Btree->CompareAndSwapRecord(&ekey.m_Key, expectedRec, newRec);
+  }
+
+  void PrintStats(FILE* file) { m_Btree->PrintStats(file); }
+  UINT CheckTree(FILE* file) { return m_Btree->CheckTree(file); }
+};
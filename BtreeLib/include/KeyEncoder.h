@@ -0,0 +1,168 @@
+// ***************************************************************************
+// KeyEncoder encodes typed and composite keys as byte strings whose memcmp
+// order (the order of DefaultCompareKeys) is the same as the order of the
+// typed values, compared component by component. Encoded keys may start with
+// 0xFF; DefaultCompareKeys still sorts them before the tree's high bound.
+//
+// Components are appended to a caller-supplied buffer:
+//  - Integers are stored big-endian in the given number of bytes. The sign
+//    bit of signed integers is flipped so negative values sort first.
+//  - Floating point values are stored big-endian with the sign bit flipped
+//    for positive values and all bits flipped for negative values. -0.0 is
+//    stored as 0.0. All NaNs are stored as the same positive quiet NaN, which
+//    sorts after all other values.
+//  - Strings are escaped so that no encoded string is a prefix of another:
+//    a zero byte is stored as 0x00 0xFF and the string is terminated by
+//    0x00 0x01. A string component can therefore be followed by further
+//    components.
+//  - Any component can be stored in descending order, which inverts all its
+//    bytes.
+//
+// Example (tenant ascending, timestamp descending, name ascending):
+//
+//   char buffer[64];
+//   KeyEncoder enc(buffer, sizeof(buffer));
+//   enc.AppendUInt(tenant, 4);
+//   enc.AppendInt(timestamp, 8, true);
+//   enc.AppendString(name, UINT(strlen(name)));
+//   KeyType key = enc.GetKey();
+// ***************************************************************************
+#pragma once
+
+#include "BtreeInternal.h"
+
+class KeyEncoder
+{
+  static const BYTE EscapeByte = 0x00;		// Zero byte in a string
+  static const BYTE EscapedZero = 0xFF;		// Follows EscapeByte for a zero byte in the string
+  static const BYTE Terminator = 0x01;		// Follows EscapeByte at the end of the string
+
+  char*		  m_Buffer;			// Encoded key
+  UINT		  m_Capacity;		// Size of buffer
+  UINT		  m_Length;			// Nr of bytes used
+
+  // Append the low-order bytes of value, most significant byte first.
+  BTRESULT AppendBigEndian(ULONGLONG value, UINT bytes, bool descending)
+  {
+	if (bytes == 0 || bytes > sizeof(ULONGLONG) || m_Length + bytes > m_Capacity)
+	{
+	  return BT_INVALID_ARG;
+	}
+	if (descending)
+	{
+	  value = ~value;
+	}
+	for (UINT i = 0; i < bytes; i++)
+	{
+	  m_Buffer[m_Length++] = char(value >> (8 * (bytes - 1 - i)));
+	}
+	return BT_SUCCESS;
+  }
+
+public:
+  KeyEncoder(char* buffer, UINT capacity)
+  {
+	m_Buffer = buffer;
+	m_Capacity = capacity;
+	m_Length = 0;
+  }
+
+  void Reset() { m_Length = 0; }
+  UINT GetLength() { return m_Length; }
+  KeyType GetKey() { return KeyType(m_Buffer, m_Length); }
+
+  // Append an unsigned integer stored in bytes bytes (1 to 8).
+  BTRESULT AppendUInt(ULONGLONG value, UINT bytes = sizeof(ULONGLONG), bool descending = false)
+  {
+	if (bytes < sizeof(ULONGLONG) && (value >> (8 * bytes)) != 0)
+	{
+	  return BT_INVALID_ARG;
+	}
+	return AppendBigEndian(value, bytes, descending);
+  }
+
+  // Append a signed integer stored in bytes bytes (1 to 8).
+  BTRESULT AppendInt(LONGLONG value, UINT bytes = sizeof(LONGLONG), bool descending = false)
+  {
+	if (bytes == 0 || bytes > sizeof(LONGLONG))
+	{
+	  return BT_INVALID_ARG;
+	}
+	UINT shift = 8 * UINT(sizeof(LONGLONG) - bytes);
+	if (shift > 0 && (LONGLONG(ULONGLONG(value) << shift) >> shift) != value)
+	{
+	  // Does not fit in bytes bytes
+	  return BT_INVALID_ARG;
+	}
+	ULONGLONG signBit = 1ULL << (8 * bytes - 1);
+	return AppendBigEndian(ULONGLONG(value) ^ signBit, bytes, descending);
+  }
+
+  BTRESULT AppendDouble(double value, bool descending = false)
+  {
+	ULONGLONG bits = 0;
+	if (value == 0.0)
+	{
+	  value = 0.0;
+	}
+	if (value != value)
+	{
+	  // NaN; the default NaN on x86 has the sign bit set
+	  bits = 0x7FF8000000000000ULL;
+	}
+	else
+	{
+	  memcpy(&bits, &value, sizeof(bits));
+	}
+	bits = (bits & 0x8000000000000000ULL) ? ~bits : (bits | 0x8000000000000000ULL);
+	return AppendBigEndian(bits, sizeof(bits), descending);
+  }
+
+  BTRESULT AppendFloat(float value, bool descending = false)
+  {
+	UINT32 bits = 0;
+	if (value == 0.0f)
+	{
+	  value = 0.0f;
+	}
+	if (value != value)
+	{
+	  bits = 0x7FC00000;
+	}
+	else
+	{
+	  memcpy(&bits, &value, sizeof(bits));
+	}
+	bits = (bits & 0x80000000) ? ~bits : (bits | 0x80000000);
+	return AppendBigEndian(bits, sizeof(bits), descending);
+  }
+
+  // Append a string of len bytes. The string may contain zero bytes.
+  BTRESULT AppendString(const char* value, UINT len, bool descending = false)
+  {
+	// Compute the encoded length first so that a failed append leaves the key unchanged
+	UINT encLen = len + 2;
+	for (UINT i = 0; i < len; i++)
+	{
+	  if (BYTE(value[i]) == EscapeByte) encLen++;
+	}
+	if (m_Length + encLen > m_Capacity)
+	{
+	  return BT_INVALID_ARG;
+	}
+
+	BYTE mask = (descending) ? 0xFF : 0x00;
+	for (UINT i = 0; i < len; i++)
+	{
+	  BYTE ch = BYTE(value[i]);
+	  m_Buffer[m_Length++] = char(ch ^ mask);
+	  if (ch == EscapeByte)
+	  {
+		m_Buffer[m_Length++] = char(EscapedZero ^ mask);
+	  }
+	}
+	m_Buffer[m_Length++] = char(EscapeByte ^ mask);
+	m_Buffer[m_Length++] = char(Terminator ^ mask);
+	return BT_SUCCESS;
+  }
+};
@@ -0,0 +1,124 @@
+// ***************************************************************************
+// Log-linear latency histogram in the style of HdrHistogram.
+//
+// Values (latencies in nanoseconds) below 2*SubBuckets are counted exactly.
+// Larger values are counted in buckets whose width grows with the magnitude
+// of the value: each power of two is split into SubBuckets buckets, so the
+// relative error of a reported percentile is at most 1/SubBuckets (about 3%).
+// Values at or above 2^MaxMagnitude are counted in the last bucket.
+//
+// A histogram is updated by a single thread without synchronization.
+// Histograms from different threads are combined with Merge(). Used by the
+// library (see LatencyRecorder.h) and by the benchmark.
+// ***************************************************************************
+#pragma once
+
+#include "Platform.h"
+
+class LatencyHistogram
+{
+public:
+  static const UINT SubBucketBits = 5;
+  static const UINT SubBuckets = 1 << SubBucketBits;
+  static const UINT MaxMagnitude = 40;		// About 18 minutes in ns
+  static const UINT BucketCount = 2 * SubBuckets + (MaxMagnitude - SubBucketBits - 1) * SubBuckets;
+
+private:
+  ULONGLONG	  m_Counts[BucketCount];
+  ULONGLONG	  m_TotalCount;
+  ULONGLONG	  m_Sum;
+  ULONGLONG	  m_Max;
+
+  static UINT HighBit(ULONGLONG value)
+  {
+	UINT bit = 0;
+	while (value >>= 1) bit++;
+	return bit;
+  }
+
+  static UINT BucketIndex(ULONGLONG value)
+  {
+	if (value < 2 * SubBuckets)
+	{
+	  return UINT(value);
+	}
+	UINT magnitude = HighBit(value);
+	if (magnitude >= MaxMagnitude)
+	{
+	  return BucketCount - 1;
+	}
+	// Keep the SubBucketBits bits below the highest bit
+	UINT shift = magnitude - SubBucketBits;
+	UINT subBucket = UINT(value >> shift) - SubBuckets;
+	return 2 * SubBuckets + (magnitude - SubBucketBits - 1) * SubBuckets + subBucket;
+  }
+
+  // Highest value counted in a bucket
+  static ULONGLONG BucketHighValue(UINT index)
+  {
+	if (index < 2 * SubBuckets)
+	{
+	  return index;
+	}
+	UINT magnitude = (index - 2 * SubBuckets) / SubBuckets + SubBucketBits + 1;
+	UINT subBucket = (index - 2 * SubBuckets) % SubBuckets;
+	UINT shift = magnitude - SubBucketBits;
+	return ((ULONGLONG(SubBuckets + subBucket + 1)) << shift) - 1;
+  }
+
+public:
+  LatencyHistogram() { Reset(); }
+
+  void Reset()
+  {
+	memset(m_Counts, 0, sizeof(m_Counts));
+	m_TotalCount = 0;
+	m_Sum = 0;
+	m_Max = 0;
+  }
+
+  void Record(ULONGLONG value)
+  {
+	m_Counts[BucketIndex(value)]++;
+	m_TotalCount++;
+	m_Sum += value;
+	if (value > m_Max) m_Max = value;
+  }
+
+  void Merge(const LatencyHistogram& other)
+  {
+	for (UINT i = 0; i < BucketCount; i++)
+	{
+	  m_Counts[i] += other.m_Counts[i];
+	}
+	m_TotalCount += other.m_TotalCount;
+	m_Sum += other.m_Sum;
+	m_Max = max(m_Max, other.m_Max);
+  }
+
+  ULONGLONG Count() const { return m_TotalCount; }
+  ULONGLONG Max() const { return m_Max; }
+  double Mean() const { return (m_TotalCount > 0) ? double(m_Sum) / m_TotalCount : 0.0; }
+
+  // Smallest value such that at least percentile percent of the recorded values
+  // are less than or equal to it (within the precision of the histogram).
+  ULONGLONG Percentile(double percentile) const
+  {
+	if (m_TotalCount == 0)
+	{
+	  return 0;
+	}
+	ULONGLONG target = ULONGLONG(percentile / 100.0 * m_TotalCount + 0.5);
+	target = max(target, 1ULL);
+	ULONGLONG seen = 0;
+	for (UINT i = 0; i < BucketCount; i++)
+	{
+	  seen += m_Counts[i];
+	  if (seen >= target)
+	  {
+		return min(BucketHighValue(i), m_Max);
+	  }
+	}
+	return m_Max;
+  }
+};
@@ -0,0 +1,93 @@
+// ***************************************************************************
+// Latency histograms for B-tree operations and page maintenance.
+//
+// Compiled in only if BTREE_LATENCY_HISTOGRAMS is defined (uncomment the
+// define below or use the CMake option of the same name). Otherwise the
+// recorder has no state and Start() and Record() are empty, so the calls
+// in the tree compile away.
+//
+// Every thread records into its own set of histograms, one per operation
+// type, so recording needs no synchronization (see ThreadSlots.h). The sets
+// are merged when a summary is read. Latencies are recorded in time
+// stamp counter ticks and converted to nanoseconds when read, using the tick
+// rate measured since the recorder was created or cleared.
+//
+// Summaries can be read and the histograms cleared while operations run;
+// counts being updated at the time may then be missed.
+// ***************************************************************************
+#pragma once
+
+//#define BTREE_LATENCY_HISTOGRAMS 1
+
+#include "Platform.h"
+#include "LatencyHistogram.h"
+#include "ThreadSlots.h"
+
+#if defined(_WIN32) && defined(BTREE_LATENCY_HISTOGRAMS)
+#include <intrin.h>
+#endif
+
+// Operation types. Update includes compare-and-swap and upsert. Split and
+// merge include index pages.
+enum LatencyOp
+{
+  LAT_INSERT, LAT_LOOKUP, LAT_DELETE, LAT_UPDATE,
+  LAT_CONSOLIDATE, LAT_SPLIT, LAT_MERGE, LAT_PAGE_DELETE,
+  LAT_OP_COUNT
+};
+
+extern const char* LatencyOpName[LAT_OP_COUNT];
+
+// Latency summary of one operation type. Times are in nanoseconds.
+struct LatencySummary
+{
+  ULONGLONG	  m_Count;
+  double	  m_Mean;
+  ULONGLONG	  m_P50;
+  ULONGLONG	  m_P99;
+  ULONGLONG	  m_P999;
+  ULONGLONG	  m_Max;
+};
+
+class LatencyRecorder
+{
+#ifdef BTREE_LATENCY_HISTOGRAMS
+  struct ThreadHistograms
+  {
+	LatencyHistogram  m_Histograms[LAT_OP_COUNT];
+  };
+
+  ThreadSlots<ThreadHistograms>	m_Threads;
+  ULONGLONG			  m_StartTicks;		  // Time stamp counter when started or cleared
+  LONGLONG			  m_StartTime;		  // Performance counter at the same time
+
+public:
+  LatencyRecorder() { Clear(); }
+
+  static bool IsEnabled() { return true; }
+
+  ULONGLONG Start() { return __rdtsc(); }
+
+  // Record the latency of an operation of type op that began at start
+  void Record(LatencyOp op, ULONGLONG start)
+  {
+	ULONGLONG ticks = __rdtsc() - start;
+	ThreadHistograms* hist = m_Threads.Get();
+	if (hist)
+	{
+	  hist->m_Histograms[op].Record(ticks);
+	}
+  }
+
+  void Clear();
+  void GetSummary(LatencyOp op, LatencySummary* summary);
+
+#else
+public:
+  static bool IsEnabled() { return false; }
+  ULONGLONG Start() { return 0; }
+  void Record(LatencyOp, ULONGLONG) {}
+  void Clear() {}
+  void GetSummary(LatencyOp, LatencySummary* summary) { memset(summary, 0, sizeof(*summary)); }
+#endif
+};
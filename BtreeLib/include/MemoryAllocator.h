@@ -1,6 +1,6 @@
 #pragma once
 
-#include <Windows.h>
+#include "Platform.h"
 
 
 // Interface that a custom memory allocator needs to implement.
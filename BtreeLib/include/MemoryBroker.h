@@ -11,12 +11,14 @@
 
 #pragma once
 
-#include <windows.h>
+#include "Platform.h"
+#ifdef _WIN32
 #include <crtdbg.h>
+#endif
 #include "MemoryAllocator.h"
 
 
-#define ASSERT_WITH_TRACE(condition, msg, ...) _ASSERTE(( L ## #condition ## msg, condition));
+#define ASSERT_WITH_TRACE(condition, msg, ...) _ASSERTE(((void)(#condition " " msg), (condition)));
 
 
 #ifdef _DEBUG
@@ -50,20 +52,21 @@ enum MemObjectType : int
   LeafPage,
   TmpPointerArray,
   GCItemObj,
+  ShadowIndexObj,
 
   First = IndexPage,
-  Last = GCItemObj
+  Last = ShadowIndexObj
 };
 
 static const int s_TypeCount = (int)MemObjectType::Last - (int)MemObjectType::First + 1;
 
 // Provides the name of the given object type.
 //
-static char* NameOfMemObjectType(MemObjectType type)
+static const char* NameOfMemObjectType(MemObjectType type)
 {
-  static char Name[s_TypeCount][10] = { "IndexPage", "LeafPage", "PtrArray", "GCItem" };
+  static char Name[s_TypeCount][10] = { "IndexPage", "LeafPage", "PtrArray", "GCItem", "ShadowIdx" };
 
-  char* str = "InvalidType";
+  const char* str = "InvalidType";
   if (type >= MemObjectType::First && type <= MemObjectType::Last)
   {
 	str = &Name[(int)type][0];
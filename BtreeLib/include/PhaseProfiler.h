@@ -0,0 +1,148 @@
+// ***************************************************************************
+// Sampled breakdown of where record operations spend their time.
+//
+// When enabled with a sample rate N, one of every N inserts, lookups, deletes
+// and updates of each thread is timed phase by phase with the time stamp
+// counter:
+//   enter_epoch   entering the epoch, including the deallocation work the
+//                 epoch manager does on entry
+//   find_target   the descent to the leaf page (FindTargetPage)
+//   key_search    the search of the leaf page (lookups)
+//   update_page   the change to the leaf page: AddRecordToPage, including
+//                 the slot reservation, DeleteRecordFromPage or
+//                 UpdateRecordOnPage
+//   maintenance   page maintenance done by the operation, including the MwCAS
+//                 that installs it, also when done during the descent
+//   exit_epoch    exiting the epoch, including advancing it
+//   other         everything else, such as deciding to retry
+// Phases do not overlap, so they add up to the time of the operation. Under
+// a BtreeSession the epoch is entered once per batch; the refresh is charged
+// to the operation that triggers it.
+//
+// A sampled operation carries its PhaseSample in its iterator. The pointer is
+// null for operations that are not sampled, so a phase boundary costs a
+// compare and an operation a load and a branch when profiling is off.
+// Samples are added to per-thread totals (see ThreadSlots.h) that are merged
+// when a profile is read.
+// ***************************************************************************
+#pragma once
+
+#include "Platform.h"
+#include "ThreadSlots.h"
+
+#if defined(_WIN32)
+#include <intrin.h>
+#endif
+
+// Update includes compare-and-swap and upsert
+enum ProfileOp
+{
+  PROF_INSERT, PROF_LOOKUP, PROF_DELETE, PROF_UPDATE,
+  PROF_OP_COUNT
+};
+
+enum ProfilePhase
+{
+  PH_ENTER_EPOCH, PH_FIND_TARGET, PH_KEY_SEARCH, PH_UPDATE_PAGE, PH_MAINTENANCE, PH_EXIT_EPOCH, PH_OTHER,
+  PH_COUNT
+};
+
+extern const char* ProfileOpName[PROF_OP_COUNT];
+extern const char* ProfilePhaseName[PH_COUNT];
+
+// Phase breakdown of one operation type. Times are mean nanoseconds per sampled operation.
+struct PhaseProfile
+{
+  ULONGLONG	  m_Samples;
+  double	  m_Total;
+  double	  m_Phases[PH_COUNT];
+};
+
+// Timing of a sampled operation in progress
+struct PhaseSample
+{
+  ProfilePhase	m_Phase;			  // Current phase
+  ULONGLONG		m_Start;			  // Time stamp counter when the operation began
+  ULONGLONG		m_Last;				  // Time stamp counter when the current phase began
+  ULONGLONG		m_Ticks[PH_COUNT];
+};
+
+class PhaseProfiler
+{
+  struct ThreadProfile
+  {
+	UINT32		m_Skip;				  // Operations to skip before the next sample
+	bool		m_Active;			  // m_Sample is in use
+	PhaseSample	m_Sample;
+	ProfileOp	m_Op;				  // Operation of m_Sample
+	ULONGLONG	m_Samples[PROF_OP_COUNT];
+	ULONGLONG	m_Total[PROF_OP_COUNT];
+	ULONGLONG	m_Ticks[PROF_OP_COUNT][PH_COUNT];
+
+	ThreadProfile() { memset(this, 0, sizeof(*this)); }
+  };
+
+  ThreadSlots<ThreadProfile>  m_Threads;
+  volatile UINT32	  m_SampleRate;		  // Zero when profiling is off
+  ULONGLONG			  m_StartTicks;		  // Time stamp counter when started or cleared
+  LONGLONG			  m_StartTime;		  // Performance counter at the same time
+
+  PhaseSample* StartSample(ProfileOp op, ProfilePhase phase)
+  {
+	ThreadProfile* prof = m_Threads.Get();
+	if (!prof || prof->m_Active) return nullptr;
+	if (prof->m_Skip > 0)
+	{
+	  prof->m_Skip--;
+	  return nullptr;
+	}
+	prof->m_Skip = m_SampleRate - 1;
+
+	PhaseSample* sample = &prof->m_Sample;
+	prof->m_Active = true;
+	prof->m_Op = op;
+	memset(sample->m_Ticks, 0, sizeof(sample->m_Ticks));
+	sample->m_Phase = phase;
+	sample->m_Start = sample->m_Last = __rdtsc();
+	return sample;
+  }
+
+  void EndSample(PhaseSample* sample);
+
+public:
+  PhaseProfiler() : m_SampleRate(0) { Clear(); }
+
+  // Profile one of every sampleRate operations per thread, zero turns profiling off
+  void Enable(UINT32 sampleRate) { m_SampleRate = sampleRate; }
+  bool IsEnabled() { return m_SampleRate != 0; }
+
+  // Start timing an operation in the given phase. Returns null if the
+  // operation is not sampled.
+  PhaseSample* Begin(ProfileOp op, ProfilePhase phase = PH_OTHER)
+  {
+	if (m_SampleRate == 0) return nullptr;
+	return StartSample(op, phase);
+  }
+
+  // Charge the time since the last switch to the current phase and move on
+  // to phase. Returns the phase left, so that a nested phase can switch back.
+  ProfilePhase Switch(PhaseSample* sample, ProfilePhase phase)
+  {
+	if (!sample) return phase;
+	ULONGLONG now = __rdtsc();
+	ProfilePhase prev = sample->m_Phase;
+	sample->m_Ticks[prev] += now - sample->m_Last;
+	sample->m_Phase = phase;
+	sample->m_Last = now;
+	return prev;
+  }
+
+  // Finish timing an operation and add it to the totals of the thread
+  void End(PhaseSample* sample)
+  {
+	if (sample) EndSample(sample);
+  }
+
+  void Clear();
+  void GetProfile(ProfileOp op, PhaseProfile* profile);
+};
@@ -0,0 +1,214 @@
+// ***************************************************************************
+// Platform definitions. On Windows this just includes <windows.h>. On other
+// platforms (Linux with GCC or Clang) it supplies the small subset of Windows
+// types, annotations and intrinsics used by the library so that the code can
+// be compiled unchanged.
+// ***************************************************************************
+#pragma once
+
+#ifdef _WIN32
+
+#include <windows.h>
+
+#else
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+#include <malloc.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <algorithm>
+
+using std::min;
+using std::max;
+
+// Integer types with the same sizes as on Windows (LLP64)
+typedef int					LONG;
+typedef unsigned int		ULONG;
+typedef unsigned int		DWORD;
+typedef long long			LONGLONG;
+typedef unsigned long long	ULONGLONG;
+typedef long long			LONG64;
+typedef long long			INT64;
+typedef unsigned long long	UINT64;
+typedef int					INT32;
+typedef unsigned int		UINT32;
+typedef unsigned short		UINT16;
+typedef unsigned char		UINT8;
+typedef signed char			INT8;
+typedef int					INT;
+typedef unsigned int		UINT;
+typedef unsigned char		BYTE;
+typedef unsigned char		UCHAR;
+typedef unsigned short		USHORT;
+typedef uintptr_t			UINT_PTR;
+typedef int					BOOL;
+typedef int					HRESULT;
+typedef void				VOID;
+typedef void*				PVOID;
+typedef void*				HANDLE;
+typedef int					errno_t;
+
+// The SAL annotations are defined as empty macros. Standard library headers
+// may use the same names internally, so include them before this file.
+#define __int64				long long
+#define __forceinline		inline __attribute__((always_inline))
+#define __checkReturn
+#define __callback
+#define __in
+#define __in_opt
+#define __out
+#define _cdecl
+#define WINAPI
+
+#define S_OK				((HRESULT)0)
+#define S_FALSE				((HRESULT)1)
+#define E_POINTER			((HRESULT)0x80004003)
+#define E_UNEXPECTED		((HRESULT)0x8000FFFF)
+#define E_INVALIDARG		((HRESULT)0x80070057)
+#define E_OUTOFMEMORY		((HRESULT)0x8007000E)
+#define ERROR_OUTOFMEMORY	14L
+#define ERROR_INVALID_PARAMETER 87L
+#define FAILED(hr)			(((HRESULT)(hr)) < 0)
+#define SUCCEEDED(hr)		(((HRESULT)(hr)) >= 0)
+
+#define MEMORY_ALLOCATION_ALIGNMENT 16
+#define MAXUINT16			((UINT16)~((UINT16)0))
+
+#define _ASSERTE(e)			assert(e)
+#define _ASSERT(e)			assert(e)
+
+typedef union
+{
+  struct
+  {
+	DWORD LowPart;
+	LONG  HighPart;
+  };
+  LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+// Performance counter ticks are nanoseconds
+inline BOOL QueryPerformanceCounter(LARGE_INTEGER* counter)
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  counter->QuadPart = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  return 1;
+}
+
+inline BOOL QueryPerformanceFrequency(LARGE_INTEGER* freq)
+{
+  freq->QuadPart = 1000000000LL;
+  return 1;
+}
+
+inline ULONGLONG GetTickCount64()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+inline DWORD GetTickCount() { return DWORD(GetTickCount64()); }
+
+inline DWORD GetCurrentThreadId()
+{
+  return DWORD(syscall(SYS_gettid));
+}
+
+typedef struct
+{
+  DWORD dwNumberOfProcessors;
+} SYSTEM_INFO;
+
+inline void GetSystemInfo(SYSTEM_INFO* info)
+{
+  info->dwNumberOfProcessors = DWORD(sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+inline void Sleep(DWORD ms) { usleep(ms * 1000); }
+inline BOOL SwitchToThread() { sched_yield(); return 1; }
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define YieldProcessor()	_mm_pause()
+#else
+#define YieldProcessor()	__asm__ __volatile__("" ::: "memory")
+inline ULONGLONG __rdtsc()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+#define MemoryBarrier()		__sync_synchronize()
+#define _ReadBarrier()		__asm__ __volatile__("" ::: "memory")
+
+// Interlocked operations are full barriers, as on Windows
+inline LONG InterlockedCompareExchange(LONG volatile* dest, LONG exch, LONG comp)
+{
+  return __sync_val_compare_and_swap(dest, comp, exch);
+}
+inline ULONG InterlockedCompareExchange(ULONG volatile* dest, ULONG exch, ULONG comp)
+{
+  return __sync_val_compare_and_swap(dest, comp, exch);
+}
+inline LONG InterlockedIncrement(LONG volatile* dest) { return __sync_add_and_fetch(dest, 1); }
+inline LONG InterlockedDecrement(LONG volatile* dest) { return __sync_sub_and_fetch(dest, 1); }
+
+inline LONG64 InterlockedCompareExchange64(LONG64 volatile* dest, LONG64 exch, LONG64 comp)
+{
+  return __sync_val_compare_and_swap(dest, comp, exch);
+}
+inline LONG64 InterlockedIncrement64(LONG64 volatile* dest) { return __sync_add_and_fetch(dest, 1); }
+inline LONG64 InterlockedDecrement64(LONG64 volatile* dest) { return __sync_sub_and_fetch(dest, 1); }
+inline LONG64 InterlockedExchangeAdd64(LONG64 volatile* dest, LONG64 val) { return __sync_fetch_and_add(dest, val); }
+inline LONG64 InterlockedAdd64(LONG64 volatile* dest, LONG64 val) { return __sync_add_and_fetch(dest, val); }
+inline LONG64 InterlockedExchange64(LONG64 volatile* dest, LONG64 val)
+{
+  return __atomic_exchange_n(dest, val, __ATOMIC_SEQ_CST);
+}
+
+inline void* InterlockedExchangePointer(void* volatile* dest, void* val)
+{
+  return __atomic_exchange_n(dest, val, __ATOMIC_SEQ_CST);
+}
+inline void* InterlockedCompareExchangePointer(void* volatile* dest, void* exch, void* comp)
+{
+  return __sync_val_compare_and_swap(dest, comp, exch);
+}
+
+inline void* _aligned_malloc(size_t size, size_t alignment)
+{
+  void* ptr = nullptr;
+  if (posix_memalign(&ptr, alignment, size) != 0) return nullptr;
+  return ptr;
+}
+inline void _aligned_free(void* ptr) { free(ptr); }
+inline size_t _msize(void* ptr) { return malloc_usable_size(ptr); }
+inline size_t _aligned_msize(void* ptr, size_t, size_t) { return malloc_usable_size(ptr); }
+
+inline ULONGLONG _byteswap_uint64(ULONGLONG val) { return __builtin_bswap64(val); }
+inline ULONG _byteswap_ulong(ULONG val) { return __builtin_bswap32(val); }
+
+inline errno_t memcpy_s(void* dest, size_t destSize, const void* src, size_t count)
+{
+  if (count > destSize) return ERANGE;
+  memcpy(dest, src, count);
+  return 0;
+}
+
+inline errno_t fopen_s(FILE** file, const char* name, const char* mode)
+{
+  *file = fopen(name, mode);
+  return (*file) ? 0 : errno;
+}
+
+#endif // _WIN32
@@ -0,0 +1,80 @@
+// ***************************************************************************
+// The files ShadowIndex.h and ShadowIndex.cpp contain a read-optimized copy
+// of the top index levels of a B-tree.
+//
+// Index pages store their separators as packed key-pointer pairs with the
+// keys stored elsewhere on the page so a binary search on an index page
+// touches many cache lines. The shadow index stores, for each index page
+// copied, an array of 8-byte key prefixes (as big-endian integers) that
+// can be binary searched with integer comparisons. The full separator is
+// compared only when the prefixes are equal.
+//
+// Only levels whose children are index pages are copied. They change only
+// when an index page is split, merged or replaced, which is rare. Each node
+// records the status of its index page when it was copied. A descent checks
+// the status before using a node and falls back to a normal descent from
+// that page if the status has changed.
+//
+// Nodes refer to index pages that may be retired. The B-tree increments its
+// index version before retiring an index page, and a shadow index built
+// under an older version is not used. Because the version is checked after
+// entering an epoch, any page referenced by a valid shadow index stays
+// allocated for the duration of the descent.
+//
+// A stale shadow index is rebuilt by a reader that keeps finding it stale.
+// A rebuild copies at most MaxNodes index pages and rebuilds of a tree are
+// spaced MinRebuildIntervalMs apart, so readers spend a bounded share of
+// their time on rebuilds however often index pages change.
+// ***************************************************************************
+#pragma once
+
+#include "Platform.h"
+#include "BtreeInternal.h"
+
+class ShadowIndex
+{
+public:
+  static const UINT MaxLevels = 2;			  // Max nr of index levels copied
+  static const UINT MaxNodes = 1024;		  // Max nr of index pages copied
+  static const UINT RebuildThreshold = 64;	  // Nr of stale uses by a thread before it rebuilds the shadow
+  static const UINT MinRebuildIntervalMs = 10; // Min time between rebuilds of the shadow of a tree
+  static const UINT CacheLineSize = 64;
+
+private:
+  static const UINT NoChild = 0xFFFFFFFF;
+  static const UINT PrefixesPerLine = CacheLineSize / sizeof(ULONGLONG);
+
+  // Copy of an index page
+  struct ShadowNode
+  {
+	BtreePage*		  m_Page;			// Index page copied
+	LONGLONG		  m_PageStatus;		// Status of the index page when copied
+	UINT			  m_Count;			// Nr of separators on the page
+	UINT			  m_FirstEntry;		// Position of the first separator in m_Prefixes and m_Entries
+	UINT			  m_FirstChild;		// Node of the child of the first separator (or NoChild)
+  };
+
+  // Separator and child pointer of an index page entry
+  struct ShadowEntry
+  {
+	char*			  m_Separator;		// Separator (stored on the index page)
+	BtreePage*		  m_Child;			// Child page
+	UINT			  m_SepLen;			// Length of the separator
+  };
+
+  LONGLONG			  m_Version;		// Index version of the tree when the shadow was built
+  UINT				  m_nLevels;		// Nr of index levels copied
+  UINT				  m_nNodes;			// Nr of nodes
+  ShadowNode*		  m_Nodes;			// Nodes, level by level, starting with the root
+  ULONGLONG*		  m_Prefixes;		// Separator prefixes (each node starts on a new cache line)
+  ShadowEntry*		  m_Entries;		// Separators and child pointers
+
+  int SearchNode(ShadowNode* node, ULONGLONG keyPrefix, KeyType* key);
+
+public:
+  static ULONGLONG KeyPrefix(const char* key, UINT keyLen);
+  static ShadowIndex* Build(BtreeRootInternal* btree, LONGLONG version);
+
+  LONGLONG Version() { return m_Version; }
+  UINT Descend(BtreeRootInternal* btree, KeyType* key, BtIterator* iter, BtreePage*& nextPage, bool& stale);
+};
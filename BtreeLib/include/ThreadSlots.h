@@ -0,0 +1,169 @@
+// ***************************************************************************
+// Per-thread instances of T owned by an object, for example the statistics
+// of a B-tree.
+//
+// Get() returns the calling thread's instance, creating it on first use, so
+// the thread can update it without synchronization. Instances are kept until
+// the owner is destroyed; readers visit them with At(), for example to add up
+// per-thread counts. The instances of the last few owners a thread used are
+// cached in a thread-local table indexed by owner id, so Get() is normally a
+// single compare. When a thread exits its slot is released and its instance,
+// with the counts it holds, is handed to the next thread that claims the
+// slot. At most MaxThreads threads have a slot at the same time, Get()
+// returns null for the others.
+// ***************************************************************************
+#pragma once
+
+#include <vector>
+#include "Platform.h"
+
+template <class T>
+class ThreadSlots
+{
+public:
+  static const UINT MaxThreads = 256;
+
+private:
+  static const UINT CacheSize = 4;		  // Owners cached per thread, a power of 2
+
+  struct Slot
+  {
+	volatile LONG	m_ThreadId;		  // Zero if free
+	T* volatile		m_Data;			  // Null until the instance has been created
+  };
+
+  // The slots are freed by the owner or by the last thread to exit, whichever comes last
+  struct SlotArray
+  {
+	volatile LONG	m_Refs;			  // The owner plus the threads holding a slot
+	Slot			m_Slots[MaxThreads];
+  };
+
+  // Keyed on the owner id because a new owner may be allocated at the address of a deleted one
+  struct Cache
+  {
+	LONGLONG		m_OwnerId;
+	T*				m_Data;
+  };
+
+  // Releases the slots of a thread when it exits
+  struct ThreadExit
+  {
+	std::vector<Slot*>		m_Slots;
+	std::vector<SlotArray*>	m_Arrays;
+
+	~ThreadExit()
+	{
+	  LONG threadId = LONG(GetCurrentThreadId());
+	  for (size_t i = 0; i < m_Slots.size(); i++)
+	  {
+		InterlockedCompareExchange(&m_Slots[i]->m_ThreadId, 0, threadId);
+		if (InterlockedDecrement(&m_Arrays[i]->m_Refs) == 0)
+		{
+		  delete m_Arrays[i];
+		}
+	  }
+	}
+  };
+
+  static thread_local Cache		  t_Cache[CacheSize];
+  static thread_local ThreadExit  t_Exit;
+  static volatile LONGLONG		  s_NextOwnerId;
+
+  LONGLONG		  m_OwnerId;
+  SlotArray*	  m_Array;
+
+  // Find or claim the slot of the calling thread, starting at a slot given by a hash of the thread id
+  T* Register()
+  {
+	LONG threadId = LONG(GetCurrentThreadId());
+	UINT start = UINT((ULONGLONG(threadId) * 0x12B9B6A5) >> 5) % MaxThreads;
+	Slot* slots = m_Array->m_Slots;
+	T* data = nullptr;
+
+	// The slot may have been evicted from the cache only, or it may be past a slot
+	// released since it was claimed
+	for (UINT i = 0; i < MaxThreads && !data; i++)
+	{
+	  Slot* slot = &slots[(start + i) % MaxThreads];
+	  if (slot->m_ThreadId == threadId)
+	  {
+		data = slot->m_Data;
+	  }
+	}
+
+	for (UINT i = 0; i < MaxThreads && !data; i++)
+	{
+	  Slot* slot = &slots[(start + i) % MaxThreads];
+	  if (slot->m_ThreadId == 0 && InterlockedCompareExchange(&slot->m_ThreadId, threadId, 0) == 0)
+	  {
+		// Keep the instance of an exited thread so that its counts are not lost
+		data = slot->m_Data;
+		if (!data)
+		{
+		  data = new T();
+		  InterlockedExchangePointer((void* volatile*)(&slot->m_Data), data);
+		}
+		InterlockedIncrement(&m_Array->m_Refs);
+		t_Exit.m_Slots.push_back(slot);
+		t_Exit.m_Arrays.push_back(m_Array);
+	  }
+	}
+
+	if (data)
+	{
+	  Cache* cache = &t_Cache[m_OwnerId & (CacheSize - 1)];
+	  cache->m_OwnerId = m_OwnerId;
+	  cache->m_Data = data;
+	}
+	return data;
+  }
+
+public:
+  ThreadSlots()
+  {
+	m_OwnerId = InterlockedIncrement64(&s_NextOwnerId);
+	m_Array = new SlotArray();
+	m_Array->m_Refs = 1;
+	for (UINT i = 0; i < MaxThreads; i++)
+	{
+	  m_Array->m_Slots[i].m_ThreadId = 0;
+	  m_Array->m_Slots[i].m_Data = nullptr;
+	}
+  }
+
+  ~ThreadSlots()
+  {
+	for (UINT i = 0; i < MaxThreads; i++)
+	{
+	  delete m_Array->m_Slots[i].m_Data;
+	  m_Array->m_Slots[i].m_Data = nullptr;
+	}
+	if (InterlockedDecrement(&m_Array->m_Refs) == 0)
+	{
+	  delete m_Array;
+	}
+  }
+
+  ThreadSlots(const ThreadSlots&) = delete;
+  ThreadSlots& operator=(const ThreadSlots&) = delete;
+
+  // Instance of the calling thread, or null if all slots are taken
+  T* Get()
+  {
+	Cache* cache = &t_Cache[m_OwnerId & (CacheSize - 1)];
+	return (cache->m_OwnerId == m_OwnerId) ? cache->m_Data : Register();
+  }
+
+  // Instance in slot i (i < MaxThreads), or null if the slot is unused
+  T* At(UINT i) { return m_Array->m_Slots[i].m_Data; }
+};
+
+template <class T>
+thread_local typename ThreadSlots<T>::Cache ThreadSlots<T>::t_Cache[ThreadSlots<T>::CacheSize] = {};
+
+template <class T>
+thread_local typename ThreadSlots<T>::ThreadExit ThreadSlots<T>::t_Exit;
+
+template <class T>
+volatile LONGLONG ThreadSlots<T>::s_NextOwnerId = 0;
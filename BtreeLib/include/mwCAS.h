@@ -25,11 +25,13 @@
 
 #pragma once
 
-#include <Windows.h>
-#include <typeinfo.h>
+#include "Platform.h"
 #include <stdio.h>
 #include <assert.h>
+#ifdef _WIN32
+#include <typeinfo.h>
 #include <crtdbg.h>
+#endif
 
 // Forward references
 class MwCasDescriptorPartition;
@@ -408,11 +410,16 @@ public:
 	MwCASDescriptor* AllocateMwCASDescriptor(ULONG mask);
 
 	// Gather and print stats about MwCasOperations
+	void GetMwCasStats(MwCasStats* stats);
 	void PrintMwCasStats();
 };
 
 MwCASDescriptor* AllocateMwCASDescriptor(ULONG flagPos);
 
+// Counts of the MwCAS operations on the global descriptor pool, by call depth.
+// Updated without synchronization, so the counts are approximate.
+void GetMwCasStats(MwCasStats* stats);
+
 template < class T, int FlagPos = 0>
 class MwcTargetField
 {
@@ -1,9 +1,15 @@
-#include <Windows.h>
+#include "Platform.h"
 #include "MemoryAllocator.h"
 #include "MemoryBroker.h"
 #include "mwCAS.h"
 #include "BtreeInternal.h"
+#include "ShadowIndex.h"
 
+// The bound keys take the address of these
+const char KeyType::MinChar;
+const char KeyType::MaxChar;
+
+char KeyPtrPair::ClosedSlot = 0;
 
 
 void TraceInfo::Print(FILE* file)
@@ -13,7 +19,7 @@ void TraceInfo::Print(FILE* file)
   fprintf(file, "------ Home page ----\n");
   if (m_HomePage) m_HomePage->PrintLeafPage(file, 0);
 
-  char * ac = nullptr;
+  const char * ac = nullptr;
   for (int i = 0; i < m_ActionCount; i++)
   {
 	Action* pa = &m_ActionArr[i];
@@ -229,6 +235,14 @@ loopend:
 #endif
 
 int BtreePage::KeySearch(KeyType* searchKey, BtreePage::CompType ctype, bool forwardScan)
+{
+  CompareFn* compareFn = m_Btree->m_CompareFn;
+  if (compareFn == DefaultCompareKeys) return KeySearch(DefaultKeyComparer(), searchKey, ctype);
+  return KeySearch(CompareFnComparer(compareFn), searchKey, ctype);
+}
+
+template <class Comparer>
+int BtreePage::KeySearch(const Comparer& comparer, KeyType* searchKey, BtreePage::CompType ctype)
 {
 
 tryagain:
@@ -246,6 +260,7 @@ tryagain:
     char* curKey = nullptr;
     int cv = 0;
     int indx = -1;
+    int incr = 1;
 
 
     while (last - first > 5)
@@ -253,7 +268,7 @@ tryagain:
         mid = (last + first) / 2;
         pre = GetKeyPtrPair(mid);
         curKey = baseAddr + pre->m_KeyOffset;
-        cv = m_Btree->m_CompareFn(searchKey->m_pKeyValue, searchKey->m_KeyLen, curKey, pre->m_KeyLen);
+        cv = comparer.Compare(searchKey->m_pKeyValue, searchKey->m_KeyLen, curKey, pre->m_KeyLen);
         if (cv < 0)      last = mid;
         else if (cv > 0) first = mid;
         else
@@ -270,7 +285,6 @@ tryagain:
 
 
     // Forward or backward scan?
-    int incr = 1;
     if (ctype == LTE || ctype == LT)
     {
         // Do a backwards scan
@@ -285,7 +299,7 @@ tryagain:
     {
         pre = GetKeyPtrPair(indx);
         curKey = baseAddr + pre->m_KeyOffset;
-        cv = m_Btree->m_CompareFn(searchKey->m_pKeyValue, searchKey->m_KeyLen, curKey, pre->m_KeyLen);
+        cv = comparer.Compare(searchKey->m_pKeyValue, searchKey->m_KeyLen, curKey, pre->m_KeyLen);
         // Adjust for direction
         cv = incr*cv;
 
@@ -336,7 +350,7 @@ tryagain:
     } //end loop
 
     // No success if we fall out of the loop
-    indx = (ctype == CompType::EQ)? -1 :indx -= incr ;
+    indx = (ctype == CompType::EQ)? -1 : indx - incr ;
  
 loopend:
     // If thare are keys in the unsorted area, check each one separately
@@ -347,7 +361,7 @@ loopend:
             _ASSERTE(ctype == CompType::EQ);
             pre = GetKeyPtrPair(pos);
             curKey = baseAddr + pre->m_KeyOffset;
-            cv = m_Btree->m_CompareFn(searchKey->m_pKeyValue, searchKey->m_KeyLen, curKey, pre->m_KeyLen);
+            cv = comparer.Compare(searchKey->m_pKeyValue, searchKey->m_KeyLen, curKey, pre->m_KeyLen);
             if (cv == 0)
             {
                 indx = pos;
@@ -374,7 +388,7 @@ finalchecks:
         {
             pre = GetKeyPtrPair(indx - 1);
             curKey = baseAddr + pre->m_KeyOffset;
-            cv = m_Btree->m_CompareFn(searchKey->m_pKeyValue, searchKey->m_KeyLen, curKey, pre->m_KeyLen);
+            cv = comparer.Compare(searchKey->m_pKeyValue, searchKey->m_KeyLen, curKey, pre->m_KeyLen);
 
             if (cv <= 0)
             {
@@ -389,7 +403,7 @@ finalchecks:
             pre = GetKeyPtrPair(indx);
             curKey = baseAddr + pre->m_KeyOffset;
             int keylen = int(pre->m_KeyLen);
-            cv = m_Btree->m_CompareFn(searchKey->m_pKeyValue, searchKey->m_KeyLen, curKey, pre->m_KeyLen);
+            cv = comparer.Compare(searchKey->m_pKeyValue, searchKey->m_KeyLen, curKey, pre->m_KeyLen);
             if (cv > 0)
             {
                 printf("Thread %d: Separator %.*s in slot %d is less than search key %.*s\n", GetCurrentThreadId(),
@@ -418,7 +432,8 @@ finalchecks:
     return indx;
 }
 
-INT BinarySearchEq(const char *pSearchKey, const UINT keyLen, const char*baseAddr, const KeyPtrPair* rgRecord, const USHORT cLen, CompareFn* CompareKeys)
+template <class Comparer>
+INT BinarySearchEq(const char *pSearchKey, const UINT keyLen, const char*baseAddr, const KeyPtrPair* rgRecord, const USHORT cLen, const Comparer& comparer)
 {
     // do a binary search for the desired key
     INT Low = 0, High = cLen - 1;
@@ -429,7 +444,7 @@ INT BinarySearchEq(const char *pSearchKey, const UINT keyLen, const char*baseAdd
     {
         Middle = (Low + High) / 2;
         curKey = const_cast<char*>(baseAddr) + rgRecord[Middle].m_KeyOffset;
-        Cmp = CompareKeys(curKey, rgRecord[Middle].m_KeyLen, pSearchKey, keyLen);
+        Cmp = comparer.Compare(curKey, rgRecord[Middle].m_KeyLen, pSearchKey, keyLen);
         if (Cmp < 0) 
         {
             Low = Middle + 1;
@@ -447,7 +462,8 @@ INT BinarySearchEq(const char *pSearchKey, const UINT keyLen, const char*baseAdd
 }
 
 // Find first key that is greater than or equal to the search key
-INT BinarySearchGE(const char *pSearchKey, const UINT keyLen, const char*baseAddr, const KeyPtrPair* rgRecord, const USHORT cLen, CompareFn* CompareKeys, bool& fEqual)
+template <class Comparer>
+INT BinarySearchGE(const char *pSearchKey, const UINT keyLen, const char*baseAddr, const KeyPtrPair* rgRecord, const USHORT cLen, const Comparer& comparer, bool& fEqual)
 
 {
     if (cLen == 0)
@@ -466,7 +482,7 @@ INT BinarySearchGE(const char *pSearchKey, const UINT keyLen, const char*baseAdd
     while (High - Low > 3) {
         Middle = (Low + High) / 2;
         curKey = const_cast<char*>(baseAddr) + rgRecord[Middle].m_KeyOffset;
-        Cmp = CompareKeys(pSearchKey, keyLen, curKey, rgRecord[Middle].m_KeyLen );
+        Cmp = comparer.Compare(pSearchKey, keyLen, curKey, rgRecord[Middle].m_KeyLen );
 
         if (Cmp > 0) {
             // we now know that lowkey < searchkey
@@ -482,7 +498,7 @@ INT BinarySearchGE(const char *pSearchKey, const UINT keyLen, const char*baseAdd
     // we are now down to at most three keys
     for (INT k = Low; k<High; ++k) {
         curKey = const_cast<char*>(baseAddr) + rgRecord[k].m_KeyOffset;
-        Cmp = CompareKeys(pSearchKey, keyLen, curKey, rgRecord[k].m_KeyLen );
+        Cmp = comparer.Compare(pSearchKey, keyLen, curKey, rgRecord[k].m_KeyLen );
         if (Cmp <= 0) {
             Trgt = k;
             fEqual = (Cmp == 0);
@@ -561,11 +577,7 @@ tryagain:
 
     if (pst->m_nUnsortedReserved > 0)
     {
-        btr = newArray->SortPermArray();
-        if (btr != BT_SUCCESS)
-        {
-            goto tryagain;
-        }
+        SortPermutationArray(newArray);
     }
   
     MwCASDescriptor* desc = AllocateMwCASDescriptor(DescriptorFlagPos);
@@ -581,6 +593,7 @@ tryagain:
     bool installed = desc->MwCAS(0);
     if (!installed)
     {
+        m_Btree->m_Contention.Count(CC_INSTALL_FAILED_PERM_ARRAY);
         m_Btree->m_EpochMgr->DeallocateNow(newArray, MemObjectType::TmpPointerArray);
         goto tryagain;
     }
@@ -590,6 +603,60 @@ tryagain:
     return BT_SUCCESS;
 }
 
+// Sort the permutation array of the page. The sorted set is already in slot order so
+// only the unsorted slots are sorted, by binary insertion, and then merged with it.
+// Entries with equal keys keep their slot order.
+void BtreePage::SortPermutationArray(PermutationArray* permArr)
+{
+    CompareFn* compareFn = m_Btree->m_CompareFn;
+    if (compareFn == DefaultCompareKeys) SortPermutationArray(DefaultKeyComparer(), permArr);
+    else                                 SortPermutationArray(CompareFnComparer(compareFn), permArr);
+}
+
+template <class Comparer>
+void BtreePage::SortPermutationArray(const Comparer& comparer, PermutationArray* permArr)
+{
+    // The unsorted slots are sorted into the end of the array. The merge never writes 
+    // past the next unsorted slot to be read.
+    UINT16* tail = &permArr->m_PermArray[m_nSortedSet];
+    UINT sortedCount = m_nSortedSet;
+    UINT rCount = 0;
+    for (UINT16 slot = UINT16(sortedCount); slot < permArr->m_nrEntries; slot++)
+    {
+        KeyPtrPair* pre = &m_RecordArr[slot];
+        char* key = (char*)(this) + pre->m_KeyOffset;
+
+        // Find the first position with a higher key
+        UINT low = 0;
+        UINT high = rCount;
+        while (low < high)
+        {
+            UINT mid = (low + high) / 2;
+            KeyPtrPair* mre = &m_RecordArr[tail[mid]];
+            int cv = comparer.Compare(key, pre->m_KeyLen, (char*)(this) + mre->m_KeyOffset, mre->m_KeyLen);
+            if (cv < 0) high = mid; else low = mid + 1;
+        }
+        memmove(&tail[low + 1], &tail[low], (rCount - low) * sizeof(UINT16));
+        tail[low] = slot;
+        rCount++;
+    }
+
+    UINT lIndx = 0;
+    UINT rIndx = 0;
+    UINT trgt = 0;
+    while (lIndx < sortedCount && rIndx < rCount)
+    {
+        KeyPtrPair* pLeft = &m_RecordArr[lIndx];
+        KeyPtrPair* pRight = &m_RecordArr[tail[rIndx]];
+        int cv = comparer.Compare((char*)(this) + pLeft->m_KeyOffset, pLeft->m_KeyLen, 
+                                  (char*)(this) + pRight->m_KeyOffset, pRight->m_KeyLen);
+        permArr->m_PermArray[trgt++] = (cv <= 0) ? UINT16(lIndx++) : tail[rIndx++];
+    }
+    while (lIndx < sortedCount) permArr->m_PermArray[trgt++] = UINT16(lIndx++);
+    while (rIndx < rCount)      permArr->m_PermArray[trgt++] = tail[rIndx++];
+    _ASSERTE(trgt == permArr->m_nrEntries);
+}
+
 void BtreePage::ComputeLeafStats(BtreeStatistics* statsp)
 {
   _ASSERTE(IsLeafPage());
@@ -605,6 +672,7 @@ void BtreePage::ComputeLeafStats(BtreeStatistics* statsp)
   statsp->m_RecArrSpaceLP += (m_nSortedSet+pst->m_nUnsortedReserved) * sizeof(KeyPtrPair);
   statsp->m_FreeSpaceLP += FreeSpace();
   statsp->m_DeletedSpaceLP += m_WastedSpace;
+  statsp->m_UnsortedLP += pst->m_nUnsortedReserved;
   UINT hsize = UINT((char*)(&m_RecordArr[0]) - (char*)(this));
   _ASSERTE(hsize == PageHeaderSize());
 }
@@ -720,7 +788,7 @@ void BtreePage::PrintLeafPage(FILE* file, UINT level)
 
   _ASSERTE(IsLeafPage());
 
-  fprintf(file, "\n------ Leaf page 0X%I64X -----------------------\n", ULONGLONG(this));
+  fprintf(file, "\n------ Leaf page 0X%llX -----------------------\n", ULONGLONG(this));
 
   UINT nUnsorted = pst->m_nUnsortedReserved;
   UINT delSpace = 0;
@@ -745,7 +813,7 @@ void BtreePage::PrintLeafPage(FILE* file, UINT level)
   char* baseAddr = (char*)(this);
   KeyPtrPair* pe = nullptr;
   char* keyPtr = nullptr;
-  char* recPtr = nullptr;
+  const char* recPtr = nullptr;
   
   fprintf(file, "%d records in sorted area\n", m_nSortedSet);
   for (UINT i = 0; i < m_nSortedSet; i++)
@@ -903,7 +971,7 @@ void BtreePage::PrintPage(FILE* file, UINT level, bool recursive)
 	LONGLONG psw = m_PageStatus.ReadLL();
 	PageStatus* pst = (PageStatus*)(&psw);
 
-  fprintf(file, "\n------ Index page 0X%I64X at level %d -----------------\n", ULONGLONG(this), level);
+  fprintf(file, "\n------ Index page 0X%llX at level %d -----------------\n", ULONGLONG(this), level);
 
   UINT nUnsorted = pst->m_nUnsortedReserved;
   UINT delSpace = 0;
@@ -933,7 +1001,7 @@ void BtreePage::PrintPage(FILE* file, UINT level, bool recursive)
 	KeyPtrPair* pe = GetKeyPtrPair(i);
 	fprintf(file, "  (%d, %d, 0x%llx):", pe->m_KeyOffset, pe->m_KeyLen, pe->m_Pointer.ReadLL());
    
-	char* keyPtr =( pe->m_KeyLen > 0)? (baseAddr + pe->m_KeyOffset): "----------------";
+	const char* keyPtr =( pe->m_KeyLen > 0)? (baseAddr + pe->m_KeyOffset): "----------------";
     fprintf(file, " \"%1.*s\",", pe->m_KeyLen, keyPtr);
 
     BtreePage* bp = (BtreePage*)(pe->m_Pointer.ReadPP());
@@ -963,10 +1031,10 @@ void BtreeRoot::Print(FILE* file)
 
 }
 
-BTRESULT BtreeRootInternal::AllocateLeafPage(UINT recCount, UINT keySpace, BtreePage*& newPage)
+BTRESULT BtreeRootInternal::AllocateLeafPage(UINT recCount, UINT keySpace, BtreePage*& newPage, double heat)
 {
-  UINT pageSize = ComputeLeafPageSize(recCount, keySpace, 0);
-  pageSize = max(pageSize, m_MinPageSize);
+  UINT pageSize = ComputeLeafPageSize(recCount, keySpace, 0, heat);
+  pageSize = max(pageSize, m_PageSizePolicy.m_MinPageSize);
 
   BtreePage* page = nullptr;
   HRESULT hre = m_MemoryBroker->Allocate(pageSize, (void**)(&page), MemObjectType::LeafPage);
@@ -1020,7 +1088,7 @@ BtreePage* BtreeRootInternal::CreateIndexPage(BtreePage* leftPage, BtreePage* ri
 
 BtreePage::BtreePage(PageType type, UINT size, BtreeRootInternal* root)
 {
-    _ASSERTE(size <= 64 * 1024);
+    _ASSERTE(size <= PageSizeLimit);
 	PageStatus* pst = (PageStatus*)(&m_PageStatus);
 
     memset(this, 0, size);
@@ -1029,6 +1097,9 @@ BtreePage::BtreePage(PageType type, UINT size, BtreeRootInternal* root)
     m_PageType = type;
     m_nSortedSet = 0;
     m_WastedSpace = 0;
+    m_CreateTime = GetTickCount();
+    m_ReadScanCost = 0;
+    m_ReadScanHot = false;
     pst->m_LastFreeByte = size - 1;
     pst->m_nUnsortedReserved = 0;
     pst->m_PageState = PAGE_NORMAL;
@@ -1082,6 +1153,11 @@ BTRESULT BtreePage::ExpandIndexPage(char* separator, UINT sepLen, BtreePage* lef
 	PageStatus* pst = (PageStatus*)(&psw);
 
     BtreePage* newpage = nullptr;
+    char* curSep = nullptr;
+    UINT curSepLen = 0;
+    KeyPtrPair* pre = nullptr;
+    UINT spos = 0;
+
 	btr = m_Btree->AllocateIndexPage(m_nSortedSet + 1, KeySpaceSize() + sepLen, newpage);
      if (btr != BT_SUCCESS) 
     { 
@@ -1090,19 +1166,14 @@ BTRESULT BtreePage::ExpandIndexPage(char* separator, UINT sepLen, BtreePage* lef
  
     // Allow the parent page to be larger than the max page size temporararily
     // but mark it to be split
-    if (newpage->PageSize() >= m_Btree->m_MaxPageSize)
+    if (newpage->PageSize() >= m_Btree->m_PageSizePolicy.m_MaxPageSize)
     {
 	  PageStatus* newpst = (PageStatus*)(&newpage->m_PageStatus);
       newpst->m_PendAction = PA_SPLIT_PAGE;
     }
 
-    char* curSep = nullptr;
-    UINT curSepLen = 0;
-    KeyPtrPair* pre = nullptr;
-
     // spos it position in the source (old) page
     // tpos is position in the target (new) page
-    UINT spos = 0;
     for (UINT tpos = 0; tpos < UINT(m_nSortedSet+1); tpos++)
     {
         if (tpos != oldPos)
@@ -1143,6 +1214,10 @@ BTRESULT BtreePage::SplitIndexPage(BtIterator* iter)
     for (UINT i = 0; i < lCount; i++) keySpace += GetKeyPtrPair(i)->m_KeyLen;
 
     BtreePage* leftPage = nullptr;
+    BtreePage* rightPage = nullptr;
+    char* separator = nullptr;
+    UINT seplen = 0;
+
 	btr = m_Btree->AllocateIndexPage(lCount, keySpace, leftPage);
    if (btr != BT_SUCCESS) 
     { 
@@ -1161,7 +1236,6 @@ BTRESULT BtreePage::SplitIndexPage(BtIterator* iter)
     keySpace = 0;
     for (UINT i = lCount; i < m_nSortedSet; i++) keySpace += GetKeyPtrPair(i)->m_KeyLen;
 
-    BtreePage* rightPage = nullptr;
 	btr = m_Btree->AllocateIndexPage(rCount, keySpace, rightPage);
     if (btr != BT_SUCCESS) 
     { 
@@ -1178,8 +1252,8 @@ BTRESULT BtreePage::SplitIndexPage(BtIterator* iter)
      // Use the last key of the left page as separator for the two pages.
     // A separator thus indicates the highest key value allowed on a page.
     // The separator will be added to the parent index page.
-    char* separator = (char*)(leftPage)+leftPage->GetKeyPtrPair(lCount - 1)->m_KeyOffset;
-    UINT seplen = leftPage->GetKeyPtrPair(lCount - 1)->m_KeyLen;
+    separator = (char*)(leftPage)+leftPage->GetKeyPtrPair(lCount - 1)->m_KeyOffset;
+    seplen = leftPage->GetKeyPtrPair(lCount - 1)->m_KeyLen;
 
 #ifdef _DEBUG
 	leftPage->m_SrcPage1 = this;
@@ -1268,6 +1342,9 @@ BTRESULT BtreePage::ShrinkIndexPage(UINT dropPos, BtreePage*& newIndexPage)
 
   BTRESULT btr = BT_SUCCESS;
   BtreePage* newpage = nullptr;
+  UINT sepLen = 0;
+  char* curSep = nullptr;
+  KeyPtrPair* pre = nullptr;
 
   if (m_nSortedSet <= 1)
   {
@@ -1275,7 +1352,8 @@ BTRESULT BtreePage::ShrinkIndexPage(UINT dropPos, BtreePage*& newIndexPage)
   }
 
   _ASSERTE(dropPos < m_nSortedSet);
-  UINT sepLen = m_RecordArr[dropPos].m_KeyLen;
+  // Dropping the last entry removes the separator before it (see below)
+  sepLen = (dropPos == m_nSortedSet - 1) ? m_RecordArr[dropPos - 1].m_KeyLen : m_RecordArr[dropPos].m_KeyLen;
 
   btr = m_Btree->AllocateIndexPage(m_nSortedSet - 1, KeySpaceSize() - sepLen, newpage);
    if (btr != BT_SUCCESS)
@@ -1283,30 +1361,31 @@ BTRESULT BtreePage::ShrinkIndexPage(UINT dropPos, BtreePage*& newIndexPage)
 	goto exit;
   }
 
-  if (newpage->m_PageSize < m_Btree->m_MinPageSize)
+  if (newpage->m_PageSize < m_Btree->m_PageSizePolicy.m_MinPageSize)
   {
 	PageStatus* newpst = (PageStatus*)(&newpage->m_PageStatus);
 	newpst->m_PendAction = PA_MERGE_PAGE;
   }
  
-  char* curSep = nullptr;
-  UINT curSepLen = 0;
-  KeyPtrPair* pre = nullptr;
-
    for (UINT spos = 0; spos < m_nSortedSet; spos++)
   {
 	if (spos != dropPos)
 	{
 	  pre = GetKeyPtrPair(spos);
 	  curSep = (char*)(this) + pre->m_KeyOffset;
-	  newpage->AppendToSortedSet(curSep, pre->m_KeyLen, pre->m_Pointer.Read());
+	  sepLen = pre->m_KeyLen;
+	  // The last separator is the high bound of the page. When the last entry is dropped,
+	  // its separator is kept so the previous child takes over its key range.
+	  if (dropPos == m_nSortedSet - 1 && spos + 1 == dropPos)
+	  {
+		curSep = (char*)(this) + m_RecordArr[dropPos].m_KeyOffset;
+		sepLen = m_RecordArr[dropPos].m_KeyLen;
+	  }
+	  newpage->AppendToSortedSet(curSep, sepLen, pre->m_Pointer.Read());
 	}
   }
    _ASSERTE(newpage->m_nSortedSet == m_nSortedSet - 1);
-
-  UINT frontSize = UINT((char*)(&newpage->m_RecordArr[m_nSortedSet-1]) - (char*)(newpage));
-  UINT backSize = newpage->KeySpaceSize();
-  _ASSERTE(frontSize + backSize == newpage->PageSize());
+  _ASSERTE(UINT((char*)(&newpage->m_RecordArr[m_nSortedSet-1]) - (char*)(newpage)) + newpage->KeySpaceSize() == newpage->PageSize());
 
 exit:
   newIndexPage = newpage;
@@ -1348,11 +1427,6 @@ BTRESULT BtreePage::DeleteEmptyPage(BtIterator* iter)
         }
     }
 
-
-#ifdef DO_LOG
-    DeletePageInfo::RecDeletePage('B', this, psw, parentPage, parentpsw);
-#endif
-
     // Create a new instance of the parent page without the separator and pointer
     // for the current page. Then update the pointer in the grandparent page or b-tree object
     UINT dropPos = iter->m_Path[parentIndx].m_Slot;
@@ -1416,14 +1490,19 @@ BTRESULT BtreePage::DeleteEmptyPage(BtIterator* iter)
     desc->CloseDescriptor();
     bool installed = desc->MwCAS();
 
+    TraceEvent* ev = m_Btree->m_Tracer.NewEvent(TE_PAGE_DELETE, (installed) ? BT_SUCCESS : BT_INSTALL_FAILED);
+    if (ev)
+    {
+        ev->m_Page = ULONGLONG(this);
+        ev->m_Status = psw;
+        ev->m_Parent = ULONGLONG(parentPage);
+        ev->m_ParentStatus = (parentIndx >= 0) ? LONGLONG(iter->m_Path[parentIndx].m_PageStatus) : 0;
+        ev->m_NewPage = ULONGLONG(newIndxPage);
+    }
+
     BTRESULT btr = BT_SUCCESS;
     if (installed)
     {
-#ifdef DO_LOG
-        LONGLONG    newIndxPageStatus = (newIndxPage) ? newIndxPage->m_PageStatus : 0;
-        DeletePageInfo::RecDeletePage('E', this, PageStatus::MakePageInactive(psw), newIndxPage, newIndxPageStatus);
-#endif
-
         // Delete index pages that are no longer needed plus the empty leaf page
         for (UINT idx = max(0, parentIndx); idx < iter->m_Count; idx++)
         {
@@ -1431,7 +1510,7 @@ BTRESULT BtreePage::DeleteEmptyPage(BtIterator* iter)
             _ASSERTE(page->IsInactive());
             if (page->IsIndexPage())
             {
-                m_Btree->m_EpochMgr->Deallocate(page, MemObjectType::IndexPage);
+                m_Btree->RetireIndexPage(page);
                 m_Btree->m_nIndexPages--;
             }
             else
@@ -1446,11 +1525,8 @@ BTRESULT BtreePage::DeleteEmptyPage(BtIterator* iter)
      }
     else
     {
-#ifdef DO_LOG
-        DeletePageInfo::RecDeletePage('E', this, psw, 0, 0);
-#endif
-
         // Failed to install the new index page
+        m_Btree->m_Contention.Count(CC_INSTALL_FAILED_PAGE_DELETE);
         if( newIndxPage) m_Btree->m_EpochMgr->DeallocateNow(newIndxPage, MemObjectType::IndexPage);
         btr = BT_NO_ACTION_TAKEN;
     }
@@ -1483,6 +1559,11 @@ BTRESULT BtreeRootInternal::InstallSplitPages(BtIterator* iter, BtreePage* leftP
 	LONGLONG*  gpStatusAddr = nullptr;
 	LONGLONG   gppsw = 0;
 
+	MwCASDescriptor* desc = nullptr;
+	INT32      pos = 0;
+	BtreePage* srcPage = nullptr;
+	LONGLONG   srcpsw = 0;
+
 	// Install the two new pages
 	if (iter->m_Count == 1)
 	{
@@ -1548,14 +1629,14 @@ BTRESULT BtreeRootInternal::InstallSplitPages(BtIterator* iter, BtreePage* leftP
 	}
 
 
-	MwCASDescriptor* desc = AllocateMwCASDescriptor(DescriptorFlagPos);
+	desc = AllocateMwCASDescriptor(DescriptorFlagPos);
 
 	// We always have a new parent page so need to install it
-	INT32 pos = desc->AddEntryToDescriptor((LONGLONG*)(installAddr), LONGLONG(expVal), LONGLONG(newParentPage));
+	pos = desc->AddEntryToDescriptor((LONGLONG*)(installAddr), LONGLONG(expVal), LONGLONG(newParentPage));
     
     // Always make the source page inactive
-    BtreePage* srcPage = iter->m_Path[iter->m_Count - 1].m_Page ;
-    LONGLONG   srcpsw = iter->m_Path[iter->m_Count - 1].m_PageStatus;
+    srcPage = iter->m_Path[iter->m_Count - 1].m_Page ;
+    srcpsw = iter->m_Path[iter->m_Count - 1].m_PageStatus;
     pos = desc->AddEntryToDescriptor((LONGLONG*)(&srcPage->m_PageStatus), srcpsw, PageStatus::MakePageInactive(srcpsw));
 
 	if (iter->m_Count > 1)
@@ -1576,8 +1657,9 @@ BTRESULT BtreeRootInternal::InstallSplitPages(BtIterator* iter, BtreePage* leftP
 exit:
 	if (installed)
 	{
-	  // Success so delete the old parent page (if there was one)
-	  if (parentPage) m_EpochMgr->Deallocate(parentPage, MemObjectType::IndexPage);
+	  // Success so delete the page that was split and the old parent page (if there was one)
+	  RetirePage(curPage);
+	  if (parentPage) RetireIndexPage(parentPage);
 	  m_nIndexPages += addedIndexPages;
       if (leftPage->IsLeafPage()) m_nLeafPages++;
       else                        m_nIndexPages++;
@@ -1586,9 +1668,22 @@ exit:
 	else
 	{
 	  // Failure so delete the new parent page
+	  m_Contention.Count(CC_INSTALL_FAILED_SPLIT);
 	  if( newParentPage) m_EpochMgr->DeallocateNow(newParentPage, MemObjectType::IndexPage);
 	  btr = BT_INSTALL_FAILED;
 	}
+
+	TraceEvent* ev = m_Tracer.NewEvent(TE_SPLIT, btr);
+	if (ev)
+	{
+	  if (curPage->IsIndexPage()) ev->m_Type |= TraceIndexPage;
+	  ev->m_Page = ULONGLONG(curPage);
+	  ev->m_Status = curpe->m_PageStatus;
+	  ev->m_Parent = ULONGLONG(parentPage);
+	  ev->m_ParentStatus = parentsw;
+	  ev->m_NewPage = ULONGLONG(leftPage);
+	  ev->m_Arg = ULONGLONG(rightPage);
+	}
 	return btr;
 }
 
@@ -1604,6 +1699,37 @@ BTRESULT BtreeRoot::InsertRecord(KeyType* key, void* recptr)
     return br;
 }
 
+// Atomically update several records. See BtreeRootInternal::MultiUpdateInternal.
+BTRESULT BtreeRoot::MultiUpdate(MultiUpdateEntry* entries, UINT count)
+{
+    if (entries == nullptr)
+    {
+        return BT_INVALID_ARG;
+    }
+    for (UINT i = 0; i < count; i++)
+    {
+        KeyType* key = entries[i].m_Key;
+        if (key == nullptr || key->m_pKeyValue == nullptr || key->m_KeyLen == 0)
+        {
+            return BT_INVALID_ARG;
+        }
+    }
+    BtreeRootInternal* btreeInt = (BtreeRootInternal*)(this);
+    return btreeInt->MultiUpdateInternal(entries, count);
+}
+
+// Insert the record only if there is no record with the same key.
+// Returns BT_DUPLICATE_KEY if the key already exists.
+BTRESULT BtreeRoot::InsertIfAbsent(KeyType* key, void* recptr)
+{
+    if (key == nullptr || key->m_pKeyValue == nullptr || key->m_KeyLen == 0 || recptr == nullptr)
+    {
+        return BT_INVALID_ARG;
+    }
+    BtreeRootInternal* btreeInt = (BtreeRootInternal*)(this);
+    return btreeInt->InsertRecordInternal(key, recptr, true);
+}
+
 BTRESULT BtreeRoot::LookupRecord(KeyType* key, void*& recFound)
 {
     if (key == nullptr || key->m_pKeyValue == nullptr || key->m_KeyLen == 0 )
@@ -1624,6 +1750,40 @@ BTRESULT BtreeRoot::DeleteRecord(KeyType* key)
     return btreeInt->DeleteRecordInternal(key);
 }
 
+BTRESULT BtreeRoot::UpdateRecord(KeyType* key, void* newRec, void*& oldRec)
+{
+    oldRec = nullptr;
+    if (key == nullptr || key->m_pKeyValue == nullptr || key->m_KeyLen == 0 || newRec == nullptr)
+    {
+        return BT_INVALID_ARG;
+    }
+    BtreeRootInternal* btreeInt = (BtreeRootInternal*)(this);
+    return btreeInt->UpdateRecordInternal(key, nullptr, newRec, oldRec);
+}
+
+// Replace the record pointer only if it still equals expectedRec.
+// Returns BT_RECORD_CHANGED if the record pointer has changed.
+BTRESULT BtreeRoot::CompareAndSwapRecord(KeyType* key, void* expectedRec, void* newRec)
+{
+    if (key == nullptr || key->m_pKeyValue == nullptr || key->m_KeyLen == 0 || expectedRec == nullptr || newRec == nullptr)
+    {
+        return BT_INVALID_ARG;
+    }
+    void* oldRec = nullptr;
+    BtreeRootInternal* btreeInt = (BtreeRootInternal*)(this);
+    return btreeInt->UpdateRecordInternal(key, expectedRec, newRec, oldRec);
+}
+
+BTRESULT BtreeRoot::UpsertRecord(KeyType* key, void* recptr)
+{
+    if (key == nullptr || key->m_pKeyValue == nullptr || key->m_KeyLen == 0 || recptr == nullptr)
+    {
+        return BT_INVALID_ARG;
+    }
+    BtreeRootInternal* btreeInt = (BtreeRootInternal*)(this);
+    return btreeInt->UpsertRecordInternal(key, recptr);
+}
+
 #ifdef _DEBUG
 BTRESULT BtreeRoot::TraceRecord(KeyType* key)
 {
@@ -1642,12 +1802,102 @@ void BtreeRoot::PrintStats(FILE* file)
   root->PrintTreeStats(file);
 }
 
-void BtreeRoot::CheckTree(FILE* fh)
+UINT BtreeRoot::CheckTree(FILE* fh)
 {
 	BtreeRootInternal* btreeInt = (BtreeRootInternal*)(this);
     return btreeInt->CheckTree(fh);
 }
 
+void BtreeRoot::SetLimboLimits(__int64 softLimitBytes, __int64 hardLimitBytes)
+{
+  BtreeRootInternal* btreeInt = (BtreeRootInternal*)(this);
+  btreeInt->GetEpochManager()->SetLimboLimits(softLimitBytes, hardLimitBytes);
+}
+
+BTRESULT BtreeRoot::SetPageSizePolicy(PageSizePolicy& policy)
+{
+  if (policy.m_MinPageSize >= policy.m_MaxPageSize || policy.m_MaxPageSize > BtreePage::PageSizeLimit ||
+	  policy.m_MinFreeFraction < 0.0 || policy.m_MinFreeFraction > policy.m_MaxFreeFraction)
+  {
+	return BT_INVALID_ARG;
+  }
+  m_PageSizePolicy = policy;
+  return BT_SUCCESS;
+}
+
+void BtreeRoot::GetLimboStats(EpochLimboStats* stats)
+{
+  if (stats == nullptr) return;
+  BtreeRootInternal* btreeInt = (BtreeRootInternal*)(this);
+  btreeInt->GetEpochManager()->GetLimboStats(stats);
+}
+
+BTRESULT BtreeRoot::GetLatencyStats(LatencyOp op, LatencySummary* summary)
+{
+  if (summary == nullptr || op < 0 || op >= LAT_OP_COUNT)
+  {
+	return BT_INVALID_ARG;
+  }
+  BtreeRootInternal* btreeInt = (BtreeRootInternal*)(this);
+  btreeInt->GetLatencyRecorder()->GetSummary(op, summary);
+  return (LatencyRecorder::IsEnabled()) ? BT_SUCCESS : BT_NO_ACTION_TAKEN;
+}
+
+void BtreeRoot::ClearLatencyStats()
+{
+  BtreeRootInternal* btreeInt = (BtreeRootInternal*)(this);
+  btreeInt->GetLatencyRecorder()->Clear();
+}
+
+void BtreeRoot::GetContentionStats(ContentionStats* stats)
+{
+  if (stats == nullptr) return;
+  BtreeRootInternal* btreeInt = (BtreeRootInternal*)(this);
+  btreeInt->GetContentionCounters()->GetStats(stats);
+}
+
+void BtreeRoot::ClearContentionStats()
+{
+  BtreeRootInternal* btreeInt = (BtreeRootInternal*)(this);
+  btreeInt->GetContentionCounters()->Clear();
+}
+
+void BtreeRoot::SetEventTrace(UINT32 eventMask, UINT32 sampleRate)
+{
+  BtreeRootInternal* btreeInt = (BtreeRootInternal*)(this);
+  btreeInt->GetEventTracer()->Enable(eventMask, sampleRate);
+}
+
+BTRESULT BtreeRoot::DumpEventTrace(FILE* file)
+{
+  if (file == nullptr) return BT_INVALID_ARG;
+  BtreeRootInternal* btreeInt = (BtreeRootInternal*)(this);
+  return (btreeInt->GetEventTracer()->Dump(file) >= 0) ? BT_SUCCESS : BT_INTERNAL_ERROR;
+}
+
+void BtreeRoot::SetPhaseProfiling(UINT32 sampleRate)
+{
+  BtreeRootInternal* btreeInt = (BtreeRootInternal*)(this);
+  btreeInt->GetPhaseProfiler()->Enable(sampleRate);
+}
+
+BTRESULT BtreeRoot::GetPhaseProfile(ProfileOp op, PhaseProfile* profile)
+{
+  if (profile == nullptr || op < 0 || op >= PROF_OP_COUNT)
+  {
+	return BT_INVALID_ARG;
+  }
+  BtreeRootInternal* btreeInt = (BtreeRootInternal*)(this);
+  btreeInt->GetPhaseProfiler()->GetProfile(op, profile);
+  return BT_SUCCESS;
+}
+
+void BtreeRoot::ClearPhaseProfile()
+{
+  BtreeRootInternal* btreeInt = (BtreeRootInternal*)(this);
+  btreeInt->GetPhaseProfiler()->Clear();
+}
+
 BtreeRootInternal::BtreeRootInternal()
 {
   m_MemoryBroker = new MemoryBroker(m_MemoryAllocator);
@@ -1658,29 +1908,107 @@ BtreeRootInternal::BtreeRootInternal()
   m_nRecords = m_nLeafPages = m_nIndexPages = 0;
   m_nPageSplits = m_nConsolidations = m_nPageMerges = m_nPageDeletes = 0;
   m_FailList = nullptr;
+  m_CreateTime = GetTickCount64();
+  m_nTotalInserts = m_nTotalKeyBytes = 0;
+  m_Shadow = nullptr;
+  m_IndexVersion = 0;
+  m_ShadowBuildTime = 0;
+  m_nShadowRebuilds = 0;
+}
+
+// Free all pages of the tree and its memory managers. No thread may still be using the tree.
+BtreeRootInternal::~BtreeRootInternal()
+{
+  FreePages((BtreePage*)(m_RootPage.ReadPP()));
+  m_RootPage = nullptr;
+  if (m_Shadow)
+  {
+	m_EpochMgr->DeallocateNow(m_Shadow, MemObjectType::ShadowIndexObj);
+	m_Shadow = nullptr;
+  }
+
+  // The epoch manager frees the objects still waiting in its limbo lists
+  delete m_EpochMgr;
+  delete m_MemoryBroker;
+}
+
+// Free a page and, for an index page, all pages below it
+void BtreeRootInternal::FreePages(BtreePage* page)
+{
+  if (page == nullptr)
+  {
+	return;
+  }
+  if (page->IsIndexPage())
+  {
+	for (UINT slot = 0; slot < page->m_nSortedSet; slot++)
+	{
+	  FreePages((BtreePage*)(page->m_RecordArr[slot].m_Pointer.ReadPP()));
+	}
+	m_EpochMgr->DeallocateNow(page, MemObjectType::IndexPage);
+  }
+  else
+  {
+	page->DeletePermutationArray();
+	m_EpochMgr->DeallocateNow(page, MemObjectType::LeafPage);
+  }
 }
 
 void BtreeRootInternal::ClearTreeStats()
 {
   m_nInserts = m_nDeletes = m_nUpdates = 0;
   m_nPageSplits = m_nConsolidations = m_nPageMerges = 0;
+  m_Latency.Clear();
+  m_Contention.Clear();
+  m_Profiler.Clear();
 }
 
-// Compute the page size to allocate
-UINT BtreeRootInternal::ComputeLeafPageSize(UINT nrRecords, UINT keySpace, UINT minFree)
+// Compute the page size to allocate.
+// The amount of free space is determined by the page size policy and the heat of the page.
+UINT BtreeRootInternal::ComputeLeafPageSize(UINT nrRecords, UINT keySpace, UINT minFree, double heat)
 {
   UINT frontSpace = BtreePage::PageHeaderSize();
   UINT minKeySpace = sizeof(KeyPtrPair)*nrRecords+ keySpace;
-  UINT freeSpace = max(minFree, UINT(minKeySpace*m_FreeSpaceFraction));
+  UINT freeSpace = max(minFree, UINT(minKeySpace*m_PageSizePolicy.FreeSpaceFraction(heat)));
   
-  // Leave room for two average size keys
-  UINT twoKeys = UINT(2.0*(double(minKeySpace) / nrRecords));
+  // Leave room for two average size keys. Use the average over the tree
+  // if there is any insert history, otherwise the average on this page.
+  ULONGLONG totalInserts = m_nTotalInserts;
+  double avgKeyLen = (totalInserts > 0) ? double(m_nTotalKeyBytes) / totalInserts 
+	                                    : double(keySpace) / max(nrRecords, 1U);
+  UINT twoKeys = UINT(2.0*(sizeof(KeyPtrPair) + avgKeyLen));
   freeSpace = max(freeSpace, twoKeys);
 
-  UINT pageSize = frontSpace + minKeySpace + freeSpace;
+  // Page sizes are stored in 16 bits so the free space may have to be cut down
+  UINT pageSize = min(frontSpace + minKeySpace + freeSpace, UINT(BtreePage::PageSizeLimit));
+  _ASSERTE(frontSpace + minKeySpace <= pageSize);
   return pageSize;
 }
 
+// Estimate the insert heat of a leaf page, that is, the insert rate per record
+// into the page relative to the insert rate per record into the whole tree.
+// The records in the unsorted area were inserted since the page was created.
+// Returns a negative value if there is too little history to make an estimate.
+double BtreeRootInternal::LeafPageHeat(BtreePage* page, UINT recCount)
+{
+  ULONGLONG totalInserts = m_nTotalInserts;
+  UINT treeRecords = m_nRecords;
+  if (page == nullptr || totalInserts == 0 || treeRecords == 0)
+  {
+	return -1.0;
+  }
+
+  LONGLONG psw = page->m_PageStatus.ReadLL();
+  PageStatus* pst = (PageStatus*)(&psw);
+  UINT pageInserts = pst->m_nUnsortedReserved;
+  UINT pageAge = GetTickCount() - page->m_CreateTime;
+  ULONGLONG treeAge = GetTickCount64() - m_CreateTime;
+
+  double pageRate = double(pageInserts) / max(pageAge, 1U) / max(recCount, 1U);
+  double treeRate = double(totalInserts) / max(treeAge, ULONGLONG(1)) / treeRecords;
+  return pageRate / treeRate;
+}
+
 UINT BtreeRootInternal::ComputeIndexPageSize(UINT fanout, UINT keySpace)
 {
   UINT frontSize = BtreePage::PageHeaderSize();
@@ -1688,6 +2016,85 @@ UINT BtreeRootInternal::ComputeIndexPageSize(UINT fanout, UINT keySpace)
   return pageSize;
 }
 
+// Descend through the top index levels using the shadow index. Returns the number of 
+// levels passed; curPage is then set to the page where the normal descent continues.
+// A thread rebuilds a stale shadow index each time it has found it stale RebuildThreshold times.
+// The count is kept per thread (see ContentionCounters) to keep descents free of shared writes.
+// Descents that use a valid shadow index are not counted, they are the fast path.
+UINT BtreeRootInternal::DescendShadowIndex(KeyType* searchKey, BtIterator* iter, BtreePage*& curPage)
+{
+  // Prefix comparisons are only valid for the default comparison function
+  if (m_CompareFn != DefaultCompareKeys)
+  {
+	return 0;
+  }
+
+  UINT levels = 0;
+  ShadowIndex* shadow = m_Shadow;
+  bool stale = (shadow == nullptr || shadow->Version() != m_IndexVersion);
+  if (!stale)
+  {
+	BtreePage* nextPage = nullptr;
+	levels = shadow->Descend(this, searchKey, iter, nextPage, stale);
+	if (levels > 0)
+	{
+	  curPage = nextPage;
+	}
+  }
+
+  if (stale)
+  {
+	ULONGLONG staleCount = m_Contention.Count(CC_SHADOW_STALE);
+	if (staleCount != 0 && staleCount % ShadowIndex::RebuildThreshold == 0)
+	{
+	  RebuildShadowIndex();
+	}
+  }
+  return levels;
+}
+
+// Build a new shadow index and swap it in. Only one thread rebuilds at a time;
+// other threads simply continue to use the normal descent. The rebuild runs on the 
+// reader that found the index stale, so rebuilds are at least MinRebuildIntervalMs apart.
+// This bounds the time readers spend rebuilding when index pages keep changing.
+void BtreeRootInternal::RebuildShadowIndex()
+{
+  ULONGLONG now = GetTickCount64();
+  if (now - m_ShadowBuildTime < ShadowIndex::MinRebuildIntervalMs || !m_ShadowLock.TryAcquireLock())
+  {
+	return;
+  }
+  m_ShadowBuildTime = now;
+
+  LONGLONG version = m_IndexVersion;
+  ShadowIndex* newShadow = ShadowIndex::Build(this, version);
+  ShadowIndex* oldShadow = (ShadowIndex*)(InterlockedExchange64((LONG64*)(&m_Shadow), LONG64(newShadow)));
+  if (oldShadow)
+  {
+	m_EpochMgr->Deallocate(oldShadow, MemObjectType::ShadowIndexObj);
+  }
+  if (newShadow)
+  {
+	m_nShadowRebuilds++;
+  }
+  m_ShadowLock.ReleaseLock();
+}
+
+// Retire an index page that has been replaced. The shadow index may still refer to it
+// so the index version is incremented first, which invalidates the current shadow index.
+void BtreeRootInternal::RetireIndexPage(BtreePage* page)
+{
+  InterlockedIncrement64(&m_IndexVersion);
+  m_EpochMgr->Deallocate(page, MemObjectType::IndexPage);
+}
+
+// Retire a leaf or index page that has been replaced
+void BtreeRootInternal::RetirePage(BtreePage* page)
+{
+  if (page->IsIndexPage()) RetireIndexPage(page);
+  else                     m_EpochMgr->Deallocate(page, MemObjectType::LeafPage);
+}
+
 BTRESULT BtreeRootInternal::DoMaintenance(BtreePage* leafPage, BtIterator* iter)
 {
     // Read page status again (because some other thread may have changed it)
@@ -1696,16 +2103,25 @@ BTRESULT BtreeRootInternal::DoMaintenance(BtreePage* leafPage, BtIterator* iter)
     PageStatus* pst = (PageStatus*)(&psw);
 
     BTRESULT btr = BT_NO_ACTION_TAKEN; 
+    LatencyOp op = LAT_OP_COUNT;
+    ULONGLONG start = m_Latency.Start();
+    ProfilePhase prevPhase = m_Profiler.Switch(iter->m_Profile, PH_MAINTENANCE);
     switch (pst->m_PendAction)
     {
     case PA_NONE:           break;
-    case PA_CONSOLIDATE:    btr = leafPage->ConsolidateLeafPage(iter, 0); break;
-    case PA_SPLIT_PAGE:     btr = leafPage->SplitLeafPage(iter); break;
-    case PA_MERGE_PAGE:     btr = leafPage->TryToMergePage(iter); break;
-    case PA_DELETE_PAGE:    btr = leafPage->DeleteEmptyPage(iter); break;
+    case PA_CONSOLIDATE:    btr = leafPage->ConsolidateLeafPage(iter, 0); op = LAT_CONSOLIDATE; break;
+    case PA_SPLIT_PAGE:     btr = leafPage->SplitLeafPage(iter); op = LAT_SPLIT; break;
+    case PA_MERGE_PAGE:     btr = leafPage->TryToMergePage(iter); op = LAT_MERGE; break;
+    case PA_DELETE_PAGE:    btr = leafPage->DeleteEmptyPage(iter); op = LAT_PAGE_DELETE; break;
     default:                _ASSERTE(false);
     }
 
+    // Count attempts that did the work, even if the result was not installed
+    if (btr != BT_NO_ACTION_TAKEN && op != LAT_OP_COUNT)
+    {
+        m_Latency.Record(op, start);
+    }
+    m_Profiler.Switch(iter->m_Profile, prevPhase);
     return btr;
 }
 
@@ -1714,51 +2130,69 @@ BTRESULT BtreeRootInternal::DoMaintenance(BtreePage* leafPage, BtIterator* iter)
 // Find the path down to the target leaf page and store it in iter.
 // The function does not include inactive pages in the path.
 // However, when accessing the pages later on, their status may have changed.
+// If iter already holds a path for the same key, from an earlier attempt, the
+// descent resumes from that path (see below). Call iter->Reset() for a new key.
 //
 BTRESULT BtreeRootInternal::FindTargetPage(KeyType* searchKey, BtIterator* iter)
 {
-	int attempts = 0;
 	 LONGLONG psw = 0;
 	 PageStatus* pst = (PageStatus*)(&psw);
 	 BTRESULT btr = BT_SUCCESS;
 	 iter->m_TrInfo = searchKey->m_TrInfo;
      BtreePage* curPage = nullptr;
-     BtreePage* leafPage = nullptr;
-     BtreePage* prevLeafPage = nullptr;
      int level = 0;
-     int reached = 0;
+     int resumes = 0;
 
-tryagain:
- 
-#ifdef DO_LOG
-     attempts++;
-     if ((prevLeafPage && prevLeafPage == leafPage || !leafPage) && attempts > 10)
+     if (iter->m_Count == 0)
      {
-         fprintf(logFile, " ---- Thread %d Leaf page 0X%I64X ", GetCurrentThreadId(),  ULONGLONG(leafPage));
-         PageStatus::PrintPageStatus(logFile, leafPage->m_PageStatus, false);
-         fprintf(logFile, " key=%*s", searchKey->m_KeyLen, searchKey->m_pKeyValue);
-         fprintf(logFile, "\n");
+         goto tryagain;
+     }
 
+resume:
+     // Resume the descent from the deepest index page on the path that is still active.
+     // Index pages are never modified in place, except for child pointers, and a page that is
+     // replaced is made inactive, so an active page on the path still covers the search key.
+     // The path is kept down to the first inactive page, top-down, so every page kept is still
+     // the child of the page above it. Their status is read again because installs use it as
+     // the expected value and it changes whenever a child pointer is swapped.
+     // After MaxResumeAttempts attempts, start over from the root.
+     curPage = nullptr;
+     if (resumes++ < MaxResumeAttempts)
+     {
          for (UINT i = 0; i < iter->m_Count; i++)
          {
-             iter->m_Path[i].PrintPathEntry(logFile, i+1);
-             fprintf(logFile, "\n");
+             BtreePage* page = iter->m_Path[i].m_Page;
+             psw = page->m_PageStatus.ReadLL();
+             if (!page->IsIndexPage() || PageStatus::IsPageInactive(psw))
+             {
+                 break;
+             }
+             iter->m_Path[i].m_PageStatus = (void*)(psw);
+             curPage = page;
+             level = i;
+         }
+         if (curPage)
+         {
+             iter->m_Count = level;
          }
-
-         PrintLog(logFile, 10000);
-         _exit(4);
      }
+     if (curPage)
+     {
+         goto descend;
+     }
+     m_Contention.Count(CC_RESTART_FROM_ROOT);
 
-#endif
-     prevLeafPage = leafPage;
-     leafPage = nullptr;
-
+tryagain:
      btr = BT_SUCCESS;
      iter->m_Count = 0;
     // Descend down to the correct leaf page
     curPage = (BtreePage*)(m_RootPage.ReadPP());
 	level = 0;
-    reached = 0;
+
+    // Skip the top index levels using the shadow index, if there is a valid one
+    level += DescendShadowIndex(searchKey, iter, curPage);
+
+descend:
     while (curPage && curPage->IsIndexPage())
     {
 		level++;
@@ -1766,21 +2200,27 @@ tryagain:
 		// Can't use an inactive page
 		if (PageStatus::IsPageInactive(psw))
 		{
-            reached = 1;
-		  goto tryagain;
+            m_Contention.Count(CC_RESTART_INDEX_INACTIVE);
+		  goto resume;
 		}
 
+		// Separators on an index page never change, only child pointers are swapped,
+		// so the slot found stays valid while the page is active. 
 		int slot = curPage->KeySearch(searchKey, BtreePage::GTE);
 		_ASSERTE(slot >= 0 && UINT(slot) < curPage->m_nSortedSet);
 		iter->ExtendPath(curPage, slot, psw);
 
-		// If the status of the page has changed,
-		// the iterator info may be incorrect so try again
-		if (psw != curPage->m_PageStatus.ReadLL())
+		// Record the status as of after the child pointer was read. Updates of other slots
+		// change the status but don't affect this descent. The slot followed is validated
+		// on the next level instead: swapping a child pointer makes the old child page inactive
+		// in the same MwCAS, so if the child is still active, the pointer read is still current.
+		psw = curPage->m_PageStatus.ReadLL();
+		if (PageStatus::IsPageInactive(psw))
 		{
-            reached = 2;
-		  goto tryagain;
+            m_Contention.Count(CC_RESTART_INDEX_CHANGED);
+		  goto resume;
 		}
+		iter->m_Path[iter->m_Count - 1].m_PageStatus = (void*)(psw);
        
 		// Any pending actions on this page?
 		if (pst->m_PendAction != PA_NONE)
@@ -1788,11 +2228,14 @@ tryagain:
 		  // Is it time to split this index page?
 		  if (pst->m_PendAction == PA_SPLIT_PAGE)
 		  {
-			if (curPage->SplitIndexPage(iter) == BT_SUCCESS)
+			ULONGLONG start = m_Latency.Start();
+			BTRESULT btrs = curPage->SplitIndexPage(iter);
+			if (btrs != BT_NO_ACTION_TAKEN) m_Latency.Record(LAT_SPLIT, start);
+			if (btrs == BT_SUCCESS)
 			{
 			  m_nPageSplits++;
-              reached = 3;
-			  goto tryagain;
+              m_Contention.Count(CC_RESTART_INDEX_SPLIT);
+			  goto resume;
 			}
 		  }
 
@@ -1801,42 +2244,25 @@ tryagain:
 		  if (pst->m_PendAction == PA_MERGE_PAGE && iter->m_Count > 1)
 		  {
 			// Try to merge this page with its left or right neighbour
-			if (curPage->TryToMergePage(iter) == BT_SUCCESS)
+			ULONGLONG start = m_Latency.Start();
+			BTRESULT btrm = curPage->TryToMergePage(iter);
+			if (btrm != BT_NO_ACTION_TAKEN) m_Latency.Record(LAT_MERGE, start);
+			if (btrm == BT_SUCCESS)
 			{
 			  m_nPageMerges++;
-              reached = 4;
-			  goto tryagain;
+              m_Contention.Count(CC_RESTART_INDEX_MERGE);
+			  goto resume;
 			}
 		  }
 		}
 
 		// Completed all pending actions, if any.
-		// Now move to the next index level but only if the current
-		// index page has not been modified since we entered. Another thread
-        // may have swapped the pointer but then it also modified the status of the page.
-		// (The last conditition is safe but perhaps overcautious. 
-		BtreePage* nextPage = (BtreePage*)(curPage->GetKeyPtrPair(slot)->m_Pointer.ReadPP());
-		if ( psw != curPage->m_PageStatus.ReadLL())
-		{
-            reached = 5;
-		  goto tryagain;
-		}
-		curPage = nextPage;
+		// Now move to the child read when the path was extended.
+		curPage = iter->m_Path[iter->m_Count - 1].m_NextPage;
     }
 
     if (curPage)
     {
-       leafPage = curPage;
-
-#ifdef DO_LOG
-
-       if (leafPage->m_PageSize == 0xdddd)
-       {
-           fprintf(logFile, "Thread %d, page 0X%I64X Invalid page size = 0xdddd\n", GetCurrentThreadId(), LONGLONG(leafPage));
-           PrintLog(logFile, 10000);
-           _exit(7);
-       }
-#endif
 
 	   _ASSERTE(curPage->IsLeafPage());
         psw = curPage->m_PageStatus.ReadLL();
@@ -1845,24 +2271,39 @@ tryagain:
 
 	   if (PageStatus::IsPageInactive(psw))
 	   {
-           reached = 6;
-		 goto tryagain;
+           m_Contention.Count(CC_RESTART_LEAF_INACTIVE);
+		 goto resume;
+	   }
+
+	   // Lookups keep scanning the unsorted area of the page, consolidate it first
+	   if (curPage->m_ReadScanHot)
+	   {
+		 LONGLONG newpsw = 0;
+		 if (curPage->MarkReadScanHot(psw, newpsw))
+		 {
+		   psw = newpsw;
+		   iter->m_Path[iter->m_Count - 1].m_PageStatus = (void*)(psw);
+		   m_Contention.Count(CC_RESTART_LEAF_READ_HOT);
+		 }
 	   }
 
        BTRESULT btrc = DoMaintenance(curPage, iter) ;
        if (btrc == BT_SUCCESS)
        {
-           reached = 7;
-           goto tryagain;
+           m_Contention.Count(CC_RESTART_LEAF_MAINTENANCE);
+           goto resume;
        }
 
-		// Don't trust the page if its status has changed
-		// Perhaps too cautious but better safe than sorry
-		if (psw != curPage->m_PageStatus.ReadLL())
+		// The status may have changed, for example by inserts, while maintenance was
+		// considered. Only an inactive page forces a new descent, otherwise record the
+		// current status.
+		psw = curPage->m_PageStatus.ReadLL();
+		if (PageStatus::IsPageInactive(psw))
 		{
-            reached = 8;
-		  goto tryagain;
+            m_Contention.Count(CC_RESTART_LEAF_CHANGED);
+		  goto resume;
 		}
+		iter->m_Path[iter->m_Count - 1].m_PageStatus = (void*)(psw);
     }
     else
     {
@@ -1872,19 +2313,39 @@ tryagain:
 }
 
 
-BTRESULT BtreeRootInternal::InsertRecordInternal(KeyType* key, void* recptr)
+// Insert a record. If unique is true, the record is inserted only if 
+// the tree contains no record with the same key.
+//
+BTRESULT BtreeRootInternal::InsertRecordInternal(KeyType* key, void* recptr, bool unique)
 {
     LONGLONG epochId = 0;
+    BtIterator iter(this);
+    iter.m_Profile = m_Profiler.Begin(PROF_INSERT, PH_ENTER_EPOCH);
     m_EpochMgr->EnterEpoch(&epochId);
+    m_Profiler.Switch(iter.m_Profile, PH_OTHER);
 
+    BTRESULT btr = DoInsertRecord(key, recptr, unique, &iter);
 
+    m_Profiler.Switch(iter.m_Profile, PH_EXIT_EPOCH);
+    m_EpochMgr->ExitEpoch(epochId);
+    m_Profiler.End(iter.m_Profile);
+    return btr;
+}
+
+// Body of InsertRecordInternal. The caller must be in an epoch.
+BTRESULT BtreeRootInternal::DoInsertRecord(KeyType* key, void* recptr, bool unique, BtIterator* iter)
+{
      BTRESULT btr = BT_SUCCESS;
-     BtIterator  iter(this);
+     iter->Reset(this);
      BtreePage* rootbase = nullptr;
+     BtreePage* leafPage = nullptr;
+     TraceEvent* ev = nullptr;
+     ULONGLONG start = m_Latency.Start();
 
+     // On a retry the path from the previous attempt is kept so that
+     // FindTargetPage can resume from it instead of descending from the root
  tryagain: 
      btr = BT_SUCCESS;
-     iter.Reset(this);
  
     rootbase = (BtreePage*)(m_RootPage.ReadPP());
 
@@ -1912,31 +2373,40 @@ BTRESULT BtreeRootInternal::InsertRecordInternal(KeyType* key, void* recptr)
 
 
     // Locate the target leaf page for the insertion
-    btr = FindTargetPage(key, &iter);
-    BtreePage* leafPage = (BtreePage*)(iter.m_Path[iter.m_Count-1].m_Page);
+    m_Profiler.Switch(iter->m_Profile, PH_FIND_TARGET);
+    btr = FindTargetPage(key, iter);
+    leafPage = (BtreePage*)(iter->m_Path[iter->m_Count-1].m_Page);
     _ASSERTE(leafPage && btr == BT_SUCCESS);
 
-#ifdef DO_LOG
-	PathEntry* ipe = (iter.m_Count > 1) ? &iter.m_Path[iter.m_Count - 2]: nullptr;
-	InsertInfo::RecInsert('B', key->m_pKeyValue, key->m_KeyLen, leafPage, leafPage->m_PageStatus, ipe);
-#endif
-
-     btr = leafPage->AddRecordToPage(key, recptr);
+     m_Profiler.Switch(iter->m_Profile, PH_UPDATE_PAGE);
+     btr = leafPage->AddRecordToPage(key, recptr, unique);
+     m_Profiler.Switch(iter->m_Profile, PH_OTHER);
+     ev = m_Tracer.NewEvent(TE_INSERT, btr);
+     if (ev)
+     {
+         iter->TraceLeafPath(ev);
+         ev->SetKey(key->m_pKeyValue, key->m_KeyLen);
+     }
 	 if (btr == BT_SUCCESS) 
      {
-#ifdef DO_LOG
-	   InsertInfo::RecInsert('E', key->m_pKeyValue, key->m_KeyLen, leafPage, leafPage->m_PageStatus, ipe);
-#endif
          m_nRecords++;
 		 m_nInserts++;
+		 m_nTotalInserts++;
+		 m_nTotalKeyBytes += key->m_KeyLen;
          goto exit; 
      }
 
 	if (btr == BT_NOT_INSERTED)
 	{
+	  m_Contention.Count(CC_RETRY_INSERT_NOT_INSERTED);
 	  goto tryagain;
 	}
 
+	if (btr == BT_DUPLICATE_KEY)
+	{
+	  goto exit;
+	}
+
     if (btr == BT_PAGE_FULL)
     {
         // Page is full so either enlarge and consolidate it or split it
@@ -1949,8 +2419,9 @@ BTRESULT BtreeRootInternal::InsertRecordInternal(KeyType* key, void* recptr)
         UINT recCount = 0, keySpace = 0;
         leafPage->LiveRecordSpace(recCount, keySpace);
 
+        // The consolidated page must also fit within the page size limit
         UINT newSize = (recCount + 1) * sizeof(KeyPtrPair) + keySpace + key->m_KeyLen;
-        if (newSize < m_MaxPageSize)
+        if (newSize < m_PageSizePolicy.m_MaxPageSize && BtreePage::PageHeaderSize() + newSize <= BtreePage::PageSizeLimit)
         {
             newpst->m_PendAction = PA_CONSOLIDATE;
         }
@@ -1962,61 +2433,71 @@ BTRESULT BtreeRootInternal::InsertRecordInternal(KeyType* key, void* recptr)
         if (rv == psw)
         {
             // Must update the status of the page in the iterator as well.
-            iter.m_Path[iter.m_Count - 1].m_PageStatus = (void*)(newpsw);
-            BTRESULT btrc = DoMaintenance(leafPage, &iter);
+            iter->m_Path[iter->m_Count - 1].m_PageStatus = (void*)(newpsw);
+            BTRESULT btrc = DoMaintenance(leafPage, iter);
  
         }
+        m_Contention.Count(CC_RETRY_INSERT_PAGE_FULL);
         goto tryagain; 
     }
     // Should never get here
     _ASSERTE(false);
  
   exit:
-
-    m_EpochMgr->ExitEpoch(epochId);
+    m_Latency.Record(LAT_INSERT, start);
     return btr;
 }
 
 BTRESULT BtreeRootInternal::DeleteRecordInternal(KeyType* key)
 {
     LONGLONG epochId = 0;
+    BtIterator iter(this);
+    iter.m_Profile = m_Profiler.Begin(PROF_DELETE, PH_ENTER_EPOCH);
     m_EpochMgr->EnterEpoch(&epochId);
+    m_Profiler.Switch(iter.m_Profile, PH_OTHER);
+
+    BTRESULT btr = DoDeleteRecord(key, &iter);
 
+    m_Profiler.Switch(iter.m_Profile, PH_EXIT_EPOCH);
+    m_EpochMgr->ExitEpoch(epochId);
+    m_Profiler.End(iter.m_Profile);
+    return btr;
+}
+
+// Body of DeleteRecordInternal. The caller must be in an epoch.
+BTRESULT BtreeRootInternal::DoDeleteRecord(KeyType* key, BtIterator* iter)
+{
     BTRESULT btr = BT_SUCCESS;
-    BtIterator  iter(this);
-    LONG retries = 0;
+    iter->Reset(this);
+    TraceEvent* ev = nullptr;
+    ULONGLONG start = m_Latency.Start();
 
+    // On a retry the path from the previous attempt is kept (see FindTargetPage)
 tryagain:
-    iter.Reset(this);
     btr = BT_SUCCESS;
-    retries++;
-#ifdef DO_LOG
-    if (retries > 5)
-    {
-        fprintf(logFile, "Thread %d, too many delete record attempts, key=%*s\n", GetCurrentThreadId(), key->m_KeyLen, key->m_pKeyValue);
-        PrintLog(logFile, 10000);
-     }
-#endif
 
     // Locate the target leaf page 
-    btr = FindTargetPage(key, &iter);
-    BtreePage* leafPage = (BtreePage*)(iter.m_Path[iter.m_Count - 1].m_Page);
+    m_Profiler.Switch(iter->m_Profile, PH_FIND_TARGET);
+    btr = FindTargetPage(key, iter);
+    BtreePage* leafPage = (BtreePage*)(iter->m_Path[iter->m_Count - 1].m_Page);
     _ASSERTE(leafPage && btr == BT_SUCCESS);
-#ifdef DO_LOG
-    PathEntry* ipe = (iter.m_Count > 1) ? &iter.m_Path[iter.m_Count - 2] : nullptr;
-    DeleteInfo::RecDelete('B', key->m_pKeyValue, key->m_KeyLen, leafPage, leafPage->m_PageStatus, ipe, BT_SUCCESS);
-#endif
 
     // and delete the target record from the leaf page
+    m_Profiler.Switch(iter->m_Profile, PH_UPDATE_PAGE);
     btr = leafPage->DeleteRecordFromPage(key);
-#ifdef DO_LOG
-    DeleteInfo::RecDelete('E', key->m_pKeyValue, key->m_KeyLen, leafPage, leafPage->m_PageStatus, ipe, btr);
-#endif
+    m_Profiler.Switch(iter->m_Profile, PH_OTHER);
+    ev = m_Tracer.NewEvent(TE_DELETE, btr);
+    if (ev)
+    {
+        iter->TraceLeafPath(ev);
+        ev->SetKey(key->m_pKeyValue, key->m_KeyLen);
+    }
  
     // If some other thread managed to squeeze in and modify the page
     // and coused our delete to fail we can try again
     if (btr == BT_PAGE_INACTIVE || btr == BT_INSTALL_FAILED)
     {
+        m_Contention.Count(CC_RETRY_DELETE);
         goto tryagain;
     }
 
@@ -2024,56 +2505,352 @@ tryagain:
     {
         m_nRecords--;
         m_nDeletes++;
+        CheckPageAfterDelete(leafPage, iter);
+    }
+    else
+    {
+        _ASSERTE(btr == BT_KEY_NOT_FOUND);
+    }
+    m_Latency.Record(LAT_DELETE, start);
+    return btr;
+}
 
-         // Check whether we need to consolidate, merge, or delete the page
-        LONGLONG    psw = leafPage->m_PageStatus.ReadLL();
-        PageStatus* pst = (PageStatus*)(&psw); 
-        LONGLONG newpsw = psw;
-        PageStatus* newpst = (PageStatus*)(&newpsw);
+// Check whether a leaf page needs to be consolidated, merged, or deleted after records 
+// were deleted from it. If so, set the pending action and try to do it. 
+// iter must hold the path to the page.
+//
+void BtreeRootInternal::CheckPageAfterDelete(BtreePage* leafPage, BtIterator* iter)
+{
+    LONGLONG    psw = leafPage->m_PageStatus.ReadLL();
+    PageStatus* pst = (PageStatus*)(&psw); 
+    LONGLONG newpsw = psw;
+    PageStatus* newpst = (PageStatus*)(&newpsw);
+
+    UINT liveRecords = 0;
+    UINT keySpace    = 0;
+    if (pst->m_PageState == PAGE_NORMAL && (pst->m_PendAction == PA_NONE || pst->m_PendAction == PA_MERGE_PAGE))
+    {
+        leafPage->LiveRecordSpace(liveRecords, keySpace);
+        UINT netPageSize = leafPage->NetPageSize();
+        UINT wastedSpace = leafPage->m_WastedSpace;
+
+        // A leaf page that is the root has no parent and no siblings so it can
+        // only be consolidated. Deleting or merging it would never succeed and
+        // the pending action would block inserts into the page.
+        bool isRoot = (iter->m_Count == 1);
 
-        UINT liveRecords = 0;
-        UINT keySpace    = 0;
-        if (pst->m_PageState == PAGE_NORMAL && (pst->m_PendAction == PA_NONE || pst->m_PendAction == PA_MERGE_PAGE))
+        if (liveRecords == 0 && !isRoot)
+        {
+            newpst->m_PendAction = PA_DELETE_PAGE;
+        }
+        else
+        if (leafPage->m_PageSize > m_PageSizePolicy.m_MinPageSize && leafPage->m_WastedSpace > leafPage->NetPageSize()*m_PageSizePolicy.m_FreeSpaceFraction)
         {
-            leafPage->LiveRecordSpace(liveRecords, keySpace);
-            UINT netPageSize = leafPage->NetPageSize();
-            UINT wastedSpace = leafPage->m_WastedSpace;
+            newpst->m_PendAction = PA_CONSOLIDATE;
+        }
+        else
+        if (!isRoot && leafPage->m_PageSize - leafPage->FreeSpace() < m_PageSizePolicy.m_MinPageSize)
+        {
+            newpst->m_PendAction = PA_MERGE_PAGE;
+        }
 
-            if (liveRecords == 0)
-            {
-                newpst->m_PendAction = PA_DELETE_PAGE;
-            }
-            else
-            if (leafPage->m_PageSize > m_MinPageSize && leafPage->m_WastedSpace > leafPage->NetPageSize()*m_FreeSpaceFraction)
-            {
-                newpst->m_PendAction = PA_CONSOLIDATE;
-            }
-            else
-            if (leafPage->m_PageSize - leafPage->FreeSpace() < m_MinPageSize)
+        // Anything we need to do?
+        if (newpst->m_PendAction != PA_NONE)
+        {
+            // Update page status to signal that the page requires maintenance
+            // and then try to do it. Will be done by this thread or some other thread accessing th page.
+            LONG64	rv = InterlockedCompareExchange64((LONGLONG*)(&leafPage->m_PageStatus), newpsw, psw);
+            if (rv == psw)
             {
-                newpst->m_PendAction = PA_MERGE_PAGE;
+                // Must update the status stored by the iterator to reflect the change in pending action
+                iter->m_Path[iter->m_Count - 1].m_PageStatus = (void*)(newpsw);
+                BTRESULT btrc = DoMaintenance(leafPage, iter);
             }
+        }
+    }
+}
+
+
+// Replace the record pointer of an existing record. The old record pointer is returned in oldRec.
+// The update is done in place on the leaf page: no key is copied and no slot is consumed.
+// If expectedRec is not null, the pointer is replaced only if it equals expectedRec.
+//
+BTRESULT BtreeRootInternal::UpdateRecordInternal(KeyType* key, void* expectedRec, void* newRec, void*& oldRec)
+{
+    LONGLONG epochId = 0;
+    BtIterator iter(this);
+    iter.m_Profile = m_Profiler.Begin(PROF_UPDATE, PH_ENTER_EPOCH);
+    m_EpochMgr->EnterEpoch(&epochId);
+    m_Profiler.Switch(iter.m_Profile, PH_OTHER);
+
+    BTRESULT btr = DoUpdateRecord(key, expectedRec, newRec, oldRec, &iter);
+
+    m_Profiler.Switch(iter.m_Profile, PH_EXIT_EPOCH);
+    m_EpochMgr->ExitEpoch(epochId);
+    m_Profiler.End(iter.m_Profile);
+    return btr;
+}
+
+// Body of UpdateRecordInternal. The caller must be in an epoch.
+BTRESULT BtreeRootInternal::DoUpdateRecord(KeyType* key, void* expectedRec, void* newRec, void*& oldRec, BtIterator* iter)
+{
+    BTRESULT btr = BT_SUCCESS;
+    iter->Reset(this);
+    BtreePage* leafPage = nullptr;
+    oldRec = nullptr;
+    ULONGLONG start = m_Latency.Start();
+
+    // On a retry the path from the previous attempt is kept (see FindTargetPage)
+tryagain:
+    btr = BT_SUCCESS;
+
+    // Locate the target leaf page 
+    m_Profiler.Switch(iter->m_Profile, PH_FIND_TARGET);
+    btr = FindTargetPage(key, iter);
+    m_Profiler.Switch(iter->m_Profile, PH_OTHER);
+    if (btr != BT_SUCCESS)
+    {
+        goto exit;
+    }
+    leafPage = (BtreePage*)(iter->m_Path[iter->m_Count - 1].m_Page);
+    _ASSERTE(leafPage);
+
+    // and swap the record pointer on the leaf page
+    m_Profiler.Switch(iter->m_Profile, PH_UPDATE_PAGE);
+    btr = leafPage->UpdateRecordOnPage(key, expectedRec, newRec, oldRec);
+    m_Profiler.Switch(iter->m_Profile, PH_OTHER);
+
+    // Page became inactive, has pending maintenance or was modified by another thread 
+    if (btr == BT_NOT_INSERTED || btr == BT_INSTALL_FAILED)
+    {
+        m_Contention.Count(CC_RETRY_UPDATE);
+        goto tryagain;
+    }
+
+    if (btr == BT_SUCCESS)
+    {
+        m_nUpdates++;
+    }
+    else
+    {
+        _ASSERTE(btr == BT_KEY_NOT_FOUND || btr == BT_RECORD_CHANGED);
+    }
+
+exit:
+    m_Latency.Record(LAT_UPDATE, start);
+    return btr;
+}
+
+// Update the record with the given key if it exists, otherwise insert a new record.
+// If another thread inserts the key between the update attempt and the insert, try the update again.
+// Returns BT_INSTALL_FAILED if the key keeps changing and MaxUpsertAttempts rounds all fail.
+//
+BTRESULT BtreeRootInternal::UpsertRecordInternal(KeyType* key, void* recptr)
+{
+    LONGLONG epochId = 0;
+    BtIterator iter(this);
+    iter.m_Profile = m_Profiler.Begin(PROF_UPDATE, PH_ENTER_EPOCH);
+    m_EpochMgr->EnterEpoch(&epochId);
+    m_Profiler.Switch(iter.m_Profile, PH_OTHER);
+
+    BTRESULT btr = DoUpsertRecord(key, recptr, &iter);
+
+    m_Profiler.Switch(iter.m_Profile, PH_EXIT_EPOCH);
+    m_EpochMgr->ExitEpoch(epochId);
+    m_Profiler.End(iter.m_Profile);
+    return btr;
+}
+
+// Body of UpsertRecordInternal. The caller must be in an epoch.
+BTRESULT BtreeRootInternal::DoUpsertRecord(KeyType* key, void* recptr, BtIterator* iter)
+{
+    void* oldRec = nullptr;
+    BTRESULT btr = BT_SUCCESS;
+
+    // Update and insert find the live record the same way, so the insert only fails
+    // if another thread inserted the key in between. If that keeps happening, give up.
+    for (int attempt = 0; attempt < MaxUpsertAttempts; attempt++)
+    {
+        btr = DoUpdateRecord(key, nullptr, recptr, oldRec, iter);
+        if (btr == BT_KEY_NOT_FOUND)
+        {
+            btr = DoInsertRecord(key, recptr, true, iter);
+        }
+        if (btr != BT_DUPLICATE_KEY)
+        {
+            return btr;
+        }
+        m_Contention.Count(CC_RETRY_UPDATE);
+    }
+
+    return BT_INSTALL_FAILED;
+}
+
+
+// Atomically replace the record pointers of several existing records, possibly on different leaf pages.
+// The record pointers and the status words of their leaf pages are all included in a single MwCAS 
+// so either all records are updated or none. A null m_NewRec deletes the record.
+// The descriptor holds at most MaxWordsPerDescriptor words, each record needs one word for its 
+// pointer and one for the status of its leaf page unless the page is shared with another record.
+// The operation is retried if any of the pages is changed by another thread.
+// Returns BT_SUCCESS, BT_INVALID_ARG if the records do not fit in one descriptor or a key is repeated,
+// BT_KEY_NOT_FOUND if any of the keys is missing, and BT_RECORD_CHANGED if any record differs 
+// from its m_ExpectedRec. The current record pointers are returned in m_OldRec.
+//
+BTRESULT BtreeRootInternal::MultiUpdateInternal(MultiUpdateEntry* entries, UINT count)
+{
+    struct UpdateTarget
+    {
+        BtreePage*  m_Page;
+        LONGLONG    m_Psw;
+        KeyPtrPair* m_Kpp;
+        LONGLONG    m_RecPtr;
+    };
+
+    UpdateTarget targets[MaxWordsPerDescriptor];
+    BtreePage*  pages[MaxWordsPerDescriptor];
+    LONGLONG    pagePsw[MaxWordsPerDescriptor];
+    LONGLONG    newPagePsw[MaxWordsPerDescriptor];
+    UINT        nrPages = 0;
+    BtIterator  iter(this);
+    BTRESULT    btr = BT_SUCCESS;
+    MwCASDescriptor* desc = nullptr;
+
+    if (count == 0 || count >= MaxWordsPerDescriptor)
+    {
+        return BT_INVALID_ARG;
+    }
+
+    LONGLONG epochId = 0;
+    m_EpochMgr->EnterEpoch(&epochId);
+
+tryagain:
+    nrPages = 0;
+    for (UINT i = 0; i < count; i++)
+    {
+        entries[i].m_OldRec = nullptr;
+
+        // Locate the target leaf page 
+        iter.Reset(this);
+        btr = FindTargetPage(entries[i].m_Key, &iter);
+        if (btr != BT_SUCCESS)
+        {
+            goto exit;
+        }
+        BtreePage* leafPage = (BtreePage*)(iter.m_Path[iter.m_Count - 1].m_Page);
+        UpdateTarget* trgt = &targets[i];
+        trgt->m_Page = leafPage;
+        btr = leafPage->LocateRecordForUpdate(entries[i].m_Key, entries[i].m_ExpectedRec, trgt->m_Psw, trgt->m_Kpp, trgt->m_RecPtr);
+        if (btr == BT_NOT_INSERTED || btr == BT_INSTALL_FAILED)
+        {
+            m_Contention.Count(CC_RETRY_UPDATE);
+            goto tryagain;
+        }
+        if (btr == BT_RECORD_CHANGED)
+        {
+            entries[i].m_OldRec = (void*)(trgt->m_RecPtr);
+        }
+        if (btr != BT_SUCCESS)
+        {
+            goto exit;
+        }
 
-            // Anything we need to do?
-            if (newpst->m_PendAction != PA_NONE)
+        // Records on the same page must have been located under the same page status
+        UINT p = 0;
+        for (p = 0; p < nrPages && pages[p] != leafPage; p++);
+        if (p == nrPages)
+        {
+            pages[nrPages] = leafPage;
+            pagePsw[nrPages] = newPagePsw[nrPages] = trgt->m_Psw;
+            nrPages++;
+        }
+        else
+        if (pagePsw[p] != trgt->m_Psw)
+        {
+            m_Contention.Count(CC_RETRY_UPDATE);
+            goto tryagain;
+        }
+        if (entries[i].m_NewRec == nullptr)
+        {
+            newPagePsw[p] = PageStatus::IncrClearedSlots(newPagePsw[p]);
+        }
+
+        // The same record cannot be updated twice
+        for (UINT j = 0; j < i; j++)
+        {
+            if (targets[j].m_Kpp == trgt->m_Kpp)
             {
-                // Update page status to signal that the page requires maintenance
-                // and then try to do it. Will be done by this thread or some other thread accessing th page.
-                LONG64	rv = InterlockedCompareExchange64((LONGLONG*)(&leafPage->m_PageStatus), newpsw, psw);
-                if (rv == psw)
-                {
-                    // Must update the status stored by the iterator to reflect the change in pending action
-                    iter.m_Path[iter.m_Count - 1].m_PageStatus = (void*)(newpsw);
-                    BTRESULT btrc = DoMaintenance(leafPage, &iter);
-                }
+                btr = BT_INVALID_ARG;
+                goto exit;
             }
         }
     }
-    else
+
+    if (count + nrPages > MaxWordsPerDescriptor)
     {
-        _ASSERTE(btr == BT_KEY_NOT_FOUND);
+        btr = BT_INVALID_ARG;
+        goto exit;
     }
 
+    // Swap all record pointers and verify or update the status of their pages in one MwCAS 
+    desc = AllocateMwCASDescriptor(DescriptorFlagPos);
+    if (!desc)
+    {
+        // Descriptor pool exhausted, back off and try again
+        YieldProcessor();
+        m_Contention.Count(CC_RETRY_UPDATE);
+        goto tryagain;
+    }
+    for (UINT i = 0; i < count; i++)
+    {
+        desc->AddEntryToDescriptor((LONGLONG*)(&targets[i].m_Kpp->m_Pointer), targets[i].m_RecPtr, LONGLONG(entries[i].m_NewRec));
+    }
+    for (UINT p = 0; p < nrPages; p++)
+    {
+        desc->AddEntryToDescriptor((LONGLONG*)(&pages[p]->m_PageStatus), pagePsw[p], newPagePsw[p]);
+    }
+    desc->CloseDescriptor();
+
+    if (!desc->MwCAS(0))
+    {
+        m_Contention.Count(CC_RETRY_UPDATE);
+        goto tryagain;
+    }
+
+    for (UINT i = 0; i < count; i++)
+    {
+        entries[i].m_OldRec = (void*)(targets[i].m_RecPtr);
+        if (entries[i].m_NewRec == nullptr)
+        {
+            targets[i].m_Page->m_WastedSpace += sizeof(KeyPtrPair) + targets[i].m_Kpp->m_KeyLen;
+            m_nRecords--;
+            m_nDeletes++;
+        }
+        else
+        {
+            m_nUpdates++;
+        }
+    }
+
+    // Pages that records were deleted from may need maintenance, as after DeleteRecord.
+    // The paths were not kept so find each page again, once per page.
+    for (UINT i = 0; i < count; i++)
+    {
+        if (entries[i].m_NewRec != nullptr) continue;
+
+        UINT j = 0;
+        for (j = 0; j < i && !(entries[j].m_NewRec == nullptr && targets[j].m_Page == targets[i].m_Page); j++);
+        if (j < i) continue;
+
+        iter.Reset(this);
+        if (FindTargetPage(entries[i].m_Key, &iter) == BT_SUCCESS && iter.m_Path[iter.m_Count - 1].m_Page == targets[i].m_Page)
+        {
+            CheckPageAfterDelete(targets[i].m_Page, &iter);
+        }
+    }
+    btr = BT_SUCCESS;
+
+exit:
     m_EpochMgr->ExitEpoch(epochId);
     return btr;
 }
@@ -2081,25 +2858,47 @@ tryagain:
 
 BTRESULT BtreeRootInternal::LookupRecordInternal(KeyType* key, void*& recFound)
 {
-    BTRESULT btr = BT_SUCCESS;
-    BtIterator iter(this);
-    recFound = nullptr;
-
     LONGLONG epochId = 0;
+    BtIterator iter(this);
+    iter.m_Profile = m_Profiler.Begin(PROF_LOOKUP, PH_ENTER_EPOCH);
     m_EpochMgr->EnterEpoch(&epochId);
+    m_Profiler.Switch(iter.m_Profile, PH_OTHER);
 
-tryagain:
+    BTRESULT btr = DoLookupRecord(key, recFound, &iter);
+
+    m_Profiler.Switch(iter.m_Profile, PH_EXIT_EPOCH);
+    m_EpochMgr->ExitEpoch(epochId);
+    m_Profiler.End(iter.m_Profile);
+    return btr;
+}
+
+// Body of LookupRecordInternal. The caller must be in an epoch.
+BTRESULT BtreeRootInternal::DoLookupRecord(KeyType* key, void*& recFound, BtIterator* iter)
+{
+    BTRESULT btr = BT_SUCCESS;
+    iter->Reset(this);
+    recFound = nullptr;
+    BtreePage* leafPage = nullptr;
+    KeyPtrPair* kpp = nullptr;
+    int pos = -1;
+    bool ambiguous = false;
+    LONGLONG psw = 0;
+    PageStatus* pst = (PageStatus*)(&psw);
+    ULONGLONG start = m_Latency.Start();
 
-    iter.Reset(this);
+    // On a retry the path from the previous attempt is kept (see FindTargetPage)
+tryagain:
     btr = BT_SUCCESS;
 
     // Locate the target leaf page
-    btr = FindTargetPage(key, &iter);
+    m_Profiler.Switch(iter->m_Profile, PH_FIND_TARGET);
+    btr = FindTargetPage(key, iter);
+    m_Profiler.Switch(iter->m_Profile, PH_OTHER);
     if (btr != BT_SUCCESS)
     {
         goto exit;
     }
-    BtreePage* leafPage = (BtreePage*)(iter.m_Path[iter.m_Count - 1].m_Page);
+    leafPage = (BtreePage*)(iter->m_Path[iter->m_Count - 1].m_Page);
     _ASSERTE(leafPage);
     if (!leafPage)
     {
@@ -2107,28 +2906,46 @@ tryagain:
         goto exit;
     }
 
-    // Found the target leaf page, now look for the record
-    int pos = leafPage->KeySearch(key, BtreePage::EQ);
+    // Found the target leaf page, now look for a live record. Earlier copies of
+    // the key may have been deleted.
+	psw = leafPage->m_PageStatus.ReadLL();
+    m_Profiler.Switch(iter->m_Profile, PH_KEY_SEARCH);
+    pos = leafPage->FindLiveSlot(key, psw, ambiguous);
+    m_Profiler.Switch(iter->m_Profile, PH_OTHER);
+
+    // Charge the page for the unsorted area, unless the record was found in the sorted area
+    if (pos < 0 || UINT(pos) >= leafPage->m_nSortedSet)
+    {
+        leafPage->ChargeReadScan(psw);
+    }
+
     if (pos < 0)
     {
         btr = BT_KEY_NOT_FOUND;
         goto exit;
     }
 
-    KeyPtrPair* kpp = leafPage->GetKeyPtrPair(pos);
+    kpp = leafPage->GetKeyPtrPair(pos);
     _ASSERTE(kpp);
     recFound = kpp->m_Pointer.Read();
 
-	LONGLONG psw = leafPage->m_PageStatus.ReadLL();
-	PageStatus* pst = (PageStatus*)(&psw);
+	psw = leafPage->m_PageStatus.ReadLL();
 
     if (pst->m_PageState == PAGE_INACTIVE)
     {
+        m_Contention.Count(CC_RETRY_LOOKUP);
         goto tryagain;
     }
 
+    // Deleted after we located it
+    if (KeyPtrPair::IsNullPointer(LONGLONG(recFound)))
+    {
+        recFound = nullptr;
+        btr = BT_KEY_NOT_FOUND;
+    }
+
 exit:
-    m_EpochMgr->ExitEpoch(epochId);
+    m_Latency.Record(LAT_LOOKUP, start);
     return btr;
 }
 
@@ -2239,6 +3056,13 @@ void BtreeRootInternal::ComputeTreeStats(BtreeStatistics* statsp)
   }
 }
 
+// Space and record counts of the pages currently in the tree
+void BtreeRootInternal::GetTreeStats(BtreeStatistics* stats)
+{
+  stats->Clear();
+  ComputeTreeStats(stats);
+}
+
 void BtreeRootInternal::PrintTreeStats(FILE* file)
 {
   BtreeStatistics stats;
@@ -2248,25 +3072,78 @@ void BtreeRootInternal::PrintTreeStats(FILE* file)
   fprintf(file, "\n=========== B-tree statistics ===============\n");
   fprintf(file, "Size: %d records, %d leaf pages, %d index pages\n",
 				UINT(m_nRecords), UINT(m_nLeafPages), UINT(m_nIndexPages));
-  fprintf(file, "Operations: %d inserts, %d deletes\n", UINT(m_nInserts), UINT(m_nDeletes));
+  fprintf(file, "Operations: %d inserts, %d deletes, %d updates\n", UINT(m_nInserts), UINT(m_nDeletes), UINT(m_nUpdates));
   fprintf(file, "Page ops: %d consolidations, %d splits, %d merges, %d deletes\n", 
                  UINT(m_nConsolidations), UINT(m_nPageSplits), UINT(m_nPageMerges), UINT(m_nPageDeletes));
+  fprintf(file, "Shadow index: %d rebuilds\n", UINT(m_nShadowRebuilds));
 
   fprintf(file, "Index pages\n");
   fprintf(file, "   Space: %d alloced, %d pages\n", stats.m_AllocedSpaceIP, stats.m_SpaceIP );
   fprintf(file, "   Space usage: %d headers, %d rec arrays, %d keys\n", stats.m_HeaderSpaceIP, stats.m_RecArrSpaceIP, stats.m_KeySpaceIP);
 
   fprintf(file, "Leaf pages\n");
-  fprintf(file, "   %d live records\n", stats.m_Records);
+  fprintf(file, "   %d live records, %d unsorted slots\n", stats.m_Records, stats.m_UnsortedLP);
   fprintf(file, "   Space: %d alloced, %d pages\n", stats.m_AllocedSpaceLP, stats.m_SpaceLP);
   fprintf(file, "   Space usage: %d headers, %d rec arrays, %d keys, %d free, %d deleted\n", 
 	                stats.m_HeaderSpaceLP, stats.m_RecArrSpaceLP, stats.m_KeySpaceLP,
 	                stats.m_FreeSpaceLP, stats.m_DeletedSpaceLP);
 
+  EpochLimboStats limbo;
+  m_EpochMgr->GetLimboStats(&limbo);
+  fprintf(file, "Epochs: current %lld, oldest age %lld ms\n", limbo.m_nCurrentEpoch, limbo.m_OldestEpochAgeMs);
+  fprintf(file, "   Limbo: %lld bytes, %lld items (%lld ready), %lld escalated drains, %lld throttled writers\n",
+	                limbo.m_nLimboBytes, limbo.m_nLimboItems, limbo.m_nCentralQueueItems,
+	                limbo.m_nAggressiveDrains, limbo.m_nThrottledWriters);
+
+  if (LatencyRecorder::IsEnabled())
+  {
+	fprintf(file, "Latency (ns)       count     mean      p50      p99    p99.9      max\n");
+	for (UINT op = 0; op < LAT_OP_COUNT; op++)
+	{
+	  LatencySummary lat;
+	  m_Latency.GetSummary(LatencyOp(op), &lat);
+	  if (lat.m_Count == 0) continue;
+	  fprintf(file, "   %-12s %8llu %8.0f %8llu %8llu %8llu %8llu\n", LatencyOpName[op],
+	                  lat.m_Count, lat.m_Mean, lat.m_P50, lat.m_P99, lat.m_P999, lat.m_Max);
+	}
+  }
+
+  ContentionStats cs;
+  m_Contention.GetStats(&cs);
+  fprintf(file, "Contention: %llu MwCAS ops (%llu failed), %llu helped (%llu already done)\n",
+	              cs.m_MwCasOps, cs.m_MwCasFailed, cs.m_MwCasHelps, cs.m_MwCasHelpsBailed);
+  for (UINT c = 0; c < CC_COUNT; c++)
+  {
+	if (cs.m_Counts[c] == 0) continue;
+	fprintf(file, "   %-28s %10llu\n", ContentionCounterName[c], cs.m_Counts[c]);
+  }
+
+  if (m_Profiler.IsEnabled())
+  {
+	fprintf(file, "Phases (ns)    samples    total");
+	for (UINT p = 0; p < PH_COUNT; p++)
+	{
+	  fprintf(file, " %12s", ProfilePhaseName[p]);
+	}
+	fprintf(file, "\n");
+	for (UINT op = 0; op < PROF_OP_COUNT; op++)
+	{
+	  PhaseProfile prof;
+	  m_Profiler.GetProfile(ProfileOp(op), &prof);
+	  if (prof.m_Samples == 0) continue;
+	  fprintf(file, "   %-8s %10llu %8.0f", ProfileOpName[op], prof.m_Samples, prof.m_Total);
+	  for (UINT p = 0; p < PH_COUNT; p++)
+	  {
+		fprintf(file, " %12.0f", prof.m_Phases[p]);
+	  }
+	  fprintf(file, "\n");
+	}
+  }
+
   fprintf(file, "=============================================\n");
 }
 
-void BtreeRootInternal::CheckTree(FILE* file)
+UINT BtreeRootInternal::CheckTree(FILE* file)
 {
     //fprintf(file, " ====== Checking tree =======\n");
     KeyType lowbound;
@@ -2286,27 +3163,81 @@ void BtreeRootInternal::CheckTree(FILE* file)
     {
         fprintf(file, " ==== Tree check found %d errors ======\n", errorCount);
     }
+    return errorCount;
 }
 
 
-BTRESULT BtreePage::AddRecordToPage(KeyType* key, void* recptr)
+// Add a record to the unsorted area of the page. If unique is true, the record is added
+// only if the page contains no live record with the same key. The check and the slot 
+// reservation are both done against the same page status, so no record with the same key 
+// can be added by another thread in between.
+//
+BTRESULT BtreePage::AddRecordToPage(KeyType* key, void* recptr, bool unique)
 {
   LONGLONG psw = 0;
   PageStatus* pst = (PageStatus*)(&psw);
+  LONGLONG newpsw = 0;
+  PageStatus* newpst = (PageStatus*)(&newpsw);
+  LONG64 oldval = 0;
+  char* keyBuffer = nullptr;
+  UINT32 slotIndx = 0;
+  KeyPtrPair* pentry = nullptr;
+  ULONGLONG resVal = 0;
   BTRESULT btr = BT_SUCCESS;
+  UINT insertWaits = 0;
 
 
 tryagain:
   btr = BT_SUCCESS;
   psw = m_PageStatus.ReadLL();
 
+  // A pending merge is cancelled, as for updates (see LocateRecordForUpdate). The merge may
+  // not be possible, for example while another insert into the page is in progress, and
+  // inserts must not wait for it.
+  if (pst->m_PageState == PAGE_NORMAL && pst->m_PendAction == PA_MERGE_PAGE)
+  {
+	newpsw = psw;
+	newpst->m_PendAction = PA_NONE;
+	InterlockedCompareExchange64((LONG64*)(&m_PageStatus), newpsw, psw);
+	goto tryagain;
+  }
+
   // Page has to be in normal state with no pending actions
   if (!(pst->m_PageState == PAGE_NORMAL && pst->m_PendAction == PA_NONE))
   {
+	m_Btree->m_Contention.Count(CC_ADD_PAGE_BUSY);
 	btr = BT_NOT_INSERTED;
 	goto exit;
   }
 
+ // Check for duplicates before checking free space so that a duplicate doesn't trigger maintenance 
+  if (unique)
+  {
+	btr = FindLiveRecord(key, psw);
+	if (btr == BT_NOT_INSERTED)
+	{
+	  // Another insert into this page has not completed yet
+	  m_Btree->m_Contention.Count(CC_ADD_WAIT_FOR_INSERT);
+	  if (++insertWaits < MaxInsertWaits)
+	  {
+		YieldProcessor();
+		goto tryagain;
+	  }
+
+	  // The inserter may have stalled or died after reserving its slot. Consolidating the
+	  // page closes the slot (see CloseUnfilledSlots); the caller retries on the new page.
+	  newpsw = psw;
+	  newpst->m_PendAction = PA_CONSOLIDATE;
+	  InterlockedCompareExchange64((LONG64*)(&m_PageStatus), newpsw, psw);
+	  goto exit;
+	}
+	if (btr == BT_DUPLICATE_KEY)
+	{
+	  goto exit;
+	}
+	btr = BT_SUCCESS;
+  }
+
   // And have enough free space for the new key/separator
   if (!EnoughFreeSpace(key->m_KeyLen, psw))
   {
@@ -2316,27 +3247,25 @@ tryagain:
  
   // Reserve space for the new record by updating page status field.
   // OK to do so an interlocked operation even though its an MwCAS target field.
-  LONGLONG newpsw = psw;
-  PageStatus* newpst = (PageStatus*)(&newpsw);
-
   newpsw = psw;
   newpst->m_nUnsortedReserved++;
   newpst->m_LastFreeByte -= key->m_KeyLen;
-  LONG64 oldval = InterlockedCompareExchange64((LONG64*)(&m_PageStatus), newpsw, psw);
+  oldval = InterlockedCompareExchange64((LONG64*)(&m_PageStatus), newpsw, psw);
   if (oldval != psw)
   {
 	// No success, some other thread acquired that slot.
+	m_Btree->m_Contention.Count(CC_ADD_RESERVE_FAILED);
 	goto tryagain;
   }
 
   // We've now reserved space so it's time to fill it in.
   // First copy the key into its reserved space
-  char* keyBuffer = (char*)(this) + newpst->m_LastFreeByte + 1;
+  keyBuffer = (char*)(this) + newpst->m_LastFreeByte + 1;
   memcpy(keyBuffer, key->m_pKeyValue, key->m_KeyLen);
 
   // Then fill in the slot in the record array
-  UINT32 slotIndx = newpst->m_nUnsortedReserved - 1;
-  KeyPtrPair* pentry = GetUnsortedEntry(slotIndx);
+  slotIndx = newpst->m_nUnsortedReserved - 1;
+  pentry = GetUnsortedEntry(slotIndx);
   pentry->m_KeyOffset = newpst->m_LastFreeByte + 1;
   pentry->m_KeyLen = key->m_KeyLen;
   MemoryBarrier();
@@ -2344,20 +3273,151 @@ tryagain:
   // Setting the record pointer makes the slot and record visible
   // Note that we count on the page having been zeroed on creating so we can
   // assume that m_Pointer is 0.
-  ULONGLONG resVal = InterlockedCompareExchange64((LONGLONG*)(&pentry->m_Pointer), ULONGLONG(recptr), 0);
+  resVal = InterlockedCompareExchange64((LONGLONG*)(&pentry->m_Pointer), ULONGLONG(recptr), 0);
   if (resVal != 0)
   {
 	// Some other thread sneaked in and closed the entry after we acquired the space 
+	m_Btree->m_Contention.Count(CC_ADD_SLOT_CLOSED);
 	btr = BT_NOT_INSERTED;
   }
-  key->m_TrInfo->m_HomePage = this;
-  key->m_TrInfo->m_HomePos = slotIndx;
+  if (key->m_TrInfo)
+  {
+	key->m_TrInfo->m_HomePage = this;
+	key->m_TrInfo->m_HomePos = slotIndx;
+  }
 
 exit:
   return btr;
 
 }
 
+// Check whether the page contains a live record with the given key as of page status psw.
+// A slot in the unsorted area with a null record pointer is either deleted or reserved by an insert
+// that has not yet published its record. If such a slot could hold the key, count the null slots
+// on the page: if there are more than the deleted slots recorded in psw, an insert is in progress.
+// Returns BT_DUPLICATE_KEY if a live record exists, BT_KEY_NOT_FOUND if not, and BT_NOT_INSERTED
+// if the outcome depends on an insert in progress.
+//
+BTRESULT BtreePage::FindLiveRecord(KeyType* key, LONGLONG psw)
+{
+  CompareFn* compareFn = m_Btree->m_CompareFn;
+  if (compareFn == DefaultCompareKeys) return FindLiveRecord(DefaultKeyComparer(), key, psw);
+  return FindLiveRecord(CompareFnComparer(compareFn), key, psw);
+}
+
+template <class Comparer>
+BTRESULT BtreePage::FindLiveRecord(const Comparer& comparer, KeyType* key, LONGLONG psw)
+{
+  _ASSERTE(IsLeafPage());
+  bool ambiguous = false;
+  bool verified = false;
+
+checkagain:
+  if (FindLiveSlot(comparer, key, psw, ambiguous) >= 0)
+  {
+	return BT_DUPLICATE_KEY;
+  }
+
+  if (ambiguous && !verified)
+  {
+	if (InsertInProgress(psw))
+	{
+	  return BT_NOT_INSERTED;
+	}
+
+	// No insert was in progress when we counted and none can start without changing 
+	// the page status, so check once more against a stable page
+	verified = true;
+	goto checkagain;
+  }
+
+  return BT_KEY_NOT_FOUND;
+}
+
+// Return the position of a live record with the given key as of page status psw, or -1 if there is none.
+// A key that was deleted and inserted again has a deleted slot ahead of the live one, so deleted
+// slots are skipped. Sets ambiguous if an unsorted slot is not yet filled in or holds a deleted
+// record with the key; such a slot may belong to an insert that has not yet set its record pointer.
+//
+int BtreePage::FindLiveSlot(KeyType* key, LONGLONG psw, bool& ambiguous)
+{
+  CompareFn* compareFn = m_Btree->m_CompareFn;
+  if (compareFn == DefaultCompareKeys) return FindLiveSlot(DefaultKeyComparer(), key, psw, ambiguous);
+  return FindLiveSlot(CompareFnComparer(compareFn), key, psw, ambiguous);
+}
+
+template <class Comparer>
+int BtreePage::FindLiveSlot(const Comparer& comparer, KeyType* key, LONGLONG psw, bool& ambiguous)
+{
+  _ASSERTE(IsLeafPage());
+  PageStatus* pst = (PageStatus*)(&psw);
+  char* baseAddr = (char*)(this);
+  UINT slotCount = m_nSortedSet + pst->m_nUnsortedReserved;
+  KeyPtrPair* kpp = nullptr;
+  bool fEqual = false;
+  ambiguous = false;
+
+  // Sorted area: deleted records are not removed so there may be several entries with the key
+  UINT slot = BinarySearchGE(key->m_pKeyValue, key->m_KeyLen, baseAddr, m_RecordArr, m_nSortedSet, comparer, fEqual);
+  for (; fEqual && slot < m_nSortedSet; slot++)
+  {
+	kpp = GetKeyPtrPair(slot);
+	if (comparer.Compare(key->m_pKeyValue, key->m_KeyLen, baseAddr + kpp->m_KeyOffset, kpp->m_KeyLen) != 0) break;
+	if (!kpp->IsDeleted()) return int(slot);
+  }
+
+  // Unsorted area
+  for (slot = m_nSortedSet; slot < slotCount; slot++)
+  {
+	kpp = GetKeyPtrPair(slot);
+	if (kpp->m_KeyLen == 0)
+	{
+	  // Key not yet filled in
+	  ambiguous = true;
+	  continue;
+	}
+	if (comparer.Compare(key->m_pKeyValue, key->m_KeyLen, baseAddr + kpp->m_KeyOffset, kpp->m_KeyLen) != 0) continue;
+	if (!kpp->IsDeleted()) return int(slot);
+	ambiguous = true;
+  }
+
+  return -1;
+}
+
+// Check whether an insert that reserved a slot as of page status psw has not yet
+// set its record pointer, that is, whether there are more null slots than deleted slots.
+// A closed slot (see CloseUnfilledSlots) is not counted: its insert will fail and be retried.
+bool BtreePage::InsertInProgress(LONGLONG psw)
+{
+  PageStatus* pst = (PageStatus*)(&psw);
+  UINT slotCount = m_nSortedSet + pst->m_nUnsortedReserved;
+  UINT nullSlots = 0;
+  for (UINT slot = 0; slot < slotCount; slot++)
+  {
+	if (GetKeyPtrPair(slot)->m_Pointer.ReadLL() == 0) nullSlots++;
+  }
+  return nullSlots > pst->m_SlotsCleared;
+}
+
+// Close the unsorted slots whose insert has not yet set the record pointer. The insert 
+// then fails (see AddRecordToPage) and is retried on the page replacing this one. 
+// Must only be called when psw has a pending split or consolidation, so no new slots 
+// can be reserved and the page will not be used for inserts again.
+// Slots are packed so the pointer may straddle a cache line; only null pointers are swapped.
+void BtreePage::CloseUnfilledSlots(LONGLONG psw)
+{
+  PageStatus* pst = (PageStatus*)(&psw);
+  _ASSERTE(pst->m_PendAction == PA_SPLIT_PAGE || pst->m_PendAction == PA_CONSOLIDATE);
+  for (UINT i = 0; i < pst->m_nUnsortedReserved; i++)
+  {
+	KeyPtrPair* pentry = GetUnsortedEntry(i);
+	if (pentry->m_Pointer.ReadLL() == 0)
+	{
+	  InterlockedCompareExchange64((LONGLONG*)(&pentry->m_Pointer), LONGLONG(&KeyPtrPair::ClosedSlot), 0);
+	}
+  }
+}
+
 // Delete the record wirth the given key from the page.
 // If the key is not unique, one of the records with the 
 // given key value will be deleted.
@@ -2374,8 +3434,9 @@ BTRESULT BtreePage::DeleteRecordFromPage(KeyType* key)
         return BT_PAGE_INACTIVE;
     }
 
-    // Locate the record
-    int pos = KeySearch(key, EQ);
+    // Locate the live record; earlier copies of the key may have been deleted
+    bool ambiguous = false;
+    int pos = FindLiveSlot(key, psw, ambiguous);
     if (pos < 0)
     {
         return BT_KEY_NOT_FOUND;
@@ -2389,9 +3450,15 @@ BTRESULT BtreePage::DeleteRecordFromPage(KeyType* key)
         // To delete the record, atomically set the pointer to zero 
         // and increment the slots-cleared count in the status word.
         recPtr = kpp->m_Pointer.ReadLL();
-        if (recPtr)
+        if (!KeyPtrPair::IsNullPointer(recPtr))
         {
             MwCASDescriptor* desc = AllocateMwCASDescriptor(DescriptorFlagPos);
+            if (!desc)
+            {
+                // Descriptor pool exhausted, back off and let the caller retry
+                YieldProcessor();
+                return BT_INSTALL_FAILED;
+            }
 
             // This sets the record pointer to zero.
             INT32 pos = desc->AddEntryToDescriptor((LONGLONG*)(&kpp->m_Pointer), recPtr, 0);
@@ -2415,7 +3482,124 @@ BTRESULT BtreePage::DeleteRecordFromPage(KeyType* key)
             btr = BT_PAGE_INACTIVE;
         }
     }
-    return btr;
+    return btr;
+}
+
+
+// Locate the record with the given key and prepare to replace its record pointer in place.
+// On success, returns the page status (psw), the slot (kpp) and the current record pointer (recPtr).
+// The caller must swap the pointer by an MwCAS that also verifies that the page status is still psw.
+// The page must have no pending action: consolidation and split copy records off a leaf page
+// only after setting a pending action on the page so a successful swap cannot be lost by such a copy.
+// A pending merge is cancelled (merging is only a space optimization) so that updates 
+// do not have to wait for a merge that may not be possible.
+// If expectedRec is not null, the current record pointer must equal expectedRec.
+// Returns BT_SUCCESS, BT_KEY_NOT_FOUND, BT_RECORD_CHANGED if the pointer differs from expectedRec,
+// BT_NOT_INSERTED if the page is inactive or has a pending action, and BT_INSTALL_FAILED 
+// if the page or record changed concurrently.
+//
+BTRESULT BtreePage::LocateRecordForUpdate(KeyType* key, void* expectedRec, LONGLONG& psw, KeyPtrPair*& kpp, LONGLONG& recPtr)
+{
+    _ASSERTE(IsLeafPage());
+    kpp = nullptr;
+    recPtr = 0;
+
+    psw = m_PageStatus.ReadLL();
+    PageStatus* pst = (PageStatus*)(&psw);
+
+    if (pst->m_PageState == PAGE_INACTIVE)
+    {
+        return BT_NOT_INSERTED;
+    }
+
+    // Locate the live record; earlier copies of the key may have been deleted
+    bool ambiguous = false;
+    int pos = FindLiveSlot(key, psw, ambiguous);
+    if (pos < 0)
+    {
+        return BT_KEY_NOT_FOUND;
+    }
+
+    if (pst->m_PendAction == PA_MERGE_PAGE)
+    {
+        LONGLONG newpsw = psw;
+        PageStatus* newpst = (PageStatus*)(&newpsw);
+        newpst->m_PendAction = PA_NONE;
+        InterlockedCompareExchange64((LONGLONG*)(&m_PageStatus), newpsw, psw);
+        return BT_INSTALL_FAILED;
+    }
+
+    if (pst->m_PendAction != PA_NONE)
+    {
+        return BT_NOT_INSERTED;
+    }
+
+    kpp = GetKeyPtrPair(pos);
+    _ASSERTE(kpp);
+    recPtr = kpp->m_Pointer.ReadLL();
+    if (KeyPtrPair::IsNullPointer(recPtr))
+    {
+        // Deleted after we located it
+        return BT_INSTALL_FAILED;
+    }
+
+    if (expectedRec != nullptr && recPtr != LONGLONG(expectedRec))
+    {
+        // Only report the mismatch if the pointer was read from an unchanged page
+        if (psw != m_PageStatus.ReadLL())
+        {
+            return BT_INSTALL_FAILED;
+        }
+        return BT_RECORD_CHANGED;
+    }
+
+    return BT_SUCCESS;
+}
+
+// Replace the record pointer of the record with the given key by newRec and return the old pointer.
+// If expectedRec is not null, the pointer is replaced only if it equals expectedRec.
+// The pointer is swapped in place by an MwCAS that also verifies that the page status is unchanged.
+// Return values are the same as for LocateRecordForUpdate.
+//
+BTRESULT BtreePage::UpdateRecordOnPage(KeyType* key, void* expectedRec, void* newRec, void*& oldRec)
+{
+    oldRec = nullptr;
+
+    LONGLONG psw = 0;
+    KeyPtrPair* kpp = nullptr;
+    LONGLONG recPtr = 0;
+    BTRESULT btr = LocateRecordForUpdate(key, expectedRec, psw, kpp, recPtr);
+    if (btr == BT_RECORD_CHANGED)
+    {
+        oldRec = (void*)(recPtr);
+    }
+    if (btr != BT_SUCCESS)
+    {
+        return btr;
+    }
+
+    MwCASDescriptor* desc = AllocateMwCASDescriptor(DescriptorFlagPos);
+    if (!desc)
+    {
+        // Descriptor pool exhausted, back off and let the caller retry
+        YieldProcessor();
+        return BT_INSTALL_FAILED;
+    }
+
+    // This swaps the record pointer
+    desc->AddEntryToDescriptor((LONGLONG*)(&kpp->m_Pointer), recPtr, LONGLONG(newRec));
+
+    // and this verifies that the page status has not changed
+    desc->AddEntryToDescriptor((LONGLONG*)(&m_PageStatus), psw, psw);
+    desc->CloseDescriptor();
+
+    if (!desc->MwCAS(0))
+    {
+        return BT_INSTALL_FAILED;
+    }
+
+    oldRec = (void*)(recPtr);
+    return BT_SUCCESS;
 }
 
 
@@ -2439,32 +3623,6 @@ bool BtreePage::EnoughFreeSpace(UINT32 keylen, UINT64 pageState)
   return reqSpace <= freeSpace;
 }
 
-int _cdecl QSortCompareKeys(void* context, const void* leftp, const void* rightp)
-{
-  KeyPtrPair* lre = (KeyPtrPair*)(leftp);
-  KeyPtrPair* rre = (KeyPtrPair*)(rightp);
-  BtreePage* page = (BtreePage*)(context);
-
-  char* leftkey  = (char*)(page) + lre->m_KeyOffset;
-  char* rightkey = (char*)(page) + rre->m_KeyOffset;
-
-  return page->GetBtreeRoot()->m_CompareFn(leftkey, lre->m_KeyLen, rightkey, rre->m_KeyLen);
-}
-
-int _cdecl PermArrayCompareKeys(void* context, const void* leftp, const void* rightp)
-{
-    PermutationArray*  parr = (PermutationArray*)(context);
-    UINT16 lidx = *(UINT16*)(leftp);
-    UINT16 ridx = *(UINT16*)(rightp);
-    KeyPtrPair* lkpp = parr->m_TargetPage->GetKeyPtrPair(lidx); 
-    KeyPtrPair* rkpp = parr->m_TargetPage->GetKeyPtrPair(ridx); 
-
-    char* leftkey = (char*)(parr->m_TargetPage) + lkpp->m_KeyOffset;
-    char* rightkey = (char*)(parr->m_TargetPage) + rkpp->m_KeyOffset;
-  
-    return parr->m_TargetPage->GetBtreeRoot()->m_CompareFn(leftkey, lkpp->m_KeyLen, rightkey, rkpp->m_KeyLen);
-}
-
 void OnLeafPageDelete(void* btreePtr, void* objToDelete, MemObjectType objType)
 {
     if (objType == MemObjectType::LeafPage)
@@ -2486,19 +3644,109 @@ void OnLeafPageDelete(void* btreePtr, void* objToDelete, MemObjectType objType)
             _ASSERTE(PageStatus::IsPageInactive(indexPage->GetPageStatus()));
         }
     }
+    // No thread can reach the object any longer so free it
+    BtreeRootInternal* btree = (BtreeRootInternal*)(btreePtr);
+    btree->GetEpochManager()->DeallocateOnFinalize(objToDelete, objType);
+}
+
+// Sort the live records in the first nrUnsorted slots of the unsorted area.
+// The slot numbers of the records are returned in slots in key order.
+// The unsorted area is small so binary insertion sort is used.
+// Records with equal keys stay in insertion order.
+// Returns the number of live records.
+UINT BtreePage::SortUnsortedSlots(UINT nrUnsorted, UINT16* slots)
+{
+  CompareFn* compareFn = m_Btree->m_CompareFn;
+  if (compareFn == DefaultCompareKeys) return SortUnsortedSlots(DefaultKeyComparer(), nrUnsorted, slots);
+  return SortUnsortedSlots(CompareFnComparer(compareFn), nrUnsorted, slots);
 }
 
-BTRESULT PermutationArray::SortPermArray()
+template <class Comparer>
+UINT BtreePage::SortUnsortedSlots(const Comparer& comparer, UINT nrUnsorted, UINT16* slots)
 {
-    qsort_s(&m_PermArray[0], m_nrEntries, sizeof(UINT16), PermArrayCompareKeys, this);
-    return (errno != EINVAL) ? BT_SUCCESS : BT_INTERNAL_ERROR;
+  UINT count = 0;
+  for (UINT i = 0; i < nrUnsorted; i++)
+  {
+	UINT16 slot = UINT16(m_nSortedSet + i);
+	KeyPtrPair* pre = &m_RecordArr[slot];
+	if (pre->IsDeleted())
+	{
+	  continue;
+	}
+	char* key = (char*)(this) + pre->m_KeyOffset;
+
+	// Find the first position with a higher key
+	UINT low = 0;
+	UINT high = count;
+	while (low < high)
+	{
+	  UINT mid = (low + high) / 2;
+	  KeyPtrPair* mre = &m_RecordArr[slots[mid]];
+	  int cv = comparer.Compare(key, pre->m_KeyLen, (char*)(this) + mre->m_KeyOffset, mre->m_KeyLen);
+	  if (cv < 0) high = mid; else low = mid + 1;
+	}
+	memmove(&slots[low + 1], &slots[low], (count - low) * sizeof(UINT16));
+	slots[low] = slot;
+	count++;
+  }
+  return count;
 }
 
+// Merge the live records in the sorted set with the sorted live records in the 
+// first nrUnsorted slots of the unsorted area. The slot numbers of all live records
+// are returned in order in key order and their total key length in keySpace.
+// Order must have room for m_nSortedSet + nrUnsorted slots. Returns the number of live records.
+UINT BtreePage::MergeLiveSlots(UINT nrUnsorted, UINT16* order, UINT& keySpace)
+{
+  CompareFn* compareFn = m_Btree->m_CompareFn;
+  if (compareFn == DefaultCompareKeys) return MergeLiveSlots(DefaultKeyComparer(), nrUnsorted, order, keySpace);
+  return MergeLiveSlots(CompareFnComparer(compareFn), nrUnsorted, order, keySpace);
+}
 
-BTRESULT BtreePage::SortUnsortedSet(KeyPtrPair* pSortedArr, UINT count)
+template <class Comparer>
+UINT BtreePage::MergeLiveSlots(const Comparer& comparer, UINT nrUnsorted, UINT16* order, UINT& keySpace)
 {
-  qsort_s(pSortedArr, count, sizeof(KeyPtrPair), QSortCompareKeys, this);
-  return (errno != 0) ? BT_INTERNAL_ERROR : BT_SUCCESS;
+  // The live unsorted slots are sorted into order after the room for the sorted set.
+  // The merge never writes past the next unsorted slot to be read.
+  UINT16* tail = &order[m_nSortedSet];
+  UINT rCount = SortUnsortedSlots(comparer, nrUnsorted, tail);
+
+  UINT lIndx = 0;
+  UINT rIndx = 0;
+  UINT count = 0;
+  keySpace = 0;
+  while (lIndx < m_nSortedSet)
+  {
+	KeyPtrPair* pLeft = &m_RecordArr[lIndx];
+	if (pLeft->IsDeleted())
+	{
+	  lIndx++;
+	  continue;
+	}
+
+	// Output records from the unsorted area with lower keys first
+	if (rIndx < rCount)
+	{
+	  KeyPtrPair* pRight = &m_RecordArr[tail[rIndx]];
+	  char* lKey = (char*)(this) + pLeft->m_KeyOffset;
+	  char* rKey = (char*)(this) + pRight->m_KeyOffset;
+	  if (comparer.Compare(lKey, pLeft->m_KeyLen, rKey, pRight->m_KeyLen) > 0)
+	  {
+		order[count++] = tail[rIndx++];
+		keySpace += pRight->m_KeyLen;
+		continue;
+	  }
+	}
+	order[count++] = UINT16(lIndx++);
+	keySpace += pLeft->m_KeyLen;
+  }
+
+  while (rIndx < rCount)
+  {
+	keySpace += m_RecordArr[tail[rIndx]].m_KeyLen;
+	order[count++] = tail[rIndx++];
+  }
+  return count;
 }
 
 
@@ -2575,114 +3823,98 @@ void BtreePage::LiveRecordSpace(UINT& recCount, UINT& keySpace)
 
 }
 
-BTRESULT BtreePage::ExtractLiveRecords(KeyPtrPair*& liveRecArray, UINT& count, UINT& keySpace)
- {
-  BTRESULT btr = BT_SUCCESS;
+// Per-thread scratch space for the slot numbers of a page. Grown to the largest page the thread
+// has ordered and kept until the thread exits, so ordering the slots of a page needs neither a
+// large stack array nor an allocation per page.
+class SlotScratch
+{
+  UINT16*	m_Slots;
+  UINT		m_Capacity;
 
-  // Allocate array for final result
-  UINT liveRecs = LiveRecordCount();
-  liveRecArray = nullptr;
-  count = 0;
-  keySpace = 0;
+public:
+  SlotScratch() : m_Slots(nullptr), m_Capacity(0) {}
+  ~SlotScratch() { free(m_Slots); }
 
-  HRESULT hr = m_Btree->m_MemoryBroker->Allocate(liveRecs*sizeof(KeyPtrPair), (void**)(&liveRecArray), MemObjectType::TmpPointerArray);
-  if (hr != S_OK)
+  // Returns room for count slot numbers, or null if out of memory
+  UINT16* Get(UINT count)
   {
-	btr = BT_OUT_OF_MEMORY;
-	goto exit;
+	if (count > m_Capacity || !m_Slots)
+	{
+	  UINT capacity = max(max(count, 2*m_Capacity), 64U);
+	  UINT16* slots = (UINT16*)(realloc(m_Slots, capacity*sizeof(UINT16)));
+	  if (!slots)
+	  {
+		return nullptr;
+	  }
+	  m_Slots = slots;
+	  m_Capacity = capacity;
+	}
+	return m_Slots;
   }
-  // Copy in the the live records from the sorted set
-  UINT recCount = 0;
-  for (UINT i = 0; i < m_nSortedSet; i++)
+};
+
+// Merging two pages orders the slots of both
+static const UINT SlotScratchBuffers = 2;
+static thread_local SlotScratch t_SlotScratch[SlotScratchBuffers];
+
+// Get the slots of the live records in the sorted set and the first nrUnsorted slots of the 
+// unsorted area in key order, in scratch buffer 'buffer' of the calling thread. The slots are
+// valid until the thread orders the slots of another page into the same buffer.
+BTRESULT BtreePage::OrderLiveSlots(UINT nrUnsorted, UINT buffer, UINT16*& order, UINT& count, UINT& keySpace)
+{
+  _ASSERTE(buffer < SlotScratchBuffers);
+  count = 0;
+  keySpace = 0;
+  order = t_SlotScratch[buffer].Get(m_nSortedSet + nrUnsorted);
+  if (!order)
   {
-	KeyPtrPair* pre = &m_RecordArr[i];
-	liveRecArray[recCount].Set(pre->m_KeyOffset, pre->m_KeyLen, pre->m_Pointer.ReadPP());
-	if (!liveRecArray[recCount].IsDeleted() && recCount < liveRecs)
-	{
-      keySpace += liveRecArray[recCount].m_KeyLen;
- 	  recCount++;
-    }
+	return BT_OUT_OF_MEMORY;
   }
+  count = MergeLiveSlots(nrUnsorted, order, keySpace);
+  return BT_SUCCESS;
+}
 
-  // Copy the unsorted record entries into an array and sort them
-  //
-  LONGLONG psw = m_PageStatus.ReadLL();
+// Add the cost of a lookup scanning the unsorted area to the read scan cost of the page. 
+// If the accumulated cost exceeds the threshold, the page is flagged as hot. Lookups don't
+// consolidate the page themselves; the next operation that reaches it does (see FindTargetPage).
+void BtreePage::ChargeReadScan(LONGLONG psw)
+{
   PageStatus* pst = (PageStatus*)(&psw);
-  KeyPtrPair* sortArr = nullptr;
   UINT nrUnsorted = pst->m_nUnsortedReserved;
-  UINT srcCount = 0;
-  if (nrUnsorted > 0)
-    {
-	HRESULT hr = m_Btree->m_MemoryBroker->Allocate(nrUnsorted * sizeof(KeyPtrPair), (void**)(&sortArr), MemObjectType::TmpPointerArray);
-	if (hr != S_OK)
-	{
-	  btr = BT_OUT_OF_MEMORY;
-      goto exit;
-    }
-
-	KeyPtrPair* pre = nullptr;
-	for (UINT i = 0; i < nrUnsorted; i++)
-    {
-	  pre = GetUnsortedEntry(i);
-      sortArr[srcCount].Set(pre->m_KeyOffset, pre->m_KeyLen, pre->m_Pointer.ReadPP());
-	  if (!sortArr[srcCount].IsDeleted() && srcCount < nrUnsorted)
-	  {
-		srcCount++;
-      }
-	}
-	btr = SortUnsortedSet(sortArr, srcCount);
+  if (!IsLeafPage() || m_ReadScanHot || nrUnsorted < ReadScanMinUnsorted)
+  {
+	return;
   }
- 
-  // Now merge the newly sorted records into liveRecArray.
-  // The numberof records in sortArr is typically much smaller
-  // then the number of records in liveRecArray.
-
-  if (srcCount > 0)
-    {
-	int trgtIndx = recCount + srcCount -1;
-	int liveIndx = recCount - 1;
-	int recsCopied = 0;
-	for (int srcIndx = srcCount - 1; srcIndx >= 0; srcIndx--)
-	{
-	  char* srcKey = (char*)(this) + sortArr[srcIndx].m_KeyOffset;
-	  UINT  srcKeyLen = sortArr[srcIndx].m_KeyLen;
 
-	  // Advance until we find a record with a key less than or equal to the srcKey
-	  for (; liveIndx >= 0; liveIndx--)
-	  {
-		char* liveKey = (char*)(this) + liveRecArray[liveIndx].m_KeyOffset;
-		UINT liveKeyLen = liveRecArray[liveIndx].m_KeyLen;
-		
-		// Copy larger key into the target position
-		recsCopied++;
-		int cv = m_Btree->m_CompareFn(liveKey, liveKeyLen, srcKey, srcKeyLen);
-		if (cv <= 0)
-		{
-		  // Copy from srcIndx into target position
-		  liveRecArray[trgtIndx] = sortArr[srcIndx];
-		  trgtIndx++;
-		  break;
-    }
-		// Copy  from liveIndx into target poisition
-		liveRecArray[trgtIndx] = liveRecArray[liveIndx];
-		trgtIndx++;
-	  }
-	}
+  UINT cost = (m_ReadScanCost += nrUnsorted);
+  if (cost >= ReadScanCostFactor*(m_nSortedSet + nrUnsorted))
+  {
+	m_ReadScanHot = true;
   }
-  count = recCount + srcCount;
-
+}
 
-exit:
-  if (btr != BT_SUCCESS)
+// Mark a page flagged by lookups (see ChargeReadScan) for consolidation, or for a split if
+// its records no longer fit in a page of the maximum size (as for inserts). Otherwise a page 
+// that keeps being consolidated before it fills would never be split.
+// Returns true if this call marked the page, newpsw then holds the new page status.
+bool BtreePage::MarkReadScanHot(LONGLONG psw, LONGLONG& newpsw)
+{
+  PageStatus* pst = (PageStatus*)(&psw);
+  if (!m_ReadScanHot || pst->m_PageState != PAGE_NORMAL || pst->m_PendAction != PA_NONE)
   {
-	if (liveRecArray)
-	{
-	  m_Btree->m_EpochMgr->DeallocateNow(liveRecArray, MemObjectType::TmpPointerArray);
-	  liveRecArray = nullptr;
-	  count = 0;
-	}
+	return false;
   }
-  return btr;
+
+  UINT recCount = 0, keySpace = 0;
+  LiveRecordSpace(recCount, keySpace);
+  UINT newSize = recCount * sizeof(KeyPtrPair) + keySpace;
+
+  newpsw = psw;
+  PageStatus* newpst = (PageStatus*)(&newpsw);
+  bool fits = newSize < m_Btree->m_PageSizePolicy.m_MaxPageSize && PageHeaderSize() + newSize <= PageSizeLimit;
+  newpst->m_PendAction = (fits || recCount < 2) ? PA_CONSOLIDATE : PA_SPLIT_PAGE;
+  LONGLONG rv = InterlockedCompareExchange64((LONGLONG*)(&m_PageStatus), newpsw, psw);
+  return rv == psw;
 }
 
 BTRESULT BtreePage::CopyToNewPage(BtreePage* newPage)
@@ -2692,127 +3924,30 @@ BTRESULT BtreePage::CopyToNewPage(BtreePage* newPage)
     LONGLONG psw = m_PageStatus.ReadLL();
     PageStatus* pst = (PageStatus*)(&psw);
 
-    KeyPtrPair* sortArr = nullptr;
     BTRESULT btr = BT_SUCCESS;
 
-    // Copy the unsorted record entries into an array and sort them
-  //
-    UINT nrUnsorted = pst->m_nUnsortedReserved;
-    UINT rCount = 0;
-    if (nrUnsorted > 0)
-    {
-        HRESULT hr = m_Btree->m_MemoryBroker->Allocate(nrUnsorted * sizeof(KeyPtrPair), (void**)(&sortArr), MemObjectType::TmpPointerArray);
-        if (hr != S_OK)
-        {
-            btr = BT_OUT_OF_MEMORY;
-            goto exit;
-        }
-
-
-        KeyPtrPair* pre = nullptr;
-        for (UINT i = 0; i < nrUnsorted; i++)
-        {
-            pre = GetUnsortedEntry(i);
-            sortArr[rCount] = *pre; 
-            if (!sortArr[rCount].IsDeleted() && rCount < nrUnsorted)
-            {
-                rCount++;
-            }
-        }
-        btr = SortUnsortedSet(sortArr, rCount);
-    }
-
-    // Merge the record entries from the sorted set on the input page
-    // and the record entries from the sort array to create the sorted set of the new page
-    KeyPtrPair* pLeft = GetKeyPtrPair(0);
-    KeyPtrPair* pRight = (KeyPtrPair*)(sortArr);
-    INT lCount = m_nSortedSet;
-
-    UINT copiedRecs = 0;
-    UINT copiedSpace = 0;
-
-
-    while (lCount > 0 && rCount > 0)
-    {
-        // Skip deleted entries in the sorted set
-        if (pLeft->IsDeleted())
-        {
-            pLeft++;
-            lCount--;
-            continue;
-        }
-        // Should we pull from left or right input to the merge
-        char* lKey = (char*)(this) + pLeft->m_KeyOffset;
-        char* rKey = (char*)(this) + pRight->m_KeyOffset;
-        int cv = m_Btree->m_CompareFn(lKey, pLeft->m_KeyLen, rKey, pRight->m_KeyLen);
-
-        if (cv <= 0)
-        {
-            // Copy record entry and key value from left input
-            newPage->AppendToSortedSet(lKey, pLeft->m_KeyLen, pLeft->m_Pointer.Read());
-            copiedRecs++;
-            copiedSpace += pLeft->m_KeyLen;
-
-            // Advance left input
-            pLeft++;
-            lCount--;
-        }
-        else
-        {
-            // Copy record entry and key value from right input
-            newPage->AppendToSortedSet(rKey, pRight->m_KeyLen, pRight->m_Pointer.Read());
-
-            copiedRecs++;
-            copiedSpace += pRight->m_KeyLen;
-
-            // Advance right input
-            pRight++;
-            rCount--;
-        }
-    }
-
-    // Copy remaining, if any, from left or right
-    while (lCount > 0)
+    // Merge the live records in the sorted set with the sorted live records 
+    // in the unsorted area to create the sorted set of the new page
+    UINT16* order = nullptr;
+    UINT keySpace = 0;
+    UINT count = 0;
+    btr = OrderLiveSlots(pst->m_nUnsortedReserved, 0, order, count, keySpace);
+    if (btr != BT_SUCCESS)
     {
-        if (!pLeft->IsDeleted())
-        {
-            // Copy record entry and key value from left input
-            char* lKey = (char*)(this) + pLeft->m_KeyOffset;
-            newPage->AppendToSortedSet(lKey, pLeft->m_KeyLen, pLeft->m_Pointer.Read());
-            copiedRecs++;
-            copiedSpace += pLeft->m_KeyLen;
-        }
-
-        // Advance left input
-        pLeft++;
-        lCount--;
+        return btr;
     }
 
-    while (rCount > 0)
+    for (UINT i = 0; i < count; i++)
     {
-        // Copy record entry and key value from right input
-        char* rKey = (char*)(this) + pRight->m_KeyOffset;
-        newPage->AppendToSortedSet(rKey, pRight->m_KeyLen, pRight->m_Pointer.Read());
-        copiedRecs++;
-        copiedSpace += pRight->m_KeyLen;
-
-        // Advance right input
-        pRight++;
-        rCount--;
+        KeyPtrPair* pre = &m_RecordArr[order[i]];
+        newPage->AppendToSortedSet((char*)(this) + pre->m_KeyOffset, pre->m_KeyLen, pre->m_Pointer.Read());
     }
 
-    if (sortArr)
-    {
-        HRESULT hr = m_Btree->m_EpochMgr->DeallocateNow(sortArr, MemObjectType::TmpPointerArray);
-        _ASSERTE(hr == S_OK);
-        sortArr = nullptr;
-    }
 #ifdef _DEBUG
     newPage->m_SrcPage1 = this;
     m_TrgtPage1 = newPage;
 #endif
 
-exit:
     return btr;
 }
 
@@ -2829,6 +3964,8 @@ BTRESULT BtreePage::ConsolidateLeafPage(BtIterator* iter, UINT minFree)
     BTRESULT btr    = BT_NO_ACTION_TAKEN ;
     BtreePage* newPage = nullptr;
     bool  installed = false;
+    UINT recCount = 0;
+    UINT keySpace = 0;	
 
 
     if (pst->m_PendAction != PA_CONSOLIDATE || PageStatus::IsPageInactive(pst->m_PageState))
@@ -2836,29 +3973,19 @@ BTRESULT BtreePage::ConsolidateLeafPage(BtIterator* iter, UINT minFree)
         goto exit ;
     }
 
-
-    UINT recCount = 0;
-    UINT keySpace = 0;	
-
-#ifdef DO_LOG
-    BtreePage* ixPage = (iter->m_Count > 1) ? iter->m_Path[iter->m_Count - 2].m_Page : nullptr;
-    LONGLONG   ixpStatus = (iter->m_Count > 1) ? iter->m_Path[iter->m_Count - 2].m_PageStatus : 0;
-	ConsInfo::RecCons('B', this, psw, nullptr, 0, recCount, ixPage, ixpStatus);
-#endif
-
     curpsw = m_PageStatus.ReadLL();
     if ( curpst->m_PendAction != PA_CONSOLIDATE)
     {
-#ifdef DO_LOG
-        ConsInfo::RecCons('E', this, psw, nullptr, 0, recCount, nullptr, 0);
-#endif
         return btr;
     }
 
+	// Inserts that have not completed yet must be retried on the new page
+	CloseUnfilledSlots(curpsw);
+
 	// Recompute space requirements
 	LiveRecordSpace(recCount, keySpace);
  
-	if( m_Btree->AllocateLeafPage(recCount, keySpace, newPage) != BT_SUCCESS)
+	if( m_Btree->AllocateLeafPage(recCount, keySpace, newPage, m_Btree->LeafPageHeat(this, recCount)) != BT_SUCCESS)
 	{
         goto exit;
     }
@@ -2870,9 +3997,6 @@ BTRESULT BtreePage::ConsolidateLeafPage(BtIterator* iter, UINT minFree)
     curpsw = m_PageStatus.ReadLL();
 	if (psw != curpsw)
 	{
-#ifdef DO_LOG
-        ConsInfo::RecCons('E', this, m_PageStatus, nullptr, 0, 0, nullptr, 0);
-#endif
 	  goto exit;
 	}
 
@@ -2887,7 +4011,7 @@ BTRESULT BtreePage::ConsolidateLeafPage(BtIterator* iter, UINT minFree)
 		_ASSERTE(newPage->m_nSortedSet == recCount);
         UINT oldCount = LiveRecordCount();
         UINT newCount = newPage->LiveRecordCount();
-		_ASSERTE(LiveRecordCount() == newPage->LiveRecordCount());
+		_ASSERTE(newCount <= oldCount);
 #endif
         // Update pointer slot in parent index page pointing to this page to point to the new page
         // If there is no no parent page, update the B-tree root pointer
@@ -2942,16 +4066,26 @@ BTRESULT BtreePage::ConsolidateLeafPage(BtIterator* iter, UINT minFree)
         {
             btr = BT_SUCCESS;
   		}
-
-#ifdef DO_LOG
-        LONGLONG newpstw = (installed) ? PageStatus::MakePageInactive(psw) : 0;
-		ConsInfo::RecCons('E', this, newpstw, newPage, newPageStatus, newCount, ixPage, newixStatusVal);
-#endif
-
+        else
+        {
+            m_Btree->m_Contention.Count(CC_INSTALL_FAILED_CONSOLIDATE);
+        }
 	}
 
 exit:
-	iter->m_TrInfo->RecordAction(TraceInfo::CONS_PAGE, btr == BT_SUCCESS, this, newPage, nullptr);
+	if (iter->m_TrInfo) iter->m_TrInfo->RecordAction(TraceInfo::CONS_PAGE, btr == BT_SUCCESS, this, newPage, nullptr);
+
+	// Trace attempts that got as far as creating the new page
+	if (newPage)
+	{
+	  TraceEvent* ev = m_Btree->m_Tracer.NewEvent(TE_CONSOLIDATE, (installed) ? BT_SUCCESS : BT_INSTALL_FAILED);
+	  if (ev)
+	  {
+		iter->TraceLeafPath(ev);
+		ev->m_Status = psw;
+		ev->m_NewPage = ULONGLONG(newPage);
+	  }
+	}
 
     if (installed)
 	{
@@ -2983,48 +4117,38 @@ BTRESULT BtreePage::SplitLeafPage(BtIterator* iter)
       return BT_NO_ACTION_TAKEN;
   }
 
-#ifdef DO_LOG
-  SplitInfo::RecSplit('B', this, psw, nullptr, nullptr);
-#endif
   
-  // Copy a record entries for reccords that have not been deleted into a temporary array for sorting
-  UINT nrSlots = m_nSortedSet + pst->m_nUnsortedReserved;
-  KeyPtrPair* sortArr = nullptr;
-  HRESULT hr = m_Btree->m_MemoryBroker->Allocate(nrSlots * sizeof(KeyPtrPair), (void**)(&sortArr), MemObjectType::TmpPointerArray);
-  if( hr != S_OK)
-  {
-      btr = BT_NO_ACTION_TAKEN;
-      goto exit;
-  }
+  // Inserts that have not completed yet must be retried on the new pages
+  CloseUnfilledSlots(psw);
 
+  // Get the slots of the records that have not been deleted in key order
+  UINT16* order = nullptr;
+  UINT totalKeySpace = 0;
   UINT nrRecords = 0;
-  KeyPtrPair* pre = nullptr;
-  for (UINT i = 0; i < nrSlots; i++)
+  btr = OrderLiveSlots(pst->m_nUnsortedReserved, 0, order, nrRecords, totalKeySpace);
+  if (btr != BT_SUCCESS)
   {
-	pre = GetKeyPtrPair(i);
-	if (!pre->IsDeleted())
-	{
-	  sortArr[nrRecords] = *pre;
-	  nrRecords++;
-	}
-  }
-
-  qsort_s(sortArr, nrRecords, sizeof(KeyPtrPair), QSortCompareKeys, this);
-  if (errno == EINVAL) 
-  { 
-      btr = BT_NO_ACTION_TAKEN; 
-      goto exit; 
+      return btr;
   }
 
-  UINT lCount = nrRecords / 2;
+  // Split evenly unless records are being appended at the high end of the page.
+  // Then the left page gets most of the records and is sized as a cold page
+  // because it is unlikely to receive any more inserts. Both pages must get a record.
+  bool appending = nrRecords >= 2 && IsAppendPattern(psw);
+  UINT lCount = (appending)? min((nrRecords*AppendSplitPercent)/100, nrRecords - 1) : nrRecords / 2;
   UINT rCount = nrRecords - lCount;
+  double heat = m_Btree->LeafPageHeat(this, nrRecords);
 
   // Copy first lCount records to the left new page (lower keys)
   UINT keySpace = 0;
-  for (UINT i = 0; i < lCount; i++) keySpace += GetKeyPtrPair(i)->m_KeyLen;
+  for (UINT i = 0; i < lCount; i++) keySpace += m_RecordArr[order[i]].m_KeyLen;
 
   BtreePage* leftPage = nullptr;
-  btr = m_Btree->AllocateLeafPage(lCount, keySpace, leftPage);
+  BtreePage* rightPage = nullptr;
+  char* separator = nullptr;
+  UINT seplen = 0;
+
+  btr = m_Btree->AllocateLeafPage(lCount, keySpace, leftPage, (appending)? 0.0 : heat);
   if (btr != BT_SUCCESS) 
   { 
       goto exit; 
@@ -3032,16 +4156,15 @@ BTRESULT BtreePage::SplitLeafPage(BtIterator* iter)
 
   for (UINT i = 0; i < lCount; i++)
   {
-	char* key = (char*)(this) + sortArr[i].m_KeyOffset;
-	leftPage->AppendToSortedSet(key, sortArr[i].m_KeyLen, sortArr[i].m_Pointer.Read());
+	KeyPtrPair* pre = &m_RecordArr[order[i]];
+	char* key = (char*)(this) + pre->m_KeyOffset;
+	leftPage->AppendToSortedSet(key, pre->m_KeyLen, pre->m_Pointer.Read());
   }
 
   // Copy the higher rCount records into the right new page (higher keys)
-  keySpace = 0;
-  for (UINT i = lCount; i < nrRecords; i++) keySpace += GetKeyPtrPair(i)->m_KeyLen;
+  keySpace = totalKeySpace - keySpace;
 
-  BtreePage* rightPage = nullptr;
-  btr = m_Btree->AllocateLeafPage(rCount, keySpace, rightPage);
+  btr = m_Btree->AllocateLeafPage(rCount, keySpace, rightPage, heat);
   if (btr != BT_SUCCESS) 
   { 
        goto exit; 
@@ -3050,16 +4173,17 @@ BTRESULT BtreePage::SplitLeafPage(BtIterator* iter)
 
   for (UINT i = lCount; i < nrRecords; i++)
   {
-	char* key = (char*)(this) + sortArr[i].m_KeyOffset;
-	rightPage->AppendToSortedSet( key, sortArr[i].m_KeyLen, sortArr[i].m_Pointer.Read());
+	KeyPtrPair* pre = &m_RecordArr[order[i]];
+	char* key = (char*)(this) + pre->m_KeyOffset;
+	rightPage->AppendToSortedSet( key, pre->m_KeyLen, pre->m_Pointer.Read());
   }
  
   // Use the last key of the left page as separator for the two pages.
   // A separator thus indicates the highest key value allowed on a page.
   // The separator will be added to the parent index page.
-  char* separator = (char*)(leftPage)+leftPage->GetKeyPtrPair(lCount-1)->m_KeyOffset;
-  UINT seplen = leftPage->GetKeyPtrPair(lCount-1)->m_KeyLen;
-  _ASSERTE(LiveRecordCount() == leftPage->LiveRecordCount() + rightPage->LiveRecordCount());
+  separator = (char*)(leftPage)+leftPage->GetKeyPtrPair(lCount-1)->m_KeyOffset;
+  seplen = leftPage->GetKeyPtrPair(lCount-1)->m_KeyLen;
+  _ASSERTE(nrRecords == leftPage->LiveRecordCount() + rightPage->LiveRecordCount());
 
 #ifdef _DEBUG
   leftPage->m_SrcPage1 = this;
@@ -3068,18 +4192,10 @@ BTRESULT BtreePage::SplitLeafPage(BtIterator* iter)
   m_TrgtPage2 = rightPage;
 #endif
 
-  // Delete sort array
-  hr = m_Btree->m_EpochMgr->DeallocateNow (sortArr, MemObjectType::TmpPointerArray);
-  _ASSERTE(hr == S_OK);
-  sortArr = nullptr;
-
   // Install the new pages
   btr = m_Btree->InstallSplitPages(iter, leftPage, rightPage, separator, seplen);
 
-  iter->m_TrInfo->RecordAction(TraceInfo::SPLI_PAGE, btr == BT_SUCCESS, this, leftPage, rightPage);
-#ifdef DO_LOG 
-  SplitInfo::RecSplit('E', this, psw, leftPage, rightPage);
-#endif
+  if (iter->m_TrInfo) iter->m_TrInfo->RecordAction(TraceInfo::SPLI_PAGE, btr == BT_SUCCESS, this, leftPage, rightPage);
 
    if (btr == BT_INSTALL_FAILED)
   {
@@ -3105,6 +4221,53 @@ BTRESULT BtreePage::SplitLeafPage(BtIterator* iter)
    return btr;
  }
 
+// Returns true if the records in the unsorted area were inserted in ascending key order
+// and all have keys higher than the last key in the sorted area.
+bool BtreePage::IsAppendPattern(LONGLONG psw)
+{
+  CompareFn* compareFn = m_Btree->m_CompareFn;
+  if (compareFn == DefaultCompareKeys) return IsAppendPattern(DefaultKeyComparer(), psw);
+  return IsAppendPattern(CompareFnComparer(compareFn), psw);
+}
+
+template <class Comparer>
+bool BtreePage::IsAppendPattern(const Comparer& comparer, LONGLONG psw)
+{
+  PageStatus* pst = (PageStatus*)(&psw);
+  UINT nrUnsorted = pst->m_nUnsortedReserved;
+  if (nrUnsorted < AppendSplitMinInserts)
+  {
+	return false;
+  }
+
+  char* prevKey = nullptr;
+  UINT prevKeyLen = 0;
+  if (m_nSortedSet > 0)
+  {
+	KeyPtrPair* pre = GetKeyPtrPair(m_nSortedSet - 1);
+	prevKey = (char*)(this) + pre->m_KeyOffset;
+	prevKeyLen = pre->m_KeyLen;
+  }
+
+  for (UINT i = 0; i < nrUnsorted; i++)
+  {
+	KeyPtrPair* pre = GetUnsortedEntry(i);
+	if (pre->m_KeyLen == 0)
+	{
+	  // Slot reserved but not yet filled in
+	  return false;
+	}
+	char* curKey = (char*)(this) + pre->m_KeyOffset;
+	if (prevKey && comparer.Compare(prevKey, prevKeyLen, curKey, pre->m_KeyLen) >= 0)
+	{
+	  return false;
+	}
+	prevKey = curKey;
+	prevKeyLen = pre->m_KeyLen;
+  }
+  return true;
+}
+
 BTRESULT BtreePage::TryToMergePage(BtIterator* iter)
 {
     LONGLONG psw = m_PageStatus.ReadLL();
@@ -3185,11 +4348,8 @@ BTRESULT BtreePage::TryToMergePage(BtIterator* iter)
                 // Merge with left
                 UINT pageSize = (IsLeafPage())? m_Btree->ComputeLeafPageSize(leftCount + myCount, leftKeySpace + myKeySpace, 0): 
                                                 m_Btree->ComputeIndexPageSize(leftCount+myCount, leftKeySpace+myKeySpace);
-                if (pageSize <= m_Btree->m_MaxPageSize)
+                if (pageSize <= m_Btree->m_PageSizePolicy.m_MaxPageSize)
                 {
-#ifdef DO_LOG
-                    MergeInfo::RecMerge('B', this, m_PageStatus.ReadLL(), leftPage, leftPsw, parent, parentPsw, nullptr, 0);
-#endif
                     btr = (IsLeafPage())? MergeLeafPages(leftPage, false, &newPage): MergeIndexPages(leftPage, false, &newPage);
                     rightPage = nullptr;
                     slotToDelete = mySlot - 1;
@@ -3203,11 +4363,8 @@ BTRESULT BtreePage::TryToMergePage(BtIterator* iter)
                 // Merge with right
                 UINT pageSize = (IsLeafPage())? m_Btree->ComputeLeafPageSize(rightCount + myCount, rightKeySpace + myKeySpace, 0):
                                                 m_Btree->ComputeIndexPageSize(rightCount + myCount, rightKeySpace+myKeySpace);
-                if (pageSize <= m_Btree->m_MaxPageSize)
+                if (pageSize <= m_Btree->m_PageSizePolicy.m_MaxPageSize)
                 {
-#ifdef DO_LOG
-                    MergeInfo::RecMerge('B', this, m_PageStatus.ReadLL(), rightPage, rightPsw, parent, parentPsw, nullptr, 0);
-#endif
                     btr = (IsLeafPage())? MergeLeafPages(rightPage, true, &newPage): MergeIndexPages(rightPage, true, &newPage);
                     leftPage = nullptr;
                     slotToDelete = mySlot;
@@ -3243,8 +4400,16 @@ BTRESULT BtreePage::TryToMergePage(BtIterator* iter)
      // All done - clean up
      if (btr == BT_SUCCESS)
      {
-         if (leftPage)  m_Btree->m_EpochMgr->Deallocate(leftPage, pageType);
-         if (rightPage) m_Btree->m_EpochMgr->Deallocate(rightPage, pageType);
+         if (IsIndexPage())
+         {
+             if (leftPage)  m_Btree->RetireIndexPage(leftPage);
+             if (rightPage) m_Btree->RetireIndexPage(rightPage);
+         }
+         else
+         {
+             if (leftPage)  m_Btree->m_EpochMgr->Deallocate(leftPage, pageType);
+             if (rightPage) m_Btree->m_EpochMgr->Deallocate(rightPage, pageType);
+         }
          m_Btree->m_nPageMerges++;
       }
      else
@@ -3279,9 +4444,9 @@ BTRESULT BtreePage::TryToMergePage(BtIterator* iter)
      PageStatus* src1Pst = (PageStatus*)(&src1Psw);
      LONGLONG    src2Psw = otherPsw;
      PageStatus* src2Pst = (PageStatus*)(&src2Psw);
-     LONGLONG    parentPsw = (parentIndx >= 0) ? iter->m_Path[parentIndx].m_PageStatus : 0;
+     LONGLONG    parentPsw = (parentIndx >= 0) ? iter->m_Path[parentIndx].m_PageStatus.ReadLL() : 0;
      PageStatus* parentPst = (PageStatus*)(&parentPsw); 
-     LONGLONG    grandParentPsw = (grandParentIndx >= 0) ? iter->m_Path[grandParentIndx].m_PageStatus : 0;
+     LONGLONG    grandParentPsw = (grandParentIndx >= 0) ? iter->m_Path[grandParentIndx].m_PageStatus.ReadLL() : 0;
      PageStatus* grandParentPst = (PageStatus*)(&grandParentPsw); 
      
 
@@ -3325,20 +4490,27 @@ BTRESULT BtreePage::TryToMergePage(BtIterator* iter)
      {
          if (newPage->IsIndexPage()) m_nIndexPages--;
          else                        m_nLeafPages--;
-     }
 
-#ifdef DO_LOG
-     if (installed)
-     {
-         MergeInfo::RecMerge('E', srcPage1, PageStatus::MakePageInactive(src1Psw), srcPage2, PageStatus::MakePageInactive(src2Psw),
-             parentPage, PageStatus::MakePageInactive(parentPsw), grandParentPage, PageStatus::IncrUpdateCount(grandParentPsw));
+         // The other source page is retired by the caller (see TryToMergePage)
+         RetirePage(srcPage1);
+         RetireIndexPage(parentPage);
      }
      else
      {
-         MergeInfo::RecMerge('E', srcPage1, src1Psw, srcPage2, src2Psw, parentPage, parentPsw, grandParentPage, grandParentPsw);
+         m_Contention.Count(CC_INSTALL_FAILED_MERGE);
+     }
 
+     TraceEvent* ev = m_Tracer.NewEvent(TE_MERGE, btr);
+     if (ev)
+     {
+         if (srcPage1->IsIndexPage()) ev->m_Type |= TraceIndexPage;
+         ev->m_Page = ULONGLONG(srcPage1);
+         ev->m_Status = src1Psw;
+         ev->m_Parent = ULONGLONG(parentPage);
+         ev->m_ParentStatus = parentPsw;
+         ev->m_NewPage = ULONGLONG(newPage);
+         ev->m_Arg = ULONGLONG(srcPage2);
      }
-#endif
   
      return btr;
  }
@@ -3363,30 +4535,35 @@ BTRESULT BtreePage::TryToMergePage(BtIterator* iter)
 
    BTRESULT btr = BT_SUCCESS;
 
-   KeyPtrPair* leftSortedArr = nullptr;
-   char* leftBase = nullptr;
+   BtreePage* leftPage = (mergeOnRight) ? this : otherPage;
+   BtreePage* rightPage = (mergeOnRight) ? otherPage : this;
+   LONGLONG leftPsw = (mergeOnRight) ? thisPsw : otherPsw;
+   LONGLONG rightPsw = (mergeOnRight) ? otherPsw : thisPsw;
+   UINT16* leftOrder = nullptr;
    UINT leftRecCount = 0;
    UINT leftKeySpace = 0;
-   KeyPtrPair* rightSortedArr = nullptr;
-   char* rightBase = nullptr;
+   UINT16* rightOrder = nullptr;
    UINT rightRecCount = 0;
    UINT rightKeySpace = 0;
+   UINT keySpace = 0;
+   UINT thisRecCount = 0;
+   UINT otherRecCount = 0;
+   double heat = 0.0;
 
    BtreePage* newLeafPage = nullptr;
    *newPage = nullptr;
-   if (mergeOnRight)
+
+   // A pending merge may be cancelled, so unfilled slots cannot be closed as for a split.
+   // Give up if an insert into either page has not completed yet.
+   if (InsertInProgress(thisPsw) || otherPage->InsertInProgress(otherPsw))
    {
-	 btr = ExtractLiveRecords(leftSortedArr, leftRecCount, leftKeySpace);
-	 leftBase = (char*)(this);
-	 btr = otherPage->ExtractLiveRecords(rightSortedArr, rightRecCount, rightKeySpace);
-	 rightBase = (char*)(otherPage);
+       return BT_NO_ACTION_TAKEN;
    }
-   else
+
+   btr = leftPage->OrderLiveSlots(((PageStatus*)(&leftPsw))->m_nUnsortedReserved, 0, leftOrder, leftRecCount, leftKeySpace);
+   if (btr == BT_SUCCESS)
    {
-	 btr = otherPage->ExtractLiveRecords(leftSortedArr, leftRecCount, leftKeySpace);
-	 leftBase = (char*)(otherPage);
-	 btr = ExtractLiveRecords(rightSortedArr, rightRecCount, rightKeySpace);
-	 rightBase = (char*)(this);
+	 btr = rightPage->OrderLiveSlots(((PageStatus*)(&rightPsw))->m_nUnsortedReserved, 1, rightOrder, rightRecCount, rightKeySpace);
    }
 
    // Check that the input pages haven't been modified
@@ -3397,8 +4574,11 @@ BTRESULT BtreePage::TryToMergePage(BtIterator* iter)
    }
 
  
-   UINT keySpace = leftKeySpace + rightKeySpace;
-   btr = m_Btree->AllocateLeafPage(leftRecCount + rightRecCount, keySpace, newLeafPage);
+   keySpace = leftKeySpace + rightKeySpace;
+   thisRecCount = (mergeOnRight) ? leftRecCount : rightRecCount;
+   otherRecCount = (mergeOnRight) ? rightRecCount : leftRecCount;
+   heat = max(m_Btree->LeafPageHeat(this, thisRecCount), m_Btree->LeafPageHeat(otherPage, otherRecCount));
+   btr = m_Btree->AllocateLeafPage(leftRecCount + rightRecCount, keySpace, newLeafPage, heat);
    if (btr != BT_SUCCESS)
    {
 	 goto exit;
@@ -3406,21 +4586,19 @@ BTRESULT BtreePage::TryToMergePage(BtIterator* iter)
    // Insert the records into the new page
    for (UINT i = 0; i < leftRecCount; i++)
    {
-	 KeyPtrPair* pre = &leftSortedArr[i];
-	 char* key = leftBase + pre->m_KeyOffset;
+	 KeyPtrPair* pre = &leftPage->m_RecordArr[leftOrder[i]];
+	 char* key = (char*)(leftPage) + pre->m_KeyOffset;
 	 newLeafPage->AppendToSortedSet(key, pre->m_KeyLen, pre->m_Pointer.Read());
    }
    for (UINT i = 0; i < rightRecCount; i++)
    {
-	 KeyPtrPair* pre = &rightSortedArr[i];
-	 char* key = rightBase + pre->m_KeyOffset;
+	 KeyPtrPair* pre = &rightPage->m_RecordArr[rightOrder[i]];
+	 char* key = (char*)(rightPage) + pre->m_KeyOffset;
 	 newLeafPage->AppendToSortedSet(key, pre->m_KeyLen, pre->m_Pointer.Read());
    }
    *newPage = newLeafPage;
 
  exit:
-   if (leftSortedArr) m_Btree->m_EpochMgr->DeallocateNow(leftSortedArr, MemObjectType::TmpPointerArray);
-   if (rightSortedArr) m_Btree->m_EpochMgr->DeallocateNow(rightSortedArr, MemObjectType::TmpPointerArray);
 
    if (btr != BT_SUCCESS)
    {
@@ -3432,132 +4610,12 @@ BTRESULT BtreePage::TryToMergePage(BtIterator* iter)
 
  }
 
-// Deafult function for comparing keys. Compares keys using strncmp.
+// Deafult function for comparing keys. Compares keys as unsigned byte strings (memcmp order),
+// see KeyEncoder.h for encoding typed and composite keys in this order.
+// Search and sort routines use DefaultKeyComparer directly.
 int DefaultCompareKeys(const void* key1, const int keylen1, const void* key2, const int keylen2)
 {
-  size_t minlen = min(keylen1, keylen2);
-  int res = strncmp((char*)(key1), (char*)(key2), minlen);
-  if (res == 0)
-  {
-	// The shorter one is earlier in sort order
-    if (keylen1 < keylen2) res = -1;
-	else if (keylen1 > keylen2) res = 1;
-  }
-  return res;
-}
-
-
-#ifdef DO_LOG
-volatile LONGLONG EventCounter = 0;
-LogRec  EventLog[MaxLogEntries];
-atomic_uint logPrintCount = 0;
-
-
-LogRec* NewEvent(char action, char BorE)
-{
-    _ASSERT(EventCounter < MaxLogEntries);
-  UINT64 pos = InterlockedIncrement64(&EventCounter) - 1;
-  LogRec* event = &EventLog[pos];
-  event->m_Time = pos;
-  event->m_ThreadId = GetCurrentThreadId();
-  event->m_Action = action;
-  event->m_BeginEnd = BorE;
-  return event;
-}
-
-void InsertInfo::RecInsert(char BorE, char* key, UINT keylen, BtreePage* page, LONGLONG pstatus, PathEntry* prior)
-{
-  LogRec* pre = NewEvent('I', BorE);
-  InsertInfo* pii = &pre->m_Insert;
-  pii->m_Key = key;
-  pii->m_KeyLen = keylen;
-  pii->m_Page = page;
-  pii->m_Status = pstatus;
-  if (prior)
-  {
-	pii->m_Prior = *prior;
-  }
-}
-
-void DeleteInfo::RecDelete(char BorE, char* key, UINT keylen, BtreePage* page, LONGLONG pstatus, PathEntry* prior, BTRESULT btr)
-{
-    LogRec* pre = NewEvent('D', BorE);
-    DeleteInfo* pii = &pre->m_Delete;
-    pii->m_Key = key;
-    pii->m_KeyLen = keylen;
-    pii->m_Page = page;
-    pii->m_Status = pstatus;
-    if (prior)
-    {
-        pii->m_Prior = *prior;
-    }
-    pii->m_btResult = btr;
-}
-
-void ConsInfo::RecCons(char BorE, BtreePage* trgt, LONGLONG status, BtreePage* newpage, LONGLONG newstatus, UINT reccount, BtreePage* ixPage, LONGLONG ixpStatus)
-{
-  LogRec* pre = NewEvent('C', BorE);
-  ConsInfo* pci = &pre->m_Cons;
-  pci->m_TrgPage = trgt;
-  pci->m_TrgtStatus = status;
-  pci->m_NewPage = newpage;
-  pci->m_NewStatus = newstatus;
-  pci->m_RecCount = reccount;
-  pci->m_IndexPage = ixPage;
-  pci->m_IndexPageStatus = ixpStatus;
-}
-
-void SplitInfo::RecSplit(char BorE, BtreePage* srcpage, LONGLONG srcstate, BtreePage* left, BtreePage* right)
-{
-  LogRec* pre = NewEvent('S', BorE);
-  SplitInfo* psi = &pre->m_Split;
-  psi->m_SrcPage = srcpage;
-  psi->m_SrcStatus = srcstate;
-  psi->m_LeftPage = left;
-  psi->m_RightPage = right;
-}
-
-void MergeInfo::RecMerge(char BorE, BtreePage* srcpage1, LONGLONG srcstate1, BtreePage* srcpage2, LONGLONG srcstate2,
-                         BtreePage* parentpage, LONGLONG parentstate, BtreePage* grandparentpage, LONGLONG grandparentstate)
-{
-    LogRec* pre = NewEvent('M', BorE);
-    MergeInfo* psi = &pre->m_Merge;
-    psi->m_SrcPage1 = srcpage1;
-    psi->m_SrcStatus1 = srcstate1;
-    psi->m_SrcPage2 = srcpage2;
-    psi->m_SrcStatus2 = srcstate2;
-    psi->m_ParentPage = parentpage;
-    psi->m_ParentStatus = parentstate;
-    psi->m_GrandParentPage = grandparentpage;
-    psi->m_GrandParentStatus = grandparentstate;
-}
-
-void DeletePageInfo::RecDeletePage(char BorE, BtreePage* page, LONGLONG status, BtreePage* parent, LONGLONG parentstatus)
-{
-    LogRec* pre = NewEvent('P', BorE);
-    DeletePageInfo* psi = &pre->m_DeletePage;
-    psi->m_Page = page;
-    psi->m_PageStatus = status;
-    psi->m_ParentPage = parent;
-    psi->m_ParentStatus = parentstatus;
-
+  return DefaultKeyComparer().Compare(key1, keylen1, key2, keylen2);
 }
 
 
-void PrintLog(FILE* file, int eventCount)
-{
-    logPrintCount++;
-    if (logPrintCount == 1)
-    {
-        fprintf(file, "====== Event log =======\n");
-
-        for (LONGLONG i = EventCounter - 1, cnt = 0; i >= 0, cnt < eventCount; i--, cnt++)
-        {
-            EventLog[i].Print(file);
-        }
-        fclose(file);
-    }
-    ExitThread(3);
-    
-}
-#endif DO_LOG
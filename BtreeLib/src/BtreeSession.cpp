@@ -0,0 +1,120 @@
+#include "Platform.h"
+#include "MemoryAllocator.h"
+#include "MemoryBroker.h"
+#include "mwCAS.h"
+#include "BtreeInternal.h"
+#include "BtreeSession.h"
+
+BtreeSession::BtreeSession(BtreeRoot* btree, UINT refreshInterval)
+  : m_Iter((BtreeRootInternal*)(btree))
+{
+  m_Btree = (BtreeRootInternal*)(btree);
+  m_RefreshInterval = max(refreshInterval, 1U);
+  m_nOps = 0;
+  m_EpochId = 0;
+  m_Btree->m_EpochMgr->EnterEpoch(&m_EpochId);
+}
+
+BtreeSession::~BtreeSession()
+{
+  m_Btree->m_EpochMgr->ExitEpoch(m_EpochId);
+}
+
+void BtreeSession::Refresh()
+{
+  PhaseProfiler* profiler = &m_Btree->m_Profiler;
+  profiler->Switch(m_Iter.m_Profile, PH_EXIT_EPOCH);
+  m_Btree->m_EpochMgr->ExitEpoch(m_EpochId);
+  profiler->Switch(m_Iter.m_Profile, PH_ENTER_EPOCH);
+  m_Btree->m_EpochMgr->EnterEpoch(&m_EpochId);
+  profiler->Switch(m_Iter.m_Profile, PH_OTHER);
+  m_nOps = 0;
+}
+
+BTRESULT BtreeSession::InsertRecord(KeyType* key, void* recptr)
+{
+  if (key == nullptr || key->m_pKeyValue == nullptr || key->m_KeyLen == 0 || recptr == nullptr)
+  {
+	return BT_INVALID_ARG;
+  }
+  m_Iter.m_Profile = m_Btree->m_Profiler.Begin(PROF_INSERT);
+  BTRESULT btr = m_Btree->DoInsertRecord(key, recptr, false, &m_Iter);
+  OperationDone();
+  return btr;
+}
+
+// Insert the record only if there is no record with the same key.
+BTRESULT BtreeSession::InsertIfAbsent(KeyType* key, void* recptr)
+{
+  if (key == nullptr || key->m_pKeyValue == nullptr || key->m_KeyLen == 0 || recptr == nullptr)
+  {
+	return BT_INVALID_ARG;
+  }
+  m_Iter.m_Profile = m_Btree->m_Profiler.Begin(PROF_INSERT);
+  BTRESULT btr = m_Btree->DoInsertRecord(key, recptr, true, &m_Iter);
+  OperationDone();
+  return btr;
+}
+
+BTRESULT BtreeSession::LookupRecord(KeyType* key, void*& recFound)
+{
+  if (key == nullptr || key->m_pKeyValue == nullptr || key->m_KeyLen == 0)
+  {
+	return BT_INVALID_ARG;
+  }
+  m_Iter.m_Profile = m_Btree->m_Profiler.Begin(PROF_LOOKUP);
+  BTRESULT btr = m_Btree->DoLookupRecord(key, recFound, &m_Iter);
+  OperationDone();
+  return btr;
+}
+
+BTRESULT BtreeSession::DeleteRecord(KeyType* key)
+{
+  if (key == nullptr || key->m_pKeyValue == nullptr || key->m_KeyLen == 0)
+  {
+	return BT_INVALID_ARG;
+  }
+  m_Iter.m_Profile = m_Btree->m_Profiler.Begin(PROF_DELETE);
+  BTRESULT btr = m_Btree->DoDeleteRecord(key, &m_Iter);
+  OperationDone();
+  return btr;
+}
+
+BTRESULT BtreeSession::UpdateRecord(KeyType* key, void* newRec, void*& oldRec)
+{
+  oldRec = nullptr;
+  if (key == nullptr || key->m_pKeyValue == nullptr || key->m_KeyLen == 0 || newRec == nullptr)
+  {
+	return BT_INVALID_ARG;
+  }
+  m_Iter.m_Profile = m_Btree->m_Profiler.Begin(PROF_UPDATE);
+  BTRESULT btr = m_Btree->DoUpdateRecord(key, nullptr, newRec, oldRec, &m_Iter);
+  OperationDone();
+  return btr;
+}
+
+BTRESULT BtreeSession::UpsertRecord(KeyType* key, void* recptr)
+{
+  if (key == nullptr || key->m_pKeyValue == nullptr || key->m_KeyLen == 0 || recptr == nullptr)
+  {
+	return BT_INVALID_ARG;
+  }
+  m_Iter.m_Profile = m_Btree->m_Profiler.Begin(PROF_UPDATE);
+  BTRESULT btr = m_Btree->DoUpsertRecord(key, recptr, &m_Iter);
+  OperationDone();
+  return btr;
+}
+
+// Replace the record pointer only if it still equals expectedRec.
+BTRESULT BtreeSession::CompareAndSwapRecord(KeyType* key, void* expectedRec, void* newRec)
+{
+  if (key == nullptr || key->m_pKeyValue == nullptr || key->m_KeyLen == 0 || expectedRec == nullptr || newRec == nullptr)
+  {
+	return BT_INVALID_ARG;
+  }
+  void* oldRec = nullptr;
+  m_Iter.m_Profile = m_Btree->m_Profiler.Begin(PROF_UPDATE);
+  BTRESULT btr = m_Btree->DoUpdateRecord(key, expectedRec, newRec, oldRec, &m_Iter);
+  OperationDone();
+  return btr;
+}
@@ -0,0 +1,57 @@
+#include "ContentionStats.h"
+
+const char* ContentionCounterName[CC_COUNT] =
+{
+  "restart_index_inactive", "restart_index_changed", "restart_index_split", "restart_index_merge",
+  "restart_leaf_inactive", "restart_leaf_maintenance", "restart_leaf_changed", "restart_leaf_read_hot",
+  "restart_from_root",
+  "retry_insert_not_inserted", "retry_insert_page_full", "retry_lookup", "retry_delete", "retry_update",
+  "add_page_busy", "add_wait_for_insert", "add_reserve_failed", "add_slot_closed",
+  "install_failed_consolidate", "install_failed_split", "install_failed_merge", "install_failed_page_delete",
+  "install_failed_perm_array",
+  "shadow_stale"
+};
+
+void ContentionCounters::Clear()
+{
+  for (UINT i = 0; i < ThreadSlots<ThreadCounts>::MaxThreads; i++)
+  {
+	ThreadCounts* counts = m_Threads.At(i);
+	if (counts) memset(counts->m_Counts, 0, sizeof(counts->m_Counts));
+  }
+  GetMwCasStats(&m_MwCasBase);
+}
+
+void ContentionCounters::GetStats(ContentionStats* stats)
+{
+  stats->Clear();
+  for (UINT i = 0; i < ThreadSlots<ThreadCounts>::MaxThreads; i++)
+  {
+	ThreadCounts* counts = m_Threads.At(i);
+	if (!counts) continue;
+	for (UINT c = 0; c < CC_COUNT; c++)
+	{
+	  stats->m_Counts[c] += counts->m_Counts[c];
+	}
+  }
+
+  // Level 0 counts operations called by their owner, higher levels calls made to help
+  MwCasStats mwcas;
+  GetMwCasStats(&mwcas);
+  for (UINT32 l = 0; l < s_MaxStatsDepth; l++)
+  {
+	MwCasCounts& cur = mwcas.Counts[l];
+	MwCasCounts& base = m_MwCasBase.Counts[l];
+	ULONG attempts = cur.m_Attempts - base.m_Attempts;
+	if (l == 0)
+	{
+	  stats->m_MwCasOps += attempts;
+	  stats->m_MwCasFailed += cur.m_Failed - base.m_Failed;
+	}
+	else
+	{
+	  stats->m_MwCasHelps += attempts;
+	  stats->m_MwCasHelpsBailed += cur.m_Bailed - base.m_Bailed;
+	}
+  }
+}
@@ -22,8 +22,10 @@
 *
 * Paul Larson, gpalarson@outlook.com, October 2016
 * ================================================================================= */
-#include <Windows.h>
+#include "Platform.h"
+#ifdef _WIN32
 #include <crtdbg.h>
+#endif
 #include "Utilities.h"
 #include "MemoryBroker.h"
 #include "EpochManager.h"
@@ -60,11 +62,16 @@ EpochManager::EpochManager()
     :
   m_IsReadyForUse(false),
     m_nCurrentEpoch(0),
-    m_nMemoryAllocatedCountInGC(0),
-    m_pFinalizeContext(nullptr),
-    m_finalizeCallback(nullptr),
 	m_CentralDeallocationList(nullptr),
-    m_nCentralQueueSize(0)
+    m_nCentralQueueSize(0),
+    m_finalizeCallback(nullptr),
+    m_pFinalizeContext(nullptr),
+    m_nMemoryAllocatedCountInGC(0),
+    m_nLimboSoftLimit(EpochManager::LimboSoftLimitDefault),
+    m_nLimboHardLimit(EpochManager::LimboHardLimitDefault),
+    m_nAggressiveDrains(0),
+    m_nThrottledWriters(0),
+    m_pMemoryBroker(nullptr)
 {}
 
 
@@ -92,6 +99,7 @@ __checkReturn HRESULT EpochManager::Initialize(
     m_pMemoryBroker = pMemoryBroker;
     m_pFinalizeContext = pFinalizeContext;
     m_finalizeCallback = finalizeCallback;
+	m_epochs[GetCurrentInternalEpoch()].m_StartTime = GetTickCount64();
 	m_IsReadyForUse = true;
 
     return S_OK;
@@ -160,6 +168,14 @@ __checkReturn HRESULT EpochManager::EnterEpoch(
 
     HRESULT hr = S_OK;
 
+	// Apply backpressure if limbo memory is above the hard limit. This is done before
+	// joining an epoch, as a member the thread would itself hold up draining.
+	if (!bIsReader && m_nMemoryAllocatedCountInGC > m_nLimboHardLimit)
+	{
+	  hr = ThrottleOnLimboSize();
+	  if (FAILED(hr)) return hr;
+	}
+
     Epoch* pCurrentEpoch = &(m_epochs[GetCurrentInternalEpoch()]);
     if(!bIsReader && pCurrentEpoch->m_nItemCount > EpochManager::EpochAdvanceThreshold)
     {
@@ -209,7 +225,7 @@ __checkReturn HRESULT EpochManager::EnterEpoch(
     if(!bIsReader)
     {
         // Try to do some work to dealloc from previous epoch. 
-        hr = DoDeallocationWork(EpochManager::DeallocCountLarge);
+        hr = DoDeallocationWork(DeallocationBatchSize(EpochManager::DeallocCountLarge));
         if(FAILED(hr)) return hr;
     }
 
@@ -297,6 +313,7 @@ __checkReturn HRESULT EpochManager::TryAdvanceEpoch()
     __int64 nCurrentExternalEpochValue = GetCurrentExternalEpoch();
     __int64 nNextEpochIdInternal       = GetNextEpochValueInternal();
     Epoch* pNextEpoch = &(m_epochs[nNextEpochIdInternal]);
+    __int64 nNextEpochIdExternal = 0;
 
     // We can only advance the epoch if the previous epoch has no members
 	// becasue the previous epoch becomes the new current epoch
@@ -324,7 +341,8 @@ __checkReturn HRESULT EpochManager::TryAdvanceEpoch()
 
     // No need for an atomic op here. This thread has write exclusion to
     // m_nCurrentEpoch, so just use StRel.
-    __int64 nNextEpochIdExternal = GetNextEpochValueExternal();
+    pNextEpoch->m_StartTime = GetTickCount64();
+    nNextEpochIdExternal = GetNextEpochValueExternal();
     StoreWithRelease<__int64>(&m_nCurrentEpoch, nNextEpochIdExternal);
 
     if(nNextEpochIdExternal != m_nCurrentEpoch)
@@ -379,16 +397,18 @@ __checkReturn HRESULT EpochManager::Deallocate(
 	ULONG nGCSize = 0;
 	hr = m_pMemoryBroker->GetAllocatedSize(pvDeallocObject, &nSize);
  	hr = m_pMemoryBroker->GetAlignedAllocatedSize(pDeallocNode, &nGCSize);
+	pDeallocNode->m_nSize = nSize + nGCSize;
     ::InterlockedIncrement64(&pCurrentEpoch->m_nItemCount);
 	::InterlockedExchangeAdd64(&m_nMemoryAllocatedCountInGC, (__int64)(nSize + nGCSize));
 
 
     // Look for dealloc work to do from previous epoch(s).
-    hr = DoDeallocationWork(EpochManager::DeallocCountSmall);
+    hr = DoDeallocationWork(DeallocationBatchSize(EpochManager::DeallocCountSmall));
     if(FAILED(hr)) return hr;
 
-    // Try to advance epoch if deallocation queue grows too large.
-    if(pCurrentEpoch->m_nItemCount > EpochManager::EpochAdvanceThreshold)
+    // Try to advance epoch if deallocation queue or limbo memory grows too large.
+    if(pCurrentEpoch->m_nItemCount > EpochManager::EpochAdvanceThreshold ||
+	   m_nMemoryAllocatedCountInGC > m_nLimboSoftLimit)
     {
         HRESULT hr = TryAdvanceEpoch();
         if(FAILED(hr)) return hr;
@@ -398,6 +418,101 @@ __checkReturn HRESULT EpochManager::Deallocate(
 }
 
 
+// Returns the number of items a thread should deallocate when doing deallocation work.
+// The normal count is used unless limbo memory exceeds the soft limit in which case
+// the batch size is escalated. Called on every epoch entry, so it only reads shared state;
+// DoDeallocationWork counts the escalated batches that deallocate anything.
+//
+__checkReturn int EpochManager::DeallocationBatchSize(
+  __in int nNormalCount)								// batch size when limbo memory is below the soft limit
+{
+  if (m_nMemoryAllocatedCountInGC <= m_nLimboSoftLimit || m_nCentralQueueSize <= 0)
+  {
+	return nNormalCount;
+  }
+  return EpochManager::DeallocCountAggressive;
+}
+
+
+// Throttle a thread entering an epoch while limbo memory is above the hard limit.
+// The thread drains the central deallocation list and tries to advance the epoch,
+// sleeping between attempts, until limbo memory drops below the hard limit.
+// The thread may still be a member of an epoch through an outer call, so it does not
+// wait indefinitely for limbo to drain - the number of attempts is bounded by ThrottleRetryLimit.
+// Return values:
+// S_OK		  throttling completed (limbo memory may still be above the hard limit)
+// Function can also return errors from deallocation or epoch advancement.
+//
+__checkReturn HRESULT EpochManager::ThrottleOnLimboSize()
+{
+  HRESULT hr = S_OK;
+  ::InterlockedIncrement64(&m_nThrottledWriters);
+
+  for (ULONG attempt = 0; attempt < EpochManager::ThrottleRetryLimit; attempt++)
+  {
+	hr = DoDeallocationWork(EpochManager::DrainQueueDeallocCount);
+	if (FAILED(hr)) return hr;
+
+	hr = TryAdvanceEpoch();
+	if (FAILED(hr)) return hr;
+
+	if (m_nMemoryAllocatedCountInGC <= m_nLimboHardLimit) break;
+
+	::Sleep(EpochManager::ThrottleSleepMs);
+  }
+
+  return S_OK;
+}
+
+
+// Set the limbo memory limits. Limbo memory above nSoftLimitBytes escalates deallocation work,
+// limbo memory above nHardLimitBytes also throttles threads that free objects.
+//
+void EpochManager::SetLimboLimits(
+  __in __int64 nSoftLimitBytes,		// escalate deallocation work above this limit
+  __in __int64 nHardLimitBytes)		// throttle threads freeing objects above this limit
+{
+  _ASSERTE(nSoftLimitBytes <= nHardLimitBytes);
+  m_nLimboSoftLimit = nSoftLimitBytes;
+  m_nLimboHardLimit = max(nSoftLimitBytes, nHardLimitBytes);
+}
+
+
+// Returns a snapshot of the limbo memory metrics. The counters are read without synchronization
+// so the snapshot is approximate.
+//
+void EpochManager::GetLimboStats(__out EpochLimboStats* pStats)
+{
+  if (!pStats) return;
+
+  __int64 nCurrentEpoch = GetCurrentExternalEpoch();
+  Epoch* pCurrentEpoch = &m_epochs[TranslateToInternalEpoch(nCurrentEpoch)];
+  Epoch* pPrevEpoch = &m_epochs[TranslateToInternalEpoch(nCurrentEpoch + 1)];
+
+  pStats->m_nLimboBytes = m_nMemoryAllocatedCountInGC;
+  pStats->m_nCentralQueueItems = m_nCentralQueueSize;
+  pStats->m_nLimboItems = m_nCentralQueueSize + pCurrentEpoch->m_nItemCount + pPrevEpoch->m_nItemCount;
+  pStats->m_nCurrentEpoch = nCurrentEpoch;
+
+  // Age of the oldest epoch that has members, zero if none has. A thread that stays in an epoch
+  // for a long time blocks advancement so the age of its epoch keeps growing.
+  ULONGLONG startTime = 0;
+  if (pCurrentEpoch->m_nMemberCount > 0)
+  {
+	startTime = pCurrentEpoch->m_StartTime;
+  }
+  if (pPrevEpoch->m_nMemberCount > 0 && pPrevEpoch->m_StartTime > 0 && (startTime == 0 || pPrevEpoch->m_StartTime < startTime))
+  {
+	startTime = pPrevEpoch->m_StartTime;
+  }
+  ULONGLONG now = GetTickCount64();
+  pStats->m_OldestEpochAgeMs = (startTime > 0 && now > startTime) ? (__int64)(now - startTime) : 0;
+
+  pStats->m_nAggressiveDrains = m_nAggressiveDrains;
+  pStats->m_nThrottledWriters = m_nThrottledWriters;
+}
+
+
 // Help along in peforming deallocation work from the central deallocation
 // list. Attempt to perform nDeallocateCount deallocations. All work items are
 // guaranteed to be safe for deallocation, i.e., they cannot be derefenced by
@@ -429,6 +544,10 @@ __checkReturn HRESULT EpochManager::DoDeallocationWork(
     }
     ::InterlockedAdd64(&m_nCentralQueueSize, -nCurrDeallocCount);
 
+    if(nDeallocationCount == EpochManager::DeallocCountAggressive && nCurrDeallocCount > 0)
+    {
+        ::InterlockedIncrement64(&m_nAggressiveDrains);
+    }
 
     return hr;
 }
@@ -480,6 +599,7 @@ __checkReturn HRESULT EpochManager::DeallocateItem(__in GCItem* pItem)
     if(!pItem) return E_POINTER;
 
     if(m_finalizeCallback ) m_finalizeCallback(m_pFinalizeContext, pItem->m_pDataObject, pItem->m_ItemType);
+	::InterlockedExchangeAdd64(&m_nMemoryAllocatedCountInGC, -(__int64)(pItem->m_nSize));
 
    HRESULT hr = m_pMemoryBroker->FreeAligned(pItem, MEMORY_ALLOCATION_ALIGNMENT, MemObjectType::GCItemObj);
  
@@ -0,0 +1,71 @@
+#include "EventTrace.h"
+
+const char* TraceEventName[TE_COUNT] =
+{
+  "none", "insert", "delete", "consolidate", "split", "merge", "page_delete"
+};
+
+thread_local UINT32 EventTracer::t_ThreadId = 0;
+
+void EventTracer::Enable(UINT32 mask, UINT32 sampleRate)
+{
+  if (mask != 0 && m_Mask == 0)
+  {
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	m_StartTime = now.QuadPart;
+	m_StartTicks = __rdtsc();
+  }
+  m_SampleRate = (sampleRate > 0) ? sampleRate : 1;
+  m_Mask = mask & TraceAllEvents;
+}
+
+LONGLONG EventTracer::Dump(FILE* file)
+{
+  EventTraceHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.m_Magic, EventTraceMagic, sizeof(hdr.m_Magic));
+  hdr.m_EventSize = sizeof(TraceEvent);
+  hdr.m_StartTicks = m_StartTicks;
+
+  // Nanoseconds per tick over the time since tracing was enabled
+  LARGE_INTEGER now, freq;
+  QueryPerformanceCounter(&now);
+  QueryPerformanceFrequency(&freq);
+  ULONGLONG ticks = __rdtsc() - m_StartTicks;
+  double elapsedNs = double(now.QuadPart - m_StartTime) * 1e9 / double(freq.QuadPart);
+  hdr.m_NsPerTick = (m_StartTicks > 0 && ticks > 0) ? elapsedNs / double(ticks) : 1.0;
+
+  // Fix the number of events in each ring before writing, the header goes first
+  ULONGLONG next[ThreadSlots<Ring>::MaxThreads];
+  for (UINT i = 0; i < ThreadSlots<Ring>::MaxThreads; i++)
+  {
+	Ring* ring = m_Rings.At(i);
+	next[i] = (ring) ? ring->m_Next : 0;
+	if (next[i] == 0) continue;
+	ULONGLONG count = (next[i] < RingSize) ? next[i] : RingSize;
+	hdr.m_ThreadCount++;
+	hdr.m_EventCount += count;
+	hdr.m_Overwritten += next[i] - count;
+  }
+
+  if (fwrite(&hdr, sizeof(hdr), 1, file) != 1) return -1;
+
+  for (UINT i = 0; i < ThreadSlots<Ring>::MaxThreads; i++)
+  {
+	if (next[i] == 0) continue;
+	Ring* ring = m_Rings.At(i);
+	ULONGLONG count = (next[i] < RingSize) ? next[i] : RingSize;
+
+	// Oldest first, in up to two pieces if the ring has wrapped around
+	UINT first = UINT((next[i] - count) & (RingSize - 1));
+	UINT piece = UINT((count < RingSize - first) ? count : RingSize - first);
+	if (fwrite(&ring->m_Events[first], sizeof(TraceEvent), piece, file) != piece) return -1;
+	if (count > piece)
+	{
+	  UINT rest = UINT(count - piece);
+	  if (fwrite(&ring->m_Events[0], sizeof(TraceEvent), rest, file) != rest) return -1;
+	}
+  }
+  return LONGLONG(hdr.m_EventCount);
+}
@@ -0,0 +1,53 @@
+#include "LatencyRecorder.h"
+
+const char* LatencyOpName[LAT_OP_COUNT] =
+{
+  "insert", "lookup", "delete", "update", "consolidate", "split", "merge", "page_delete"
+};
+
+#ifdef BTREE_LATENCY_HISTOGRAMS
+
+void LatencyRecorder::Clear()
+{
+  for (UINT i = 0; i < ThreadSlots<ThreadHistograms>::MaxThreads; i++)
+  {
+	ThreadHistograms* hist = m_Threads.At(i);
+	if (!hist) continue;
+	for (UINT op = 0; op < LAT_OP_COUNT; op++)
+	{
+	  hist->m_Histograms[op].Reset();
+	}
+  }
+
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  m_StartTime = now.QuadPart;
+  m_StartTicks = __rdtsc();
+}
+
+void LatencyRecorder::GetSummary(LatencyOp op, LatencySummary* summary)
+{
+  LatencyHistogram merged;
+  for (UINT i = 0; i < ThreadSlots<ThreadHistograms>::MaxThreads; i++)
+  {
+	ThreadHistograms* hist = m_Threads.At(i);
+	if (hist) merged.Merge(hist->m_Histograms[op]);
+  }
+
+  // Nanoseconds per tick over the time since the start
+  LARGE_INTEGER now, freq;
+  QueryPerformanceCounter(&now);
+  QueryPerformanceFrequency(&freq);
+  ULONGLONG ticks = __rdtsc() - m_StartTicks;
+  double elapsedNs = double(now.QuadPart - m_StartTime) * 1e9 / double(freq.QuadPart);
+  double nsPerTick = (ticks > 0) ? elapsedNs / double(ticks) : 1.0;
+
+  summary->m_Count = merged.Count();
+  summary->m_Mean = merged.Mean() * nsPerTick;
+  summary->m_P50 = ULONGLONG(merged.Percentile(50.0) * nsPerTick);
+  summary->m_P99 = ULONGLONG(merged.Percentile(99.0) * nsPerTick);
+  summary->m_P999 = ULONGLONG(merged.Percentile(99.9) * nsPerTick);
+  summary->m_Max = ULONGLONG(merged.Max() * nsPerTick);
+}
+
+#endif // BTREE_LATENCY_HISTOGRAMS
@@ -9,8 +9,10 @@
 * Paul Larson, gpalarson@outlook.com, Dec 2016
 ==========================================================================================*/
 
-#include <Windows.h>
+#include "Platform.h"
+#ifdef _WIN32
 #include <crtdbg.h>
+#endif
 #include <stdio.h>
 #include "MemoryBroker.h"
 #include "BtreeInternal.h"
@@ -151,10 +153,8 @@ __checkReturn HRESULT MemoryBroker::Free(__in void* pBytes, __in MemObjectType t
   ULONG nAllocatedSize = 0;
   HRESULT hr = m_pMemoryAllocator->GetAllocatedSize(pBytes, &nAllocatedSize);
   
-#ifndef DO_LOG
   hr = m_pMemoryAllocator->Free(pBytes);
   if (FAILED(hr)) return hr;
-#endif
  
   ::InterlockedExchangeAdd64(&m_nMemoryAllocatedCount, -(__int64)(nAllocatedSize));
 
@@ -182,11 +182,8 @@ __checkReturn HRESULT MemoryBroker::FreeAligned(__in void* pBytes, __in DWORD nA
   ULONG nAllocatedSize = 0;
   HRESULT hr = m_pMemoryAllocator->GetAlignedAllocatedSize(pBytes, &nAllocatedSize);
  
-#ifdef DO_LOG
-  // Don't free memory if we are logging actions 
   hr = m_pMemoryAllocator->FreeAligned(pBytes, nAlignment);
   if (FAILED(hr)) return hr;
-#endif
 
   ::InterlockedExchangeAdd64(&m_nMemoryAllocatedCount, -(__int64)(nAllocatedSize));
 
@@ -0,0 +1,81 @@
+#include "PhaseProfiler.h"
+
+const char* ProfileOpName[PROF_OP_COUNT] =
+{
+  "insert", "lookup", "delete", "update"
+};
+
+const char* ProfilePhaseName[PH_COUNT] =
+{
+  "enter_epoch", "find_target", "key_search", "update_page", "maintenance", "exit_epoch", "other"
+};
+
+// The sample is the one of the calling thread (see Begin)
+void PhaseProfiler::EndSample(PhaseSample* sample)
+{
+  ThreadProfile* prof = m_Threads.Get();
+  _ASSERTE(prof && sample == &prof->m_Sample);
+  ULONGLONG now = __rdtsc();
+  sample->m_Ticks[sample->m_Phase] += now - sample->m_Last;
+
+  ProfileOp op = prof->m_Op;
+  prof->m_Samples[op]++;
+  prof->m_Total[op] += now - sample->m_Start;
+  for (UINT p = 0; p < PH_COUNT; p++)
+  {
+	prof->m_Ticks[op][p] += sample->m_Ticks[p];
+  }
+  prof->m_Active = false;
+}
+
+void PhaseProfiler::Clear()
+{
+  for (UINT i = 0; i < ThreadSlots<ThreadProfile>::MaxThreads; i++)
+  {
+	ThreadProfile* prof = m_Threads.At(i);
+	if (!prof) continue;
+	memset(prof->m_Samples, 0, sizeof(prof->m_Samples));
+	memset(prof->m_Total, 0, sizeof(prof->m_Total));
+	memset(prof->m_Ticks, 0, sizeof(prof->m_Ticks));
+  }
+
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  m_StartTime = now.QuadPart;
+  m_StartTicks = __rdtsc();
+}
+
+void PhaseProfiler::GetProfile(ProfileOp op, PhaseProfile* profile)
+{
+  ULONGLONG samples = 0;
+  ULONGLONG total = 0;
+  ULONGLONG ticks[PH_COUNT];
+  memset(ticks, 0, sizeof(ticks));
+  for (UINT i = 0; i < ThreadSlots<ThreadProfile>::MaxThreads; i++)
+  {
+	ThreadProfile* prof = m_Threads.At(i);
+	if (!prof) continue;
+	samples += prof->m_Samples[op];
+	total += prof->m_Total[op];
+	for (UINT p = 0; p < PH_COUNT; p++)
+	{
+	  ticks[p] += prof->m_Ticks[op][p];
+	}
+  }
+
+  // Nanoseconds per tick over the time since the start
+  LARGE_INTEGER now, freq;
+  QueryPerformanceCounter(&now);
+  QueryPerformanceFrequency(&freq);
+  ULONGLONG elapsed = __rdtsc() - m_StartTicks;
+  double elapsedNs = double(now.QuadPart - m_StartTime) * 1e9 / double(freq.QuadPart);
+  double nsPerTick = (elapsed > 0) ? elapsedNs / double(elapsed) : 1.0;
+  double scale = (samples > 0) ? nsPerTick / double(samples) : 0.0;
+
+  profile->m_Samples = samples;
+  profile->m_Total = double(total) * scale;
+  for (UINT p = 0; p < PH_COUNT; p++)
+  {
+	profile->m_Phases[p] = double(ticks[p]) * scale;
+  }
+}
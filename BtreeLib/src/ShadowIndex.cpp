@@ -0,0 +1,224 @@
+#include "Platform.h"
+#include "MemoryAllocator.h"
+#include "MemoryBroker.h"
+#include "mwCAS.h"
+#include "BtreeInternal.h"
+#include "ShadowIndex.h"
+
+static char* AlignToCacheLine(char* ptr)
+{
+  return (char*)((UINT_PTR(ptr) + ShadowIndex::CacheLineSize - 1) & ~UINT_PTR(ShadowIndex::CacheLineSize - 1));
+}
+
+// Returns the first eight bytes of the key as a big-endian integer so that integer
+// comparison of prefixes agrees with the key comparison function. Keys shorter than 
+// eight bytes are padded with zero bytes. Keys with equal prefixes must be compared in full.
+ULONGLONG ShadowIndex::KeyPrefix(const char* key, UINT keyLen)
+{
+  ULONGLONG prefix = 0;
+  UINT len = min(keyLen, UINT(sizeof(ULONGLONG)));
+  for (UINT i = 0; i < len; i++)
+  {
+	prefix |= ULONGLONG(BYTE(key[i])) << (8 * (sizeof(ULONGLONG) - 1 - i));
+  }
+  return prefix;
+}
+
+// Returns the position of the first separator that is greater than or equal to the key.
+// The last separator on an index page is the high bound so it is returned for any higher key.
+int ShadowIndex::SearchNode(ShadowNode* node, ULONGLONG keyPrefix, KeyType* key)
+{
+  DefaultKeyComparer comparer;
+  ULONGLONG* prefixes = &m_Prefixes[node->m_FirstEntry];
+  UINT low = 0;
+  UINT high = node->m_Count - 1;
+  while (low < high)
+  {
+	UINT mid = (low + high) / 2;
+	int cv = 0;
+	if (keyPrefix < prefixes[mid])		cv = -1;
+	else if (keyPrefix > prefixes[mid]) cv = 1;
+	else
+	{
+	  ShadowEntry* entry = &m_Entries[node->m_FirstEntry + mid];
+	  cv = comparer.Compare(key->m_pKeyValue, key->m_KeyLen, entry->m_Separator, entry->m_SepLen);
+	}
+	if (cv <= 0) high = mid;
+	else         low = mid + 1;
+  }
+  return int(low);
+}
+
+// Descend through the shadow index, adding the index pages passed to the path of the iterator.
+// The status of each index page is checked before its node is used. The descent stops
+// when a page has changed (stale is then set) or the last copied level has been passed.
+// Returns the number of index levels passed, nextPage is set to the page to continue from.
+UINT ShadowIndex::Descend(BtreeRootInternal* btree, KeyType* key, BtIterator* iter, BtreePage*& nextPage, bool& stale)
+{
+  UINT levels = 0;
+  stale = false;
+
+  ShadowNode* node = &m_Nodes[0];
+  if (node->m_Page != (BtreePage*)(btree->m_RootPage.ReadPP()))
+  {
+	// Root page has changed
+	stale = true;
+	return 0;
+  }
+
+  ULONGLONG keyPrefix = KeyPrefix(key->m_pKeyValue, key->m_KeyLen);
+  while (node)
+  {
+	LONGLONG psw = node->m_Page->m_PageStatus.ReadLL();
+	if (psw != node->m_PageStatus)
+	{
+	  stale = true;
+	  break;
+	}
+
+	int slot = SearchNode(node, keyPrefix, key);
+	ShadowEntry* entry = &m_Entries[node->m_FirstEntry + slot];
+	iter->ExtendPath(node->m_Page, slot, psw, entry->m_Separator, entry->m_SepLen, entry->m_Child);
+	nextPage = entry->m_Child;
+	levels++;
+
+	node = (node->m_FirstChild != NoChild) ? &m_Nodes[node->m_FirstChild + slot] : nullptr;
+  }
+  return levels;
+}
+
+// Build a shadow index of the top index levels of the tree. The caller must be in an epoch.
+// Returns null if the tree is too small or an index page changed during the build.
+ShadowIndex* ShadowIndex::Build(BtreeRootInternal* btree, LONGLONG version)
+{
+  BtreePage* pages[MaxNodes];
+  UINT levelStart[MaxLevels + 1];
+  ShadowIndex* shadow = nullptr;
+  UINT nrNodes = 0;
+  UINT nrLevels = 0;
+  UINT nrEntries = 0;
+  UINT size = 0;
+  char* ptr = nullptr;
+  HRESULT hr = S_OK;
+
+  BtreePage* root = (BtreePage*)(btree->m_RootPage.ReadPP());
+  if (root == nullptr || !root->IsIndexPage())
+  {
+	goto exit;
+  }
+
+  // Determine how many index levels to copy. The tree is balanced so the leftmost
+  // path gives the height. The level just above the leaf pages is not copied because
+  // its pages change every time a leaf page is consolidated, split or merged.
+  {
+	UINT indexLevels = 0;
+	BtreePage* page = root;
+	while (page && page->IsIndexPage())
+	{
+	  indexLevels++;
+	  page = (BtreePage*)(page->m_RecordArr[0].m_Pointer.ReadPP());
+	}
+	nrLevels = min(UINT(MaxLevels), indexLevels - 1);
+  }
+  if (nrLevels == 0)
+  {
+	goto exit;
+  }
+
+  // Collect the index pages level by level
+  pages[nrNodes++] = root;
+  levelStart[0] = 0;
+  for (UINT level = 0; level < nrLevels; level++)
+  {
+	levelStart[level + 1] = nrNodes;
+	for (UINT i = levelStart[level]; i < levelStart[level + 1]; i++)
+	{
+	  BtreePage* page = pages[i];
+	  nrEntries += (page->m_nSortedSet + PrefixesPerLine - 1) & ~(PrefixesPerLine - 1);
+	  if (level + 1 == nrLevels) continue;
+
+	  for (UINT slot = 0; slot < page->m_nSortedSet; slot++)
+	  {
+		if (nrNodes >= MaxNodes) goto exit;
+		pages[nrNodes++] = (BtreePage*)(page->m_RecordArr[slot].m_Pointer.ReadPP());
+	  }
+	}
+  }
+
+  // Allocate the shadow index as a single block with the node and prefix arrays cache line aligned
+  size = sizeof(ShadowIndex) + CacheLineSize + nrNodes * sizeof(ShadowNode) + CacheLineSize
+		 + nrEntries * (sizeof(ULONGLONG) + sizeof(ShadowEntry));
+  hr = btree->m_MemoryBroker->Allocate(size, (void**)(&shadow), MemObjectType::ShadowIndexObj);
+  if (hr != S_OK || shadow == nullptr)
+  {
+	shadow = nullptr;
+	goto exit;
+  }
+
+  ptr = AlignToCacheLine((char*)(shadow) + sizeof(ShadowIndex));
+  shadow->m_Nodes = (ShadowNode*)(ptr);
+  ptr = AlignToCacheLine(ptr + nrNodes * sizeof(ShadowNode));
+  shadow->m_Prefixes = (ULONGLONG*)(ptr);
+  shadow->m_Entries = (ShadowEntry*)(ptr + nrEntries * sizeof(ULONGLONG));
+  shadow->m_Version = version;
+  shadow->m_nLevels = nrLevels;
+  shadow->m_nNodes = nrNodes;
+
+  // Copy the index pages. A page must be stable, that is, active, without pending
+  // actions and with the same status before and after copying.
+  {
+	UINT entryPos = 0;
+	UINT nextChild = 1;
+	for (UINT level = 0; level < nrLevels; level++)
+	{
+	  for (UINT i = levelStart[level]; i < levelStart[level + 1]; i++)
+	  {
+		BtreePage* page = pages[i];
+		ShadowNode* node = &shadow->m_Nodes[i];
+		LONGLONG psw = page->m_PageStatus.ReadLL();
+		PageStatus* pst = (PageStatus*)(&psw);
+		if (!page->IsIndexPage() || PageStatus::IsPageInactive(psw) || pst->m_PendAction != PA_NONE || page->m_nSortedSet == 0)
+		{
+		  goto failed;
+		}
+
+		node->m_Page = page;
+		node->m_PageStatus = psw;
+		node->m_Count = page->m_nSortedSet;
+		node->m_FirstEntry = entryPos;
+		node->m_FirstChild = (level + 1 < nrLevels) ? nextChild : NoChild;
+
+		for (UINT slot = 0; slot < node->m_Count; slot++)
+		{
+		  KeyPtrPair* kpp = &page->m_RecordArr[slot];
+		  ShadowEntry* entry = &shadow->m_Entries[entryPos + slot];
+		  entry->m_Separator = (char*)(page) + kpp->m_KeyOffset;
+		  entry->m_SepLen = kpp->m_KeyLen;
+		  entry->m_Child = (BtreePage*)(kpp->m_Pointer.ReadPP());
+		  shadow->m_Prefixes[entryPos + slot] = KeyPrefix(entry->m_Separator, entry->m_SepLen);
+
+		  // The child must be the page collected for the next level
+		  if (node->m_FirstChild != NoChild && entry->m_Child != pages[nextChild + slot])
+		  {
+			goto failed;
+		  }
+		}
+		if (node->m_FirstChild != NoChild) nextChild += node->m_Count;
+		entryPos += (node->m_Count + PrefixesPerLine - 1) & ~(PrefixesPerLine - 1);
+
+		if (psw != page->m_PageStatus.ReadLL())
+		{
+		  goto failed;
+		}
+	  }
+	}
+  }
+  goto exit;
+
+failed:
+  btree->m_EpochMgr->DeallocateNow(shadow, MemObjectType::ShadowIndexObj);
+  shadow = nullptr;
+
+exit:
+  return shadow;
+}
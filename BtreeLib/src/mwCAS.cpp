@@ -22,10 +22,10 @@
 //
 //  Paul Larson, May 2016, gpalarson@outlook.com
 // ***************************************************************************
-#include <Windows.h>
+#include "Platform.h"
 #include <stdio.h> 
 #include <assert.h>
-#include "mwcas.h"
+#include "mwCAS.h"
 
 // Global pool of descriptors. 
 static MwCasDescriptorPool g_MwCASDescriptorPool;
@@ -35,6 +35,11 @@ MwCASDescriptor* AllocateMwCASDescriptor(ULONG flagPos)
     return g_MwCASDescriptorPool.AllocateMwCASDescriptor(flagPos);
 }
 
+void GetMwCasStats(MwCasStats* stats)
+{
+    g_MwCASDescriptorPool.GetMwCasStats(stats);
+}
+
 void MwCasStats::AddCounts(MwCasCounts* partCounts)
 {
   if (partCounts)
@@ -66,16 +71,20 @@ void MwCasStats::PrintStats()
   }
 }
 
-void MwCasDescriptorPool::PrintMwCasStats()
+// Add up the counts of all partitions
+void MwCasDescriptorPool::GetMwCasStats(MwCasStats* stats)
 {
-  MwCasStats sumStats;
-
-  sumStats.InitStats();
-
+  stats->InitStats();
   for (UINT32 i = 0; i < m_PartitionCount; i++)
   {
-	sumStats.AddCounts(m_PartitionTbl[i].m_StatsCounts);
+	stats->AddCounts(m_PartitionTbl[i].m_StatsCounts);
   }
+}
+
+void MwCasDescriptorPool::PrintMwCasStats()
+{
+  MwCasStats sumStats;
+  GetMwCasStats(&sumStats);
   sumStats.PrintStats();
 }
 
@@ -444,7 +453,7 @@ INT32 MwCASDescriptor::AddEntryToDescriptor( __in LONGLONG* addr, __in LONGLONG
 // Note that multiple threads may be executing this function concurrently.
 bool MwCASDescriptor::MwCAS(UINT calldepth)
 {
-	MwCasCounts* stats  = &m_OwnerPartition->m_StatsCounts[min(calldepth,s_MaxStatsDepth)];	  
+	MwCasCounts* stats  = &m_OwnerPartition->m_StatsCounts[min(calldepth,s_MaxStatsDepth-1)];	  
 
 	stats->m_Attempts++;
 
@@ -639,11 +648,11 @@ bool MwCASDescriptor::VerifyUpdates()
 
 void MwCASDescriptor::PrintDescriptor()
 {
-  printf("Descriptor %I64X: %s(%d)\n", LONGLONG(this), (m_SavedOutcome == 2) ? "FAILED" : "SUCCEEDED", m_SavedOutcome);
+  printf("Descriptor %llX: %s(%d)\n", LONGLONG(this), (m_SavedOutcome == 2) ? "FAILED" : "SUCCEEDED", m_SavedOutcome);
   for (INT i = 0; i < m_Count; i++)
   {
 	CondCASDescriptor* cdesc = &m_CondCASDesc[i];
-	printf("Word %d(addr=%I64X, old=%I64X, new=%I64X, final=%I64X)\n", i, ULONGLONG(const_cast<LONGLONG*>(cdesc->m_TargetAddr)), 
+	printf("Word %d(addr=%llX, old=%llX, new=%llX, final=%llX)\n", i, ULONGLONG(const_cast<LONGLONG*>(cdesc->m_TargetAddr)), 
 	           cdesc->m_OldVal, cdesc->m_NewVal, cdesc->m_FinalVal);
   }
 
@@ -0,0 +1,9 @@
+// ***************************************************************************
+// Targeted tests of single B-tree operations, run by the test driver with
+// --test NAME. Each test builds its own tree and returns 0 if it passes.
+// ***************************************************************************
+#pragma once
+
+// Run the named test, or all tests if name is "all". Returns 0 if the tests pass,
+// 1 if a test fails and 2 if there is no test with the given name.
+int RunOperationTest(const char* name);
@@ -1,15 +1,15 @@
-#include <windows.h>
+#include "Platform.h"
 
 #pragma once
 
 class CRandomULongs {
 
-  unsigned long x, y, z;	// Generator state variables
+  ULONG x, y, z;	// Generator state variables (32 bits on all platforms)
 
 							// Very simple generator used only to set the initial
 							// state (x,y,z) of the actual generator
-  unsigned long simple_xor_rng(unsigned long rn) {
-	unsigned long t = rn;
+  ULONG simple_xor_rng(ULONG rn) {
+	ULONG t = rn;
 	t ^= (t << 13);
 	t ^= (t >> 17);
 	t ^= (t << 5);
@@ -18,7 +18,7 @@ class CRandomULongs {
 
 public:
   // Initialize or reset the state of the generator
-  void Init(unsigned long seed)
+  void Init(ULONG seed)
   {
 	// initialize with a random number if seed=0
 	// (use lower half of high resolution counter)
@@ -35,14 +35,14 @@ public:
   }
 
   // Constructor
-  CRandomULongs(unsigned long seed = 0)
+  CRandomULongs(ULONG seed = 0)
   {
 	Init(seed);
   }
 
   // Return next random number
-  unsigned long GetRandomULong() {
-	unsigned long t;
+  ULONG GetRandomULong() {
+	ULONG t;
 	t = (x ^ (x << 3)) ^ (y ^ (y >> 19)) ^ (z ^ (z << 6));
 	x = y;
 	y = z;
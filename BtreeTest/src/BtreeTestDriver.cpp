@@ -1,6 +1,8 @@
-#include <Windows.h>
+#include <thread>
+#include "Platform.h"
 #include"RandomLong.h"
 #include "BtreeInternal.h"
+#include "OperationTests.h"
 
 const int SRC_KEYS = 25000;
 const int MAX_KEYS = 1000000;
@@ -19,7 +21,7 @@ TraceInfo insertfb[MAX_KEYS];
 struct ThreadParams
 {
     UINT        m_ThreadId;
-    HANDLE      m_ThreadHandle;
+    std::thread m_Thread;
     BtreeRoot*  m_Btree;
 
     UINT        m_RangeFirst;       // Firsta and lst index in keyptr array
@@ -29,16 +31,35 @@ struct ThreadParams
 
     UINT        m_RecsInserted;
 	UINT		m_RecsDeleted;
+	UINT		m_InsertFailures;
 
 };
 
-bool            RunFlag = false;
-volatile LONG   threadsRunning = 0;
-FILE*           logFile = nullptr;
+volatile bool   RunFlag = false;
+FILE*           traceFile = nullptr;
+volatile LONG   traceDumps = 0;
 
 
 ThreadParams    paramArr[MAX_THREADS];
 
+// Write the event trace of the tree to the trace file and exit. If several
+// threads fail, the first one writes the trace and the others wait. Without
+// tracing it just exits.
+void DumpTraceAndExit(BtreeRoot* btree, int exitCode)
+{
+  if (!traceFile)
+  {
+	_exit(exitCode);
+  }
+  if (InterlockedIncrement(&traceDumps) == 1)
+  {
+	btree->DumpEventTrace(traceFile);
+	fclose(traceFile);
+	_exit(exitCode);
+  }
+  for (;;) Sleep(1000);
+}
+
 DWORD WINAPI ThreadFunction(void* p)
 {
     ThreadParams* param = (ThreadParams*)(p);
@@ -50,6 +71,7 @@ DWORD WINAPI ThreadFunction(void* p)
 
     param->m_RecsInserted = 0;
 	param->m_RecsDeleted = 0;
+	param->m_InsertFailures = 0;
 
     INT64 spinCount = 0;
     while (RunFlag == false)
@@ -68,6 +90,7 @@ DWORD WINAPI ThreadFunction(void* p)
 		{
 		  printf("Thread %d, i=%d: Insertion failure, %s\n", GetCurrentThreadId(), i, searchKey.m_pKeyValue);
 		  searchKey.m_TrInfo->Print(stdout);
+		  param->m_InsertFailures++;
 		}
 		searchKey.m_TrInfo->m_DoRecord = false;
 
@@ -82,10 +105,7 @@ DWORD WINAPI ThreadFunction(void* p)
             fprintf(stdout, "Thread %d, i=%d: Lookup failure, %s\n", GetCurrentThreadId(), i, searchKey.m_pKeyValue);
 			searchKey.m_TrInfo->Print(stdout);
 			fprintf(stdout, "\n");
-#ifdef DO_LOG
-            PrintLog(logFile, 20000);
-#endif
-            _exit(5);
+            DumpTraceAndExit(btree, 5);
 		}
 
 #endif
@@ -104,11 +124,8 @@ DWORD WINAPI ThreadFunction(void* p)
 	  {
 		printf("Thread %d, i=%d: Delete failure, btr=%d, %s\n", GetCurrentThreadId(), i, INT(btr), searchKey.m_pKeyValue);
 		searchKey.m_TrInfo->Print(stdout);
-#ifdef DO_LOG
-		fprintf(logFile, "Thread %d, i=%d: Delete failure, btr=%d, %s\n", GetCurrentThreadId(), i, INT(btr), searchKey.m_pKeyValue);
-        PrintLog(logFile, 5000);
-        _exit(6);
-#endif
+		// Without tracing the run goes on and the final check reports the record
+		if (traceFile) DumpTraceAndExit(btree, 6);
 	  }
 	  searchKey.m_TrInfo->m_DoRecord = false;
 
@@ -123,8 +140,6 @@ DWORD WINAPI ThreadFunction(void* p)
 		fprintf(stdout, "Thread %d, i=%d: Deleted record found, %s\n", GetCurrentThreadId(), i, searchKey.m_pKeyValue);
 		//searchKey.m_TrInfo->Print(stdout);
 		//fprintf(stdout, "\n");
-		//fprintf(logFile, "Thread %d, i=%d: Deleted record found, %s\n", GetCurrentThreadId(), i, searchKey.m_pKeyValue);
-        //PrintLog(logFile, 20000);
         _exit(8);
       }
 
@@ -133,10 +148,24 @@ DWORD WINAPI ThreadFunction(void* p)
 	printf("Tread %d: %d deletes\n", param->m_ThreadId, param->m_RecsDeleted);
 
 
-    InterlockedDecrement(&threadsRunning);
+    return 0;
+}
 
+// Read a word delimited by white space. Returns false at the end of the file.
+static bool ReadWord(FILE* fp, char* buffer, UINT size)
+{
+  int c = getc(fp);
+  while (c == ' ' || c == '\t' || c == '\r' || c == '\n') c = getc(fp);
+  if (c == EOF) return false;
 
-    return 0;
+  UINT len = 0;
+  while (c != EOF && c != ' ' && c != '\t' && c != '\r' && c != '\n')
+  {
+	if (len + 1 < size) buffer[len++] = char(c);
+	c = getc(fp);
+  }
+  buffer[len] = '\0';
+  return true;
 }
 
 static int ExpandKeySet(int srckeys, int maxKeys)
@@ -183,31 +212,62 @@ static void ShuffleKeys(int seed, int nKeys)
 UINT            numThreads = 4;
 int             keyCount = 1000000;
 
-int main()
+// Usage: BtreeTestDriver [threads file [keys [notrace]]]
+//        BtreeTestDriver --test NAME|all
+// Without arguments the thread count and the word file are read from stdin.
+// Events are traced unless notrace is given. --test runs one of the operation
+// tests instead (see OperationTests.cpp).
+// Returns 0 if all inserts and deletes succeeded and the tree checks out.
+int main(int argc, char** argv)
 {
   unsigned     seed = 23456;
   char         fname[100];
+  char         input[100];
   FILE        *fp = nullptr;
+  bool         trace = true;
 
   printf("\nTest driver for lock-free B-tree\n\n");
-  printf("no of threads:     "); scanf_s("%d", &numThreads);
-  //printf("random seed: ");     scanf_s("%d", &seed);
-  printf("input file: ");      scanf_s("%s", fname, 100);
+  if (argc >= 3 && strcmp(argv[1], "--test") == 0)
+  {
+	return RunOperationTest(argv[2]);
+  }
+  if (argc >= 3)
+  {
+	numThreads = UINT(atoi(argv[1]));
+	strncpy(fname, argv[2], sizeof(fname) - 1);
+	fname[sizeof(fname) - 1] = '\0';
+	if (argc >= 4) keyCount = atoi(argv[3]);
+	if (argc >= 5) trace = (strcmp(argv[4], "notrace") != 0);
+  }
+  else
+  {
+	printf("no of threads:     "); ReadWord(stdin, input, sizeof(input)); numThreads = UINT(atoi(input));
+	printf("input file: ");      ReadWord(stdin, fname, sizeof(fname));
+  }
+  if (numThreads < 1 || numThreads > MAX_THREADS || keyCount < 1 || keyCount > MAX_KEYS)
+  {
+	printf("Invalid thread or key count\n");
+	exit(1);
+  }
   errno_t err = fopen_s(&fp, fname, "r");
   if (err != 0 || !fp) {
 	printf("Can't open file %s\n", fname);
 	exit(1);
   }
 
-  err = fopen_s(&logFile, "LogFile.txt", "w");
-  if (err != 0 || !logFile)
+  // Events are traced so that they can be written out on a failure (see EventDecode)
+  if (trace)
   {
-      printf("Can't open log file\n");
+	err = fopen_s(&traceFile, "EventTrace.bin", "wb");
+	if (err != 0 || !traceFile)
+	{
+      printf("Can't open trace file\n");
       exit(2);
+	}
   }
 
   UINT maxlen = 0;
-  while (fscanf_s(fp, "%s", &srctable[csrckeys][0], KEYLENGTH + 1) != EOF) {
+  while (ReadWord(fp, &srctable[csrckeys][0], KEYLENGTH + 1)) {
 	UINT len = UINT(strlen(&srctable[csrckeys][0]));
 	maxlen = max(maxlen, len);
 	csrckeys++;
@@ -222,6 +282,7 @@ int main()
 
 
   BtreeRoot* btree = new BtreeRootInternal();
+  if (trace) btree->SetEventTrace(TraceAllEvents);
 
   int trange = numKeys / numThreads;
 
@@ -235,32 +296,30 @@ int main()
  	  par->m_Inserts =  trange;
       par->m_RecsInserted = 0;
   }
-  threadsRunning = numThreads;
 
   for (UINT i = 0; i < numThreads; i++)
   { 
-     DWORD threadId = 0;
      ThreadParams* par = &paramArr[i];
-     par->m_ThreadHandle = CreateThread(NULL, 0, ThreadFunction, par, 0, &threadId);
-     _ASSERTE(par->m_ThreadHandle != NULL);
+     par->m_Thread = std::thread(ThreadFunction, par);
   }
 
   // Release threads to run
   RunFlag = true;
 
-  while (threadsRunning > 0)
+  UINT failures = 0;
+  for (UINT i = 0; i < numThreads; i++)
   {
-      Sleep(1000);
+      paramArr[i].m_Thread.join();
+      failures += paramArr[i].m_InsertFailures;
   }
 
-  btree->CheckTree(stdout);
+  failures += btree->CheckTree(stdout);
   btree->PrintStats(stdout);
   //btree->Print(stdout);
 
   KeyType searchKey;
   char*  recordFound;
-  UINT   missing = 0;
-#ifdef _DEBUG
+  UINT   remaining = 0;
   for (int i = 0; i < numKeys; i++)
   {
 	searchKey.m_pKeyValue = keyptr[i];
@@ -269,21 +328,20 @@ int main()
 	BTRESULT btr = btree->LookupRecord(&searchKey, (void*&)(recordFound));
 	if (btr != BT_KEY_NOT_FOUND)
 	{
-	  fprintf(stdout, "i=%d: Record %s not found\n", i, searchKey.m_pKeyValue);
+	  fprintf(stdout, "i=%d: Deleted record %s found\n", i, searchKey.m_pKeyValue);
 	  insertfb[i].Print(stdout);
 
 	  btr = btree->LookupRecord(&searchKey, (void*&)(recordFound));
 	  //btree->Print(stdout);
 	  //btree->TraceRecord(&searchKey);
-	  missing++;
+	  remaining++;
 	}
   }	
-  if (missing == 0)
+  if (remaining == 0)
   {
-	fprintf(stdout, "No records missing from the tree\n");
+	fprintf(stdout, "No deleted records left in the tree\n");
   }
-#endif
 
-  return 0;
+  return (failures == 0 && remaining == 0) ? 0 : 3;
 
 }
\ No newline at end of file
@@ -0,0 +1,713 @@
+#include <thread>
+#include <atomic>
+#include <climits>
+#include "Platform.h"
+#include "BtreeInternal.h"
+#include "IntKeyBtree.h"
+#include "BtreeSession.h"
+#include "OperationTests.h"
+
+// Record pointers are only compared, never dereferenced
+static char s_Records[256];
+
+#define CHECK(cond, ...)				\
+  if (!(cond))							\
+  {										\
+	printf("  FAILED: " __VA_ARGS__);	\
+	printf("\n");						\
+	return 1;							\
+  }
+
+static void MakeKey(char* buffer, UINT i)
+{
+  snprintf(buffer, 16, "key%07u", i);
+}
+
+// Start all threads at once so that they compete for the same keys
+static void RunThreads(UINT nThreads, void (*fn)(UINT thread, std::atomic<bool>* start), std::atomic<bool>* start)
+{
+  std::thread threads[16];
+  start->store(false);
+  for (UINT t = 0; t < nThreads; t++) threads[t] = std::thread(fn, t, start);
+  start->store(true);
+  for (UINT t = 0; t < nThreads; t++) threads[t].join();
+}
+
+// ---------------------------------------------------------------------------
+// insert-if-absent: threads insert the same keys in the same order. Exactly
+// one insert of each key succeeds, all others return BT_DUPLICATE_KEY.
+
+static const UINT IiaThreads = 4;
+static const UINT IiaKeys = 20000;
+
+static BtreeRootInternal* s_IiaTree;
+static std::atomic<UINT>  s_IiaWins[IiaKeys];
+static std::atomic<UINT>  s_IiaDuplicates;
+static std::atomic<UINT>  s_IiaOtherResults;
+static UINT				  s_IiaWinner[IiaKeys];
+
+static void InsertIfAbsentThread(UINT thread, std::atomic<bool>* start)
+{
+  char buffer[16];
+  while (!start->load()) YieldProcessor();
+  for (UINT i = 0; i < IiaKeys; i++)
+  {
+	MakeKey(buffer, i);
+	KeyType key(buffer, UINT(strlen(buffer)));
+	BTRESULT btr = s_IiaTree->InsertIfAbsent(&key, &s_Records[thread]);
+	if (btr == BT_SUCCESS)
+	{
+	  s_IiaWins[i]++;
+	  s_IiaWinner[i] = thread;
+	}
+	else if (btr == BT_DUPLICATE_KEY) s_IiaDuplicates++;
+	else							  s_IiaOtherResults++;
+  }
+}
+
+static int TestInsertIfAbsent()
+{
+  s_IiaTree = new BtreeRootInternal();
+  for (UINT i = 0; i < IiaKeys; i++) s_IiaWins[i] = 0;
+  s_IiaDuplicates = 0;
+  s_IiaOtherResults = 0;
+
+  std::atomic<bool> start;
+  RunThreads(IiaThreads, InsertIfAbsentThread, &start);
+
+  CHECK(s_IiaOtherResults == 0, "%u inserts returned neither success nor a duplicate", UINT(s_IiaOtherResults));
+  CHECK(s_IiaDuplicates == IiaKeys * (IiaThreads - 1), "%u duplicates, expected %u", UINT(s_IiaDuplicates), IiaKeys * (IiaThreads - 1));
+  char buffer[16];
+  for (UINT i = 0; i < IiaKeys; i++)
+  {
+	CHECK(s_IiaWins[i] == 1, "key %u inserted %u times", i, UINT(s_IiaWins[i]));
+	MakeKey(buffer, i);
+	KeyType key(buffer, UINT(strlen(buffer)));
+	void* rec = nullptr;
+	CHECK(s_IiaTree->LookupRecord(&key, rec) == BT_SUCCESS && rec == &s_Records[s_IiaWinner[i]], "key %u has the wrong record", i);
+  }
+  CHECK(s_IiaTree->CheckTree(stdout) == 0, "tree check failed");
+  delete s_IiaTree;
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// upsert: an upsert of a new key inserts it, of an existing key replaces its
+// record. Threads upserting the same keys leave exactly one record per key.
+
+static const UINT UpsThreads = 4;
+static const UINT UpsKeys = 5000;
+
+static BtreeRootInternal* s_UpsTree;
+static std::atomic<UINT>  s_UpsFailures;
+
+static void UpsertThread(UINT thread, std::atomic<bool>* start)
+{
+  char buffer[16];
+  while (!start->load()) YieldProcessor();
+  for (UINT round = 0; round < 4; round++)
+  {
+	for (UINT i = 0; i < UpsKeys; i++)
+	{
+	  MakeKey(buffer, i);
+	  KeyType key(buffer, UINT(strlen(buffer)));
+	  if (s_UpsTree->UpsertRecord(&key, &s_Records[thread]) != BT_SUCCESS) s_UpsFailures++;
+	}
+  }
+}
+
+static int TestUpsert()
+{
+  s_UpsTree = new BtreeRootInternal();
+  char buffer[16];
+  void* rec = nullptr;
+
+  // Single thread: insert, then replace
+  for (UINT i = 0; i < UpsKeys; i++)
+  {
+	MakeKey(buffer, i);
+	KeyType key(buffer, UINT(strlen(buffer)));
+	CHECK(s_UpsTree->UpsertRecord(&key, &s_Records[100]) == BT_SUCCESS, "upsert of new key %u failed", i);
+  }
+  for (UINT i = 0; i < UpsKeys; i += 2)
+  {
+	MakeKey(buffer, i);
+	KeyType key(buffer, UINT(strlen(buffer)));
+	CHECK(s_UpsTree->UpsertRecord(&key, &s_Records[101]) == BT_SUCCESS, "upsert of existing key %u failed", i);
+  }
+  for (UINT i = 0; i < UpsKeys; i++)
+  {
+	MakeKey(buffer, i);
+	KeyType key(buffer, UINT(strlen(buffer)));
+	void* expected = &s_Records[(i % 2 == 0) ? 101 : 100];
+	CHECK(s_UpsTree->LookupRecord(&key, rec) == BT_SUCCESS && rec == expected, "key %u has the wrong record", i);
+  }
+
+  // Concurrent upserts of the same keys, starting from an empty tree
+  delete s_UpsTree;
+  s_UpsTree = new BtreeRootInternal();
+  s_UpsFailures = 0;
+  std::atomic<bool> start;
+  RunThreads(UpsThreads, UpsertThread, &start);
+  CHECK(s_UpsFailures == 0, "%u concurrent upserts failed", UINT(s_UpsFailures));
+
+  // Each key must be in the tree once: after one delete it is gone
+  for (UINT i = 0; i < UpsKeys; i++)
+  {
+	MakeKey(buffer, i);
+	KeyType key(buffer, UINT(strlen(buffer)));
+	CHECK(s_UpsTree->LookupRecord(&key, rec) == BT_SUCCESS && rec >= &s_Records[0] && rec < &s_Records[UpsThreads],
+		  "key %u has the wrong record", i);
+	CHECK(s_UpsTree->DeleteRecord(&key) == BT_SUCCESS, "delete of key %u failed", i);
+	CHECK(s_UpsTree->LookupRecord(&key, rec) == BT_KEY_NOT_FOUND, "key %u is in the tree more than once", i);
+  }
+  CHECK(s_UpsTree->CheckTree(stdout) == 0, "tree check failed");
+  delete s_UpsTree;
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// multi-update: the error returns of MultiUpdate, then threads transferring
+// amounts between accounts while another thread deletes and re-inserts the
+// keys around them, so pages are split, merged and consolidated under the
+// transfers. The total of all accounts must not change.
+
+static const UINT MuFillerKeys = 20000;		  // Keys between the accounts
+static const UINT MuAccounts = 64;
+static const UINT MuAccountSpacing = MuFillerKeys / MuAccounts;
+static const UINT MuInitialAmount = 1000;
+static const UINT MuMaxAmount = MuAccounts * MuInitialAmount;
+static const UINT MuThreads = 4;
+static const UINT MuTransfers = 20000;		  // Per thread
+
+static BtreeRootInternal* s_MuTree;
+static ULONGLONG		  s_MuAmounts[MuMaxAmount + 1];	// An account's record is &s_MuAmounts[amount]
+static std::atomic<UINT>  s_MuErrors;
+static std::atomic<UINT>  s_MuConflicts;
+static std::atomic<bool>  s_MuDone;
+
+static void* AmountRecord(UINT amount) { return &s_MuAmounts[amount]; }
+static UINT RecordAmount(void* rec) { return UINT((ULONGLONG*)(rec) - s_MuAmounts); }
+static UINT AccountKey(UINT account) { return account * MuAccountSpacing; }
+
+static void TransferThread(UINT thread, std::atomic<bool>* start)
+{
+  char buffer1[16], buffer2[16];
+  ULONG rnd = 12345 + thread;
+  while (!start->load()) YieldProcessor();
+  for (UINT n = 0; n < MuTransfers; n++)
+  {
+	rnd = rnd * 1103515245 + 12345;
+	UINT from = (rnd >> 8) % MuAccounts;
+	UINT to = (from + 1 + (rnd >> 20) % (MuAccounts - 1)) % MuAccounts;
+	MakeKey(buffer1, AccountKey(from));
+	MakeKey(buffer2, AccountKey(to));
+	KeyType key1(buffer1, UINT(strlen(buffer1)));
+	KeyType key2(buffer2, UINT(strlen(buffer2)));
+
+	void* rec1 = nullptr;
+	void* rec2 = nullptr;
+	if (s_MuTree->LookupRecord(&key1, rec1) != BT_SUCCESS || s_MuTree->LookupRecord(&key2, rec2) != BT_SUCCESS)
+	{
+	  s_MuErrors++;
+	  continue;
+	}
+	UINT amount1 = RecordAmount(rec1);
+	UINT amount2 = RecordAmount(rec2);
+	UINT transfer = min(amount1, UINT(1 + rnd % 5));
+
+	MultiUpdateEntry entries[2] = 
+	{
+	  { &key1, rec1, AmountRecord(amount1 - transfer), nullptr },
+	  { &key2, rec2, AmountRecord(amount2 + transfer), nullptr },
+	};
+	BTRESULT btr = s_MuTree->MultiUpdate(entries, 2);
+	if (btr == BT_RECORD_CHANGED) s_MuConflicts++;
+	else if (btr != BT_SUCCESS)	  s_MuErrors++;
+  }
+}
+
+// Delete and re-insert the filler keys so that the pages holding the accounts keep changing
+static void ChurnThread(UINT thread, std::atomic<bool>* start)
+{
+  char buffer[16];
+  while (!start->load()) YieldProcessor();
+  while (!s_MuDone.load())
+  {
+	for (UINT i = 0; i < MuFillerKeys && !s_MuDone.load(); i++)
+	{
+	  if (i % MuAccountSpacing == 0) continue;
+	  MakeKey(buffer, i);
+	  KeyType key(buffer, UINT(strlen(buffer)));
+	  if (s_MuTree->DeleteRecord(&key) != BT_SUCCESS) s_MuErrors++;
+	  if (i >= MuAccountSpacing && s_MuTree->InsertRecord(&key, &s_Records[thread]) != BT_SUCCESS) s_MuErrors++;
+	}
+	for (UINT i = 1; i < MuAccountSpacing; i++)
+	{
+	  MakeKey(buffer, i);
+	  KeyType key(buffer, UINT(strlen(buffer)));
+	  if (s_MuTree->InsertRecord(&key, &s_Records[thread]) != BT_SUCCESS) s_MuErrors++;
+	}
+  }
+}
+
+static void MultiUpdateWorker(UINT thread, std::atomic<bool>* start)
+{
+  if (thread < MuThreads)
+  {
+	TransferThread(thread, start);
+  }
+  else
+  {
+	ChurnThread(thread, start);
+  }
+}
+
+static int TestMultiUpdate()
+{
+  s_MuTree = new BtreeRootInternal();
+  char buffer[MaxWordsPerDescriptor][16];
+  KeyType keys[MaxWordsPerDescriptor];
+  MultiUpdateEntry entries[MaxWordsPerDescriptor];
+  void* rec = nullptr;
+
+  for (UINT i = 0; i < MuFillerKeys; i++)
+  {
+	MakeKey(buffer[0], i);
+	KeyType key(buffer[0], UINT(strlen(buffer[0])));
+	void* initial = (i % MuAccountSpacing == 0) ? AmountRecord(MuInitialAmount) : &s_Records[200];
+	CHECK(s_MuTree->InsertRecord(&key, initial) == BT_SUCCESS, "insert of key %u failed", i);
+  }
+
+  // Entry e refers to account e
+  for (UINT e = 0; e < MaxWordsPerDescriptor; e++)
+  {
+	MakeKey(buffer[e], AccountKey(e));
+	keys[e] = KeyType(buffer[e], UINT(strlen(buffer[e])));
+	entries[e].m_Key = &keys[e];
+	entries[e].m_ExpectedRec = nullptr;
+	entries[e].m_NewRec = AmountRecord(MuInitialAmount + 1);
+	entries[e].m_OldRec = nullptr;
+  }
+
+  CHECK(s_MuTree->MultiUpdate(entries, 0) == BT_INVALID_ARG, "an empty update was accepted");
+  CHECK(s_MuTree->MultiUpdate(entries, MaxWordsPerDescriptor) == BT_INVALID_ARG, "an update of %u records was accepted", MaxWordsPerDescriptor);
+
+  // Four accounts on four pages need eight words
+  CHECK(s_MuTree->MultiUpdate(entries, 4) == BT_INVALID_ARG, "an update that does not fit in a descriptor was accepted");
+
+  // The same key twice
+  entries[1].m_Key = &keys[0];
+  CHECK(s_MuTree->MultiUpdate(entries, 2) == BT_INVALID_ARG, "an update of the same key twice was accepted");
+  entries[1].m_Key = &keys[1];
+
+  // A missing key
+  char missing[] = "missing";
+  KeyType missingKey(missing, UINT(strlen(missing)));
+  entries[1].m_Key = &missingKey;
+  CHECK(s_MuTree->MultiUpdate(entries, 2) == BT_KEY_NOT_FOUND, "an update of a missing key did not fail");
+  entries[1].m_Key = &keys[1];
+
+  // A record that differs from the expected one
+  entries[1].m_ExpectedRec = AmountRecord(MuInitialAmount + 7);
+  CHECK(s_MuTree->MultiUpdate(entries, 2) == BT_RECORD_CHANGED, "an update with the wrong expected record did not fail");
+  CHECK(entries[1].m_OldRec == AmountRecord(MuInitialAmount), "the current record was not returned");
+  entries[1].m_ExpectedRec = nullptr;
+
+  // None of the failed updates may have changed a record
+  for (UINT e = 0; e < MaxWordsPerDescriptor; e++)
+  {
+	CHECK(s_MuTree->LookupRecord(&keys[e], rec) == BT_SUCCESS && rec == AmountRecord(MuInitialAmount), "a failed update changed account %u", e);
+  }
+
+  // Update one filler record and delete another one next to it (a null new record deletes)
+  char fillBuffer1[16], fillBuffer2[16];
+  MakeKey(fillBuffer1, 1);
+  MakeKey(fillBuffer2, 2);
+  KeyType fill1(fillBuffer1, UINT(strlen(fillBuffer1)));
+  KeyType fill2(fillBuffer2, UINT(strlen(fillBuffer2)));
+  MultiUpdateEntry mixed[2] = 
+  {
+	{ &fill1, &s_Records[200], &s_Records[201], nullptr },
+	{ &fill2, nullptr, nullptr, nullptr },
+  };
+  CHECK(s_MuTree->MultiUpdate(mixed, 2) == BT_SUCCESS, "update with a delete failed");
+  CHECK(mixed[0].m_OldRec == &s_Records[200] && mixed[1].m_OldRec == &s_Records[200], "old records not returned");
+  CHECK(s_MuTree->LookupRecord(&fill1, rec) == BT_SUCCESS && rec == &s_Records[201], "record not updated");
+  CHECK(s_MuTree->LookupRecord(&fill2, rec) == BT_KEY_NOT_FOUND, "record not deleted");
+  CHECK(s_MuTree->InsertRecord(&fill2, &s_Records[200]) == BT_SUCCESS, "re-insert failed");
+
+  // Concurrent transfers
+  s_MuErrors = 0;
+  s_MuConflicts = 0;
+  s_MuDone = false;
+  std::atomic<bool> start;
+  std::thread churn;
+  std::thread transfers[MuThreads];
+  start = false;
+  for (UINT t = 0; t <= MuThreads; t++)
+  {
+	if (t < MuThreads) transfers[t] = std::thread(MultiUpdateWorker, t, &start);
+	else			   churn = std::thread(MultiUpdateWorker, t, &start);
+  }
+  start = true;
+  for (UINT t = 0; t < MuThreads; t++) transfers[t].join();
+  s_MuDone = true;
+  churn.join();
+
+  CHECK(s_MuErrors == 0, "%u operations failed during the transfers", UINT(s_MuErrors));
+  UINT total = 0;
+  for (UINT a = 0; a < MuAccounts; a++)
+  {
+	MakeKey(buffer[0], AccountKey(a));
+	KeyType key(buffer[0], UINT(strlen(buffer[0])));
+	CHECK(s_MuTree->LookupRecord(&key, rec) == BT_SUCCESS, "account %u is missing", a);
+	total += RecordAmount(rec);
+  }
+  // Only updates count CC_RETRY_UPDATE, so these are transfers that located their records again
+  ContentionStats stats;
+  s_MuTree->GetContentionStats(&stats);
+  printf("  %u transfers, %u conflicts, %llu retries\n", MuThreads * MuTransfers, UINT(s_MuConflicts), (ULONGLONG)(stats.m_Counts[CC_RETRY_UPDATE]));
+  CHECK(stats.m_Counts[CC_RETRY_UPDATE] > 0, "no transfer had to locate its records again");
+  CHECK(total == MuMaxAmount, "total is %u, expected %u", total, MuMaxAmount);
+  CHECK(s_MuTree->CheckTree(stdout) == 0, "tree check failed");
+  delete s_MuTree;
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// append-split: keys inserted in ascending order. Every split is of the last
+// leaf page and gives the left page AppendSplitPercent of the records.
+// Inserting the keys in descending order splits pages evenly, so each right
+// page gets half the records of a page being split and no further inserts.
+// Pages are sized with a fixed fraction of free space so that the number of
+// records on a page when it is split does not depend on the insert rate.
+
+static const UINT AsKeys = 20000;
+
+static int BuildTree(bool ascending, BtreeStatistics* stats)
+{
+  BtreeRootInternal* tree = new BtreeRootInternal();
+  PageSizePolicy policy(PageSizePolicy::WRITE_OPTIMIZED);
+  CHECK(tree->SetPageSizePolicy(policy) == BT_SUCCESS, "page size policy not set");
+  char buffer[16];
+  for (UINT i = 0; i < AsKeys; i++)
+  {
+	MakeKey(buffer, (ascending) ? i : AsKeys - 1 - i);
+	KeyType key(buffer, UINT(strlen(buffer)));
+	CHECK(tree->InsertRecord(&key, &s_Records[0]) == BT_SUCCESS, "insert of key %u failed", i);
+  }
+  CHECK(tree->CheckTree(stdout) == 0, "tree check failed");
+  tree->GetTreeStats(stats);
+  CHECK(stats->m_Records == AsKeys, "%u records in the tree, expected %u", stats->m_Records, AsKeys);
+  delete tree;
+  return 0;
+}
+
+static int TestAppendSplit()
+{
+  BtreeStatistics ascending, descending;
+  CHECK(BuildTree(true, &ascending) == 0, "ascending inserts failed");
+  CHECK(BuildTree(false, &descending) == 0, "descending inserts failed");
+
+  double ascPerPage = double(ascending.m_Records) / ascending.m_LeafPages;
+  double descPerPage = double(descending.m_Records) / descending.m_LeafPages;
+  double leftShare = ascPerPage / (2.0*descPerPage);
+  printf("  Ascending: %u leaf pages, %.1f records per page\n", ascending.m_LeafPages, ascPerPage);
+  printf("  Descending: %u leaf pages, %.1f records per page\n", descending.m_LeafPages, descPerPage);
+  printf("  Left pages got %.0f%% of the records of a page being split\n", 100.0*leftShare);
+  CHECK(leftShare >= 0.8, "left pages got %.0f%% of the records after appends", 100.0*leftShare);
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// read-consolidate: a single leaf page with many entries in its unsorted area
+// that only receives lookups. The lookups flag the page once they have scanned
+// the unsorted area often enough, and a later lookup consolidates it, so the
+// page ends up with all its records in the sorted area.
+
+static const UINT RcKeys = 20;
+static const UINT RcMinUnsorted = 8;		  // Pages with fewer unsorted slots are not charged
+static const UINT RcRounds = 100;
+
+static int TestReadConsolidate()
+{
+  BtreeRootInternal* tree = new BtreeRootInternal();
+
+  // Leave as much free space as possible on new pages so that inserts fill the unsorted area
+  PageSizePolicy policy(PageSizePolicy::WRITE_OPTIMIZED);
+  policy.m_FreeSpaceFraction = policy.m_MaxFreeFraction;
+  CHECK(tree->SetPageSizePolicy(policy) == BT_SUCCESS, "page size policy not set");
+
+  char buffer[16];
+  for (UINT i = 0; i < RcKeys; i++)
+  {
+	MakeKey(buffer, (i * 7) % RcKeys);
+	KeyType key(buffer, UINT(strlen(buffer)));
+	CHECK(tree->InsertRecord(&key, &s_Records[(i * 7) % RcKeys]) == BT_SUCCESS, "insert of key %u failed", i);
+  }
+
+  BtreeStatistics stats;
+  tree->GetTreeStats(&stats);
+  printf("  Before lookups: %u leaf pages, %u unsorted slots\n", stats.m_LeafPages, stats.m_UnsortedLP);
+  CHECK(stats.m_LeafPages == 1 && stats.m_UnsortedLP >= RcMinUnsorted, "expected one leaf page with at least %u unsorted slots", RcMinUnsorted);
+
+  UINT rounds = 0;
+  for (; rounds < RcRounds && stats.m_UnsortedLP > 0; rounds++)
+  {
+	for (UINT i = 0; i < RcKeys; i++)
+	{
+	  void* rec = nullptr;
+	  MakeKey(buffer, i);
+	  KeyType key(buffer, UINT(strlen(buffer)));
+	  CHECK(tree->LookupRecord(&key, rec) == BT_SUCCESS && rec == &s_Records[i], "lookup of key %u failed", i);
+	}
+	tree->GetTreeStats(&stats);
+  }
+
+  printf("  After %u rounds of lookups: %u leaf pages, %u unsorted slots\n", rounds, stats.m_LeafPages, stats.m_UnsortedLP);
+  CHECK(stats.m_UnsortedLP == 0, "lookups did not get the page consolidated");
+  CHECK(stats.m_LeafPages == 1, "the page was split instead of consolidated");
+  CHECK(stats.m_Records == RcKeys, "%u records in the tree, expected %u", stats.m_Records, RcKeys);
+  CHECK(tree->CheckTree(stdout) == 0, "tree check failed");
+  delete tree;
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// intkey: IntKeyBtree with negative and positive signed keys and with unsigned
+// keys on both sides of the sign bit. Enough keys are inserted to split pages,
+// then every third key is deleted. The encoded keys must sort in numeric order
+// under the default comparison.
+
+static const int IkKeys = 20000;			  // Signed keys are -IkKeys..IkKeys-1
+
+static char s_IkRecords[2 * IkKeys];
+
+template <typename T>
+static int CheckIntKeyOrder(T low, T high)
+{
+  char lowBuffer[IntKeyBtree<T>::KeyLength];
+  char highBuffer[IntKeyBtree<T>::KeyLength];
+  IntKeyBtree<T>::Encode(low, lowBuffer);
+  IntKeyBtree<T>::Encode(high, highBuffer);
+  return DefaultCompareKeys(lowBuffer, IntKeyBtree<T>::KeyLength, highBuffer, IntKeyBtree<T>::KeyLength);
+}
+
+template <typename T>
+static int TestIntKeys(T first, const char* typeName)
+{
+  IntKeyBtree<T> tree;
+  void* rec = nullptr;
+  printf("  %s keys from %lld\n", typeName, (LONGLONG)(first));
+
+  // Insert in an order that is neither ascending nor descending
+  for (int i = 0; i < 2 * IkKeys; i++)
+  {
+	int n = int((ULONGLONG(i) * 7919) % (2 * IkKeys));
+	CHECK(tree.InsertRecord(T(first + n), &s_IkRecords[n]) == BT_SUCCESS, "insert of key %d failed", n);
+  }
+  CHECK(tree.InsertIfAbsent(first, &s_IkRecords[0]) == BT_DUPLICATE_KEY, "duplicate key inserted");
+  CHECK(tree.CheckTree(stdout) == 0, "tree check failed after inserts");
+
+  for (int n = 0; n < 2 * IkKeys; n += 3)
+  {
+	CHECK(tree.DeleteRecord(T(first + n)) == BT_SUCCESS, "delete of key %d failed", n);
+  }
+  for (int n = 0; n < 2 * IkKeys; n++)
+  {
+	BTRESULT btr = tree.LookupRecord(T(first + n), rec);
+	if (n % 3 == 0)
+	{
+	  CHECK(btr == BT_KEY_NOT_FOUND, "deleted key %d found", n);
+	}
+	else
+	{
+	  CHECK(btr == BT_SUCCESS && rec == &s_IkRecords[n], "lookup of key %d failed", n);
+	}
+  }
+  CHECK(tree.CheckTree(stdout) == 0, "tree check failed after deletes");
+
+  BtreeStatistics stats;
+  ((BtreeRootInternal*)(tree.GetBtree()))->GetTreeStats(&stats);
+  CHECK(stats.m_LeafPages > 1, "no page was split");
+  return 0;
+}
+
+static int TestIntKey()
+{
+  CHECK(CheckIntKeyOrder<int>(-1, 0) < 0 && CheckIntKeyOrder<int>(INT_MIN, -1) < 0 && CheckIntKeyOrder<int>(1, INT_MAX) < 0, "signed keys out of order");
+  CHECK(CheckIntKeyOrder<LONGLONG>(LLONG_MIN, -1) < 0 && CheckIntKeyOrder<LONGLONG>(-1, 0) < 0, "signed 8-byte keys out of order");
+  CHECK(CheckIntKeyOrder<UINT>(0x7FFFFFFF, 0x80000000) < 0 && CheckIntKeyOrder<UINT>(0, UINT_MAX) < 0, "unsigned keys out of order");
+
+  CHECK(TestIntKeys<int>(-IkKeys, "int") == 0, "int keys failed");
+  CHECK(TestIntKeys<LONGLONG>(LONGLONG(-IkKeys), "LONGLONG") == 0, "LONGLONG keys failed");
+  CHECK(TestIntKeys<UINT>(0x80000000U - IkKeys, "UINT") == 0, "UINT keys failed");
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// session: a mixed batch of operations through one BtreeSession that refreshes
+// its epoch every few operations. Every operation is sampled by the profiler,
+// so each one must show up in the profile. The inserts split pages and retire
+// the old ones. Because the session keeps leaving its epoch, the epoch keeps
+// advancing and the retired pages are freed during the batch, so the number
+// of objects in limbo stays small.
+
+static const UINT SeKeys = 5000;
+static const UINT SeNewKeys = 1000;			  // Inserted by upserts
+static const UINT SeRefreshInterval = 4;
+static const LONGLONG SeMaxLimboItems = 200;  // A few epochs' worth (see EpochAdvanceThreshold)
+
+// Largest number of objects in limbo seen during the batch
+struct LimboWatch
+{
+  EpochManager*	  m_EpochMgr;
+  LONGLONG		  m_FirstEpoch;
+  LONGLONG		  m_LastEpoch;
+  LONGLONG		  m_MaxItems;
+
+  LimboWatch(EpochManager* epochMgr)
+  {
+	EpochLimboStats limbo;
+	m_EpochMgr = epochMgr;
+	m_EpochMgr->GetLimboStats(&limbo);
+	m_FirstEpoch = m_LastEpoch = limbo.m_nCurrentEpoch;
+	m_MaxItems = limbo.m_nLimboItems;
+  }
+
+  void Sample()
+  {
+	EpochLimboStats limbo;
+	m_EpochMgr->GetLimboStats(&limbo);
+	m_LastEpoch = limbo.m_nCurrentEpoch;
+	m_MaxItems = max(m_MaxItems, LONGLONG(limbo.m_nLimboItems));
+  }
+};
+
+// Record expected for key i at the end of the batch, null if deleted
+static void* SessionRecord(UINT i)
+{
+  if (i >= SeKeys)  return &s_Records[3];
+  if (i % 3 == 0)   return nullptr;
+  if (i == 1)       return &s_Records[5];
+  if (i % 2 == 0)   return &s_Records[2];
+  return &s_Records[4];
+}
+
+static int TestSession()
+{
+  BtreeRootInternal* tree = new BtreeRootInternal();
+  PhaseProfiler* profiler = tree->GetPhaseProfiler();
+  profiler->Enable(1);
+  LimboWatch watch(tree->GetEpochManager());
+  char buffer[16];
+  void* rec = nullptr;
+  UINT updates = 0;
+  {
+	BtreeSession session(tree, SeRefreshInterval);
+	for (UINT i = 0; i < SeKeys; i++)
+	{
+	  MakeKey(buffer, i);
+	  KeyType key(buffer, UINT(strlen(buffer)));
+	  CHECK(session.InsertRecord(&key, &s_Records[1]) == BT_SUCCESS, "insert of key %u failed", i);
+	  watch.Sample();
+	}
+	MakeKey(buffer, 0);
+	KeyType key0(buffer, UINT(strlen(buffer)));
+	CHECK(session.InsertIfAbsent(&key0, &s_Records[1]) == BT_DUPLICATE_KEY, "duplicate key inserted");
+
+	// Upserts replace the records of even keys and insert new keys
+	for (UINT i = 0; i < SeKeys + SeNewKeys; i += (i < SeKeys) ? 2 : 1)
+	{
+	  MakeKey(buffer, i);
+	  KeyType key(buffer, UINT(strlen(buffer)));
+	  CHECK(session.UpsertRecord(&key, (i < SeKeys) ? &s_Records[2] : &s_Records[3]) == BT_SUCCESS, "upsert of key %u failed", i);
+	  updates++;
+	  watch.Sample();
+	}
+
+	for (UINT i = 1; i < SeKeys; i += 2)
+	{
+	  MakeKey(buffer, i);
+	  KeyType key(buffer, UINT(strlen(buffer)));
+	  CHECK(session.UpdateRecord(&key, &s_Records[4], rec) == BT_SUCCESS && rec == &s_Records[1], "update of key %u failed", i);
+	  updates++;
+	}
+
+	MakeKey(buffer, 1);
+	KeyType key1(buffer, UINT(strlen(buffer)));
+	CHECK(session.CompareAndSwapRecord(&key1, &s_Records[1], &s_Records[5]) == BT_RECORD_CHANGED, "swap with the wrong record succeeded");
+	CHECK(session.CompareAndSwapRecord(&key1, &s_Records[4], &s_Records[5]) == BT_SUCCESS, "swap failed");
+	updates += 2;
+
+	for (UINT i = 0; i < SeKeys; i += 3)
+	{
+	  MakeKey(buffer, i);
+	  KeyType key(buffer, UINT(strlen(buffer)));
+	  CHECK(session.DeleteRecord(&key) == BT_SUCCESS, "delete of key %u failed", i);
+	  watch.Sample();
+	}
+
+	for (UINT i = 0; i < SeKeys + SeNewKeys; i++)
+	{
+	  MakeKey(buffer, i);
+	  KeyType key(buffer, UINT(strlen(buffer)));
+	  void* expected = SessionRecord(i);
+	  BTRESULT btr = session.LookupRecord(&key, rec);
+	  CHECK((expected) ? (btr == BT_SUCCESS && rec == expected) : (btr == BT_KEY_NOT_FOUND), "lookup of key %u returned the wrong result", i);
+	}
+  }
+
+  PhaseProfile profile;
+  profiler->GetProfile(PROF_UPDATE, &profile);
+  printf("  %llu updates sampled, %u run\n", (ULONGLONG)(profile.m_Samples), updates);
+  CHECK(profile.m_Samples == updates, "%llu updates sampled, expected %u", (ULONGLONG)(profile.m_Samples), updates);
+
+  printf("  %lld epochs, at most %lld objects in limbo\n", watch.m_LastEpoch - watch.m_FirstEpoch, watch.m_MaxItems);
+  CHECK(watch.m_LastEpoch > watch.m_FirstEpoch, "the epoch did not advance during the session");
+  CHECK(watch.m_MaxItems <= SeMaxLimboItems, "%lld objects in limbo, expected at most %lld", watch.m_MaxItems, SeMaxLimboItems);
+  CHECK(tree->CheckTree(stdout) == 0, "tree check failed");
+  delete tree;
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+
+struct OperationTest
+{
+  const char*	m_Name;
+  int			(*m_Run)();
+};
+
+static const OperationTest s_Tests[] =
+{
+  { "insert-if-absent",	TestInsertIfAbsent },
+  { "upsert",			TestUpsert },
+  { "multi-update",		TestMultiUpdate },
+  { "append-split",		TestAppendSplit },
+  { "read-consolidate",	TestReadConsolidate },
+  { "intkey",			TestIntKey },
+  { "session",			TestSession },
+};
+
+int RunOperationTest(const char* name)
+{
+  bool all = (strcmp(name, "all") == 0);
+  bool found = false;
+  int result = 0;
+  for (size_t t = 0; t < sizeof(s_Tests) / sizeof(s_Tests[0]); t++)
+  {
+	if (!all && strcmp(name, s_Tests[t].m_Name) != 0) continue;
+	found = true;
+	printf("Test %s\n", s_Tests[t].m_Name);
+	if (s_Tests[t].m_Run() != 0) result = 1;
+  }
+  if (!found)
+  {
+	printf("No test named %s\n", name);
+	return 2;
+  }
+  printf((result == 0) ? "Passed\n" : "Failed\n");
+  return result;
+}
@@ -0,0 +1,156 @@
+// ***************************************************************************
+// Decoder for B-tree event traces (EventTrace.h).
+//
+// Reads a file written by BtreeRoot::DumpEventTrace, merges the rings of all
+// threads by time stamp and prints one line per event: the time since
+// tracing was enabled, the thread, the event type, its result, the pages
+// involved and their status words. Events can be limited to one page (as
+// target, parent, new page or other page), one thread, or the last N events.
+// ***************************************************************************
+#include <vector>
+#include <algorithm>
+#include "Platform.h"
+#include "BtreeInternal.h"
+
+static const char* ResultName[] =
+{
+  "SUCCESS", "INVALID_ARG", "DUPLICATE_KEY", "KEY_NOT_FOUND", "OUT_OF_MEMORY", "INTERNAL_ERROR",
+  "PAGE_INACTIVE", "PAGE_FULL", "NOT_INSERTED", "INSTALL_FAILED", "NO_ACTION_TAKEN", "RECORD_CHANGED"
+};
+
+static void Usage()
+{
+  fprintf(stderr,
+	"Usage: EventDecode [options] FILE\n"
+	"  --page ADDR            only events involving the page at ADDR (hex)\n"
+	"  --thread ID            only events of thread ID\n"
+	"  --last N               only the last N events\n");
+}
+
+static bool InvolvesPage(const TraceEvent& ev, ULONGLONG page)
+{
+  UINT type = ev.m_Type & ~TraceIndexPage;
+  if (ev.m_Page == page || ev.m_Parent == page || ev.m_NewPage == page) return true;
+  return (type == TE_SPLIT || type == TE_MERGE) && ev.m_Arg == page;
+}
+
+static void PrintEvent(FILE* file, const TraceEvent& ev, const EventTraceHeader& hdr)
+{
+  UINT type = ev.m_Type & ~TraceIndexPage;
+  bool isIndexPage = (ev.m_Type & TraceIndexPage) != 0;
+  double ns = double(LONGLONG(ev.m_Time - hdr.m_StartTicks)) * hdr.m_NsPerTick;
+  const char* typeName = (type < TE_COUNT) ? TraceEventName[type] : "unknown";
+  const char* result = (UINT(ev.m_Result) < sizeof(ResultName) / sizeof(ResultName[0])) ? ResultName[ev.m_Result] : "UNKNOWN";
+
+  fprintf(file, "%14.0f  thread %5u  %-11s %-15s %s page %llx", ns, ev.m_ThreadId, typeName, result,
+		  (isIndexPage) ? "index" : "leaf", ev.m_Page);
+  switch (type)
+  {
+  case TE_INSERT:
+  case TE_DELETE:
+	{
+	  char key[sizeof(ev.m_Arg) + 1];
+	  UINT len = (ev.m_KeyLen < sizeof(ev.m_Arg)) ? ev.m_KeyLen : sizeof(ev.m_Arg);
+	  memcpy(key, &ev.m_Arg, len);
+	  key[len] = '\0';
+	  for (UINT i = 0; i < len; i++)
+	  {
+		if (key[i] < ' ' || key[i] > '~') key[i] = '.';
+	  }
+	  fprintf(file, ", key \"%s%s\" (%hu bytes)", key, (ev.m_KeyLen > len) ? "..." : "", ev.m_KeyLen);
+	}
+	break;
+  case TE_CONSOLIDATE: fprintf(file, ", new page %llx", ev.m_NewPage); break;
+  case TE_SPLIT:	   fprintf(file, ", left %llx, right %llx", ev.m_NewPage, ev.m_Arg); break;
+  case TE_MERGE:	   fprintf(file, ", other page %llx, new page %llx", ev.m_Arg, ev.m_NewPage); break;
+  case TE_PAGE_DELETE: fprintf(file, ", new parent %llx", ev.m_NewPage); break;
+  }
+  fprintf(file, "\n%48s", "");
+  PageStatus::PrintPageStatus(file, ev.m_Status, isIndexPage);
+  fprintf(file, "\n");
+  if (ev.m_Parent)
+  {
+	fprintf(file, "%48sparent %llx ", "", ev.m_Parent);
+	PageStatus::PrintPageStatus(file, ev.m_ParentStatus, true);
+	fprintf(file, "\n");
+  }
+}
+
+int main(int argc, char** argv)
+{
+  const char* fileName = nullptr;
+  ULONGLONG page = 0;
+  UINT32 threadId = 0;
+  bool byThread = false;
+  ULONGLONG last = 0;
+
+  for (int i = 1; i < argc; i++)
+  {
+	const char* arg = argv[i];
+	const char* value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+	if (arg[0] != '-')
+	{
+	  if (fileName) { Usage(); return 1; }
+	  fileName = arg;
+	  continue;
+	}
+	if (value == nullptr) { Usage(); return 1; }
+	i++;
+	if (strcmp(arg, "--page") == 0)		   page = strtoull(value, nullptr, 16);
+	else if (strcmp(arg, "--thread") == 0) { threadId = UINT32(strtoul(value, nullptr, 10)); byThread = true; }
+	else if (strcmp(arg, "--last") == 0)   last = strtoull(value, nullptr, 10);
+	else { Usage(); return 1; }
+  }
+  if (fileName == nullptr)
+  {
+	Usage();
+	return 1;
+  }
+
+  FILE* file = nullptr;
+  errno_t err = fopen_s(&file, fileName, "rb");
+  if (err != 0 || !file)
+  {
+	fprintf(stderr, "Can't open trace file %s\n", fileName);
+	return 1;
+  }
+
+  EventTraceHeader hdr;
+  if (fread(&hdr, sizeof(hdr), 1, file) != 1 || memcmp(hdr.m_Magic, EventTraceMagic, sizeof(hdr.m_Magic)) != 0
+	  || hdr.m_EventSize != sizeof(TraceEvent))
+  {
+	fprintf(stderr, "%s is not an event trace of this build\n", fileName);
+	fclose(file);
+	return 1;
+  }
+
+  std::vector<TraceEvent> events(size_t(hdr.m_EventCount));
+  size_t count = (events.empty()) ? 0 : fread(&events[0], sizeof(TraceEvent), events.size(), file);
+  fclose(file);
+  if (count != events.size())
+  {
+	fprintf(stderr, "Trace file %s is truncated: %zu of %llu events\n", fileName, count, hdr.m_EventCount);
+	events.resize(count);
+  }
+
+  // Each ring is in time order, merge them
+  std::stable_sort(events.begin(), events.end(),
+	[](const TraceEvent& a, const TraceEvent& b) { return LONGLONG(a.m_Time - b.m_Time) < 0; });
+
+  std::vector<const TraceEvent*> selected;
+  for (size_t i = 0; i < events.size(); i++)
+  {
+	if (page != 0 && !InvolvesPage(events[i], page)) continue;
+	if (byThread && events[i].m_ThreadId != threadId) continue;
+	selected.push_back(&events[i]);
+  }
+  size_t first = (last > 0 && last < selected.size()) ? selected.size() - size_t(last) : 0;
+
+  printf("%llu events from %u threads, %llu overwritten, %.3f ns per tick\n",
+		 hdr.m_EventCount, hdr.m_ThreadCount, hdr.m_Overwritten, hdr.m_NsPerTick);
+  for (size_t i = first; i < selected.size(); i++)
+  {
+	PrintEvent(stdout, *selected[i], hdr);
+  }
+  return 0;
+}
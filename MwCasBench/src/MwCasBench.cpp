@@ -0,0 +1,433 @@
+// ***************************************************************************
+// Microbenchmark for the MwCAS engine (mwCAS.h), independent of the B-tree.
+//
+// Threads run a mix of reads and writes on a set of target words for a fixed
+// duration. A write reads the current values of a number of words with
+// MwCASRead, then increments all of them with one MwCAS. A read reads the
+// same number of words with MwCASRead, helping any MwCAS it finds in them.
+// The words of an operation are drawn at random from a hot set:
+//   disjoint  every thread has its own hot set, so MwCAS operations never
+//             conflict
+//   shared    all threads draw from one hot set, so operations conflict and
+//             help each other
+// Every word is on its own cache line.
+//
+// The benchmark runs every combination of thread count, words per MwCAS,
+// overlap and read percentage given in the options. For each run it reports
+// throughput, the success rate of the writes, and the MwCAS calls by helping
+// depth from the descriptor pool counters (MwCasStats): depth 0 are the
+// writes themselves, depth 1 calls made to help them, depth 2 calls made to
+// help a helper, and so on. After each run the words are added up and
+// checked against the number of successful writes.
+// ***************************************************************************
+#include <thread>
+#include <atomic>
+#include <vector>
+#include "Platform.h"
+#include "RandomLong.h"
+#include "mwCAS.h"
+
+enum Overlap { OVERLAP_DISJOINT, OVERLAP_SHARED, OVERLAP_COUNT };
+
+static const char* OverlapName[OVERLAP_COUNT] = { "disjoint", "shared" };
+
+// Flag bit of the target words; MwCASRead only recognizes descriptors flagged in bit 63
+static const ULONG FlagPos = 63;
+static const UINT64 FlagMask = UINT64(1) << FlagPos;
+
+struct alignas(CACHE_LINE_SIZE) TargetWord
+{
+  volatile LONGLONG	  m_Value;
+};
+
+struct BenchOptions
+{
+  std::vector<UINT>	  m_Threads;		// Thread counts
+  std::vector<UINT>	  m_Words;			// Words per MwCAS, 1 to MaxWordsPerDescriptor
+  std::vector<UINT>	  m_Overlaps;		// Overlap values
+  std::vector<UINT>	  m_ReadPercents;	// Percent of operations that are reads
+  UINT				  m_HotWords;		// Words in a hot set
+  UINT				  m_Duration;		// Seconds per run
+  UINT				  m_Seed;
+  const char*		  m_JsonFile;		// nullptr = stdout
+};
+
+// Per-thread state, padded to avoid false sharing between threads
+struct alignas(CACHE_LINE_SIZE) WorkerState
+{
+  TargetWord*		  m_HotSet;
+  UINT				  m_HotWords;
+  UINT				  m_WordsPerOp;
+  UINT				  m_ReadPercent;
+  ULONGLONG			  m_Reads;
+  ULONGLONG			  m_Succeeded;		// Writes that succeeded
+  ULONGLONG			  m_Failed;			// Writes that failed
+  ULONGLONG			  m_NoDescriptor;	// Writes retried because the pool had no free descriptor
+};
+
+struct RunResult
+{
+  UINT				  m_Threads;
+  UINT				  m_Words;
+  UINT				  m_Overlap;
+  UINT				  m_ReadPercent;
+  double			  m_Seconds;
+  ULONGLONG			  m_Reads;
+  ULONGLONG			  m_Succeeded;
+  ULONGLONG			  m_Failed;
+  ULONGLONG			  m_NoDescriptor;
+  MwCasCounts		  m_Depth[s_MaxStatsDepth];	// MwCAS calls by helping depth
+  bool				  m_Consistent;				// Sum of the words matches the successful writes
+
+  ULONGLONG Ops() { return m_Reads + m_Succeeded + m_Failed; }
+};
+
+static double				  g_NsPerTick = 1.0;
+static std::atomic<bool>	  g_StartFlag;
+static std::atomic<bool>	  g_StopFlag;
+
+static ULONGLONG Now()
+{
+  LARGE_INTEGER counter;
+  QueryPerformanceCounter(&counter);
+  return ULONGLONG(counter.QuadPart);
+}
+
+static void WorkerThread(WorkerState* state, UINT seed)
+{
+  CRandomULongs rng(seed);
+  UINT pick[MaxWordsPerDescriptor];
+
+  while (!g_StartFlag.load(std::memory_order_acquire))
+  {
+	YieldProcessor();
+  }
+
+  while (!g_StopFlag.load(std::memory_order_relaxed))
+  {
+	// Distinct words from the hot set
+	for (UINT i = 0; i < state->m_WordsPerOp; i++)
+	{
+	  bool duplicate = true;
+	  while (duplicate)
+	  {
+		pick[i] = rng.GetRandomULong() % state->m_HotWords;
+		duplicate = false;
+		for (UINT j = 0; j < i; j++)
+		{
+		  if (pick[j] == pick[i]) duplicate = true;
+		}
+	  }
+	}
+
+	if (rng.GetRandomULong() % 100 < state->m_ReadPercent)
+	{
+	  for (UINT i = 0; i < state->m_WordsPerOp; i++)
+	  {
+		MwCASDescriptor::MwCASRead((LONGLONG*)(&state->m_HotSet[pick[i]].m_Value), FlagMask);
+	  }
+	  state->m_Reads++;
+	  continue;
+	}
+
+	MwCASDescriptor* desc = AllocateMwCASDescriptor(FlagPos);
+	if (!desc)
+	{
+	  state->m_NoDescriptor++;
+	  YieldProcessor();
+	  continue;
+	}
+	for (UINT i = 0; i < state->m_WordsPerOp; i++)
+	{
+	  LONGLONG* addr = (LONGLONG*)(&state->m_HotSet[pick[i]].m_Value);
+	  LONGLONG oldVal = MwCASDescriptor::MwCASRead(addr, FlagMask);
+	  desc->AddEntryToDescriptor(addr, oldVal, oldVal + 1);
+	}
+	desc->CloseDescriptor();
+	if (desc->MwCAS(0))
+	{
+	  state->m_Succeeded++;
+	}
+	else
+	{
+	  state->m_Failed++;
+	}
+  }
+}
+
+static void RunConfig(BenchOptions& options, UINT nThreads, UINT wordsPerOp, UINT overlap, UINT readPercent, RunResult* result)
+{
+  UINT hotWords = max(options.m_HotWords, wordsPerOp);
+  UINT nSets = (overlap == OVERLAP_SHARED) ? 1 : nThreads;
+  // std::vector does not honor the cache line alignment of its elements before C++17
+  size_t nWords = size_t(hotWords) * nSets;
+  TargetWord* words = (TargetWord*)(_aligned_malloc(sizeof(TargetWord) * nWords, CACHE_LINE_SIZE));
+  for (size_t i = 0; i < nWords; i++) words[i].m_Value = 0;
+
+  WorkerState* states = (WorkerState*)(_aligned_malloc(sizeof(WorkerState) * nThreads, CACHE_LINE_SIZE));
+  std::vector<std::thread> threads;
+  g_StartFlag = false;
+  g_StopFlag = false;
+  for (UINT t = 0; t < nThreads; t++)
+  {
+	WorkerState* state = &states[t];
+	state->m_HotSet = &words[size_t(hotWords) * ((overlap == OVERLAP_SHARED) ? 0 : t)];
+	state->m_HotWords = hotWords;
+	state->m_WordsPerOp = wordsPerOp;
+	state->m_ReadPercent = readPercent;
+	state->m_Reads = state->m_Succeeded = state->m_Failed = state->m_NoDescriptor = 0;
+	threads.push_back(std::thread(WorkerThread, state, options.m_Seed * 7919 + nThreads * 131 + t + 1));
+  }
+
+  MwCasStats before;
+  GetMwCasStats(&before);
+  ULONGLONG start = Now();
+  g_StartFlag.store(true, std::memory_order_release);
+  std::this_thread::sleep_for(std::chrono::seconds(options.m_Duration));
+  g_StopFlag = true;
+  for (UINT t = 0; t < nThreads; t++) threads[t].join();
+  ULONGLONG end = Now();
+  MwCasStats after;
+  GetMwCasStats(&after);
+
+  result->m_Threads = nThreads;
+  result->m_Words = wordsPerOp;
+  result->m_Overlap = overlap;
+  result->m_ReadPercent = readPercent;
+  result->m_Seconds = (end - start) * g_NsPerTick / 1e9;
+  result->m_Reads = result->m_Succeeded = result->m_Failed = result->m_NoDescriptor = 0;
+  for (UINT t = 0; t < nThreads; t++)
+  {
+	result->m_Reads += states[t].m_Reads;
+	result->m_Succeeded += states[t].m_Succeeded;
+	result->m_Failed += states[t].m_Failed;
+	result->m_NoDescriptor += states[t].m_NoDescriptor;
+  }
+
+  // The pool counters are cumulative and not synchronized, so the differences are approximate
+  for (UINT l = 0; l < s_MaxStatsDepth; l++)
+  {
+	MwCasCounts& cur = after.Counts[l];
+	MwCasCounts& base = before.Counts[l];
+	result->m_Depth[l].m_Attempts = cur.m_Attempts - base.m_Attempts;
+	result->m_Depth[l].m_Bailed = cur.m_Bailed - base.m_Bailed;
+	result->m_Depth[l].m_Succeded = cur.m_Succeded - base.m_Succeded;
+	result->m_Depth[l].m_Failed = cur.m_Failed - base.m_Failed;
+	result->m_Depth[l].m_HelpAttempts = cur.m_HelpAttempts - base.m_HelpAttempts;
+  }
+
+  // Every successful write added one to each of its words
+  ULONGLONG sum = 0;
+  for (size_t i = 0; i < nWords; i++) sum += ULONGLONG(words[i].m_Value);
+  result->m_Consistent = (sum == result->m_Succeeded * wordsPerOp);
+
+  _aligned_free(states);
+  _aligned_free(words);
+}
+
+static void PrintList(FILE* file, const char* name, std::vector<UINT>& values)
+{
+  fprintf(file, "  \"%s\": [", name);
+  for (size_t i = 0; i < values.size(); i++)
+  {
+	fprintf(file, "%s%d", (i > 0) ? ", " : "", values[i]);
+  }
+  fprintf(file, "],\n");
+}
+
+static void WriteJson(FILE* file, BenchOptions& options, std::vector<RunResult>& results)
+{
+  fprintf(file, "{\n");
+  fprintf(file, "  \"benchmark\": \"MwCasBench\",\n");
+  PrintList(file, "threads", options.m_Threads);
+  PrintList(file, "words", options.m_Words);
+  fprintf(file, "  \"overlap\": [");
+  for (size_t i = 0; i < options.m_Overlaps.size(); i++)
+  {
+	fprintf(file, "%s\"%s\"", (i > 0) ? ", " : "", OverlapName[options.m_Overlaps[i]]);
+  }
+  fprintf(file, "],\n");
+  PrintList(file, "read_percent", options.m_ReadPercents);
+  fprintf(file, "  \"hot_words\": %d,\n", options.m_HotWords);
+  fprintf(file, "  \"duration_sec\": %d,\n", options.m_Duration);
+  fprintf(file, "  \"runs\": [\n");
+  for (size_t r = 0; r < results.size(); r++)
+  {
+	RunResult& res = results[r];
+	ULONGLONG writes = res.m_Succeeded + res.m_Failed;
+	fprintf(file, "    {\"threads\": %d, \"words\": %d, \"overlap\": \"%s\", \"read_percent\": %d, \"seconds\": %.3f, "
+				  "\"ops\": %llu, \"ops_per_sec\": %.0f,\n",
+			res.m_Threads, res.m_Words, OverlapName[res.m_Overlap], res.m_ReadPercent, res.m_Seconds,
+			res.Ops(), res.Ops() / res.m_Seconds);
+	fprintf(file, "     \"reads\": %llu, \"writes\": %llu, \"succeeded\": %llu, \"success_rate\": %.4f, "
+				  "\"no_descriptor\": %llu, \"consistent\": %s,\n",
+			res.m_Reads, writes, res.m_Succeeded, (writes > 0) ? double(res.m_Succeeded) / writes : 0.0,
+			res.m_NoDescriptor, (res.m_Consistent) ? "true" : "false");
+
+	// Depth 0 are the writes, deeper levels help; the last level includes all deeper calls
+	fprintf(file, "     \"mwcas_by_depth\": [");
+	for (UINT l = 0; l < s_MaxStatsDepth; l++)
+	{
+	  MwCasCounts& c = res.m_Depth[l];
+	  fprintf(file, "%s{\"calls\": %llu, \"bailed\": %llu, \"succeeded\": %llu, \"failed\": %llu}",
+			  (l > 0) ? ", " : "", ULONGLONG(c.m_Attempts), ULONGLONG(c.m_Bailed), ULONGLONG(c.m_Succeded),
+			  ULONGLONG(c.m_Failed));
+	}
+	fprintf(file, "]}%s\n", (r + 1 < results.size()) ? "," : "");
+  }
+  fprintf(file, "  ]\n}\n");
+}
+
+static void Usage()
+{
+  fprintf(stderr,
+	"Usage: MwCasBench [options]\n"
+	"  --threads N[,N...]     thread counts (default 1,2,4)\n"
+	"  --words N[,N...]       words per MwCAS, 1 to %d (default all)\n"
+	"  --overlap O[,O...]     disjoint or shared hot sets (default both)\n"
+	"  --read-percent P[,P...] percent of operations that only read (default 0,50,90)\n"
+	"  --hot-words N          words in a hot set (default 16)\n"
+	"  --duration S           seconds per run (default 1)\n"
+	"  --seed N               random seed (default 23456)\n"
+	"  --json FILE            write results to FILE instead of stdout\n",
+	MaxWordsPerDescriptor);
+}
+
+static bool ParseList(const char* arg, std::vector<UINT>& values, UINT minValue, UINT maxValue)
+{
+  values.clear();
+  const char* p = arg;
+  while (*p)
+  {
+	char* end = nullptr;
+	long value = strtol(p, &end, 10);
+	if (end == p || value < long(minValue) || value > long(maxValue)) return false;
+	values.push_back(UINT(value));
+	if (*end != ',' && *end != '\0') return false;
+	p = (*end == ',') ? end + 1 : end;
+  }
+  return !values.empty();
+}
+
+static bool ParseOverlaps(const char* arg, std::vector<UINT>& values)
+{
+  values.clear();
+  const char* p = arg;
+  while (*p)
+  {
+	const char* end = strchr(p, ',');
+	size_t len = (end) ? size_t(end - p) : strlen(p);
+	UINT overlap = OVERLAP_COUNT;
+	for (UINT o = 0; o < OVERLAP_COUNT; o++)
+	{
+	  if (strlen(OverlapName[o]) == len && strncmp(p, OverlapName[o], len) == 0) overlap = o;
+	}
+	if (overlap == OVERLAP_COUNT) return false;
+	values.push_back(overlap);
+	p = (end) ? end + 1 : p + len;
+  }
+  return !values.empty();
+}
+
+static bool ParseOptions(int argc, char** argv, BenchOptions& options)
+{
+  options.m_Threads = { 1, 2, 4 };
+  options.m_Words.clear();
+  for (UINT w = 1; w <= MaxWordsPerDescriptor; w++) options.m_Words.push_back(w);
+  options.m_Overlaps = { OVERLAP_DISJOINT, OVERLAP_SHARED };
+  options.m_ReadPercents = { 0, 50, 90 };
+  options.m_HotWords = 16;
+  options.m_Duration = 1;
+  options.m_Seed = 23456;
+  options.m_JsonFile = nullptr;
+
+  for (int i = 1; i < argc; i++)
+  {
+	const char* arg = argv[i];
+	const char* value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+	if (value == nullptr)
+	{
+	  return false;
+	}
+	i++;
+
+	if (strcmp(arg, "--threads") == 0)
+	{
+	  if (!ParseList(value, options.m_Threads, 1, 1024)) return false;
+	}
+	else if (strcmp(arg, "--words") == 0)
+	{
+	  if (!ParseList(value, options.m_Words, 1, MaxWordsPerDescriptor)) return false;
+	}
+	else if (strcmp(arg, "--overlap") == 0)
+	{
+	  if (!ParseOverlaps(value, options.m_Overlaps)) return false;
+	}
+	else if (strcmp(arg, "--read-percent") == 0)
+	{
+	  if (!ParseList(value, options.m_ReadPercents, 0, 100)) return false;
+	}
+	else if (strcmp(arg, "--hot-words") == 0)
+	{
+	  options.m_HotWords = UINT(atoi(value));
+	  if (options.m_HotWords == 0) return false;
+	}
+	else if (strcmp(arg, "--duration") == 0) options.m_Duration = UINT(atoi(value));
+	else if (strcmp(arg, "--seed") == 0)	 options.m_Seed = UINT(strtoul(value, nullptr, 10));
+	else if (strcmp(arg, "--json") == 0)	 options.m_JsonFile = value;
+	else return false;
+  }
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  BenchOptions options;
+  if (!ParseOptions(argc, argv, options))
+  {
+	Usage();
+	return 1;
+  }
+
+  LARGE_INTEGER freq;
+  QueryPerformanceFrequency(&freq);
+  g_NsPerTick = 1e9 / double(freq.QuadPart);
+
+  std::vector<RunResult> results;
+  bool consistent = true;
+  for (size_t o = 0; o < options.m_Overlaps.size(); o++)
+  {
+	for (size_t w = 0; w < options.m_Words.size(); w++)
+	{
+	  for (size_t p = 0; p < options.m_ReadPercents.size(); p++)
+	  {
+		for (size_t t = 0; t < options.m_Threads.size(); t++)
+		{
+		  RunResult res;
+		  RunConfig(options, options.m_Threads[t], options.m_Words[w], options.m_Overlaps[o], options.m_ReadPercents[p], &res);
+		  fprintf(stderr, "%-8s %d words, %3d%% reads, %2d threads: %.0f ops/sec, %.1f%% of writes succeeded%s\n",
+				  OverlapName[res.m_Overlap], res.m_Words, res.m_ReadPercent, res.m_Threads, res.Ops() / res.m_Seconds,
+				  (res.m_Succeeded + res.m_Failed > 0) ? 100.0 * res.m_Succeeded / (res.m_Succeeded + res.m_Failed) : 0.0,
+				  (res.m_Consistent) ? "" : ", INCONSISTENT");
+		  consistent = consistent && res.m_Consistent;
+		  results.push_back(res);
+		}
+	  }
+	}
+  }
+
+  FILE* jsonFile = stdout;
+  if (options.m_JsonFile)
+  {
+	errno_t err = fopen_s(&jsonFile, options.m_JsonFile, "w");
+	if (err != 0 || !jsonFile)
+	{
+	  fprintf(stderr, "Can't open output file %s\n", options.m_JsonFile);
+	  return 1;
+	}
+  }
+  WriteJson(jsonFile, options, results);
+  if (jsonFile != stdout) fclose(jsonFile);
+
+  return (consistent) ? 0 : 2;
+}